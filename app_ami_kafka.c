@@ -19,7 +19,7 @@
  * \brief AMI Events to Kafka
  *
  * Captures all AMI events via manager_custom_hook and publishes them
- * to a Kafka topic via res_kafka. Supports raw AMI text or JSON format.
+ * to a Kafka topic via res_kafka. Supports raw AMI text, JSON or MessagePack.
  *
  * \author Wazo Communication Inc.
  */
@@ -42,12 +42,34 @@
 					</description>
 				</configOption>
 				<configOption name="format">
-					<synopsis>Output format: json or ami</synopsis>
+					<synopsis>Output format: json, json_typed, ami or msgpack</synopsis>
 					<description>
 						<para>When set to <literal>json</literal>, AMI events are
-						parsed into JSON key-value objects. When set to
+						parsed into JSON key-value objects. <literal>json_typed</literal>
+						is the same object with the values of known numeric, boolean
+						and epoch headers, such as <literal>ChannelState</literal>,
+						<literal>Duration</literal> or <literal>Paused</literal>,
+						written as JSON numbers and booleans. When set to
 						<literal>ami</literal>, the raw AMI text is published
-						as-is. Default is <literal>json</literal>.</para>
+						as-is. When set to <literal>msgpack</literal>, the JSON
+						pairs are published as a MessagePack map keyed by schema
+						tags (see the <literal>schema_id</literal> Kafka header).
+						Default is <literal>json</literal>.</para>
+					</description>
+				</configOption>
+				<configOption name="fold_headers">
+					<synopsis>Keep every value of repeated and variable headers in JSON payloads</synopsis>
+					<description>
+						<para>By default a header that occurs more than once in an
+						event keeps only its last value. When enabled, the JSON
+						formats write the values of a repeated header as an array,
+						in order, and headers ending in <literal>Variable</literal>
+						(<literal>ChanVariable</literal>, <literal>DestChanVariable</literal>,
+						<literal>Variable</literal>...) whose values are all
+						<literal>name=value</literal> pairs as an object of those
+						variables, even when there is only one. Has no effect on the
+						<literal>ami</literal> and <literal>msgpack</literal> formats.
+						Default is no.</para>
 					</description>
 				</configOption>
 				<configOption name="^eventfilter" regex="true">
@@ -58,6 +80,279 @@
 						published.</para>
 					</description>
 				</configOption>
+				<configOption name="async">
+					<synopsis>Process events on dedicated worker threads</synopsis>
+					<description>
+						<para>When enabled, the manager hook only copies each event
+						into a bounded lock-free queue and returns; filtering,
+						formatting and producing happen on worker threads.
+						Default is no. Applied at module load.</para>
+					</description>
+				</configOption>
+				<configOption name="queue_size">
+					<synopsis>Capacity of the asynchronous event queue</synopsis>
+					<description>
+						<para>Rounded up to a power of two. Events arriving while
+						the queue is full are dropped. Default is 65536.
+						Applied at module load.</para>
+					</description>
+				</configOption>
+				<configOption name="worker_threads">
+					<synopsis>Number of asynchronous worker threads</synopsis>
+					<description>
+						<para>Default is 1, which preserves the manager event
+						order. Applied at module load.</para>
+					</description>
+				</configOption>
+				<configOption name="batch_mode">
+					<synopsis>Combine events into multi-record Kafka messages</synopsis>
+					<description>
+						<para><literal>none</literal> produces one message per event.
+						<literal>array</literal> combines events with the same topic
+						and message key into one message holding a JSON array;
+						<literal>ndjson</literal> does the same with newline-delimited
+						JSON objects. Requires <literal>format = json</literal>.
+						Default is <literal>none</literal>.</para>
+					</description>
+				</configOption>
+				<configOption name="batch_max_events">
+					<synopsis>Maximum number of events in a batch</synopsis>
+					<description>
+						<para>Between 1 and 100000. Default is <literal>500</literal>.</para>
+					</description>
+				</configOption>
+				<configOption name="batch_max_bytes">
+					<synopsis>Maximum size of a batch message in bytes</synopsis>
+					<description>
+						<para>Between 1024 and 16777216. A single event larger than
+						this is sent in a batch of its own. Default is
+						<literal>262144</literal>.</para>
+					</description>
+				</configOption>
+				<configOption name="batch_linger_ms">
+					<synopsis>How long a batch waits for more events</synopsis>
+					<description>
+						<para>Milliseconds after its first event after which a batch
+						is produced even if it is not full. Between 1 and 60000.
+						Default is <literal>100</literal>.</para>
+					</description>
+				</configOption>
+				<configOption name="compression">
+					<synopsis>Compress payloads: none, lz4 or zstd</synopsis>
+					<description>
+						<para>Compresses each message, or each batch, before it
+						is produced, and adds a <literal>content_encoding</literal>
+						header: <literal>lz4</literal>, <literal>zstd</literal>,
+						<literal>zstd;dict=ami-v1</literal> for the built-in
+						dictionary or <literal>zstd;dict=ID</literal> for a trained
+						one. Messages that would not get smaller are sent as they
+						are, without the header. Only available if the module was
+						built with liblz4 or libzstd. Default is
+						<literal>none</literal>.</para>
+					</description>
+				</configOption>
+				<configOption name="compression_level">
+					<synopsis>zstd compression level</synopsis>
+					<description>
+						<para>From 1 to 19. Default is 3.</para>
+					</description>
+				</configOption>
+				<configOption name="compression_dictionary">
+					<synopsis>zstd dictionary</synopsis>
+					<description>
+						<para><literal>builtin</literal> uses the dictionary shipped
+						in the module, tuned for single AMI events,
+						<literal>none</literal> uses no dictionary, and any other
+						value is the path of a dictionary trained with
+						<literal>zstd --train</literal>. Consumers need the same
+						dictionary. Default is <literal>builtin</literal>.</para>
+					</description>
+				</configOption>
+				<configOption name="spill_size">
+					<synopsis>Messages kept in memory when Kafka refuses them</synopsis>
+					<description>
+						<para>When <literal>ast_kafka_produce_hdrs()</literal> fails,
+						for instance because librdkafka's queue is full while the
+						brokers are unreachable, the message is kept and retried
+						every second, in order; newer messages wait behind it. Up to
+						this many are kept in memory, after the spill file is full.
+						From 0 to 1000000; 0 keeps none in memory. Default is
+						<literal>10000</literal>.</para>
+					</description>
+				</configOption>
+				<configOption name="spill_file">
+					<synopsis>Spool file for messages Kafka refuses</synopsis>
+					<description>
+						<para>Path of a memory-mapped file where refused messages are
+						kept first. Unlike the memory ring, it survives a restart:
+						messages left in it are replayed when the module loads.
+						Default is empty, for no file.</para>
+					</description>
+				</configOption>
+				<configOption name="spill_file_size">
+					<synopsis>Size of the spool file in bytes</synopsis>
+					<description>
+						<para>From 65536 to 2147483648. A file still holding messages
+						keeps its size until it is empty. Default is
+						<literal>67108864</literal>.</para>
+					</description>
+				</configOption>
+				<configOption name="^priority\(" regex="true">
+					<synopsis>Priority class of matching events</synopsis>
+					<description>
+						<para><literal>priority(name(Hangup)) = critical</literal>,
+						<literal>priority(prefix(RTCP)) = low</literal> or
+						<literal>priority(category(security)) = critical</literal>;
+						the classes are <literal>critical</literal>,
+						<literal>normal</literal> and <literal>low</literal>. Rules
+						match like <literal>route(...)</literal> rules. Events no
+						rule matches are normal. Critical events are never shed.</para>
+					</description>
+				</configOption>
+				<configOption name="shed_low_threshold">
+					<synopsis>Pipeline load from which low priority events are shed</synopsis>
+					<description>
+						<para>Percent of the asynchronous queue, or of the spill of
+						refused messages, in use. From 1 to 100. Default is
+						<literal>50</literal>.</para>
+					</description>
+				</configOption>
+				<configOption name="shed_normal_threshold">
+					<synopsis>Pipeline load from which normal events are shed</synopsis>
+					<description>
+						<para>From 1 to 100. Default is <literal>100</literal>, which
+						only sheds normal events once the pipeline is full.</para>
+					</description>
+				</configOption>
+				<configOption name="shed_sample">
+					<synopsis>Keep 1 in this many shed events</synopsis>
+					<description>
+						<para>From 0 to 1000000. Default is <literal>0</literal>,
+						which drops every shed event.</para>
+					</description>
+				</configOption>
+				<configOption name="^sample\(" regex="true">
+					<synopsis>Publish only 1 in N matching events</synopsis>
+					<description>
+						<para><literal>sample(name(VarSet)) = 1/100</literal> keeps the
+						first of every 100 <literal>VarSet</literal> events that pass
+						the filters. <literal>name()</literal>,
+						<literal>prefix()</literal> and <literal>category()</literal>
+						match like <literal>route(...)</literal> rules. N is from 1
+						to 1000000.</para>
+					</description>
+				</configOption>
+				<configOption name="^ratelimit\(" regex="true">
+					<synopsis>Maximum rate of matching events</synopsis>
+					<description>
+						<para><literal>ratelimit(prefix(RTCP)) = 50/s</literal> publishes
+						at most 50 matching events per second, with bursts of up to 50;
+						the period is <literal>s</literal>, <literal>m</literal> or
+						<literal>h</literal>. With <literal>50/s per channel</literal>,
+						each <literal>Channel</literal> header value has its own
+						limit. Events over the limit are dropped.</para>
+					</description>
+				</configOption>
+				<configOption name="^coalesce\(" regex="true">
+					<synopsis>Publish only the latest of a burst of state events</synopsis>
+					<description>
+						<para><literal>coalesce(name(DeviceStateChange)) = Device</literal>
+						holds a matching event for <literal>coalesce_window_ms</literal>;
+						later events with the same name and the same value of the
+						given header replace it, and only the last one is published
+						when the window closes. Events without the header are
+						published at once.</para>
+					</description>
+				</configOption>
+				<configOption name="^fields\(" regex="true">
+					<synopsis>Headers published for matching events</synopsis>
+					<description>
+						<para><literal>fields(name(Newchannel)) = Channel,Uniqueid,CallerIDNum</literal>
+						publishes only the listed body headers of matching events;
+						<literal>fields(prefix(Queue)) = !ChanVariable,!Variable</literal>
+						publishes all but those prefixed with <literal>!</literal>.
+						A list is either of one kind or the other.
+						<literal>Event</literal>, <literal>EntityID</literal> and
+						<literal>SystemName</literal> are always published. Rules
+						match like <literal>route(...)</literal> rules and apply
+						after the filters, so filters and
+						<literal>partition_key</literal> still see every header.</para>
+					</description>
+				</configOption>
+				<configOption name="coalesce_window_ms">
+					<synopsis>How long coalesced events are held</synopsis>
+					<description>
+						<para>Milliseconds from the first event of a burst to the
+						publication of the latest. Between 1 and 60000. Default is
+						<literal>250</literal>.</para>
+					</description>
+				</configOption>
+				<configOption name="enqueue_timestamp">
+					<synopsis>Send the time each message was handed to librdkafka</synopsis>
+					<description>
+						<para>When enabled, messages carry an <literal>enqueue_us</literal>
+						Kafka header with the wall clock time, in microseconds since
+						the epoch, at which they were handed to the producer, after
+						compression. Messages replayed from the spill do not carry
+						it. With the
+						<literal>timestamp_us</literal> capture time and the Kafka
+						record timestamp, it splits the latency from Asterisk to a
+						consumer into the module, librdkafka and the broker. Unlike
+						the capture time, which reuses the clock reading taken for
+						the statistics, it costs one monotonic clock read per
+						message. Default is no.</para>
+					</description>
+				</configOption>
+				<configOption name="call_tracking">
+					<synopsis>Stamp events with their position in the call</synopsis>
+					<description>
+						<para>When enabled, every call is tracked by
+						<literal>Linkedid</literal> from its first
+						<literal>Newchannel</literal> to its last
+						<literal>Hangup</literal>, and the events of a tracked call
+						are published with a <literal>call_sequence</literal> Kafka
+						header, counting from 1 in the order the events were
+						raised, and a <literal>call_start</literal> header with the
+						capture time of the first <literal>Newchannel</literal>.
+						Numbers are assigned in the manager hook, before shedding,
+						filters, <literal>sample(...)</literal> and
+						<literal>ratelimit(...)</literal>, so that they follow the
+						capture order even with <literal>async</literal>: events
+						dropped by any of them, or replaced by a coalesced one,
+						leave gaps. A gap is not a lost message. Batch messages
+						carry neither header. Default is no.</para>
+					</description>
+				</configOption>
+				<configOption name="call_summaries">
+					<synopsis>Publish one summary event per call when it ends</synopsis>
+					<description>
+						<para>When enabled, calls are tracked as for
+						<literal>call_tracking</literal> and a compact record of each
+						one (first channel, caller, extension, start, answer and end
+						times, duration, billable seconds, channels, bridges, dials,
+						last dial status and first hangup cause) is kept up to date
+						from <literal>Newchannel</literal>, <literal>Newstate</literal>,
+						<literal>DialEnd</literal>, <literal>BridgeEnter</literal> and
+						<literal>Hangup</literal>. After the last
+						<literal>Hangup</literal> of the call, the record is published
+						as a <literal>CallSummary</literal> event in the
+						<literal>cdr</literal> category, like any other event: use a
+						<literal>route(name(CallSummary))</literal> rule to send it
+						to its own topic. Default is no.</para>
+					</description>
+				</configOption>
+				<configOption name="call_idle_timeout">
+					<synopsis>Seconds after which a silent call is forgotten</synopsis>
+					<description>
+						<para>A call whose last channel hung up under another
+						<literal>Linkedid</literal> is never torn down by its
+						<literal>Hangup</literal>; it is dropped once it had no event
+						for this long, with its <literal>CallSummary</literal> when
+						<literal>call_summaries</literal> is on, ending with its
+						latest event. Between 60 and 2592000. Default is
+						<literal>86400</literal>.</para>
+					</description>
+				</configOption>
 			</configObject>
 			<configObject name="kafka">
 				<synopsis>Kafka configuration settings</synopsis>
@@ -73,29 +368,125 @@
 						<para>Defaults to asterisk_ami.</para>
 					</description>
 				</configOption>
+				<configOption name="partition_key">
+					<synopsis>What the Kafka message key is taken from</synopsis>
+					<description>
+						<para><literal>event</literal> uses the event name,
+						<literal>entity_id</literal> the Asterisk entity ID. Any
+						other value names a body header, such as
+						<literal>Linkedid</literal>, <literal>Uniqueid</literal> or
+						<literal>Channel</literal> (case-sensitive); events without
+						that header are keyed by event name. Default is
+						<literal>event</literal>.</para>
+					</description>
+				</configOption>
+				<configOption name="^route\(" regex="true">
+					<synopsis>Publish matching events to another topic</synopsis>
+					<description>
+						<para><literal>route(name(VarSet)) = topic</literal> matches
+						one event name, <literal>route(prefix(Queue)) = topic</literal>
+						every event name starting with the prefix, and
+						<literal>route(category(security)) = topic</literal> every event
+						in a manager.conf category. An exact name wins over the longest
+						matching prefix, which wins over the first matching category.
+						Events no rule matches go to <literal>topic</literal>.</para>
+					</description>
+				</configOption>
 			</configObject>
 		</configFile>
 	</configInfo>
+	<manager name="AmiKafkaStats" language="en_US">
+		<synopsis>
+			Show app_ami_kafka counters and latencies.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+		</syntax>
+		<description>
+			<para>Reports the event counters (<literal>EventsSeen</literal>,
+			<literal>EventsFiltered</literal>, <literal>EventsFormatted</literal>,
+			<literal>FormatFailures</literal>, <literal>EventsBatched</literal>,
+			<literal>MessagesProduced</literal>, <literal>ProduceFailures</literal>,
+			<literal>QueueFullDrops</literal>, <literal>CriticalDrops</literal>,
+			<literal>ShedNormal</literal>, <literal>ShedLow</literal>,
+			<literal>SampledOut</literal>, <literal>RateLimited</literal>,
+			<literal>Coalesced</literal>, <literal>CallSummaries</literal>,
+			<literal>MessagesSpilled</literal>,
+			<literal>SpillFullDrops</literal>, <literal>MessagesReplayed</literal>),
+			the number of messages waiting in the spill
+			(<literal>SpillPending</literal>) and, for each of the
+			<literal>Hook</literal>, <literal>Filter</literal>,
+			<literal>Format</literal> and <literal>Produce</literal> stages, the
+			number of samples and the p50, p99, p99.9 and maximum latency in
+			nanoseconds, e.g. <literal>HookP99</literal>. Latencies are
+			histogram bucket upper bounds, within 12.5%.</para>
+			<para>To zero the statistics, use
+			<literal>AmiKafkaStatsReset</literal>, which needs the
+			<literal>system</literal> class.</para>
+		</description>
+		<see-also>
+			<ref type="manager">AmiKafkaStatsReset</ref>
+		</see-also>
+	</manager>
+	<manager name="AmiKafkaStatsReset" language="en_US">
+		<synopsis>
+			Show app_ami_kafka counters and latencies, then zero them.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+		</syntax>
+		<description>
+			<para>Reports the same figures as <literal>AmiKafkaStats</literal>,
+			then zeroes the counters and histograms, as the
+			<literal>ami kafka reset stats</literal> CLI command does.</para>
+		</description>
+		<see-also>
+			<ref type="manager">AmiKafkaStats</ref>
+		</see-also>
+	</manager>
  ***/
 
 #include "asterisk.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <regex.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "asterisk/cli.h"
 #include "asterisk/config_options.h"
 #include "asterisk/json.h"
 #include "asterisk/kafka.h"
 #include "asterisk/manager.h"
 #include "asterisk/module.h"
 #include "asterisk/paths.h"
+#include "asterisk/sched.h"
+#include "asterisk/sem.h"
 #include "asterisk/stringfields.h"
 #include "asterisk/strings.h"
+#include "asterisk/threadstorage.h"
 #include "asterisk/utils.h"
 #include "asterisk/ast_version.h"
 
 #define CONF_FILENAME "ami_kafka.conf"
 
+/*! \brief Per-thread payload buffer, reused across events */
+AST_THREADSTORAGE(payload_buf);
+AST_THREADSTORAGE(compress_buf);
+
 /*! \brief Cached hostname, set once during load_module(). */
 static char cached_hostname[256];
 
@@ -103,6 +494,329 @@ static char cached_hostname[256];
 enum ami_kafka_format {
 	AMI_KAFKA_FORMAT_JSON = 0,
 	AMI_KAFKA_FORMAT_AMI,
+	AMI_KAFKA_FORMAT_MSGPACK,
+	/*! \brief JSON with native numbers and booleans for known headers */
+	AMI_KAFKA_FORMAT_JSON_TYPED,
+};
+
+/*! \brief 'format' option values, also sent in the "format" Kafka header */
+static const char * const format_names[] = {
+	[AMI_KAFKA_FORMAT_JSON] = "json",
+	[AMI_KAFKA_FORMAT_AMI] = "ami",
+	[AMI_KAFKA_FORMAT_MSGPACK] = "msgpack",
+	[AMI_KAFKA_FORMAT_JSON_TYPED] = "json_typed",
+};
+
+/*! \brief Sent in the "schema_id" Kafka header of msgpack payloads */
+#define AMI_MSGPACK_SCHEMA_ID "ami-msgpack-v1"
+
+/*! \brief One slot of an ami_name_map */
+struct ami_name_map_entry {
+	const char *name;            /*!< NULL = empty slot */
+	size_t len;
+	unsigned int hash;
+	void *value;
+};
+
+/*!
+ * \brief Immutable open-addressing map from event name to a value.
+ *
+ * Built once per configuration load and only read afterwards, so lookups
+ * need no locking.
+ */
+struct ami_name_map {
+	struct ami_name_map_entry *entries;
+	unsigned int mask;           /*!< table size - 1 (size is a power of two) */
+};
+
+/*! \brief Where the Kafka message key of an event comes from */
+enum ami_kafka_key_type {
+	/*! \brief the event name */
+	AMI_KAFKA_KEY_EVENT = 0,
+	/*! \brief the Asterisk entity ID */
+	AMI_KAFKA_KEY_ENTITY_ID,
+	/*! \brief the value of a body header, e.g. Linkedid */
+	AMI_KAFKA_KEY_HEADER,
+};
+
+/*! \brief Parsed 'partition_key' option */
+struct ami_kafka_key_source {
+	enum ami_kafka_key_type type;
+	/*! \brief header name (AMI_KAFKA_KEY_HEADER only) */
+	const char *header;
+	size_t header_len;
+	unsigned int hash;
+};
+
+/*! \brief Longest message key taken from a header; longer values are truncated */
+#define AMI_KAFKA_MAX_KEY 256
+
+/*! \brief What a topic routing rule matches */
+enum ami_kafka_route_type {
+	/*! \brief an exact event name */
+	AMI_KAFKA_ROUTE_NAME = 0,
+	/*! \brief an event name prefix */
+	AMI_KAFKA_ROUTE_PREFIX,
+	/*! \brief any event in a category */
+	AMI_KAFKA_ROUTE_CATEGORY,
+};
+
+/*! \brief One 'route(...)', 'priority(...)', 'sample(...)', 'ratelimit(...)', 'coalesce(...)' or 'fields(...)' line */
+struct ami_kafka_route {
+	enum ami_kafka_route_type type;
+	/*! \brief EVENT_FLAG_* bit (AMI_KAFKA_ROUTE_CATEGORY only) */
+	int category;
+	/*! \brief event name or prefix */
+	const char *match;
+	size_t match_len;
+	/*! \brief position of the rule in its container, i.e. in the config */
+	unsigned int order;
+	/*! \brief topic, priority class, identity header, or the value of a sample, ratelimit or fields rule */
+	const char *topic;
+	/*! \brief sample(...): keep 1 in this many matching events */
+	unsigned int sample_every;
+	/*! \brief sample(...): matching events so far */
+	unsigned int sample_seen;
+	/*! \brief ratelimit(...): nanoseconds per event at the sustained rate */
+	uint64_t interval;
+	/*! \brief ratelimit(...): how far ahead of the rate a burst may run */
+	uint64_t tolerance;
+	/*! \brief ratelimit(...): theoretical arrival time of the next event */
+	uint64_t tat;
+	/*! \brief ratelimit(... per channel): arrival times by channel name hash */
+	uint64_t *channel_tat;
+	/*! \brief coalesce(...): length and hash of the identity header name */
+	size_t header_len;
+	unsigned int header_hash;
+	/*! \brief fields(...): the listed header names */
+	struct ami_name_map fields;
+	/*! \brief fields(...): storage of the names in fields */
+	char *field_names;
+	/*! \brief fields(...): the names are left out rather than kept */
+	int fields_exclude;
+	char data[0];
+};
+
+/*! \brief Slots of a per-channel rate limit; channels hashing alike share one */
+#define RATELIMIT_CHANNEL_SLOTS 4096
+
+/*! \brief How much an event matters when the pipeline is saturated */
+enum ami_kafka_priority {
+	/*! \brief never shed */
+	AMI_KAFKA_PRIORITY_CRITICAL = 0,
+	/*! \brief events no priority rule matches */
+	AMI_KAFKA_PRIORITY_NORMAL,
+	/*! \brief shed first */
+	AMI_KAFKA_PRIORITY_LOW,
+	AMI_KAFKA_PRIORITY_COUNT,
+};
+
+/*! \brief When to drop events by priority (see ami_kafka_shed()) */
+struct ami_kafka_shed_policy {
+	/*! \brief pipeline load, in percent, from which each class is shed */
+	unsigned int threshold[AMI_KAFKA_PRIORITY_COUNT];
+	/*! \brief keep 1 in this many shed events, 0 to drop them all */
+	unsigned int sample;
+	/*! \brief events considered for shedding, per class; counts the samples */
+	unsigned int seen[AMI_KAFKA_PRIORITY_COUNT];
+};
+
+/*! \brief How several events are combined into one Kafka message */
+enum ami_kafka_batch_mode {
+	AMI_KAFKA_BATCH_NONE = 0,
+	/*! \brief one JSON array of event objects */
+	AMI_KAFKA_BATCH_ARRAY,
+	/*! \brief newline-delimited JSON objects */
+	AMI_KAFKA_BATCH_NDJSON,
+};
+
+/*! \brief Event and message counters */
+enum ami_kafka_counter {
+	/*! \brief events received by the hook */
+	AMI_KAFKA_STAT_SEEN = 0,
+	/*! \brief events rejected by the filters */
+	AMI_KAFKA_STAT_FILTERED,
+	/*! \brief events formatted as a payload */
+	AMI_KAFKA_STAT_FORMATTED,
+	/*! \brief events that could not be formatted */
+	AMI_KAFKA_STAT_FORMAT_FAILED,
+	/*! \brief events added to a batch */
+	AMI_KAFKA_STAT_BATCHED,
+	/*! \brief messages accepted by the producer */
+	AMI_KAFKA_STAT_PRODUCED,
+	/*! \brief messages the producer refused */
+	AMI_KAFKA_STAT_PRODUCE_FAILED,
+	/*! \brief events dropped because the asynchronous queue was full */
+	AMI_KAFKA_STAT_QUEUE_FULL,
+	/*! \brief critical events among those */
+	AMI_KAFKA_STAT_CRITICAL_DROPPED,
+	/*! \brief normal priority events shed under load */
+	AMI_KAFKA_STAT_SHED_NORMAL,
+	/*! \brief low priority events shed under load */
+	AMI_KAFKA_STAT_SHED_LOW,
+	/*! \brief events left out by sample(...) rules */
+	AMI_KAFKA_STAT_SAMPLED_OUT,
+	/*! \brief events over a ratelimit(...) rule */
+	AMI_KAFKA_STAT_RATE_LIMITED,
+	/*! \brief events replaced by a later one while coalescing */
+	AMI_KAFKA_STAT_COALESCED,
+	/*! \brief CallSummary events raised by call_summaries */
+	AMI_KAFKA_STAT_CALL_SUMMARIES,
+	/*! \brief messages kept for a later retry */
+	AMI_KAFKA_STAT_SPILLED,
+	/*! \brief messages lost because the spill was full */
+	AMI_KAFKA_STAT_SPILL_DROPPED,
+	/*! \brief spilled messages produced on retry */
+	AMI_KAFKA_STAT_REPLAYED,
+	AMI_KAFKA_STAT_COUNT,
+};
+
+/*! \brief Timed steps of the event path */
+enum ami_kafka_stage {
+	/*! \brief the whole manager hook, i.e. how long manager's lock is held */
+	AMI_KAFKA_STAGE_HOOK = 0,
+	/*! \brief header index and filters */
+	AMI_KAFKA_STAGE_FILTER,
+	/*! \brief payload writing */
+	AMI_KAFKA_STAGE_FORMAT,
+	/*! \brief compression and the producer, or batching */
+	AMI_KAFKA_STAGE_PRODUCE,
+	AMI_KAFKA_STAGE_COUNT,
+};
+
+/*! \brief Sub-buckets per power of two in a latency histogram (2^n) */
+#define LATENCY_SUB_BITS 3
+/*! \brief Highest power of two tracked; slower samples go in the last bucket */
+#define LATENCY_MAX_EXP 39
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXP - LATENCY_SUB_BITS + 2) << LATENCY_SUB_BITS)
+
+/*! \brief Counters and histograms summed over all shards */
+struct ami_kafka_stats {
+	uint64_t counters[AMI_KAFKA_STAT_COUNT];
+	/*! \brief nanoseconds, log-linear buckets (see ami_kafka_latency_bucket()) */
+	uint64_t latency[AMI_KAFKA_STAGE_COUNT][LATENCY_BUCKETS];
+};
+
+/*! \brief Payload compression done by this module (not by librdkafka) */
+enum ami_kafka_compression {
+	AMI_KAFKA_COMPRESSION_NONE = 0,
+	AMI_KAFKA_COMPRESSION_LZ4,
+	AMI_KAFKA_COMPRESSION_ZSTD,
+};
+
+/*! \brief Compression settings of one configuration, shared by all threads */
+struct ami_kafka_compressor {
+	enum ami_kafka_compression type;
+	int level;
+	/*! \brief value of the content_encoding Kafka header */
+	char encoding[32];
+#ifdef HAVE_ZSTD
+	/*! \brief NULL when compressing without a dictionary */
+	ZSTD_CDict *cdict;
+#endif
+};
+
+/*! \brief Batching options from the general section */
+struct ami_kafka_batch_settings {
+	enum ami_kafka_batch_mode mode;
+	unsigned int max_events;
+	unsigned int max_bytes;
+	unsigned int linger_ms;
+};
+
+/*!
+ * \brief Events waiting to be produced as one Kafka message.
+ *
+ * One batch exists per topic and message key while it has events; it is
+ * unlinked from the batch container when it is produced.
+ */
+struct ami_kafka_batch {
+	enum ami_kafka_batch_mode mode;
+	unsigned int count;
+	/*! \brief capture time of the first event, in microseconds since the epoch */
+	uint64_t timestamp;
+	/*! \brief still in the batch container (protected by its lock) */
+	int linked;
+	/*! \brief container of the batch, held while its linger timer is scheduled */
+	struct ao2_container *owner;
+	struct ast_str *records;
+	const char *topic;
+	const char *key;
+	char data[0];
+};
+
+/*! \brief Position of an event in its call, from the call tracking stage */
+struct ami_kafka_call_stamp {
+	/*!
+	 * \brief from 1 in capture order; 0 = the event belongs to no tracked call.
+	 * Taken before the event can be dropped, so published numbers have gaps.
+	 */
+	unsigned int sequence;
+	/*! \brief capture time of the Newchannel that started the call */
+	time_t start;
+};
+
+/*! \brief What call_summaries reports about a call; empty strings when unknown */
+struct ami_kafka_call_summary {
+	/*! \brief capture time of the first Newstate to Up, 0 = never answered */
+	time_t answer;
+	/*! \brief capture time of the latest Hangup */
+	time_t end;
+	/*! \brief Newchannel, distinct BridgeEnter and DialEnd events seen */
+	unsigned int channels;
+	unsigned int bridges;
+	unsigned int dials;
+	/*! \brief Channel, CallerIDNum and Exten of the first Newchannel */
+	char channel[80];
+	char caller[40];
+	char exten[40];
+	/*! \brief DialStatus of the latest DialEnd */
+	char dial_status[16];
+	/*! \brief Cause and Cause-txt of the first Hangup */
+	char cause[8];
+	char cause_txt[48];
+	/*! \brief BridgeUniqueid of the latest BridgeEnter */
+	char bridge[40];
+};
+
+/*! \brief A call being tracked, by Linkedid */
+struct ami_kafka_call {
+	/*! \brief capture time of the first Newchannel */
+	time_t start;
+	/*! \brief capture time of the latest event (atomic) */
+	time_t last_seen;
+	/*! \brief last sequence number handed out (atomic) */
+	unsigned int sequence;
+	/*! \brief channels up (protected by the container lock) */
+	int channels;
+	/*! \brief only kept with call_summaries (protected by the call's lock) */
+	struct ami_kafka_call_summary summary;
+	char linkedid[0];
+};
+
+/*!
+ * \brief The latest of a burst of events for one entity, held by coalescing.
+ *
+ * One exists per event name and identity header value while its window is
+ * open; it is unlinked from the container when it is published.
+ */
+struct ami_kafka_coalesced {
+	int category;
+	/*! \brief capture time of the latest event, in microseconds since the epoch */
+	uint64_t timestamp;
+	/*! \brief call position of the latest event */
+	struct ami_kafka_call_stamp call;
+	/*! \brief still in the coalescing container (protected by its lock) */
+	int linked;
+	/*! \brief container of the event, held while its window is scheduled */
+	struct ao2_container *owner;
+	/*! \brief earlier events this one replaced */
+	unsigned int replaced;
+	/*! \brief body of the latest event */
+	char *body;
+	const char *event;
+	const char *identity;
+	char data[0];
 };
 
 /*! \brief Event filter match types (compatible with Asterisk manager.c) */
@@ -131,15 +845,297 @@ struct event_filter_entry {
 	char *string_filter;         /*!< pattern string (non-REGEX match types) */
 	char *event_name;            /*!< NULL = any event */
 	char *header_name;           /*!< NULL = full body, "Header:" = specific header */
+	int body_literal;            /*!< string_filter is searched for in the body by the automaton */
+	size_t pattern;              /*!< index of string_filter in the automaton (body_literal only) */
+};
+
+/*! \brief Event captured by the hook, waiting for a worker thread */
+struct ami_kafka_queued_event {
+	int category;
+	/*! \brief capture time, in microseconds since the epoch */
+	uint64_t timestamp;
+	struct ami_kafka_call_stamp call;
+	char *event;                 /*!< points into data, after the body */
+	char body[0];
+};
+
+/*!
+ * \brief Bounded lock-free event queue between the hook and the workers.
+ *
+ * Array-based queue with a sequence number per slot (Vyukov style). Any
+ * number of manager threads may push concurrently without taking a lock;
+ * the worker threads pop. The counting semaphore tracks published items
+ * so idle workers sleep instead of spinning.
+ */
+struct ami_kafka_queue_slot {
+	unsigned int seq;
+	struct ami_kafka_queued_event *item;
+};
+
+struct ami_kafka_queue {
+	unsigned int mask;
+	struct ami_kafka_queue_slot *slots;
+	struct ast_sem items;
+	int stopping;
+	char pad0[64];
+	unsigned int enqueue_pos;    /*!< written by the hook threads */
+	char pad1[64];
+	unsigned int dequeue_pos;    /*!< written by the worker threads */
+	char pad2[64];
+	unsigned int dropped;        /*!< events rejected because the queue was full */
+};
+
+/*! \brief Number of body lines indexed on the stack before spilling to the heap */
+#define AMI_HEADER_STACK_LINES 64
+
+/*! \brief One line of an AMI body, pointing into the body text */
+struct ami_header {
+	const char *line;
+	unsigned int line_len;
+	/*! \brief length of the key before the first ": ", -1 = not a header */
+	int key_len;
+	/*! \brief FNV-1a hash of the key (headers only) */
+	unsigned int hash;
+};
+
+/*!
+ * \brief Every line of one AMI body, found in a single scan.
+ *
+ * Built once per event and shared by the filters and the formatters so
+ * none of them has to tokenize or copy the body again.
+ */
+struct ami_header_index {
+	const char *body;
+	size_t body_len;
+	struct ami_header *items;
+	size_t count;
+	size_t size;
+	struct ami_header stack[AMI_HEADER_STACK_LINES];
+};
+
+/*! \brief Filter entries that can apply to one event name */
+struct ami_kafka_filter_list {
+	struct event_filter_entry **include;
+	size_t num_include;
+	struct event_filter_entry **exclude;
+	size_t num_exclude;
+};
+
+/*! \brief Include/exclude filters compiled for lookup by event name */
+struct ami_kafka_filters {
+	size_t num_include;          /*!< total include filters configured */
+	size_t num_exclude;          /*!< total exclude filters configured */
+	/*! \brief list for events no name() filter refers to */
+	struct ami_kafka_filter_list wildcard;
+	/*! \brief event name -> struct ami_kafka_filter_list */
+	struct ami_name_map by_name;
+	struct ami_kafka_filter_list *lists;
+	size_t num_lists;
+	/*! \brief backing storage (one reference each) for all list arrays */
+	struct event_filter_entry **entries;
+	size_t num_entries;
+	/*! \brief every body_literal pattern, NULL if there are none */
+	struct ami_kafka_matcher *matcher;
+};
+
+/*!
+ * \brief Most Kafka headers taken from the identity: entity_id, system_name,
+ * asterisk_version, event_type, event_category, format, schema_id,
+ * timestamp, timestamp_us and hostname.
+ */
+#define AMI_KAFKA_IDENTITY_HEADERS 10
+
+/*! \brief Maximum number of Kafka headers sent with an event */
+#define AMI_KAFKA_MAX_HEADERS 16
+
+/* Room for call_sequence, call_start, content_encoding and enqueue_us */
+_Static_assert(AMI_KAFKA_IDENTITY_HEADERS + 4 <= AMI_KAFKA_MAX_HEADERS,
+	"AMI_KAFKA_MAX_HEADERS is too small");
+
+/*!
+ * \brief Everything about the publisher that is the same for every event.
+ *
+ * Built once per configuration load, so the per-event work is limited to
+ * the event name, category and timestamp.
+ */
+struct ami_kafka_identity {
+	char entity_id[20];
+	/*! \brief NULL when no systemname is configured */
+	char *system_name;
+	/*! \brief "EntityID: ...\r\nSystemName: ...\r\n" prepended to AMI payloads */
+	char *ami_prefix;
+	size_t ami_prefix_len;
+	/*! \brief "\"EntityID\":\"...\"" member, already escaped, for JSON payloads */
+	char *json_entity_id;
+	size_t json_entity_id_len;
+	/*! \brief "\"SystemName\":\"...\"" member; NULL when it would be dropped */
+	char *json_system_name;
+	size_t json_system_name_len;
+	/*! \brief header name -> msgpack tag; only built for format = msgpack */
+	struct ami_name_map msgpack_tags;
+	/*! \brief header name -> enum ami_json_type; only built for format = json_typed */
+	struct ami_name_map json_types;
+	/*! \brief JSON keeps repeated headers as arrays and variables as objects */
+	int fold_headers;
+	/*! \brief Kafka headers; the per-event values are filled in a copy */
+	struct ast_kafka_header headers[AMI_KAFKA_MAX_HEADERS];
+	size_t header_count;
+	size_t event_type_header;
+	size_t event_category_header;
+	size_t timestamp_header;
+	size_t timestamp_us_header;
+};
+
+/*! \brief Number of slots in a routing table's resolution cache (power of two) */
+#define ROUTE_CACHE_SIZE 256
+
+/*! \brief An event name and category already resolved to a topic */
+struct route_cache_entry {
+	unsigned int hash;
+	int category;
+	/*! \brief NULL = no rule matches */
+	struct ami_kafka_route *route;
+	size_t len;
+	char name[0];
+};
+
+/*!
+ * \brief Routing rules compiled for lookup.
+ *
+ * Exact names are hashed; prefixes are kept longest first and categories
+ * in config order. The first resolution of each event name and category
+ * is cached, so steady-state lookups are a hash and one comparison.
+ */
+struct ami_kafka_routes {
+	/*! \brief event name -> rule */
+	struct ami_name_map by_name;
+	struct ami_kafka_route **prefixes;
+	size_t num_prefixes;
+	struct ami_kafka_route **categories;
+	size_t num_categories;
+	/*! \brief every rule, one reference each; backs the arrays above */
+	struct ami_kafka_route **rules;
+	size_t num_rules;
+	/*! \brief write-once slots, filled with compare-and-swap */
+	struct route_cache_entry *cache[ROUTE_CACHE_SIZE];
 };
 
+/*! \brief Signature of ast_kafka_produce_hdrs() */
+typedef int (*ami_kafka_produce_fn)(struct ast_kafka_producer *producer,
+	const char *topic, const char *key, const void *payload, size_t len,
+	const struct ast_kafka_header *headers, size_t header_count);
+
 /* Forward declarations for exported (non-static) test-accessible functions */
 int add_filter(const char *criteria, const char *filter_pattern,
 	struct ao2_container *includefilters, struct ao2_container *excludefilters);
 int match_eventdata(struct event_filter_entry *entry, const char *eventdata);
-int should_send_event(struct ao2_container *includefilters,
-	struct ao2_container *excludefilters, const char *event, const char *body);
+struct ami_kafka_matcher *ami_kafka_matcher_build(const char * const *patterns,
+	size_t count);
+void ami_kafka_matcher_free(struct ami_kafka_matcher *matcher);
+void ami_kafka_matcher_scan(const struct ami_kafka_matcher *matcher,
+	const char *text, size_t len, unsigned long *matched);
+struct ami_kafka_filters *ami_kafka_filters_compile(
+	struct ao2_container *includefilters, struct ao2_container *excludefilters);
+int should_send_event(const struct ami_kafka_filters *filters,
+	const char *event, const struct ami_header_index *headers);
+int ami_header_index_build(struct ami_header_index *index, const char *body);
+void ami_header_index_free(struct ami_header_index *index);
 struct ast_json *ami_body_to_json(const char *event, char *body);
+int ami_json_write(struct ast_str **buf, const char *event,
+	const struct ami_header_index *headers, const struct ami_kafka_identity *identity);
+struct ami_kafka_identity *ami_kafka_identity_alloc(const char *format);
+void ami_kafka_identity_fold_headers(struct ami_kafka_identity *identity, int fold);
+int ami_msgpack_write(struct ast_str **buf, const char *event,
+	const struct ami_header_index *headers, const struct ami_kafka_identity *identity);
+void ami_kafka_identity_free(struct ami_kafka_identity *identity);
+void ami_kafka_key_source_parse(struct ami_kafka_key_source *source,
+	const char *value);
+const char *ami_kafka_message_key(const struct ami_kafka_key_source *source,
+	const char *event, const struct ami_header_index *headers,
+	const struct ami_kafka_identity *identity, char *buf, size_t buflen);
+const char *ami_kafka_category_str(int category, char *buf, size_t buflen);
+int ami_kafka_route_add(struct ao2_container *rules, const char *option,
+	const char *topic);
+struct ami_kafka_routes *ami_kafka_routes_compile(struct ao2_container *rules);
+const char *ami_kafka_route_topic(struct ami_kafka_routes *routes,
+	const char *event, int category, const char *default_topic);
+int ami_kafka_priority_add(struct ao2_container *rules, const char *option,
+	const char *priority);
+enum ami_kafka_priority ami_kafka_event_priority(struct ami_kafka_routes *priorities,
+	const char *event, int category);
+int ami_kafka_shed(struct ami_kafka_shed_policy *policy,
+	enum ami_kafka_priority priority, unsigned int load);
+int ami_kafka_sample_add(struct ao2_container *rules, const char *option,
+	const char *value);
+int ami_kafka_ratelimit_add(struct ao2_container *rules, const char *option,
+	const char *value);
+int ami_kafka_sample_keep(struct ami_kafka_routes *samples, const char *event,
+	int category);
+int ami_kafka_ratelimit_allow(struct ami_kafka_routes *ratelimits, const char *event,
+	int category, const struct ami_header_index *headers, uint64_t now);
+int ami_kafka_coalesce_add(struct ao2_container *rules, const char *option,
+	const char *header);
+struct ao2_container *ami_kafka_coalesced_alloc(void);
+int ami_kafka_coalesce(struct ao2_container *held, struct ast_sched_context *sched,
+	struct ami_kafka_routes *rules, unsigned int window_ms, int category,
+	const char *event, const struct ami_header_index *headers, uint64_t timestamp,
+	const struct ami_kafka_call_stamp *call);
+struct ami_kafka_coalesced *ami_kafka_coalesced_take(struct ao2_container *held,
+	const char *event, const char *identity);
+struct ao2_container *ami_kafka_calls_alloc(void);
+struct ami_kafka_wall_clock;
+uint64_t ami_kafka_wall_clock_advance(struct ami_kafka_wall_clock *clock,
+	uint64_t now, uint64_t wall);
+uint64_t ami_kafka_wall_clock_us(uint64_t now);
+int ami_kafka_call_track(struct ao2_container *calls, const char *event,
+	const struct ami_header_index *headers, time_t timestamp,
+	struct ami_kafka_call_stamp *stamp, struct ami_kafka_call **ended);
+int ami_kafka_call_summary(struct ami_kafka_call *call, struct ast_str **buf);
+unsigned int ami_kafka_calls_expire(struct ao2_container *calls, time_t before,
+	struct ao2_iterator **expired);
+int ami_kafka_fields_add(struct ao2_container *rules, const char *option,
+	const char *value);
+size_t ami_kafka_project(struct ami_kafka_routes *projections, const char *event,
+	int category, struct ami_header_index *headers);
+struct ami_kafka_compressor *ami_kafka_compressor_alloc(
+	enum ami_kafka_compression type, int level, const char *dictionary);
+void ami_kafka_compressor_free(struct ami_kafka_compressor *compressor);
+int ami_kafka_compress(const struct ami_kafka_compressor *compressor,
+	const char *data, size_t len, struct ast_str **out);
+unsigned int ami_kafka_latency_bucket(uint64_t ns);
+uint64_t ami_kafka_latency_bucket_floor(unsigned int bucket);
+uint64_t ami_kafka_latency_percentile(const uint64_t *buckets, double percentile);
+void ami_kafka_stats_count(enum ami_kafka_counter counter);
+void ami_kafka_stats_record(enum ami_kafka_stage stage, uint64_t ns);
+void ami_kafka_stats_collect(struct ami_kafka_stats *stats);
+void ami_kafka_stats_reset(void);
+struct ami_kafka_spill *ami_kafka_spill_alloc(unsigned int memory_records,
+	const char *path, size_t file_size);
+void ami_kafka_spill_free(struct ami_kafka_spill *spill);
+unsigned int ami_kafka_spill_pending(struct ami_kafka_spill *spill);
+int ami_kafka_spill_push(struct ami_kafka_spill *spill, const char *topic,
+	const char *key, const void *payload, size_t len,
+	const struct ast_kafka_header *hdrs, size_t hdr_count);
+unsigned int ami_kafka_spill_drain(struct ami_kafka_spill *spill,
+	ami_kafka_produce_fn produce, struct ast_kafka_producer *producer,
+	unsigned int max);
+ami_kafka_produce_fn ami_kafka_set_produce(ami_kafka_produce_fn produce);
+int ami_kafka_hook_event(int category, const char *event, char *body);
+int ami_kafka_bench_begin(const char **reason);
+void ami_kafka_bench_end(void);
+struct ao2_container *ami_kafka_batches_alloc(void);
+int ami_kafka_batch_add(struct ao2_container *batches, struct ast_sched_context *sched,
+	const struct ami_kafka_batch_settings *settings, const char *topic,
+	const char *key, const char *record, size_t len, uint64_t timestamp,
+	struct ami_kafka_batch *ready[2]);
+struct ami_kafka_queue *ami_kafka_queue_alloc(unsigned int size);
+void ami_kafka_queue_free(struct ami_kafka_queue *queue);
+int ami_kafka_queue_push(struct ami_kafka_queue *queue, int category,
+	const char *event, const char *body, uint64_t timestamp,
+	const struct ami_kafka_call_stamp *call);
+struct ami_kafka_queued_event *ami_kafka_queue_pop(struct ami_kafka_queue *queue);
+unsigned int ami_kafka_queue_depth(struct ami_kafka_queue *queue);
+unsigned int ami_kafka_spill_fill(struct ami_kafka_spill *spill);
 
 /*! \brief General configuration */
 struct ami_kafka_conf_general {
@@ -151,6 +1147,66 @@ struct ami_kafka_conf_general {
 	struct ao2_container *includefilters;
 	/*! \brief exclude event filters */
 	struct ao2_container *excludefilters;
+	/*! \brief both filter sets compiled for lookup by event name */
+	struct ami_kafka_filters *filters;
+	/*! \brief hand events to worker threads instead of publishing inline */
+	int async;
+	/*! \brief JSON keeps repeated headers as arrays and variables as objects */
+	int fold_headers;
+	/*! \brief capacity of the asynchronous queue */
+	unsigned int queue_size;
+	/*! \brief number of asynchronous worker threads */
+	unsigned int worker_threads;
+	/*! \brief combining events into multi-record messages */
+	struct ami_kafka_batch_settings batch;
+	/*! \brief payload compression */
+	enum ami_kafka_compression compression;
+	/*! \brief zstd compression level */
+	unsigned int compression_level;
+	/*! \brief "builtin", "none" or the path of a trained zstd dictionary */
+	char compression_dictionary[PATH_MAX];
+	/*! \brief built at load; NULL without compression */
+	struct ami_kafka_compressor *compressor;
+	/*! \brief messages kept in memory when the producer refuses them */
+	unsigned int spill_size;
+	/*! \brief spool file for refused messages, empty for none */
+	char spill_file[PATH_MAX];
+	/*! \brief bytes of record space in a new spool file */
+	unsigned int spill_file_size;
+	/*! \brief 'priority(...)' rules, as configured */
+	struct ao2_container *priority_rules;
+	/*! \brief priority_rules compiled at load */
+	struct ami_kafka_routes *priorities;
+	/*! \brief load shedding thresholds and sampling */
+	struct ami_kafka_shed_policy shed;
+	/*! \brief 'sample(...)' rules, as configured */
+	struct ao2_container *sample_rules;
+	/*! \brief sample_rules compiled at load */
+	struct ami_kafka_routes *samples;
+	/*! \brief 'ratelimit(...)' rules, as configured */
+	struct ao2_container *ratelimit_rules;
+	/*! \brief ratelimit_rules compiled at load */
+	struct ami_kafka_routes *ratelimits;
+	/*! \brief 'coalesce(...)' rules, as configured */
+	struct ao2_container *coalesce_rules;
+	/*! \brief coalesce_rules compiled at load */
+	struct ami_kafka_routes *coalesces;
+	/*! \brief how long the first event of a burst is held */
+	unsigned int coalesce_window_ms;
+	/*! \brief send enqueue_us, the time messages are handed to the producer */
+	int enqueue_timestamp;
+	/*! \brief stamp events with their call sequence and start time */
+	int call_tracking;
+	/*! \brief raise a CallSummary event when a call ends */
+	int call_summaries;
+	/*! \brief seconds without an event after which a call is dropped */
+	unsigned int call_idle_timeout;
+	/*! \brief 'fields(...)' rules, as configured */
+	struct ao2_container *fields_rules;
+	/*! \brief fields_rules compiled at load */
+	struct ami_kafka_routes *projections;
+	/*! \brief lowest shedding threshold; below it priorities are not looked up */
+	unsigned int shed_from;
 };
 
 /*! \brief Kafka configuration */
@@ -160,7 +1216,15 @@ struct ami_kafka_conf_kafka {
 		AST_STRING_FIELD(connection);
 		/*! \brief Kafka topic name */
 		AST_STRING_FIELD(topic);
+		/*! \brief message key strategy, as configured */
+		AST_STRING_FIELD(partition_key);
 	);
+	/*! \brief partition_key, parsed at load */
+	struct ami_kafka_key_source key_source;
+	/*! \brief route(...) rules in config order */
+	struct ao2_container *route_rules;
+	/*! \brief route_rules compiled at load */
+	struct ami_kafka_routes *routes;
 };
 
 /*! \brief Module configuration */
@@ -172,17 +1236,69 @@ struct ami_kafka_conf {
 /*! \brief Locking container for safe configuration access. */
 static AO2_GLOBAL_OBJ_STATIC(confs);
 
-/*! \brief Cached Kafka producer for fast access. */
-static AO2_GLOBAL_OBJ_STATIC(cached_producer);
+/*!
+ * \brief Configuration and Kafka producer the publishing path works with.
+ *
+ * Published through a single pointer so the hot path needs neither the
+ * global object locks nor reference counting: readers load the pointer
+ * and use it. A replaced snapshot is only freed after every reader that
+ * could still see it has finished (see snapshot_synchronize()).
+ */
+struct ami_kafka_snapshot {
+	struct ami_kafka_conf *conf;
+	struct ast_kafka_producer *producer;
+	struct ami_kafka_identity *identity;
+};
+
+/*! \brief Current snapshot; only load/reload/unload replace it. */
+static struct ami_kafka_snapshot *active_snapshot;
+
+/*! \brief Held for reading by worker and scheduler threads while they use a snapshot. */
+AST_RWLOCK_DEFINE_STATIC(snapshot_lock);
+
+/*! \brief Asynchronous event queue, NULL when events are published inline. */
+static struct ami_kafka_queue *event_queue;
+
+/*! \brief Batches with pending events, by topic and message key. */
+static struct ao2_container *batches;
+
+/*! \brief Scheduler producing batches whose linger time expired. */
+static struct ast_sched_context *batch_sched;
+
+/*! \brief Events held by coalescing, by event name and identity. */
+static struct ao2_container *coalesced;
+
+/*! \brief Calls tracked for call_tracking, by Linkedid. */
+static struct ao2_container *calls;
+
+/*! \brief How often calls without events are looked for */
+#define CALL_SWEEP_INTERVAL_MS 60000
+
+/*! \brief Worker threads draining event_queue. */
+static pthread_t *worker_threads;
+static unsigned int worker_count;
 
 static int ami_hook_callback(int category, const char *event, char *body);
 
+/*! \brief Where messages go; only replaced by bench_app_ami_kafka */
+static ami_kafka_produce_fn produce_hdrs = ast_kafka_produce_hdrs;
+
 /*! \brief AMI custom hook for capturing all manager events. */
 static struct manager_custom_hook ami_kafka_hook = {
 	.file = __FILE__,
 	.helper = ami_hook_callback,
 };
 
+/*!
+ * \brief Never registered; unregistering it just waits for running hooks.
+ *
+ * ast_manager_unregister_hook() write-locks the manager hook list, which
+ * manager.c read-locks around every hook call.
+ */
+static struct manager_custom_hook grace_hook = {
+	.file = __FILE__,
+};
+
 /* ACO type definitions */
 
 static struct aco_type general_option = {
@@ -211,6 +1327,18 @@ static void conf_general_dtor(void *obj)
 
 	ao2_cleanup(general->includefilters);
 	ao2_cleanup(general->excludefilters);
+	ao2_cleanup(general->filters);
+	ami_kafka_compressor_free(general->compressor);
+	ao2_cleanup(general->priority_rules);
+	ao2_cleanup(general->priorities);
+	ao2_cleanup(general->sample_rules);
+	ao2_cleanup(general->samples);
+	ao2_cleanup(general->ratelimit_rules);
+	ao2_cleanup(general->ratelimits);
+	ao2_cleanup(general->coalesce_rules);
+	ao2_cleanup(general->coalesces);
+	ao2_cleanup(general->fields_rules);
+	ao2_cleanup(general->projections);
 }
 
 static struct ami_kafka_conf_general *conf_general_create(void)
@@ -226,7 +1354,20 @@ static struct ami_kafka_conf_general *conf_general_create(void)
 		AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
 	general->excludefilters = ao2_container_alloc_list(
 		AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
-	if (!general->includefilters || !general->excludefilters) {
+	general->priority_rules = ao2_container_alloc_list(
+		AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
+	general->sample_rules = ao2_container_alloc_list(
+		AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
+	general->ratelimit_rules = ao2_container_alloc_list(
+		AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
+	general->coalesce_rules = ao2_container_alloc_list(
+		AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
+	general->fields_rules = ao2_container_alloc_list(
+		AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
+	if (!general->includefilters || !general->excludefilters
+		|| !general->priority_rules || !general->sample_rules
+		|| !general->ratelimit_rules || !general->coalesce_rules
+		|| !general->fields_rules) {
 		ao2_ref(general, -1);
 		return NULL;
 	}
@@ -240,6 +1381,8 @@ static void conf_kafka_dtor(void *obj)
 {
 	struct ami_kafka_conf_kafka *kafka = obj;
 	ast_string_field_free_memory(kafka);
+	ao2_cleanup(kafka->route_rules);
+	ao2_cleanup(kafka->routes);
 }
 
 static struct ami_kafka_conf_kafka *conf_kafka_create(void)
@@ -256,6 +1399,13 @@ static struct ami_kafka_conf_kafka *conf_kafka_create(void)
 		return NULL;
 	}
 
+	kafka->route_rules = ao2_container_alloc_list(
+		AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
+	if (!kafka->route_rules) {
+		ao2_ref(kafka, -1);
+		return NULL;
+	}
+
 	aco_set_defaults(&kafka_option, "kafka", kafka);
 
 	return kafka;
@@ -319,49 +1469,435 @@ static int setup_kafka(void)
 		return -1;
 	}
 
-	return 0;
-}
+	ami_kafka_key_source_parse(&conf->kafka->key_source, conf->kafka->partition_key);
 
-static int setup_cached_producer(void)
-{
-	RAII_VAR(struct ami_kafka_conf *, conf, ao2_global_obj_ref(confs), ao2_cleanup);
+	conf->kafka->routes = ami_kafka_routes_compile(conf->kafka->route_rules);
+	if (!conf->kafka->routes) {
+		ast_log(LOG_ERROR, "Failed to compile topic routes\n");
+		return -1;
+	}
 
-	if (!conf || !conf->kafka || ast_strlen_zero(conf->kafka->connection)) {
-		ast_log(LOG_WARNING, "No Kafka connection configured for ami_kafka\n");
+	if (conf->general->batch.mode != AMI_KAFKA_BATCH_NONE
+		&& conf->general->format != AMI_KAFKA_FORMAT_JSON
+		&& conf->general->format != AMI_KAFKA_FORMAT_JSON_TYPED) {
+		ast_log(LOG_WARNING, "batch_mode requires format = json or json_typed; "
+			"events will not be batched\n");
+		conf->general->batch.mode = AMI_KAFKA_BATCH_NONE;
+	}
+
+	conf->general->filters = ami_kafka_filters_compile(
+		conf->general->includefilters, conf->general->excludefilters);
+	if (!conf->general->filters) {
+		ast_log(LOG_ERROR, "Failed to compile event filters\n");
 		return -1;
 	}
 
-	struct ast_kafka_producer *producer = ast_kafka_get_producer(conf->kafka->connection);
-	if (!producer) {
-		ast_log(LOG_ERROR, "Failed to get Kafka producer for connection '%s'\n",
-			conf->kafka->connection);
+	conf->general->priorities = ami_kafka_routes_compile(conf->general->priority_rules);
+	if (!conf->general->priorities) {
+		ast_log(LOG_ERROR, "Failed to compile event priorities\n");
+		return -1;
+	}
+
+	conf->general->samples = ami_kafka_routes_compile(conf->general->sample_rules);
+	conf->general->ratelimits = ami_kafka_routes_compile(conf->general->ratelimit_rules);
+	if (!conf->general->samples || !conf->general->ratelimits) {
+		ast_log(LOG_ERROR, "Failed to compile sample and ratelimit rules\n");
+		return -1;
+	}
+
+	conf->general->coalesces = ami_kafka_routes_compile(conf->general->coalesce_rules);
+	if (!conf->general->coalesces) {
+		ast_log(LOG_ERROR, "Failed to compile coalesce rules\n");
+		return -1;
+	}
+
+	conf->general->projections = ami_kafka_routes_compile(conf->general->fields_rules);
+	if (!conf->general->projections) {
+		ast_log(LOG_ERROR, "Failed to compile fields rules\n");
 		return -1;
 	}
 
-	ao2_global_obj_replace_unref(cached_producer, producer);
-	ao2_cleanup(producer);
+	/* Critical events are never shed */
+	conf->general->shed.threshold[AMI_KAFKA_PRIORITY_CRITICAL] = UINT_MAX;
+	conf->general->shed_from = MIN(conf->general->shed.threshold[AMI_KAFKA_PRIORITY_LOW],
+		conf->general->shed.threshold[AMI_KAFKA_PRIORITY_NORMAL]);
+
+	if (conf->general->compression != AMI_KAFKA_COMPRESSION_NONE) {
+		conf->general->compressor = ami_kafka_compressor_alloc(
+			conf->general->compression, conf->general->compression_level,
+			conf->general->compression_dictionary);
+		if (!conf->general->compressor) {
+			ast_log(LOG_ERROR, "Failed to set up payload compression\n");
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
-/*! \brief Destructor for event_filter_entry ao2 objects */
-static void event_filter_dtor(void *obj)
+/*!
+ * \brief Wait until no reader can still be using a replaced snapshot.
+ *
+ * Inline readers run inside the manager hook, under the hook list read
+ * lock; worker threads, the batch scheduler and the spill drainer hold
+ * snapshot_lock for reading. Taking both for writing once is the grace period.
+ */
+static void snapshot_synchronize(void)
 {
-	struct event_filter_entry *entry = obj;
+	ast_manager_unregister_hook(&grace_hook);
 
-	if (entry->regex_filter) {
-		regfree(entry->regex_filter);
-		ast_free(entry->regex_filter);
-	}
-	ast_free(entry->event_name);
-	ast_free(entry->header_name);
-	ast_free(entry->string_filter);
+	ast_rwlock_wrlock(&snapshot_lock);
+	ast_rwlock_unlock(&snapshot_lock);
+}
+
+static void snapshot_free(struct ami_kafka_snapshot *snapshot)
+{
+	ami_kafka_identity_free(snapshot->identity);
+	ao2_cleanup(snapshot->producer);
+	ao2_cleanup(snapshot->conf);
+	ast_free(snapshot);
 }
 
 /*!
- * \brief Parse and add an event filter entry.
- *
- * Supports both legacy and advanced syntax, compatible with Asterisk manager.conf.
- *
+ * \brief Publish \a snapshot (may be NULL) and free the one it replaces.
+ */
+static void snapshot_replace(struct ami_kafka_snapshot *snapshot)
+{
+	struct ami_kafka_snapshot *old;
+
+	old = __atomic_exchange_n(&active_snapshot, snapshot, __ATOMIC_ACQ_REL);
+	if (old) {
+		snapshot_synchronize();
+		snapshot_free(old);
+	}
+}
+
+/*!
+ * \brief Build a snapshot from the current configuration and publish it.
+ *
+ * If no producer can be obtained the previous snapshot's producer is kept,
+ * so a bad reload does not stop publishing.
+ *
+ * \retval 0 on success
+ * \retval -1 if the producer could not be set up
+ */
+static int setup_snapshot(void)
+{
+	struct ami_kafka_conf *conf = ao2_global_obj_ref(confs);
+	struct ami_kafka_snapshot *current;
+	struct ami_kafka_snapshot *snapshot;
+	struct ast_kafka_producer *producer = NULL;
+	int res = 0;
+
+	if (!conf) {
+		return -1;
+	}
+
+	if (!conf->kafka || ast_strlen_zero(conf->kafka->connection)) {
+		ast_log(LOG_WARNING, "No Kafka connection configured for ami_kafka\n");
+		res = -1;
+	} else {
+		producer = ast_kafka_get_producer(conf->kafka->connection);
+		if (!producer) {
+			ast_log(LOG_ERROR, "Failed to get Kafka producer for connection '%s'\n",
+				conf->kafka->connection);
+			res = -1;
+		}
+	}
+
+	if (!producer) {
+		current = __atomic_load_n(&active_snapshot, __ATOMIC_ACQUIRE);
+		if (!current) {
+			ao2_ref(conf, -1);
+			return -1;
+		}
+		producer = ao2_bump(current->producer);
+	}
+
+	snapshot = ast_calloc(1, sizeof(*snapshot));
+	if (!snapshot) {
+		ao2_ref(producer, -1);
+		ao2_ref(conf, -1);
+		return -1;
+	}
+	snapshot->conf = conf;
+	snapshot->producer = producer;
+	snapshot->identity = ami_kafka_identity_alloc(
+		format_names[conf->general ? conf->general->format : AMI_KAFKA_FORMAT_JSON]);
+	if (!snapshot->identity) {
+		snapshot_free(snapshot);
+		return -1;
+	}
+	ami_kafka_identity_fold_headers(snapshot->identity,
+		conf->general && conf->general->fold_headers);
+
+	snapshot_replace(snapshot);
+
+	return res;
+}
+
+/*! \brief Matched pattern sets of up to this many words live on the stack */
+#define MATCHER_STACK_WORDS 4
+
+#define MATCHER_WORD_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+/*!
+ * \brief Aho-Corasick automaton over a set of literal patterns.
+ *
+ * Built once per configuration load as a complete DFA, so scanning costs
+ * one table lookup per byte of text whatever the number of patterns.
+ * Bytes are mapped to classes first: every byte no pattern uses shares
+ * class 0, which keeps the table at states x classes rather than
+ * states x 256.
+ */
+struct ami_kafka_matcher {
+	/*! \brief input class of each byte */
+	unsigned short classes[256];
+	unsigned int num_classes;
+	unsigned int num_states;
+	size_t num_patterns;
+	/*! \brief next state by state and class (num_states * num_classes) */
+	unsigned int *delta;
+	/*! \brief outputs of state s are outputs[out_start[s]] to outputs[out_start[s + 1]] */
+	unsigned int *out_start;
+	/*! \brief pattern indexes, including those of the suffixes of each state */
+	unsigned int *outputs;
+};
+
+void ami_kafka_matcher_free(struct ami_kafka_matcher *matcher)
+{
+	if (!matcher) {
+		return;
+	}
+	ast_free(matcher->delta);
+	ast_free(matcher->out_start);
+	ast_free(matcher->outputs);
+	ast_free(matcher);
+}
+
+/*!
+ * \brief Build the automaton for \a patterns.
+ *
+ * \param patterns Non-empty literal strings; duplicates are allowed.
+ * \param count Number of patterns.
+ * \return The automaton, or NULL on allocation failure.
+ */
+struct ami_kafka_matcher *ami_kafka_matcher_build(const char * const *patterns,
+	size_t count)
+{
+	struct ami_kafka_matcher *matcher;
+	unsigned int *fail = NULL;
+	unsigned int *queue = NULL;
+	unsigned int *first = NULL;
+	unsigned int *next = NULL;
+	unsigned int *out_count = NULL;
+	size_t max_states = 1;
+	unsigned int head = 0;
+	unsigned int tail = 0;
+	unsigned int classes;
+	unsigned int s;
+	size_t total;
+	size_t i;
+
+	matcher = ast_calloc(1, sizeof(*matcher));
+	if (!matcher) {
+		return NULL;
+	}
+	matcher->num_patterns = count;
+
+	matcher->num_classes = 1;
+	for (i = 0; i < count; i++) {
+		const unsigned char *p;
+
+		for (p = (const unsigned char *) patterns[i]; *p; p++) {
+			if (!matcher->classes[*p]) {
+				matcher->classes[*p] = matcher->num_classes++;
+			}
+			max_states++;
+		}
+	}
+	classes = matcher->num_classes;
+
+	matcher->delta = ast_calloc(max_states * classes, sizeof(*matcher->delta));
+	matcher->out_start = ast_calloc(max_states + 1, sizeof(*matcher->out_start));
+	fail = ast_calloc(max_states, sizeof(*fail));
+	queue = ast_calloc(max_states, sizeof(*queue));
+	first = ast_calloc(max_states, sizeof(*first));
+	out_count = ast_calloc(max_states, sizeof(*out_count));
+	next = ast_calloc(count ? count : 1, sizeof(*next));
+	if (!matcher->delta || !matcher->out_start || !fail || !queue || !first
+		|| !out_count || !next) {
+		goto error;
+	}
+
+	/* Trie; edge 0 means none, as no edge leads back to the root */
+	matcher->num_states = 1;
+	for (i = 0; i < count; i++) {
+		const unsigned char *p;
+
+		s = 0;
+		for (p = (const unsigned char *) patterns[i]; *p; p++) {
+			unsigned int *edge = &matcher->delta[s * classes + matcher->classes[*p]];
+
+			if (!*edge) {
+				*edge = matcher->num_states++;
+			}
+			s = *edge;
+		}
+		/* Patterns ending in s, as a list threaded through next[] */
+		next[i] = first[s];
+		first[s] = i + 1;
+		out_count[s]++;
+	}
+
+	/* Failure links breadth first, turning missing edges into DFA moves */
+	queue[tail++] = 0;
+	while (head < tail) {
+		unsigned int c;
+
+		s = queue[head++];
+		if (s) {
+			out_count[s] += out_count[fail[s]];
+		}
+		for (c = 0; c < classes; c++) {
+			unsigned int *edge = &matcher->delta[s * classes + c];
+
+			if (*edge) {
+				fail[*edge] = s ? matcher->delta[fail[s] * classes + c] : 0;
+				queue[tail++] = *edge;
+			} else if (s) {
+				*edge = matcher->delta[fail[s] * classes + c];
+			}
+		}
+	}
+
+	total = 0;
+	for (s = 0; s < matcher->num_states; s++) {
+		matcher->out_start[s] = total;
+		total += out_count[s];
+	}
+	matcher->out_start[matcher->num_states] = total;
+	matcher->outputs = ast_calloc(total ? total : 1, sizeof(*matcher->outputs));
+	if (!matcher->outputs) {
+		goto error;
+	}
+
+	/* In BFS order the failure state's outputs are complete when copied */
+	for (head = 0; head < tail; head++) {
+		unsigned int *out;
+		unsigned int p;
+
+		s = queue[head];
+		out = &matcher->outputs[matcher->out_start[s]];
+		for (p = first[s]; p; p = next[p - 1]) {
+			*out++ = p - 1;
+		}
+		if (s) {
+			memcpy(out, &matcher->outputs[matcher->out_start[fail[s]]],
+				out_count[fail[s]] * sizeof(*out));
+		}
+	}
+
+	ast_free(fail);
+	ast_free(queue);
+	ast_free(first);
+	ast_free(next);
+	ast_free(out_count);
+
+	return matcher;
+
+error:
+	ast_free(fail);
+	ast_free(queue);
+	ast_free(first);
+	ast_free(next);
+	ast_free(out_count);
+	ami_kafka_matcher_free(matcher);
+	return NULL;
+}
+
+/*!
+ * \brief Find which patterns occur in \a text, in a single pass.
+ *
+ * \param matched Set of matched pattern indexes, one bit each; it is
+ *        cleared first and must hold the automaton's pattern count.
+ */
+void ami_kafka_matcher_scan(const struct ami_kafka_matcher *matcher,
+	const char *text, size_t len, unsigned long *matched)
+{
+	const unsigned char *p = (const unsigned char *) text;
+	const unsigned char *end = p + len;
+	unsigned int classes = matcher->num_classes;
+	unsigned int s = 0;
+
+	memset(matched, 0, (matcher->num_patterns + MATCHER_WORD_BITS - 1)
+		/ MATCHER_WORD_BITS * sizeof(*matched));
+
+	for (; p < end; p++) {
+		unsigned int i;
+
+		s = matcher->delta[s * classes + matcher->classes[*p]];
+		for (i = matcher->out_start[s]; i < matcher->out_start[s + 1]; i++) {
+			unsigned int pattern = matcher->outputs[i];
+
+			matched[pattern / MATCHER_WORD_BITS] |= 1UL << (pattern % MATCHER_WORD_BITS);
+		}
+	}
+}
+
+/*!
+ * \brief The literal a regular expression matches, if it is nothing more.
+ *
+ * Patterns such as "Event: Newchannel" are extended regular expressions
+ * without a single operator; searching the body for them is the same as
+ * regexec(). Backslash-escaped operators are literal too.
+ *
+ * \return The unescaped literal (caller frees), or NULL if \a pattern is
+ *         not a plain literal.
+ */
+static char *regex_literal(const char *pattern)
+{
+	static const char operators[] = ".[]()*+?{}|^$\\";
+	char *literal = ast_malloc(strlen(pattern) + 1);
+	char *out = literal;
+
+	if (!literal) {
+		return NULL;
+	}
+	for (; *pattern; pattern++) {
+		if (*pattern == '\\' && pattern[1] && strchr(operators, pattern[1])) {
+			*out++ = *++pattern;
+		} else if (strchr(operators, *pattern)) {
+			ast_free(literal);
+			return NULL;
+		} else {
+			*out++ = *pattern;
+		}
+	}
+	*out = '\0';
+
+	return literal;
+}
+
+/*! \brief Destructor for event_filter_entry ao2 objects */
+static void event_filter_dtor(void *obj)
+{
+	struct event_filter_entry *entry = obj;
+
+	if (entry->regex_filter) {
+		regfree(entry->regex_filter);
+		ast_free(entry->regex_filter);
+	}
+	ast_free(entry->event_name);
+	ast_free(entry->header_name);
+	ast_free(entry->string_filter);
+}
+
+/*!
+ * \brief Parse and add an event filter entry.
+ *
+ * Supports both legacy and advanced syntax, compatible with Asterisk manager.conf.
+ *
  * Legacy:
  *   eventfilter = Event: Newchannel        (include, regex on body)
  *   eventfilter = !Channel: Local/          (exclude, regex on body)
@@ -589,8 +2125,15 @@ int add_filter(const char *criteria, const char *filter_pattern,
 				ao2_ref(filter_entry, -1);
 				return -1;
 			}
+			/* A regex that is a plain literal joins the body automaton */
+			if (!filter_entry->header_name) {
+				filter_entry->string_filter = regex_literal(filter_pattern);
+				filter_entry->body_literal = filter_entry->string_filter != NULL;
+			}
 		} else {
 			filter_entry->string_filter = ast_strdup(filter_pattern);
+			filter_entry->body_literal = !filter_entry->header_name
+				&& filter_entry->match_type == FILTER_MATCH_CONTAINS;
 		}
 	}
 
@@ -639,410 +2182,5634 @@ int match_eventdata(struct event_filter_entry *entry, const char *eventdata)
 	return 0;
 }
 
-/*! \brief Auxiliary struct for passing event+body to ao2_callback */
-struct filter_cmp_args {
-	const char *event;
-	const char *body;
-};
+/*! \brief FNV-1a hash of a (not necessarily terminated) string */
+static unsigned int name_hash(const char *str, size_t len)
+{
+	unsigned int hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char) str[i]) * 16777619U;
+	}
+
+	return hash;
+}
 
 /*!
- * \brief ao2_callback function: check if a filter entry matches an event.
+ * \brief Build an immutable name map with room for \a count names.
  *
- * Adapted from Asterisk manager.c filter_cmp_fn — uses event name string
- * comparison (no hash) and searches headers in the raw AMI body.
+ * The table is sized to at most half full so probe sequences stay short.
  */
-static int filter_cmp_fn(void *obj, void *arg, void *data, int flags)
+static int name_map_init(struct ami_name_map *map, size_t count)
 {
-	struct event_filter_entry *filter_entry = obj;
-	struct filter_cmp_args *args = arg;
-	int *result = data;
-	int match = 0;
+	unsigned int size = 8;
 
-	/* Check event name filter first */
-	if (filter_entry->event_name) {
-		if (strcmp(args->event, filter_entry->event_name) != 0) {
-			goto done;
-		}
+	while (size < count * 2) {
+		size <<= 1;
 	}
 
-	/* No header_name → match against full body */
-	if (!filter_entry->header_name) {
-		if (!ast_strlen_zero(args->body)) {
-			match = match_eventdata(filter_entry, args->body);
-		} else {
-			/* No body, but if match_type is NONE we still match */
-			match = (filter_entry->match_type == FILTER_MATCH_NONE) ? 1 : 0;
-		}
-		goto done;
+	map->entries = ast_calloc(size, sizeof(*map->entries));
+	if (!map->entries) {
+		return -1;
 	}
+	map->mask = size - 1;
 
-	/* Search for specific header in body (format: "Header: Value\r\n") */
-	{
-		char *copy = ast_strdupa(args->body);
-		char *line;
-		char *saveptr = NULL;
-
-		for (line = strtok_r(copy, "\r\n", &saveptr); line;
-		     line = strtok_r(NULL, "\r\n", &saveptr)) {
-			if (ast_strlen_zero(line)) {
-				continue;
-			}
-			if (ast_begins_with(line, filter_entry->header_name)) {
-				char *value = line + strlen(filter_entry->header_name);
-				value = ast_skip_blanks(value);
-				if (ast_strlen_zero(value)) {
-					continue;
-				}
-				match = match_eventdata(filter_entry, value);
-				if (match) {
-					break;
-				}
-			}
-		}
-	}
+	return 0;
+}
 
-done:
-	*result = match;
-	return match ? CMP_MATCH | CMP_STOP : 0;
+static void name_map_destroy(struct ami_name_map *map)
+{
+	ast_free(map->entries);
+	map->entries = NULL;
+	map->mask = 0;
 }
 
 /*!
- * \brief Determine if an event should be sent based on include/exclude filters.
- *
- * Logic (identical to Asterisk manager.c):
- *   - No filters → send everything
- *   - Include only → send only what matches an include
- *   - Exclude only → send everything except what matches an exclude
- *   - Both → match include first, then reject if matches an exclude
- *
- * \param includefilters Container of include filter entries
- * \param excludefilters Container of exclude filter entries
- * \param event AMI event name
- * \param body AMI event body
- * \retval 1 event should be sent
- * \retval 0 event should be filtered out
+ * \brief Find the slot for \a name (occupied by it, or the empty slot it would use).
  */
-int should_send_event(struct ao2_container *includefilters,
-	struct ao2_container *excludefilters, const char *event, const char *body)
+static struct ami_name_map_entry *name_map_slot(const struct ami_name_map *map,
+	const char *name, size_t len, unsigned int hash)
 {
-	struct filter_cmp_args args = {
-		.event = event,
-		.body = body,
-	};
-	int result = 0;
-	int num_include = ao2_container_count(includefilters);
-	int num_exclude = ao2_container_count(excludefilters);
-
-	if (!num_include && !num_exclude) {
-		return 1; /* no filters = send all */
-	}
+	unsigned int i = hash & map->mask;
 
-	if (num_include && !num_exclude) {
-		/* include only: implied exclude all, then include */
-		ao2_callback_data(includefilters, OBJ_NODATA, filter_cmp_fn, &args, &result);
-		return result;
-	}
-
-	if (!num_include && num_exclude) {
-		/* exclude only: implied include all, then exclude */
-		ao2_callback_data(excludefilters, OBJ_NODATA, filter_cmp_fn, &args, &result);
-		return !result;
-	}
+	for (;;) {
+		struct ami_name_map_entry *entry = &map->entries[i];
 
-	/* Both: include first, then exclude */
-	ao2_callback_data(includefilters, OBJ_NODATA, filter_cmp_fn, &args, &result);
-	if (result) {
-		result = 0;
-		ao2_callback_data(excludefilters, OBJ_NODATA, filter_cmp_fn, &args, &result);
-		return !result;
+		if (!entry->name || (entry->hash == hash && entry->len == len
+			&& !memcmp(entry->name, name, len))) {
+			return entry;
+		}
+		i = (i + 1) & map->mask;
 	}
-
-	return 0;
 }
 
 /*!
- * \brief Custom ACO handler for the 'format' option.
+ * \brief Add \a name to the map, or return its existing entry.
  *
- * Converts the string value "json" or "ami" to the enum.
+ * \a name must outlive the map. Only used while building.
  */
-static int format_handler(const struct aco_option *opt, struct ast_variable *var,
-	void *obj)
+static struct ami_name_map_entry *name_map_add(struct ami_name_map *map, const char *name)
 {
-	struct ami_kafka_conf_general *general = obj;
-
-	if (!strcasecmp(var->value, "json")) {
-		general->format = AMI_KAFKA_FORMAT_JSON;
-	} else if (!strcasecmp(var->value, "ami")) {
-		general->format = AMI_KAFKA_FORMAT_AMI;
-	} else {
-		ast_log(LOG_WARNING, "Invalid format '%s', must be 'json' or 'ami'\n",
-			var->value);
-		return -1;
+	size_t len = strlen(name);
+	unsigned int hash = name_hash(name, len);
+	struct ami_name_map_entry *entry = name_map_slot(map, name, len, hash);
+
+	if (!entry->name) {
+		entry->name = name;
+		entry->len = len;
+		entry->hash = hash;
 	}
 
-	return 0;
+	return entry;
 }
 
 /*!
- * \brief Custom ACO handler for 'eventfilter' option.
+ * \brief Look up a name: one hash and, usually, one comparison.
  *
- * Registered as ACO_REGEX to match both "eventfilter" and "eventfilter(...)".
- * Parses legacy and advanced syntax via add_filter().
+ * \return The stored value, or NULL if the name is not in the map.
  */
-static int eventfilter_handler(const struct aco_option *opt,
-	struct ast_variable *var, void *obj)
+static void *name_map_find(const struct ami_name_map *map, const char *name, size_t len)
 {
-	struct ami_kafka_conf_general *general = obj;
+	if (!map->entries) {
+		return NULL;
+	}
 
-	return add_filter(var->name, var->value,
-		general->includefilters, general->excludefilters);
+	return name_map_slot(map, name, len, name_hash(name, len))->value;
 }
 
 /*!
- * \brief Parse AMI body text into a JSON object.
+ * \brief Index every line of an AMI body in one scan.
  *
- * AMI body format is "Key: Value\r\n" pairs. This function parses each
- * line and builds an ast_json object. The event name is also added to
- * the JSON object.
+ * Lines are maximal runs without '\r' or '\n' (empty lines are skipped),
+ * the same lines strtok_r(body, "\r\n") yields. A line is a header when it
+ * contains ": ", the key being everything before the first one. Nothing is
+ * copied: entries point into \a body, which must outlive the index.
  *
- * \param event The AMI event name.
- * \param body The AMI body text.
- * \return A new ast_json object on success.
- * \return NULL on failure.
+ * \retval 0 on success
+ * \retval -1 on allocation failure (the index is still safe to free)
  */
-struct ast_json *ami_body_to_json(const char *event, char *body)
+int ami_header_index_build(struct ami_header_index *index, const char *body)
 {
-	struct ast_json *json;
-	char *copy;
-	char *line;
-	char *saveptr = NULL;
-
-	json = ast_json_object_create();
-	if (!json) {
-		return NULL;
-	}
-
-	ast_json_object_set(json, "Event", ast_json_string_create(event));
-
-	/* Inject system identification (same fields the AMI manager exposes) */
-	{
-		char eid_str[20];
-		ast_eid_to_str(eid_str, sizeof(eid_str), &ast_eid_default);
-		ast_json_object_set(json, "EntityID", ast_json_string_create(eid_str));
-	}
-	if (!ast_strlen_zero(ast_config_AST_SYSTEM_NAME)) {
-		ast_json_object_set(json, "SystemName",
-			ast_json_string_create(ast_config_AST_SYSTEM_NAME));
-	}
+	const char *p = body;
 
-	copy = ast_strdupa(body);
+	index->body = body;
+	index->items = index->stack;
+	index->count = 0;
+	index->size = AMI_HEADER_STACK_LINES;
 
-	for (line = strtok_r(copy, "\r\n", &saveptr); line;
-	     line = strtok_r(NULL, "\r\n", &saveptr)) {
-		char *sep;
+	while (*p) {
+		struct ami_header *header;
+		const char *line;
+		const char *sep = NULL;
 
-		if (ast_strlen_zero(line)) {
+		if (*p == '\r' || *p == '\n') {
+			p++;
 			continue;
 		}
 
-		sep = strstr(line, ": ");
-		if (!sep) {
-			continue;
+		line = p;
+		while (*p && *p != '\r' && *p != '\n') {
+			if (!sep && p[0] == ':' && p[1] == ' ') {
+				sep = p;
+			}
+			p++;
+		}
+
+		if (index->count == index->size) {
+			size_t size = index->size * 2;
+			struct ami_header *items;
+
+			if (index->items == index->stack) {
+				items = ast_malloc(size * sizeof(*items));
+				if (items) {
+					memcpy(items, index->stack, sizeof(index->stack));
+				}
+			} else {
+				items = ast_realloc(index->items, size * sizeof(*items));
+			}
+			if (!items) {
+				index->body_len = p - body;
+				return -1;
+			}
+			index->items = items;
+			index->size = size;
 		}
 
-		*sep = '\0';
-		ast_json_object_set(json, line, ast_json_string_create(sep + 2));
+		header = &index->items[index->count++];
+		header->line = line;
+		header->line_len = p - line;
+		header->key_len = sep ? sep - line : -1;
+		header->hash = sep ? name_hash(line, sep - line) : 0;
 	}
+	index->body_len = p - body;
+
+	return 0;
+}
 
-	return json;
+void ami_header_index_free(struct ami_header_index *index)
+{
+	if (index->items != index->stack) {
+		ast_free(index->items);
+	}
+	index->items = index->stack;
+	index->count = 0;
 }
 
 /*!
- * \brief Convert an AMI event category bitmask to a comma-separated string.
+ * \brief Find the first header with the given key.
  *
- * Iterates the EVENT_FLAG_* bits and appends each matching category name.
- * The result is written into the caller-supplied buffer.
- *
- * \param category Bitmask of EVENT_FLAG_* values.
- * \param buf Destination buffer.
- * \param buflen Size of the destination buffer.
+ * \return The header, or NULL if the body has no such header.
  */
-static void category_to_str(int category, char *buf, size_t buflen)
+static const struct ami_header *header_index_find(const struct ami_header_index *index,
+	const char *key, size_t len, unsigned int hash)
 {
-	static const struct {
-		int flag;
-		const char *name;
-	} flags[] = {
-		{ EVENT_FLAG_SYSTEM,    "system" },
-		{ EVENT_FLAG_CALL,      "call" },
-		{ EVENT_FLAG_LOG,       "log" },
-		{ EVENT_FLAG_VERBOSE,   "verbose" },
-		{ EVENT_FLAG_COMMAND,   "command" },
-		{ EVENT_FLAG_AGENT,     "agent" },
-		{ EVENT_FLAG_USER,      "user" },
-		{ EVENT_FLAG_CONFIG,    "config" },
-		{ EVENT_FLAG_DTMF,      "dtmf" },
-		{ EVENT_FLAG_REPORTING, "reporting" },
-		{ EVENT_FLAG_CDR,       "cdr" },
-		{ EVENT_FLAG_DIALPLAN,  "dialplan" },
-		{ EVENT_FLAG_ORIGINATE, "originate" },
-		{ EVENT_FLAG_AGI,       "agi" },
-		{ EVENT_FLAG_CC,        "cc" },
-		{ EVENT_FLAG_AOC,       "aoc" },
-		{ EVENT_FLAG_TEST,      "test" },
-		{ EVENT_FLAG_SECURITY,  "security" },
-		{ EVENT_FLAG_MESSAGE,   "message" },
-	};
 	size_t i;
-	size_t pos = 0;
 
-	buf[0] = '\0';
-	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
-		if (category & flags[i].flag) {
-			const char *p = flags[i].name;
-			if (pos > 0 && pos < buflen - 1) {
-				buf[pos++] = ',';
-			}
-			while (*p && pos < buflen - 1) {
-				buf[pos++] = *p++;
-			}
+	for (i = 0; i < index->count; i++) {
+		const struct ami_header *header = &index->items[i];
+
+		if (header->key_len == (int) len && header->hash == hash
+			&& !memcmp(header->line, key, len)) {
+			return header;
 		}
 	}
-	buf[pos] = '\0';
+
+	return NULL;
 }
 
 /*!
- * \brief AMI hook callback — hot path.
+ * \brief Parse a 'partition_key' value.
+ *
+ * "event" and "entity_id" select the event name and the entity ID; any
+ * other value names a body header (e.g. Linkedid, Uniqueid, Channel).
+ * \a value must outlive \a source.
+ */
+void ami_kafka_key_source_parse(struct ami_kafka_key_source *source,
+	const char *value)
+{
+	memset(source, 0, sizeof(*source));
+
+	if (ast_strlen_zero(value) || !strcasecmp(value, "event")) {
+		source->type = AMI_KAFKA_KEY_EVENT;
+	} else if (!strcasecmp(value, "entity_id")) {
+		source->type = AMI_KAFKA_KEY_ENTITY_ID;
+	} else {
+		source->type = AMI_KAFKA_KEY_HEADER;
+		source->header = value;
+		source->header_len = strlen(value);
+		source->hash = name_hash(value, source->header_len);
+	}
+}
+
+/*!
+ * \brief Get the Kafka message key of an event.
+ *
+ * A header value is read from the line index and only that value is
+ * copied, into \a buf, to terminate it. Events without the header fall
+ * back to the event name.
+ *
+ * \return The key: \a event, the entity ID, or \a buf.
+ */
+const char *ami_kafka_message_key(const struct ami_kafka_key_source *source,
+	const char *event, const struct ami_header_index *headers,
+	const struct ami_kafka_identity *identity, char *buf, size_t buflen)
+{
+	const struct ami_header *header;
+	size_t len;
+
+	switch (source->type) {
+	case AMI_KAFKA_KEY_EVENT:
+		break;
+	case AMI_KAFKA_KEY_ENTITY_ID:
+		return identity->entity_id;
+	case AMI_KAFKA_KEY_HEADER:
+		header = header_index_find(headers, source->header, source->header_len,
+			source->hash);
+		if (!header) {
+			break;
+		}
+		len = header->line_len - header->key_len - 2;
+		if (!len) {
+			break;
+		}
+		len = MIN(len, buflen - 1);
+		memcpy(buf, header->line + header->key_len + 2, len);
+		buf[len] = '\0';
+		return buf;
+	}
+
+	return event;
+}
+
+/*! \brief Buffer used to terminate a header value for regexec() */
+AST_THREADSTORAGE(filter_buf);
+
+/*!
+ * \brief match_eventdata() for a value that is not NUL-terminated.
+ *
+ * Header values point into the event body, so only the regex method needs
+ * a terminated copy of the value; every other method compares in place.
+ */
+static int match_span(const struct event_filter_entry *entry,
+	const char *value, size_t len)
+{
+	size_t filter_len;
+
+	switch (entry->match_type) {
+	case FILTER_MATCH_REGEX: {
+		struct ast_str *buf = ast_str_thread_get(&filter_buf, 128);
+
+		if (!buf || !ast_str_set_substr(&buf, 0, value, len)) {
+			return 0;
+		}
+		return regexec(entry->regex_filter, ast_str_buffer(buf), 0, NULL, 0) == 0;
+	}
+	case FILTER_MATCH_STARTS_WITH:
+		filter_len = strlen(entry->string_filter);
+		return len >= filter_len && !memcmp(value, entry->string_filter, filter_len);
+	case FILTER_MATCH_ENDS_WITH:
+		filter_len = strlen(entry->string_filter);
+		return len >= filter_len
+			&& !memcmp(value + len - filter_len, entry->string_filter, filter_len);
+	case FILTER_MATCH_CONTAINS:
+		filter_len = strlen(entry->string_filter);
+		return memmem(value, len, entry->string_filter, filter_len) != NULL;
+	case FILTER_MATCH_EXACT:
+		filter_len = strlen(entry->string_filter);
+		return len == filter_len && !memcmp(value, entry->string_filter, len);
+	case FILTER_MATCH_NONE:
+		return 1;
+	}
+
+	return 0;
+}
+
+/*! \brief Body patterns found in one event, scanned for on first use */
+struct filter_scan {
+	const struct ami_kafka_matcher *matcher;
+	int scanned;
+	unsigned long *matched;
+	unsigned long stack[MATCHER_STACK_WORDS];
+};
+
+/*!
+ * \brief Whether the body of the event contains pattern \a pattern.
+ *
+ * The first call scans the body once for every pattern of the automaton.
+ */
+static int filter_scan_matched(struct filter_scan *scan,
+	const struct ami_header_index *headers, size_t pattern)
+{
+	if (!scan->scanned) {
+		size_t words = (scan->matcher->num_patterns + MATCHER_WORD_BITS - 1)
+			/ MATCHER_WORD_BITS;
+
+		scan->matched = words <= MATCHER_STACK_WORDS ? scan->stack
+			: ast_malloc(words * sizeof(*scan->matched));
+		if (!scan->matched) {
+			return 0;
+		}
+		ami_kafka_matcher_scan(scan->matcher, headers->body, headers->body_len,
+			scan->matched);
+		scan->scanned = 1;
+	}
+
+	return !!(scan->matched[pattern / MATCHER_WORD_BITS]
+		& (1UL << (pattern % MATCHER_WORD_BITS)));
+}
+
+/*!
+ * \brief Check if a filter entry matches an event.
+ *
+ * Adapted from Asterisk manager.c filter_cmp_fn. The event name is not
+ * compared here: the compiled filter lists only ever hold entries whose
+ * name() matches the event, or that have no name() at all.
+ *
+ * header() filters walk the line index built once for the event instead
+ * of copying and tokenizing the body for every filter. Literal and
+ * contains filters on the body share a single scan through \a scan.
+ */
+static int filter_entry_match(const struct event_filter_entry *filter_entry,
+	const struct ami_header_index *headers, struct filter_scan *scan)
+{
+	size_t name_len;
+	size_t i;
+
+	if (filter_entry->body_literal && scan->matcher) {
+		return filter_scan_matched(scan, headers, filter_entry->pattern);
+	}
+
+	/* No header_name → match against full body */
+	if (!filter_entry->header_name) {
+		if (!ast_strlen_zero(headers->body)) {
+			return match_eventdata((struct event_filter_entry *) filter_entry,
+				headers->body);
+		}
+		/* No body, but if match_type is NONE we still match */
+		return filter_entry->match_type == FILTER_MATCH_NONE;
+	}
+
+	/* Search for specific header in body (format: "Header: Value\r\n") */
+	name_len = strlen(filter_entry->header_name);
+	for (i = 0; i < headers->count; i++) {
+		const struct ami_header *header = &headers->items[i];
+		const char *value = header->line + name_len;
+		const char *end = header->line + header->line_len;
+
+		if (header->line_len < name_len
+			|| memcmp(header->line, filter_entry->header_name, name_len)) {
+			continue;
+		}
+		/* Same as ast_skip_blanks() on the rest of the line */
+		while (value < end && (unsigned char) *value < 33) {
+			value++;
+		}
+		if (value == end) {
+			continue;
+		}
+		if (match_span(filter_entry, value, end - value)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*! \brief Whether any entry of a compiled filter array matches */
+static int filter_array_match(struct event_filter_entry * const *entries,
+	size_t count, const struct ami_header_index *headers, struct filter_scan *scan)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (filter_entry_match(entries[i], headers, scan)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void filters_dtor(void *obj)
+{
+	struct ami_kafka_filters *filters = obj;
+	size_t i;
+
+	for (i = 0; i < filters->num_entries; i++) {
+		ao2_ref(filters->entries[i], -1);
+	}
+	ast_free(filters->entries);
+	ast_free(filters->lists);
+	name_map_destroy(&filters->by_name);
+	ami_kafka_matcher_free(filters->matcher);
+}
+
+/*!
+ * \brief Append the entries of \a container that belong in a list.
+ *
+ * \param name Event name the list is for, NULL for the wildcard list.
+ * \param wildcards Whether to take entries without name() instead.
+ */
+static void filters_collect(struct ami_kafka_filters *filters,
+	struct ao2_container *container, const char *name, int wildcards,
+	struct event_filter_entry ***out, size_t *count)
+{
+	struct ao2_iterator iter;
+	struct event_filter_entry *entry;
+
+	*out = &filters->entries[filters->num_entries];
+	*count = 0;
+
+	iter = ao2_iterator_init(container, 0);
+	for (; (entry = ao2_iterator_next(&iter)); ao2_ref(entry, -1)) {
+		if (wildcards ? entry->event_name != NULL
+			: (!entry->event_name || strcmp(entry->event_name, name))) {
+			continue;
+		}
+		filters->entries[filters->num_entries++] = ao2_bump(entry);
+		(*count)++;
+	}
+	ao2_iterator_destroy(&iter);
+}
+
+/*!
+ * \brief Compile include/exclude filter containers into a lookup structure.
+ *
+ * Done once per configuration load. Each event name referenced by a name()
+ * filter gets a list holding its own filters followed by the filters that
+ * have no name(); every other event uses the wildcard list alone. Deciding
+ * whether an event is sent then costs a single hash lookup plus only the
+ * filters that can actually apply to it. Literal and contains patterns on
+ * the body are compiled into one automaton, so the body is scanned once
+ * however many of them there are.
+ *
+ * \return The compiled filters (ao2 object), or NULL on allocation failure.
+ */
+struct ami_kafka_filters *ami_kafka_filters_compile(
+	struct ao2_container *includefilters, struct ao2_container *excludefilters)
+{
+	struct ami_kafka_filters *filters;
+	struct ao2_container *containers[] = { includefilters, excludefilters };
+	size_t num_names = 0;
+	size_t num_wildcards = 0;
+	size_t num_patterns = 0;
+	const char **patterns;
+	size_t capacity;
+	size_t i;
+
+	filters = ao2_alloc_options(sizeof(*filters), filters_dtor,
+		AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!filters) {
+		return NULL;
+	}
+
+	filters->num_include = ao2_container_count(includefilters);
+	filters->num_exclude = ao2_container_count(excludefilters);
+
+	/* Size everything up front: names, and wildcards copied into each list */
+	for (i = 0; i < ARRAY_LEN(containers); i++) {
+		struct ao2_iterator iter = ao2_iterator_init(containers[i], 0);
+		struct event_filter_entry *entry;
+
+		for (; (entry = ao2_iterator_next(&iter)); ao2_ref(entry, -1)) {
+			if (entry->event_name) {
+				num_names++;
+			} else {
+				num_wildcards++;
+			}
+			num_patterns += entry->body_literal;
+		}
+		ao2_iterator_destroy(&iter);
+	}
+
+	if (num_patterns) {
+		patterns = ast_malloc(num_patterns * sizeof(*patterns));
+		if (!patterns) {
+			ao2_ref(filters, -1);
+			return NULL;
+		}
+		num_patterns = 0;
+		for (i = 0; i < ARRAY_LEN(containers); i++) {
+			struct ao2_iterator iter = ao2_iterator_init(containers[i], 0);
+			struct event_filter_entry *entry;
+
+			for (; (entry = ao2_iterator_next(&iter)); ao2_ref(entry, -1)) {
+				if (entry->body_literal) {
+					entry->pattern = num_patterns;
+					patterns[num_patterns++] = entry->string_filter;
+				}
+			}
+			ao2_iterator_destroy(&iter);
+		}
+		filters->matcher = ami_kafka_matcher_build(patterns, num_patterns);
+		ast_free(patterns);
+		if (!filters->matcher) {
+			ao2_ref(filters, -1);
+			return NULL;
+		}
+	}
+
+	capacity = num_names + num_wildcards * (num_names + 1);
+	filters->entries = ast_calloc(capacity ? capacity : 1, sizeof(*filters->entries));
+	filters->lists = ast_calloc(num_names ? num_names : 1, sizeof(*filters->lists));
+	if (!filters->entries || !filters->lists
+		|| (num_names && name_map_init(&filters->by_name, num_names))) {
+		ao2_ref(filters, -1);
+		return NULL;
+	}
+
+	filters_collect(filters, includefilters, NULL, 1,
+		&filters->wildcard.include, &filters->wildcard.num_include);
+	filters_collect(filters, excludefilters, NULL, 1,
+		&filters->wildcard.exclude, &filters->wildcard.num_exclude);
+
+	for (i = 0; i < ARRAY_LEN(containers); i++) {
+		struct ao2_iterator iter = ao2_iterator_init(containers[i], 0);
+		struct event_filter_entry *entry;
+
+		for (; (entry = ao2_iterator_next(&iter)); ao2_ref(entry, -1)) {
+			struct ami_name_map_entry *slot;
+			struct ami_kafka_filter_list *list;
+			struct event_filter_entry **tail;
+			size_t count;
+
+			if (!entry->event_name) {
+				continue;
+			}
+			slot = name_map_add(&filters->by_name, entry->event_name);
+			if (slot->value) {
+				continue;
+			}
+
+			list = &filters->lists[filters->num_lists++];
+			slot->value = list;
+
+			/*
+			 * name() filters first, then the wildcards, in config order.
+			 * Entries are appended contiguously, so the second collect
+			 * simply extends the array started by the first.
+			 */
+			filters_collect(filters, includefilters, entry->event_name, 0,
+				&list->include, &list->num_include);
+			filters_collect(filters, includefilters, NULL, 1, &tail, &count);
+			list->num_include += count;
+
+			filters_collect(filters, excludefilters, entry->event_name, 0,
+				&list->exclude, &list->num_exclude);
+			filters_collect(filters, excludefilters, NULL, 1, &tail, &count);
+			list->num_exclude += count;
+		}
+		ao2_iterator_destroy(&iter);
+	}
+
+	return filters;
+}
+
+/*!
+ * \brief Determine if an event should be sent based on include/exclude filters.
+ *
+ * Logic (identical to Asterisk manager.c):
+ *   - No filters → send everything
+ *   - Include only → send only what matches an include
+ *   - Exclude only → send everything except what matches an exclude
+ *   - Both → match include first, then reject if matches an exclude
+ *
+ * \param filters Compiled filters (see ami_kafka_filters_compile())
+ * \param event AMI event name
+ * \param headers Line index of the AMI event body
+ * \retval 1 event should be sent
+ * \retval 0 event should be filtered out
+ */
+int should_send_event(const struct ami_kafka_filters *filters,
+	const char *event, const struct ami_header_index *headers)
+{
+	const struct ami_kafka_filter_list *list;
+	struct filter_scan scan = {
+		.matcher = filters ? filters->matcher : NULL,
+	};
+	int res;
+
+	if (!filters || (!filters->num_include && !filters->num_exclude)) {
+		return 1; /* no filters = send all */
+	}
+
+	list = name_map_find(&filters->by_name, event, strlen(event));
+	if (!list) {
+		list = &filters->wildcard;
+	}
+
+	if (filters->num_include && !filter_array_match(list->include,
+		list->num_include, headers, &scan)) {
+		/* include configured: implied exclude all, then include */
+		res = 0;
+	} else {
+		/* exclude configured: reject what matches */
+		res = !filter_array_match(list->exclude, list->num_exclude, headers, &scan);
+	}
+
+	if (scan.matched && scan.matched != scan.stack) {
+		ast_free(scan.matched);
+	}
+
+	return res;
+}
+
+/*!
+ * \brief Custom ACO handler for the 'format' option.
+ *
+ * Converts the string value "json", "json_typed", "ami" or "msgpack" to the enum.
+ */
+static int format_handler(const struct aco_option *opt, struct ast_variable *var,
+	void *obj)
+{
+	struct ami_kafka_conf_general *general = obj;
+
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(format_names); i++) {
+		if (!strcasecmp(var->value, format_names[i])) {
+			general->format = i;
+			return 0;
+		}
+	}
+
+	ast_log(LOG_WARNING, "Invalid format '%s', must be 'json', 'ami' or 'msgpack'\n",
+		var->value);
+	return -1;
+}
+
+/*!
+ * \brief Custom ACO handler for the 'batch_mode' option.
+ *
+ * Converts "none", "array" or "ndjson" to the enum.
+ */
+static int batch_mode_handler(const struct aco_option *opt, struct ast_variable *var,
+	void *obj)
+{
+	struct ami_kafka_conf_general *general = obj;
+
+	if (!strcasecmp(var->value, "none")) {
+		general->batch.mode = AMI_KAFKA_BATCH_NONE;
+	} else if (!strcasecmp(var->value, "array")) {
+		general->batch.mode = AMI_KAFKA_BATCH_ARRAY;
+	} else if (!strcasecmp(var->value, "ndjson")) {
+		general->batch.mode = AMI_KAFKA_BATCH_NDJSON;
+	} else {
+		ast_log(LOG_WARNING, "Invalid batch_mode '%s', must be 'none', 'array' "
+			"or 'ndjson'\n", var->value);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Custom ACO handler for the 'compression' option.
+ *
+ * Converts "none", "lz4" or "zstd" to the enum, rejecting the codecs the
+ * module was built without.
+ */
+static int compression_handler(const struct aco_option *opt, struct ast_variable *var,
+	void *obj)
+{
+	struct ami_kafka_conf_general *general = obj;
+
+	if (!strcasecmp(var->value, "none")) {
+		general->compression = AMI_KAFKA_COMPRESSION_NONE;
+	} else if (!strcasecmp(var->value, "lz4")) {
+#ifdef HAVE_LZ4
+		general->compression = AMI_KAFKA_COMPRESSION_LZ4;
+#else
+		ast_log(LOG_WARNING, "compression = lz4: module built without lz4 support\n");
+		return -1;
+#endif
+	} else if (!strcasecmp(var->value, "zstd")) {
+#ifdef HAVE_ZSTD
+		general->compression = AMI_KAFKA_COMPRESSION_ZSTD;
+#else
+		ast_log(LOG_WARNING, "compression = zstd: module built without zstd support\n");
+		return -1;
+#endif
+	} else {
+		ast_log(LOG_WARNING, "Invalid compression '%s', must be 'none', 'lz4' "
+			"or 'zstd'\n", var->value);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Custom ACO handler for 'eventfilter' option.
+ *
+ * Registered as ACO_REGEX to match both "eventfilter" and "eventfilter(...)".
+ * Parses legacy and advanced syntax via add_filter().
+ */
+static int eventfilter_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct ami_kafka_conf_general *general = obj;
+
+	return add_filter(var->name, var->value,
+		general->includefilters, general->excludefilters);
+}
+
+/*!
+ * \brief Custom ACO handler for 'priority(...)' options in the general section.
+ */
+static int priority_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct ami_kafka_conf_general *general = obj;
+
+	return ami_kafka_priority_add(general->priority_rules, var->name, var->value);
+}
+
+/*!
+ * \brief Custom ACO handler for 'sample(...)' options in the general section.
+ */
+static int sample_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct ami_kafka_conf_general *general = obj;
+
+	return ami_kafka_sample_add(general->sample_rules, var->name, var->value);
+}
+
+/*!
+ * \brief Custom ACO handler for 'ratelimit(...)' options in the general section.
+ */
+static int ratelimit_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct ami_kafka_conf_general *general = obj;
+
+	return ami_kafka_ratelimit_add(general->ratelimit_rules, var->name, var->value);
+}
+
+/*!
+ * \brief Custom ACO handler for 'coalesce(...)' options in the general section.
+ */
+static int coalesce_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct ami_kafka_conf_general *general = obj;
+
+	return ami_kafka_coalesce_add(general->coalesce_rules, var->name, var->value);
+}
+
+/*!
+ * \brief Custom ACO handler for 'fields(...)' options in the general section.
+ */
+static int fields_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct ami_kafka_conf_general *general = obj;
+
+	return ami_kafka_fields_add(general->fields_rules, var->name, var->value);
+}
+
+/*!
+ * \brief Custom ACO handler for 'route(...)' options in the kafka section.
+ */
+static int route_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct ami_kafka_conf_kafka *kafka = obj;
+
+	return ami_kafka_route_add(kafka->route_rules, var->name, var->value);
+}
+
+/*! \brief Number of JSON fields kept on the stack before spilling to the heap */
+#define AMI_JSON_STACK_FIELDS 64
+
+/*! \brief One key/value pair to serialize, pointing into the event text */
+struct ami_json_field {
+	const char *key;
+	const char *value;
+	unsigned int key_len;
+	unsigned int value_len;
+	unsigned int hash;
+	/*! \brief field whose value is emitted here, -1 = not emitted */
+	int source;
+	/*! \brief when folding: next occurrence of the same key, -1 = none */
+	int next;
+	/*! \brief when folding, on the first occurrence: the last one */
+	int last;
+	/*! \brief when folding, on the first occurrence: how many there are */
+	unsigned int occurrences;
+	/*! \brief pre-escaped "key":"value" to emit when not overridden */
+	const char *literal;
+	size_t literal_len;
+};
+
+/*! \brief Field list for one event; heap storage only for very large events */
+struct ami_json_fields {
+	struct ami_json_field *items;
+	size_t count;
+	size_t size;
+	struct ami_json_field stack[AMI_JSON_STACK_FIELDS];
+};
+
+/*!
+ * \brief Validate UTF-8 the way jansson does for json_string()/object keys.
+ *
+ * Rejects overlong forms, surrogates and code points above U+10FFFF.
+ */
+static int json_utf8_valid(const char *str, size_t len)
+{
+	const unsigned char *s = (const unsigned char *) str;
+	size_t i = 0;
+
+	while (i < len) {
+		unsigned int c = s[i];
+		unsigned int value;
+		size_t n;
+		size_t k;
+
+		if (c < 0x80) {
+			i++;
+			continue;
+		} else if (c < 0xC2) {
+			return 0;
+		} else if (c < 0xE0) {
+			n = 2;
+			value = c & 0x1F;
+		} else if (c < 0xF0) {
+			n = 3;
+			value = c & 0x0F;
+		} else if (c < 0xF5) {
+			n = 4;
+			value = c & 0x07;
+		} else {
+			return 0;
+		}
+
+		if (i + n > len) {
+			return 0;
+		}
+		for (k = 1; k < n; k++) {
+			if ((s[i + k] & 0xC0) != 0x80) {
+				return 0;
+			}
+			value = (value << 6) | (s[i + k] & 0x3F);
+		}
+		if (value > 0x10FFFF || (value >= 0xD800 && value <= 0xDFFF)
+			|| (n == 3 && value < 0x800) || (n == 4 && value < 0x10000)) {
+			return 0;
+		}
+		i += n;
+	}
+
+	return 1;
+}
+
+static int json_fields_add(struct ami_json_fields *fields, const char *key,
+	size_t key_len, unsigned int hash, const char *value, size_t value_len)
+{
+	struct ami_json_field *field;
+
+	if (fields->count == fields->size) {
+		size_t size = fields->size * 2;
+		struct ami_json_field *items;
+
+		if (fields->items == fields->stack) {
+			items = ast_malloc(size * sizeof(*items));
+			if (items) {
+				memcpy(items, fields->stack, sizeof(fields->stack));
+			}
+		} else {
+			items = ast_realloc(fields->items, size * sizeof(*items));
+		}
+		if (!items) {
+			return -1;
+		}
+		fields->items = items;
+		fields->size = size;
+	}
+
+	field = &fields->items[fields->count++];
+	field->key = key;
+	field->key_len = key_len;
+	field->value = value;
+	field->value_len = value_len;
+	field->hash = hash;
+	field->source = -1;
+	field->next = -1;
+	field->occurrences = 1;
+	field->literal = NULL;
+
+	return 0;
+}
+
+/*!
+ * \brief Resolve duplicate and invalid fields with ast_json_object_set() semantics.
+ *
+ * A repeated key keeps the position of its first occurrence and takes the
+ * value of its last one. Pairs whose key or value is not valid UTF-8 are
+ * dropped, as json_string() and json_object_set() would reject them.
+ *
+ * With \a fold, the first occurrence keeps its own value instead and all
+ * occurrences are chained from it through ami_json_field.next.
+ */
+static void json_fields_resolve(struct ami_json_fields *fields, int fold)
+{
+	size_t i;
+	size_t j;
+
+	for (i = 0; i < fields->count; i++) {
+		struct ami_json_field *field = &fields->items[i];
+
+		/* Literal fields were validated when they were built */
+		if (!field->literal && (!json_utf8_valid(field->key, field->key_len)
+			|| !json_utf8_valid(field->value, field->value_len))) {
+			continue;
+		}
+
+		field->source = i;
+		field->last = i;
+		for (j = 0; j < i; j++) {
+			struct ami_json_field *prev = &fields->items[j];
+
+			if (prev->source >= 0 && prev->hash == field->hash
+				&& prev->key_len == field->key_len
+				&& !memcmp(prev->key, field->key, field->key_len)) {
+				if (fold) {
+					fields->items[prev->last].next = i;
+					prev->last = i;
+					prev->occurrences++;
+				} else {
+					prev->source = i;
+				}
+				field->source = -1;
+				break;
+			}
+		}
+	}
+}
+
+/*!
+ * \brief Make room for \a len more bytes at the end of \a buf.
+ *
+ * \return Write position (the current end of the string), or NULL.
+ */
+static char *str_reserve(struct ast_str **buf, size_t len)
+{
+	size_t used = ast_str_strlen(*buf);
+	size_t needed = used + len + 1;
+
+	if (needed > ast_str_size(*buf)
+		&& ast_str_make_space(buf, MAX(needed, ast_str_size(*buf) * 2))) {
+		return NULL;
+	}
+
+	return ast_str_buffer(*buf) + used;
+}
+
+/*!
+ * \brief Mark everything up to \a end as written.
+ *
+ * ast_str_truncate() with a non-negative length sets the used length and
+ * terminates the string, which is what is needed after writing in place.
+ */
+static void str_commit(struct ast_str *buf, const char *end)
+{
+	ast_str_truncate(buf, end - ast_str_buffer(buf));
+}
+
+/*!
+ * \brief Write a JSON string literal, escaped exactly like jansson's compact dump.
+ *
+ * \a out must have room for 6 * \a len + 2 bytes.
+ *
+ * \return Position after the closing quote.
+ */
+static char *json_write_string(char *out, const char *str, size_t len)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	const char *end = str + len;
+
+	*out++ = '"';
+	for (; str < end; str++) {
+		unsigned char c = *str;
+
+		if (c >= 0x20 && c != '"' && c != '\\') {
+			*out++ = c;
+			continue;
+		}
+
+		*out++ = '\\';
+		switch (c) {
+		case '"': *out++ = '"'; break;
+		case '\\': *out++ = '\\'; break;
+		case '\b': *out++ = 'b'; break;
+		case '\f': *out++ = 'f'; break;
+		case '\n': *out++ = 'n'; break;
+		case '\r': *out++ = 'r'; break;
+		case '\t': *out++ = 't'; break;
+		default:
+			*out++ = 'u';
+			*out++ = '0';
+			*out++ = '0';
+			*out++ = hex[c >> 4];
+			*out++ = hex[c & 0xF];
+			break;
+		}
+	}
+	*out++ = '"';
+
+	return out;
+}
+
+/*!
+ * \brief Build a pre-escaped "key":"value" JSON member.
+ */
+static char *json_member_alloc(const char *key, const char *value, size_t *len)
+{
+	size_t key_len = strlen(key);
+	size_t value_len = strlen(value);
+	char *member = ast_malloc((key_len + value_len) * 6 + 8);
+	char *out;
+
+	if (!member) {
+		return NULL;
+	}
+
+	out = json_write_string(member, key, key_len);
+	*out++ = ':';
+	out = json_write_string(out, value, value_len);
+	*out = '\0';
+	*len = out - member;
+
+	return member;
+}
+
+void ami_kafka_identity_free(struct ami_kafka_identity *identity)
+{
+	if (!identity) {
+		return;
+	}
+
+	ast_free(identity->system_name);
+	ast_free(identity->ami_prefix);
+	ast_free(identity->json_entity_id);
+	ast_free(identity->json_system_name);
+	name_map_destroy(&identity->msgpack_tags);
+	name_map_destroy(&identity->json_types);
+	ast_free(identity);
+}
+
+/*!
+ * \brief Field tags of the msgpack schema (AMI_MSGPACK_SCHEMA_ID).
+ *
+ * The index is the tag. Tag 0 holds the map of headers not listed here.
+ * Tags are part of the wire format: only ever append, and bump the
+ * schema id for any other change.
+ */
+static const char * const msgpack_tag_names[] = {
+	NULL, "Event", "EntityID", "SystemName", "Privilege",
+	"Channel", "ChannelState", "ChannelStateDesc", "CallerIDNum", "CallerIDName",
+	"ConnectedLineNum", "ConnectedLineName", "Language", "AccountCode", "Context",
+	"Exten", "Priority", "Uniqueid", "Linkedid", "DestChannel",
+	"DestChannelState", "DestChannelStateDesc", "DestCallerIDNum", "DestCallerIDName", "DestConnectedLineNum",
+	"DestConnectedLineName", "DestLanguage", "DestAccountCode", "DestContext", "DestExten",
+	"DestPriority", "DestUniqueid", "DestLinkedid", "Cause", "Cause-txt",
+	"DialStatus", "DialString", "Variable", "Value", "Application",
+	"AppData", "Queue", "Interface", "MemberName", "StateInterface",
+	"Status", "Paused", "BridgeUniqueid", "BridgeType", "BridgeTechnology",
+	"BridgeCreator", "BridgeName", "BridgeNumChannels", "Extension", "Hint",
+	"Device", "State", "Severity", "Service", "EventVersion",
+	"EventTV", "AccountID", "SessionID", "LocalAddress", "RemoteAddress",
+	"Position", "Count", "HoldTime", "TalkTime", "Reason",
+	"Digit", "Direction", "DurationMs",
+};
+
+/*! \brief JSON type of a known AMI header in format json_typed */
+enum ami_json_type {
+	AMI_JSON_TYPE_STRING = 0,
+	/*! \brief integer, e.g. ChannelState */
+	AMI_JSON_TYPE_INT,
+	/*! \brief number with an optional fraction, e.g. ServicelevelPerf */
+	AMI_JSON_TYPE_FLOAT,
+	/*! \brief 0/1, yes/no, true/false, on/off */
+	AMI_JSON_TYPE_BOOL,
+	/*! \brief seconds since the epoch, with an optional fraction */
+	AMI_JSON_TYPE_EPOCH,
+};
+
+/*!
+ * \brief Types of known AMI headers, for format json_typed.
+ *
+ * A value that does not parse as its type is published as a string, so
+ * a header that is numeric in one event and text in another is safe here.
+ */
+static const struct {
+	const char *name;
+	enum ami_json_type type;
+} json_field_types[] = {
+	{ "ChannelState", AMI_JSON_TYPE_INT },
+	{ "DestChannelState", AMI_JSON_TYPE_INT },
+	{ "Priority", AMI_JSON_TYPE_INT },
+	{ "DestPriority", AMI_JSON_TYPE_INT },
+	{ "Duration", AMI_JSON_TYPE_INT },
+	{ "DurationMs", AMI_JSON_TYPE_INT },
+	{ "BillableSeconds", AMI_JSON_TYPE_INT },
+	{ "Count", AMI_JSON_TYPE_INT },
+	{ "Cause", AMI_JSON_TYPE_INT },
+	{ "Position", AMI_JSON_TYPE_INT },
+	{ "OriginalPosition", AMI_JSON_TYPE_INT },
+	{ "Calls", AMI_JSON_TYPE_INT },
+	{ "CallsTaken", AMI_JSON_TYPE_INT },
+	{ "Completed", AMI_JSON_TYPE_INT },
+	{ "Abandoned", AMI_JSON_TYPE_INT },
+	{ "Max", AMI_JSON_TYPE_INT },
+	{ "Holdtime", AMI_JSON_TYPE_INT },
+	{ "HoldTime", AMI_JSON_TYPE_INT },
+	{ "Talktime", AMI_JSON_TYPE_INT },
+	{ "TalkTime", AMI_JSON_TYPE_INT },
+	{ "RingTime", AMI_JSON_TYPE_INT },
+	{ "Wait", AMI_JSON_TYPE_INT },
+	{ "Penalty", AMI_JSON_TYPE_INT },
+	{ "ServiceLevel", AMI_JSON_TYPE_INT },
+	{ "Weight", AMI_JSON_TYPE_INT },
+	{ "BridgeNumChannels", AMI_JSON_TYPE_INT },
+	{ "Channels", AMI_JSON_TYPE_INT },
+	{ "Bridges", AMI_JSON_TYPE_INT },
+	{ "Dials", AMI_JSON_TYPE_INT },
+	{ "ServicelevelPerf", AMI_JSON_TYPE_FLOAT },
+	{ "ServicelevelPerf2", AMI_JSON_TYPE_FLOAT },
+	{ "RTT", AMI_JSON_TYPE_FLOAT },
+	{ "Paused", AMI_JSON_TYPE_BOOL },
+	{ "Ringinuse", AMI_JSON_TYPE_BOOL },
+	{ "InCall", AMI_JSON_TYPE_BOOL },
+	{ "LastCall", AMI_JSON_TYPE_EPOCH },
+	{ "LastPause", AMI_JSON_TYPE_EPOCH },
+	{ "LoginTime", AMI_JSON_TYPE_EPOCH },
+	{ "Timestamp", AMI_JSON_TYPE_EPOCH },
+	{ "StartTime", AMI_JSON_TYPE_EPOCH },
+	{ "AnswerTime", AMI_JSON_TYPE_EPOCH },
+	{ "EndTime", AMI_JSON_TYPE_EPOCH },
+};
+
+/*!
+ * \brief Whether \a value is a JSON number of the given type.
+ *
+ * Integers have at most 18 digits so they fit any consumer's 64-bit type.
+ */
+static int json_number_valid(const char *value, size_t len, enum ami_json_type type)
+{
+	const char *end = value + len;
+	const char *digits;
+
+	if (value < end && *value == '-' && type != AMI_JSON_TYPE_EPOCH) {
+		value++;
+	}
+	digits = value;
+	while (value < end && *value >= '0' && *value <= '9') {
+		value++;
+	}
+	/* JSON has no leading zeros */
+	if (value == digits || (*digits == '0' && value - digits > 1)) {
+		return 0;
+	}
+	if (type == AMI_JSON_TYPE_INT) {
+		return value == end && value - digits <= 18;
+	}
+	if (value < end && *value == '.') {
+		digits = ++value;
+		while (value < end && *value >= '0' && *value <= '9') {
+			value++;
+		}
+		if (value == digits) {
+			return 0;
+		}
+	}
+
+	return value == end;
+}
+
+/*!
+ * \brief Write \a value as its native JSON type, if it parses as one.
+ *
+ * \return Position after the value, or NULL to write it as a string.
+ */
+static char *json_write_typed(char *out, enum ami_json_type type, const char *value,
+	size_t len)
+{
+	static const struct {
+		const char *text;
+		size_t len;
+		int value;
+	} bools[] = {
+		{ "1", 1, 1 }, { "yes", 3, 1 }, { "true", 4, 1 }, { "on", 2, 1 },
+		{ "0", 1, 0 }, { "no", 2, 0 }, { "false", 5, 0 }, { "off", 3, 0 },
+	};
+	size_t i;
+
+	if (type == AMI_JSON_TYPE_BOOL) {
+		for (i = 0; i < ARRAY_LEN(bools); i++) {
+			if (len == bools[i].len && !strncasecmp(value, bools[i].text, len)) {
+				memcpy(out, bools[i].value ? "true" : "false", bools[i].value ? 4 : 5);
+				return out + (bools[i].value ? 4 : 5);
+			}
+		}
+		return NULL;
+	}
+	if (!json_number_valid(value, len, type)) {
+		return NULL;
+	}
+	memcpy(out, value, len);
+
+	return out + len;
+}
+
+/*!
+ * \brief Write one header value, as its json_typed type when it has one.
+ *
+ * \a out must have room for 6 * \a len + 2 bytes.
+ */
+static char *json_write_value(char *out, const struct ami_kafka_identity *identity,
+	const struct ami_json_field *field, const char *value, size_t len)
+{
+	if (identity->json_types.entries) {
+		enum ami_json_type type = (uintptr_t) name_map_slot(&identity->json_types,
+			field->key, field->key_len, field->hash)->value;
+		char *typed = type ? json_write_typed(out, type, value, len) : NULL;
+
+		if (typed) {
+			return typed;
+		}
+	}
+
+	return json_write_string(out, value, len);
+}
+
+/*! \brief Whether a header carries "name=value" variables (ChanVariable...) */
+static int json_key_is_variable(const struct ami_json_field *field)
+{
+	return field->key_len >= 8
+		&& !memcmp(field->key + field->key_len - 8, "Variable", 8);
+}
+
+/*! \brief Next occurrence of the key of \a field, NULL after the last */
+static const struct ami_json_field *json_field_next(const struct ami_json_fields *fields,
+	const struct ami_json_field *field)
+{
+	return field->next < 0 ? NULL : &fields->items[field->next];
+}
+
+/*!
+ * \brief Write the value of a folded key: every occurrence, in order.
+ *
+ * Variable headers whose values all contain '=' become an object of the
+ * variables, resolved like any other JSON object: a repeated name keeps
+ * its first position and its last value. Other repeated keys become an
+ * array. A key that occurs once and is not such a variable header is
+ * written as a plain value.
+ *
+ * \param buf Destination, which already ends with the key and the colon.
+ * \param fields The resolved field list (see json_fields_resolve()).
+ * \param head The first occurrence of the key.
+ * \param identity For the json_typed types of array elements.
+ * \retval 0 on success
+ * \retval -1 on allocation failure
+ */
+static int json_write_folded(struct ast_str **buf, const struct ami_json_fields *fields,
+	const struct ami_json_field *head, const struct ami_kafka_identity *identity)
+{
+	const struct ami_json_field *item;
+	int object = json_key_is_variable(head);
+	int first = 1;
+	char *out;
+
+	for (item = head; object && item; item = json_field_next(fields, item)) {
+		object = memchr(item->value, '=', item->value_len) != NULL;
+	}
+
+	if (!object && head->occurrences == 1) {
+		out = str_reserve(buf, head->value_len * 6 + 2);
+		if (!out) {
+			return -1;
+		}
+		str_commit(*buf, json_write_value(out, identity, head, head->value,
+			head->value_len));
+		return 0;
+	}
+
+	for (item = head; item; item = json_field_next(fields, item)) {
+		const struct ami_json_field *value = item;
+		size_t name_len = 0;
+
+		if (object) {
+			const struct ami_json_field *other;
+
+			name_len = (const char *) memchr(item->value, '=', item->value_len)
+				- item->value;
+			for (other = head; other != item; other = json_field_next(fields, other)) {
+				if (!strncmp(other->value, item->value, name_len + 1)) {
+					break;
+				}
+			}
+			if (other != item) {
+				continue;
+			}
+			for (other = json_field_next(fields, item); other;
+				other = json_field_next(fields, other)) {
+				if (!strncmp(other->value, item->value, name_len + 1)) {
+					value = other;
+				}
+			}
+		}
+
+		out = str_reserve(buf, (name_len + value->value_len) * 6 + 8);
+		if (!out) {
+			return -1;
+		}
+		*out++ = first ? (object ? '{' : '[') : ',';
+		first = 0;
+		if (object) {
+			out = json_write_string(out, item->value, name_len);
+			*out++ = ':';
+			out = json_write_string(out, value->value + name_len + 1,
+				value->value_len - name_len - 1);
+		} else {
+			out = json_write_value(out, identity, head, item->value, item->value_len);
+		}
+		str_commit(*buf, out);
+	}
+
+	out = str_reserve(buf, 1);
+	if (!out) {
+		return -1;
+	}
+	*out++ = object ? '}' : ']';
+	str_commit(*buf, out);
+
+	return 0;
+}
+
+/*!
+ * \brief Precompute the invariant parts of every published event.
+ *
+ * \param format Value of the "format" Kafka header ("json", "json_typed",
+ *        "ami" or "msgpack").
+ * \return The identity (free with ami_kafka_identity_free()), or NULL.
+ */
+struct ami_kafka_identity *ami_kafka_identity_alloc(const char *format)
+{
+	struct ami_kafka_identity *identity;
+	struct ast_kafka_header *hdr;
+
+	identity = ast_calloc(1, sizeof(*identity));
+	if (!identity) {
+		return NULL;
+	}
+
+	ast_eid_to_str(identity->entity_id, sizeof(identity->entity_id), &ast_eid_default);
+	if (!ast_strlen_zero(ast_config_AST_SYSTEM_NAME)) {
+		identity->system_name = ast_strdup(ast_config_AST_SYSTEM_NAME);
+		if (!identity->system_name) {
+			goto error;
+		}
+	}
+
+	if (ast_asprintf(&identity->ami_prefix, "EntityID: %s\r\n%s%s%s",
+		identity->entity_id,
+		identity->system_name ? "SystemName: " : "",
+		S_OR(identity->system_name, ""),
+		identity->system_name ? "\r\n" : "") < 0) {
+		identity->ami_prefix = NULL;
+		goto error;
+	}
+	identity->ami_prefix_len = strlen(identity->ami_prefix);
+
+	identity->json_entity_id = json_member_alloc("EntityID", identity->entity_id,
+		&identity->json_entity_id_len);
+	if (!identity->json_entity_id) {
+		goto error;
+	}
+	/* Like ast_json_string_create(), a system name that is not UTF-8 is dropped */
+	if (identity->system_name
+		&& json_utf8_valid(identity->system_name, strlen(identity->system_name))) {
+		identity->json_system_name = json_member_alloc("SystemName",
+			identity->system_name, &identity->json_system_name_len);
+		if (!identity->json_system_name) {
+			goto error;
+		}
+	}
+
+	/* Header order is part of the output; keep it stable */
+	hdr = identity->headers;
+	*hdr++ = (struct ast_kafka_header) { "entity_id", identity->entity_id };
+	if (identity->system_name) {
+		*hdr++ = (struct ast_kafka_header) { "system_name", identity->system_name };
+	}
+	*hdr++ = (struct ast_kafka_header) { "asterisk_version", ast_get_version() };
+	identity->event_type_header = hdr - identity->headers;
+	*hdr++ = (struct ast_kafka_header) { "event_type", NULL };
+	identity->event_category_header = hdr - identity->headers;
+	*hdr++ = (struct ast_kafka_header) { "event_category", NULL };
+	*hdr++ = (struct ast_kafka_header) { "format", format };
+	if (!strcmp(format, "msgpack")) {
+		size_t tag;
+
+		*hdr++ = (struct ast_kafka_header) { "schema_id", AMI_MSGPACK_SCHEMA_ID };
+		if (name_map_init(&identity->msgpack_tags, ARRAY_LEN(msgpack_tag_names))) {
+			goto error;
+		}
+		for (tag = 1; tag < ARRAY_LEN(msgpack_tag_names); tag++) {
+			name_map_add(&identity->msgpack_tags, msgpack_tag_names[tag])->value =
+				(void *) (uintptr_t) tag;
+		}
+	} else if (!strcmp(format, "json_typed")) {
+		size_t i;
+
+		if (name_map_init(&identity->json_types, ARRAY_LEN(json_field_types))) {
+			goto error;
+		}
+		for (i = 0; i < ARRAY_LEN(json_field_types); i++) {
+			name_map_add(&identity->json_types, json_field_types[i].name)->value =
+				(void *) (uintptr_t) json_field_types[i].type;
+		}
+	}
+	identity->timestamp_header = hdr - identity->headers;
+	*hdr++ = (struct ast_kafka_header) { "timestamp", NULL };
+	identity->timestamp_us_header = hdr - identity->headers;
+	*hdr++ = (struct ast_kafka_header) { "timestamp_us", NULL };
+	*hdr++ = (struct ast_kafka_header) { "hostname", cached_hostname };
+	identity->header_count = hdr - identity->headers;
+	ast_assert(identity->header_count <= AMI_KAFKA_IDENTITY_HEADERS);
+
+	return identity;
+
+error:
+	ami_kafka_identity_free(identity);
+	return NULL;
+}
+
+/*!
+ * \brief Choose how the JSON formats write repeated and variable headers.
+ *
+ * \param fold Non-zero to write them as arrays and objects (fold_headers),
+ *        zero for the default last-value-wins object.
+ */
+void ami_kafka_identity_fold_headers(struct ami_kafka_identity *identity, int fold)
+{
+	identity->fold_headers = fold;
+}
+
+/*!
+ * \brief Serialize an AMI event straight to compact JSON.
+ *
+ * Takes each "Key: Value" pair from the line index of the body, then
+ * writes escaped JSON into \a buf. No JSON tree is built and nothing is
+ * allocated unless the event has more than AMI_JSON_STACK_FIELDS headers
+ * or \a buf has to grow.
+ *
+ * The output is byte-for-byte what ast_json_dump_string() produced for the
+ * object built by the former ami_body_to_json(): "Event", "EntityID" and
+ * "SystemName" (when configured) come first, followed by the body headers
+ * in order, with repeated keys resolved as described in json_fields_resolve().
+ *
+ * With an identity allocated for format "json_typed", the values of the
+ * headers in json_field_types[] that parse as their type are written as
+ * JSON numbers or booleans instead of strings.
+ *
+ * With fold_headers set on the identity, repeated keys and variable
+ * headers are written as described in json_write_folded() instead.
+ *
+ * \param buf Destination; the JSON is appended to its current contents.
+ * \param event The AMI event name.
+ * \param headers Line index of the AMI body (see ami_header_index_build()).
+ * \param identity Precomputed EntityID/SystemName members.
+ * \retval 0 on success
+ * \retval -1 on allocation failure
+ */
+int ami_json_write(struct ast_str **buf, const char *event,
+	const struct ami_header_index *headers, const struct ami_kafka_identity *identity)
+{
+	struct ami_json_fields fields = {
+		.items = fields.stack,
+		.size = AMI_JSON_STACK_FIELDS,
+	};
+	int first = 1;
+	int res = 0;
+	size_t i;
+
+	json_fields_add(&fields, "Event", 5, name_hash("Event", 5),
+		event, strlen(event));
+	/* Emitted from the precomputed literal unless the body overrides the key */
+	json_fields_add(&fields, "EntityID", 8, name_hash("EntityID", 8),
+		identity->entity_id, strlen(identity->entity_id));
+	fields.items[fields.count - 1].literal = identity->json_entity_id;
+	fields.items[fields.count - 1].literal_len = identity->json_entity_id_len;
+	if (identity->json_system_name) {
+		json_fields_add(&fields, "SystemName", 10, name_hash("SystemName", 10),
+			identity->system_name, strlen(identity->system_name));
+		fields.items[fields.count - 1].literal = identity->json_system_name;
+		fields.items[fields.count - 1].literal_len = identity->json_system_name_len;
+	}
+
+	for (i = 0; i < headers->count; i++) {
+		const struct ami_header *header = &headers->items[i];
+
+		if (header->key_len < 0) {
+			continue;
+		}
+		if (json_fields_add(&fields, header->line, header->key_len, header->hash,
+			header->line + header->key_len + 2,
+			header->line_len - header->key_len - 2)) {
+			res = -1;
+			goto done;
+		}
+	}
+
+	json_fields_resolve(&fields, identity->fold_headers);
+
+	for (i = 0; i < fields.count; i++) {
+		const struct ami_json_field *field = &fields.items[i];
+		const struct ami_json_field *source;
+		char *out;
+
+		if (field->source < 0) {
+			continue;
+		}
+		source = &fields.items[field->source];
+
+		if (source == field && field->literal && field->occurrences == 1) {
+			out = str_reserve(buf, field->literal_len + 1);
+			if (!out) {
+				res = -1;
+				goto done;
+			}
+			*out++ = first ? '{' : ',';
+			first = 0;
+			memcpy(out, field->literal, field->literal_len);
+			str_commit(*buf, out + field->literal_len);
+			continue;
+		}
+
+		if (identity->fold_headers
+			&& (field->occurrences > 1 || json_key_is_variable(field))) {
+			out = str_reserve(buf, field->key_len * 6 + 4);
+			if (!out) {
+				res = -1;
+				goto done;
+			}
+			*out++ = first ? '{' : ',';
+			first = 0;
+			out = json_write_string(out, field->key, field->key_len);
+			*out++ = ':';
+			str_commit(*buf, out);
+			if (json_write_folded(buf, &fields, field, identity)) {
+				res = -1;
+				goto done;
+			}
+			continue;
+		}
+
+		/* Worst case every byte becomes \u00XX, plus quotes and punctuation */
+		out = str_reserve(buf, (field->key_len + source->value_len) * 6 + 8);
+		if (!out) {
+			res = -1;
+			goto done;
+		}
+		*out++ = first ? '{' : ',';
+		first = 0;
+		out = json_write_string(out, field->key, field->key_len);
+		*out++ = ':';
+		out = json_write_value(out, identity, field, source->value, source->value_len);
+		str_commit(*buf, out);
+	}
+
+	{
+		char *out = str_reserve(buf, 2);
+
+		if (!out) {
+			res = -1;
+			goto done;
+		}
+		if (first) {
+			*out++ = '{';
+		}
+		*out++ = '}';
+		str_commit(*buf, out);
+	}
+
+done:
+	if (fields.items != fields.stack) {
+		ast_free(fields.items);
+	}
+	return res;
+}
+
+/*! \brief Write a msgpack map header for \a count pairs (at most 5 bytes) */
+static char *msgpack_write_map(char *out, size_t count)
+{
+	if (count < 16) {
+		*out++ = 0x80 | count;
+	} else if (count <= 0xFFFF) {
+		*out++ = 0xde;
+		*out++ = count >> 8;
+		*out++ = count;
+	} else {
+		*out++ = 0xdf;
+		*out++ = count >> 24;
+		*out++ = count >> 16;
+		*out++ = count >> 8;
+		*out++ = count;
+	}
+
+	return out;
+}
+
+/*! \brief Write a msgpack string (at most \a len + 5 bytes) */
+static char *msgpack_write_str(char *out, const char *str, size_t len)
+{
+	if (len < 32) {
+		*out++ = 0xa0 | len;
+	} else if (len <= 0xFF) {
+		*out++ = 0xd9;
+		*out++ = len;
+	} else if (len <= 0xFFFF) {
+		*out++ = 0xda;
+		*out++ = len >> 8;
+		*out++ = len;
+	} else {
+		*out++ = 0xdb;
+		*out++ = len >> 24;
+		*out++ = len >> 16;
+		*out++ = len >> 8;
+		*out++ = len;
+	}
+	memcpy(out, str, len);
+
+	return out + len;
+}
+
+/*! \brief Schema tag of a field, 0 when it goes in the map of other headers */
+static unsigned int msgpack_field_tag(const struct ami_kafka_identity *identity,
+	const struct ami_json_field *field)
+{
+	if (!identity->msgpack_tags.entries) {
+		return 0;
+	}
+
+	return (uintptr_t) name_map_slot(&identity->msgpack_tags, field->key,
+		field->key_len, field->hash)->value;
+}
+
+/*!
+ * \brief Serialize an AMI event to MessagePack.
+ *
+ * The payload carries the same pairs as ami_json_write(), as a map keyed
+ * by the tags in msgpack_tag_names[]. Headers without a tag are collected
+ * in a map of name to value under tag 0, which comes last and is omitted
+ * when empty. All values are strings.
+ *
+ * \param buf Destination; the payload is appended to its current contents.
+ * \param event The AMI event name.
+ * \param headers Line index of the AMI body (see ami_header_index_build()).
+ * \param identity Identity allocated for format "msgpack".
+ * \retval 0 on success
+ * \retval -1 on allocation failure
+ */
+int ami_msgpack_write(struct ast_str **buf, const char *event,
+	const struct ami_header_index *headers, const struct ami_kafka_identity *identity)
+{
+	struct ami_json_fields fields = {
+		.items = fields.stack,
+		.size = AMI_JSON_STACK_FIELDS,
+	};
+	size_t num_tagged = 0;
+	size_t num_other = 0;
+	/* Outer map header, tag 0 and the header of the map of other headers */
+	size_t size = 5 + 1 + 5;
+	char *out;
+	int res = 0;
+	size_t i;
+
+	json_fields_add(&fields, "Event", 5, name_hash("Event", 5),
+		event, strlen(event));
+	json_fields_add(&fields, "EntityID", 8, name_hash("EntityID", 8),
+		identity->entity_id, strlen(identity->entity_id));
+	if (identity->json_system_name) {
+		json_fields_add(&fields, "SystemName", 10, name_hash("SystemName", 10),
+			identity->system_name, strlen(identity->system_name));
+	}
+
+	for (i = 0; i < headers->count; i++) {
+		const struct ami_header *header = &headers->items[i];
+
+		if (header->key_len < 0) {
+			continue;
+		}
+		if (json_fields_add(&fields, header->line, header->key_len, header->hash,
+			header->line + header->key_len + 2,
+			header->line_len - header->key_len - 2)) {
+			res = -1;
+			goto done;
+		}
+	}
+
+	json_fields_resolve(&fields, 0);
+
+	/* Map headers need the pair counts, so size everything up front */
+	for (i = 0; i < fields.count; i++) {
+		const struct ami_json_field *field = &fields.items[i];
+
+		if (field->source < 0) {
+			continue;
+		}
+		if (msgpack_field_tag(identity, field)) {
+			num_tagged++;
+			size += 2;
+		} else {
+			num_other++;
+			size += field->key_len + 5;
+		}
+		size += fields.items[field->source].value_len + 5;
+	}
+
+	out = str_reserve(buf, size);
+	if (!out) {
+		res = -1;
+		goto done;
+	}
+
+	out = msgpack_write_map(out, num_tagged + !!num_other);
+	for (i = 0; i < fields.count; i++) {
+		const struct ami_json_field *field = &fields.items[i];
+		const struct ami_json_field *source;
+		unsigned int tag;
+
+		if (field->source < 0) {
+			continue;
+		}
+		tag = msgpack_field_tag(identity, field);
+		if (!tag) {
+			continue;
+		}
+		source = &fields.items[field->source];
+		if (tag > 0x7F) {
+			*out++ = 0xcc;
+		}
+		*out++ = tag;
+		out = msgpack_write_str(out, source->value, source->value_len);
+	}
+
+	if (num_other) {
+		*out++ = 0;
+		out = msgpack_write_map(out, num_other);
+		for (i = 0; i < fields.count; i++) {
+			const struct ami_json_field *field = &fields.items[i];
+			const struct ami_json_field *source;
+
+			if (field->source < 0 || msgpack_field_tag(identity, field)) {
+				continue;
+			}
+			source = &fields.items[field->source];
+			out = msgpack_write_str(out, field->key, field->key_len);
+			out = msgpack_write_str(out, source->value, source->value_len);
+		}
+	}
+
+	str_commit(*buf, out);
+
+done:
+	if (fields.items != fields.stack) {
+		ast_free(fields.items);
+	}
+	return res;
+}
+
+/*!
+ * \brief Parse AMI body text into a JSON object.
+ *
+ * AMI body format is "Key: Value\r\n" pairs. The object is loaded from
+ * ami_json_write() output, so it always matches the published payload.
+ * Not used on the hot path.
+ *
+ * \param event The AMI event name.
+ * \param body The AMI body text.
+ * \return A new ast_json object on success.
+ * \return NULL on failure.
+ */
+struct ast_json *ami_body_to_json(const char *event, char *body)
+{
+	RAII_VAR(struct ast_str *, buf, ast_str_create(strlen(body) + 128), ast_free);
+	RAII_VAR(struct ami_kafka_identity *, identity, ami_kafka_identity_alloc("json"),
+		ami_kafka_identity_free);
+	struct ami_header_index headers;
+	int res;
+
+	if (!buf || !identity) {
+		return NULL;
+	}
+
+	res = ami_header_index_build(&headers, body);
+	if (!res) {
+		res = ami_json_write(&buf, event, &headers, identity);
+	}
+	ami_header_index_free(&headers);
+	if (res) {
+		return NULL;
+	}
+
+	return ast_json_load_buf(ast_str_buffer(buf), ast_str_strlen(buf), NULL);
+}
+
+/*! \brief Names of the EVENT_FLAG_* categories, as in manager.conf */
+static const struct {
+	int flag;
+	const char *name;
+} category_names[] = {
+	{ EVENT_FLAG_SYSTEM,    "system" },
+	{ EVENT_FLAG_CALL,      "call" },
+	{ EVENT_FLAG_LOG,       "log" },
+	{ EVENT_FLAG_VERBOSE,   "verbose" },
+	{ EVENT_FLAG_COMMAND,   "command" },
+	{ EVENT_FLAG_AGENT,     "agent" },
+	{ EVENT_FLAG_USER,      "user" },
+	{ EVENT_FLAG_CONFIG,    "config" },
+	{ EVENT_FLAG_DTMF,      "dtmf" },
+	{ EVENT_FLAG_REPORTING, "reporting" },
+	{ EVENT_FLAG_CDR,       "cdr" },
+	{ EVENT_FLAG_DIALPLAN,  "dialplan" },
+	{ EVENT_FLAG_ORIGINATE, "originate" },
+	{ EVENT_FLAG_AGI,       "agi" },
+	{ EVENT_FLAG_CC,        "cc" },
+	{ EVENT_FLAG_AOC,       "aoc" },
+	{ EVENT_FLAG_TEST,      "test" },
+	{ EVENT_FLAG_SECURITY,  "security" },
+	{ EVENT_FLAG_MESSAGE,   "message" },
+};
+
+/*!
+ * \brief Convert an AMI event category bitmask to a comma-separated string.
+ *
+ * Iterates the EVENT_FLAG_* bits and appends each matching category name.
+ * The result is written into the caller-supplied buffer.
+ *
+ * \param category Bitmask of EVENT_FLAG_* values.
+ * \param buf Destination buffer.
+ * \param buflen Size of the destination buffer.
+ */
+static void category_to_str(int category, char *buf, size_t buflen)
+{
+	size_t i;
+	size_t pos = 0;
+
+	buf[0] = '\0';
+	for (i = 0; i < ARRAY_LEN(category_names); i++) {
+		if (category & category_names[i].flag) {
+			const char *p = category_names[i].name;
+			if (pos > 0 && pos < buflen - 1) {
+				buf[pos++] = ',';
+			}
+			while (*p && pos < buflen - 1) {
+				buf[pos++] = *p++;
+			}
+		}
+	}
+	buf[pos] = '\0';
+}
+
+/*! \brief Number of slots in the category string cache (power of two) */
+#define CATEGORY_CACHE_SIZE 64
+
+/*! \brief A category bitmask and its category_to_str() form */
+struct category_cache_entry {
+	int category;
+	char str[0];
+};
+
+/*!
+ * \brief Direct-mapped cache of category strings.
+ *
+ * Real traffic only uses a handful of distinct masks. A slot is filled
+ * once and never replaced, so readers need no locking; a mask whose slot
+ * is taken by another mask is simply formatted every time.
+ */
+static struct category_cache_entry *category_cache[CATEGORY_CACHE_SIZE];
+
+/*!
+ * \brief Get the comma-separated category names for a bitmask.
+ *
+ * \param category Bitmask of EVENT_FLAG_* values.
+ * \param buf Fallback buffer, used when the mask is not cached.
+ * \param buflen Size of the fallback buffer.
+ * \return The cached string or \a buf.
+ */
+const char *ami_kafka_category_str(int category, char *buf, size_t buflen)
+{
+	struct category_cache_entry **slot;
+	struct category_cache_entry *entry;
+	struct category_cache_entry *expected = NULL;
+	size_t len;
+
+	slot = &category_cache[((unsigned int) category * 2654435761U) >> 26];
+	entry = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (entry) {
+		if (entry->category == category) {
+			return entry->str;
+		}
+		category_to_str(category, buf, buflen);
+		return buf;
+	}
+
+	category_to_str(category, buf, buflen);
+	len = strlen(buf);
+	entry = ast_malloc(sizeof(*entry) + len + 1);
+	if (!entry) {
+		return buf;
+	}
+	entry->category = category;
+	memcpy(entry->str, buf, len + 1);
+
+	if (!__atomic_compare_exchange_n(slot, &expected, entry, 0,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		/* Another thread filled the slot first */
+		ast_free(entry);
+	}
+
+	return buf;
+}
+
+/*!
+ * \brief Free the category string cache.
+ *
+ * Only called once nothing can publish anymore.
+ */
+static void category_cache_clear(void)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(category_cache); i++) {
+		ast_free(category_cache[i]);
+		category_cache[i] = NULL;
+	}
+}
+
+static void route_dtor(void *obj)
+{
+	struct ami_kafka_route *route = obj;
+
+	ast_free(route->channel_tat);
+	name_map_destroy(&route->fields);
+	ast_free(route->field_names);
+}
+
+/*!
+ * \brief Parse one 'keyword(...)' option and append the rule to \a rules.
+ *
+ * \param rules Container the rule is linked into, in config order.
+ * \param keyword "route" or "priority".
+ * \param option Option name: keyword(name(X)), keyword(prefix(X)) or
+ *        keyword(category(X)), X being a category name from manager.conf.
+ * \param topic What the matching events map to.
+ * \return The new rule, whose reference \a rules holds, or NULL on a
+ *         malformed rule.
+ */
+static struct ami_kafka_route *match_rule_add(struct ao2_container *rules,
+	const char *keyword, const char *option, const char *topic)
+{
+	struct ami_kafka_route *route;
+	char *spec = ast_strdupa(option);
+	size_t keyword_len = strlen(keyword);
+	char *kind;
+	char *value;
+	char *end;
+	size_t value_len;
+	size_t topic_len;
+	int category = 0;
+	enum ami_kafka_route_type type;
+
+	topic = ast_strip(ast_strdupa(S_OR(topic, "")));
+	end = spec + strlen(spec);
+	if (strncmp(spec, keyword, keyword_len) || spec[keyword_len] != '('
+		|| (size_t) (end - spec) < keyword_len + 5 || end[-1] != ')' || end[-2] != ')') {
+		ast_log(LOG_WARNING, "Invalid %s '%s': expected %s(name(...)), "
+			"%s(prefix(...)) or %s(category(...))\n", keyword, option,
+			keyword, keyword, keyword);
+		return NULL;
+	}
+	end[-2] = '\0';
+	kind = spec + keyword_len + 1;
+	value = strchr(kind, '(');
+	if (!value) {
+		ast_log(LOG_WARNING, "Invalid %s '%s'\n", keyword, option);
+		return NULL;
+	}
+	*value++ = '\0';
+	value = ast_strip(value);
+	kind = ast_strip(kind);
+
+	if (!strcasecmp(kind, "name")) {
+		type = AMI_KAFKA_ROUTE_NAME;
+	} else if (!strcasecmp(kind, "prefix")) {
+		type = AMI_KAFKA_ROUTE_PREFIX;
+	} else if (!strcasecmp(kind, "category")) {
+		size_t i;
+
+		type = AMI_KAFKA_ROUTE_CATEGORY;
+		for (i = 0; i < ARRAY_LEN(category_names); i++) {
+			if (!strcasecmp(value, category_names[i].name)) {
+				category = category_names[i].flag;
+				break;
+			}
+		}
+		if (!category) {
+			ast_log(LOG_WARNING, "Invalid %s '%s': unknown category '%s'\n",
+				keyword, option, value);
+			return NULL;
+		}
+	} else {
+		ast_log(LOG_WARNING, "Invalid %s '%s': unknown match '%s'\n", keyword,
+			option, kind);
+		return NULL;
+	}
+
+	if (ast_strlen_zero(value) || ast_strlen_zero(topic)) {
+		ast_log(LOG_WARNING, "Invalid %s '%s': empty %s\n", keyword, option,
+			ast_strlen_zero(value) ? "match" : "topic");
+		return NULL;
+	}
+
+	value_len = strlen(value);
+	topic_len = strlen(topic);
+	route = ao2_alloc_options(sizeof(*route) + value_len + topic_len + 2, route_dtor,
+		AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!route) {
+		return NULL;
+	}
+	route->type = type;
+	route->category = category;
+	route->match = memcpy(route->data, value, value_len + 1);
+	route->match_len = value_len;
+	route->topic = memcpy(route->data + value_len + 1, topic, topic_len + 1);
+	route->order = ao2_container_count(rules);
+
+	ao2_link(rules, route);
+	ao2_ref(route, -1);
+
+	return route;
+}
+
+/*!
+ * \brief Parse one 'route(...)' option and append the rule to \a rules.
+ *
+ * \param rules Container the rule is linked into, in config order.
+ * \param option Option name: route(name(X)), route(prefix(X)) or
+ *        route(category(X)), X being a category name from manager.conf.
+ * \param topic Topic the matching events are published to.
+ * \retval 0 on success
+ * \retval -1 on a malformed rule
+ */
+int ami_kafka_route_add(struct ao2_container *rules, const char *option,
+	const char *topic)
+{
+	return match_rule_add(rules, "route", option, topic) ? 0 : -1;
+}
+
+static void routes_dtor(void *obj)
+{
+	struct ami_kafka_routes *routes = obj;
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(routes->cache); i++) {
+		ast_free(routes->cache[i]);
+	}
+	for (i = 0; i < routes->num_rules; i++) {
+		ao2_ref(routes->rules[i], -1);
+	}
+	ast_free(routes->rules);
+	ast_free(routes->prefixes);
+	ast_free(routes->categories);
+	name_map_destroy(&routes->by_name);
+}
+
+/*! \brief qsort() order for prefixes: longest first, then config order */
+static int route_prefix_cmp(const void *a, const void *b)
+{
+	const struct ami_kafka_route *left = *(struct ami_kafka_route * const *) a;
+	const struct ami_kafka_route *right = *(struct ami_kafka_route * const *) b;
+
+	if (left->match_len != right->match_len) {
+		return left->match_len < right->match_len ? 1 : -1;
+	}
+	return left->order < right->order ? -1 : left->order > right->order;
+}
+
+/*!
+ * \brief Compile routing rules for lookup by ami_kafka_route_topic().
+ *
+ * \return The compiled routes (ao2 object), or NULL on allocation failure.
+ */
+struct ami_kafka_routes *ami_kafka_routes_compile(struct ao2_container *rules)
+{
+	struct ami_kafka_routes *routes;
+	struct ao2_iterator iter;
+	struct ami_kafka_route *route;
+	size_t count = ao2_container_count(rules);
+	size_t num_names = 0;
+	size_t i;
+
+	routes = ao2_alloc_options(sizeof(*routes), routes_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!routes) {
+		return NULL;
+	}
+	if (!count) {
+		return routes;
+	}
+
+	routes->rules = ast_calloc(count, sizeof(*routes->rules));
+	routes->prefixes = ast_calloc(count, sizeof(*routes->prefixes));
+	routes->categories = ast_calloc(count, sizeof(*routes->categories));
+	if (!routes->rules || !routes->prefixes || !routes->categories) {
+		ao2_ref(routes, -1);
+		return NULL;
+	}
+
+	iter = ao2_iterator_init(rules, 0);
+	while ((route = ao2_iterator_next(&iter)) && routes->num_rules < count) {
+		routes->rules[routes->num_rules++] = route;
+		if (route->type == AMI_KAFKA_ROUTE_NAME) {
+			num_names++;
+		} else if (route->type == AMI_KAFKA_ROUTE_PREFIX) {
+			routes->prefixes[routes->num_prefixes++] = route;
+		} else {
+			routes->categories[routes->num_categories++] = route;
+		}
+	}
+	ao2_cleanup(route);
+	ao2_iterator_destroy(&iter);
+
+	/* Ties keep config order */
+	qsort(routes->prefixes, routes->num_prefixes, sizeof(*routes->prefixes),
+		route_prefix_cmp);
+
+	if (num_names && name_map_init(&routes->by_name, num_names)) {
+		ao2_ref(routes, -1);
+		return NULL;
+	}
+	for (i = 0; i < routes->num_rules; i++) {
+		struct ami_name_map_entry *entry;
+
+		route = routes->rules[i];
+		if (route->type != AMI_KAFKA_ROUTE_NAME) {
+			continue;
+		}
+		entry = name_map_add(&routes->by_name, route->match);
+		if (entry->value) {
+			ast_log(LOG_WARNING, "Duplicate rule for event '%s', using '%s'\n",
+				route->match, ((const struct ami_kafka_route *) entry->value)->topic);
+			continue;
+		}
+		entry->value = route;
+	}
+
+	return routes;
+}
+
+/*! \brief Apply the rules to an event: name, then longest prefix, then category */
+static struct ami_kafka_route *routes_resolve(const struct ami_kafka_routes *routes,
+	const char *event, size_t len, int category)
+{
+	struct ami_kafka_route *route;
+	size_t i;
+
+	route = name_map_find(&routes->by_name, event, len);
+	if (route) {
+		return route;
+	}
+
+	for (i = 0; i < routes->num_prefixes; i++) {
+		route = routes->prefixes[i];
+		if (len >= route->match_len && !memcmp(event, route->match, route->match_len)) {
+			return route;
+		}
+	}
+
+	for (i = 0; i < routes->num_categories; i++) {
+		if (category & routes->categories[i]->category) {
+			return routes->categories[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*!
+ * \brief Find the rule that applies to an event, through the cache.
+ *
+ * \param routes Compiled rules; NULL or empty match nothing.
+ * \return The rule, or NULL if none matches.
+ */
+static struct ami_kafka_route *routes_match(struct ami_kafka_routes *routes,
+	const char *event, int category)
+{
+	struct route_cache_entry **slot;
+	struct route_cache_entry *entry;
+	struct route_cache_entry *expected = NULL;
+	struct ami_kafka_route *route;
+	unsigned int hash;
+	size_t len;
+
+	if (!routes || !routes->num_rules) {
+		return NULL;
+	}
+
+	len = strlen(event);
+	hash = name_hash(event, len);
+	slot = &routes->cache[(hash ^ ((unsigned int) category * 2654435761U))
+		& (ROUTE_CACHE_SIZE - 1)];
+
+	entry = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (entry && entry->hash == hash && entry->category == category
+		&& entry->len == len && !memcmp(entry->name, event, len)) {
+		return entry->route;
+	}
+
+	route = routes_resolve(routes, event, len, category);
+
+	if (!entry) {
+		entry = ast_malloc(sizeof(*entry) + len + 1);
+		if (entry) {
+			entry->hash = hash;
+			entry->category = category;
+			entry->route = route;
+			entry->len = len;
+			memcpy(entry->name, event, len + 1);
+			if (!__atomic_compare_exchange_n(slot, &expected, entry, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+				ast_free(entry);
+			}
+		}
+	}
+
+	return route;
+}
+
+/*!
+ * \brief Get the topic for an event.
+ *
+ * \param routes Compiled routes; NULL or empty routes everything to the default.
+ * \param event AMI event name.
+ * \param category AMI event category bitmask.
+ * \param default_topic Topic for events no rule matches.
+ */
+const char *ami_kafka_route_topic(struct ami_kafka_routes *routes,
+	const char *event, int category, const char *default_topic)
+{
+	const struct ami_kafka_route *route = routes_match(routes, event, category);
+
+	return route ? route->topic : default_topic;
+}
+
+/*! \brief Names of the priority classes, indexed by ami_kafka_priority */
+static const char * const priority_names[AMI_KAFKA_PRIORITY_COUNT] = {
+	[AMI_KAFKA_PRIORITY_CRITICAL] = "critical",
+	[AMI_KAFKA_PRIORITY_NORMAL] = "normal",
+	[AMI_KAFKA_PRIORITY_LOW] = "low",
+};
+
+/*!
+ * \brief Parse one 'priority(...)' option and append the rule to \a rules.
+ *
+ * \param option Option name: priority(name(X)), priority(prefix(X)) or
+ *        priority(category(X)).
+ * \param priority critical, normal or low.
+ * \retval 0 on success
+ * \retval -1 on a malformed rule
+ */
+int ami_kafka_priority_add(struct ao2_container *rules, const char *option,
+	const char *priority)
+{
+	size_t i;
+
+	priority = ast_strip(ast_strdupa(S_OR(priority, "")));
+	for (i = 0; i < ARRAY_LEN(priority_names); i++) {
+		if (!strcasecmp(priority, priority_names[i])) {
+			return match_rule_add(rules, "priority", option, priority_names[i]) ? 0 : -1;
+		}
+	}
+
+	ast_log(LOG_WARNING, "Invalid priority '%s' for '%s': expected critical, "
+		"normal or low\n", priority, option);
+	return -1;
+}
+
+/*!
+ * \brief Get the priority class of an event.
+ *
+ * \param priorities Compiled 'priority(...)' rules; NULL or empty make
+ *        every event normal.
+ */
+enum ami_kafka_priority ami_kafka_event_priority(struct ami_kafka_routes *priorities,
+	const char *event, int category)
+{
+	const char *name = ami_kafka_route_topic(priorities, event, category, NULL);
+
+	/* Rules only hold the names above, whose first letters differ */
+	if (!name) {
+		return AMI_KAFKA_PRIORITY_NORMAL;
+	}
+	return name[0] == 'c' ? AMI_KAFKA_PRIORITY_CRITICAL
+		: name[0] == 'l' ? AMI_KAFKA_PRIORITY_LOW : AMI_KAFKA_PRIORITY_NORMAL;
+}
+
+/*!
+ * \brief Whether to drop an event of class \a priority at this load.
+ *
+ * With sampling, 1 in policy->sample of the events that would be dropped
+ * is kept, so consumers still get a statistical view of shed classes.
+ *
+ * \param load How full the pipeline is, in percent.
+ * \retval 1 to drop the event.
+ */
+int ami_kafka_shed(struct ami_kafka_shed_policy *policy,
+	enum ami_kafka_priority priority, unsigned int load)
+{
+	if (load < policy->threshold[priority]) {
+		return 0;
+	}
+
+	if (policy->sample
+		&& !(__atomic_fetch_add(&policy->seen[priority], 1, __ATOMIC_RELAXED)
+			% policy->sample)) {
+		return 0;
+	}
+
+	return 1;
+}
+
+/*!
+ * \brief Parse one 'sample(...)' option and append the rule to \a rules.
+ *
+ * \param option sample(name(X)), sample(prefix(X)) or sample(category(X)).
+ * \param value 1/N or N: keep the first of every N matching events.
+ * \retval 0 on success
+ * \retval -1 on a malformed rule
+ */
+int ami_kafka_sample_add(struct ao2_container *rules, const char *option,
+	const char *value)
+{
+	struct ami_kafka_route *route;
+	const char *rate = ast_skip_blanks(S_OR(value, ""));
+	unsigned int every;
+	char *end;
+
+	if (ast_begins_with(rate, "1/")) {
+		rate += 2;
+	}
+	every = strtoul(rate, &end, 10);
+	if (end == rate || !ast_strlen_zero(ast_skip_blanks(end))
+		|| !every || every > 1000000) {
+		ast_log(LOG_WARNING, "Invalid sample rate '%s' for '%s': expected 1/N, "
+			"N from 1 to 1000000\n", S_OR(value, ""), option);
+		return -1;
+	}
+
+	route = match_rule_add(rules, "sample", option, value);
+	if (!route) {
+		return -1;
+	}
+	route->sample_every = every;
+
+	return 0;
+}
+
+/*!
+ * \brief Parse one 'ratelimit(...)' option and append the rule to \a rules.
+ *
+ * \param option ratelimit(name(X)), ratelimit(prefix(X)) or
+ *        ratelimit(category(X)).
+ * \param value N/s, N/m or N/h, optionally followed by "per channel" to
+ *        give each Channel its own limit. Up to N events pass in a burst.
+ * \retval 0 on success
+ * \retval -1 on a malformed rule
+ */
+int ami_kafka_ratelimit_add(struct ao2_container *rules, const char *option,
+	const char *value)
+{
+	struct ami_kafka_route *route;
+	const char *rate = ast_skip_blanks(S_OR(value, ""));
+	uint64_t period;
+	unsigned int count;
+	int per_channel = 0;
+	char *end;
+
+	count = strtoul(rate, &end, 10);
+	switch (end != rate && *end == '/' ? end[1] : '\0') {
+	case 's':
+		period = 1000000000ULL;
+		break;
+	case 'm':
+		period = 60 * 1000000000ULL;
+		break;
+	case 'h':
+		period = 3600 * 1000000000ULL;
+		break;
+	default:
+		period = 0;
+		break;
+	}
+	if (period) {
+		end = ast_skip_blanks(end + 2);
+		if (!strcasecmp(end, "per channel")) {
+			per_channel = 1;
+		} else if (!ast_strlen_zero(end)) {
+			period = 0;
+		}
+	}
+	if (!period || !count || count > 1000000) {
+		ast_log(LOG_WARNING, "Invalid rate limit '%s' for '%s': expected N/s, N/m "
+			"or N/h, N from 1 to 1000000, optionally followed by 'per channel'\n",
+			S_OR(value, ""), option);
+		return -1;
+	}
+
+	route = match_rule_add(rules, "ratelimit", option, value);
+	if (!route) {
+		return -1;
+	}
+	route->interval = period / count;
+	route->tolerance = route->interval * (count - 1);
+	if (per_channel) {
+		route->channel_tat = ast_calloc(RATELIMIT_CHANNEL_SLOTS, sizeof(*route->channel_tat));
+		if (!route->channel_tat) {
+			ao2_unlink(rules, route);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Whether to keep an event under the 'sample(...)' rules.
+ *
+ * Counting is a single atomic increment per matching event.
+ */
+int ami_kafka_sample_keep(struct ami_kafka_routes *samples, const char *event,
+	int category)
+{
+	struct ami_kafka_route *route = routes_match(samples, event, category);
+
+	return !route
+		|| !(__atomic_fetch_add(&route->sample_seen, 1, __ATOMIC_RELAXED) % route->sample_every);
+}
+
+/*!
+ * \brief Token bucket, as its equivalent generic cell rate algorithm.
+ *
+ * The bucket is one theoretical arrival time, updated with compare-and-swap,
+ * so concurrent events need no lock.
+ */
+static int ratelimit_take(uint64_t *tat, uint64_t interval, uint64_t tolerance,
+	uint64_t now)
+{
+	uint64_t expected = __atomic_load_n(tat, __ATOMIC_RELAXED);
+	uint64_t next;
+
+	do {
+		next = MAX(expected, now) + interval;
+		if (next - now > tolerance + interval) {
+			return 0;
+		}
+	} while (!__atomic_compare_exchange_n(tat, &expected, next, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return 1;
+}
+
+/*!
+ * \brief Whether an event fits the 'ratelimit(...)' rules.
+ *
+ * \param headers Index of the event body; "per channel" rules read Channel.
+ *        Events without one share the rule's own limit.
+ * \param now Monotonic time in nanoseconds.
+ */
+int ami_kafka_ratelimit_allow(struct ami_kafka_routes *ratelimits, const char *event,
+	int category, const struct ami_header_index *headers, uint64_t now)
+{
+	struct ami_kafka_route *route = routes_match(ratelimits, event, category);
+	const struct ami_header *channel;
+	uint64_t *tat;
+
+	if (!route) {
+		return 1;
+	}
+
+	tat = &route->tat;
+	if (route->channel_tat) {
+		channel = header_index_find(headers, "Channel", 7, name_hash("Channel", 7));
+		if (channel) {
+			const char *value = channel->line + channel->key_len + 2;
+
+			tat = &route->channel_tat[name_hash(value,
+				channel->line_len - channel->key_len - 2) & (RATELIMIT_CHANNEL_SLOTS - 1)];
+		}
+	}
+
+	return ratelimit_take(tat, route->interval, route->tolerance, now);
+}
+
+/*!
+ * \brief Parse one 'coalesce(...)' option and append the rule to \a rules.
+ *
+ * \param option coalesce(name(X)), coalesce(prefix(X)) or coalesce(category(X)).
+ * \param header Name of the header identifying the entity whose state the
+ *        events carry, such as Device or Peer.
+ * \retval 0 on success
+ * \retval -1 on a malformed rule
+ */
+int ami_kafka_coalesce_add(struct ao2_container *rules, const char *option,
+	const char *header)
+{
+	struct ami_kafka_route *route;
+
+	route = match_rule_add(rules, "coalesce", option, header);
+	if (!route) {
+		return -1;
+	}
+	route->header_len = strlen(route->topic);
+	route->header_hash = name_hash(route->topic, route->header_len);
+
+	return 0;
+}
+
+/*!
+ * \brief Parse one 'fields(...)' option and append the rule to \a rules.
+ *
+ * \param option fields(name(X)), fields(prefix(X)) or fields(category(X)).
+ * \param value Comma separated header names to publish, or to leave out
+ *        when every name starts with '!'.
+ * \retval 0 on success
+ * \retval -1 on a malformed rule
+ */
+int ami_kafka_fields_add(struct ao2_container *rules, const char *option,
+	const char *value)
+{
+	struct ami_kafka_route *route;
+	char *names = ast_strdup(S_OR(value, ""));
+	char *cursor = names;
+	char *name;
+	size_t count = 0;
+	int exclude = -1;
+
+	if (!names) {
+		return -1;
+	}
+
+	/* First pass: validate and count */
+	while ((name = strsep(&cursor, ","))) {
+		name = ast_strip(name);
+		if (ast_strlen_zero(name)) {
+			continue;
+		}
+		if (exclude >= 0 && exclude != (*name == '!')) {
+			ast_log(LOG_WARNING, "Invalid fields '%s' for '%s': either list the "
+				"headers to publish or, each prefixed with '!', those to leave out\n",
+				value, option);
+			ast_free(names);
+			return -1;
+		}
+		exclude = *name == '!';
+		count++;
+	}
+	ast_free(names);
+
+	route = match_rule_add(rules, "fields", option, value);
+	if (!route) {
+		return -1;
+	}
+	if (!count) {
+		ast_log(LOG_WARNING, "Invalid fields '%s' for '%s': no header names\n",
+			value, option);
+		ao2_unlink(rules, route);
+		return -1;
+	}
+
+	/* Second pass over a copy the map can point into */
+	route->field_names = ast_strdup(value);
+	if (!route->field_names || name_map_init(&route->fields, count)) {
+		ao2_unlink(rules, route);
+		return -1;
+	}
+	route->fields_exclude = exclude;
+	cursor = route->field_names;
+	while ((name = strsep(&cursor, ","))) {
+		name = ast_strip(name);
+		if (!ast_strlen_zero(name)) {
+			name_map_add(&route->fields, ast_skip_blanks(name + exclude));
+		}
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Drop the headers a 'fields(...)' rule leaves out of an event.
+ *
+ * The dropped headers are removed from the index, so the formatters never
+ * see them. With a list of headers to publish, lines that are not headers
+ * are dropped too.
+ *
+ * \return Number of lines removed from \a headers.
+ */
+size_t ami_kafka_project(struct ami_kafka_routes *projections, const char *event,
+	int category, struct ami_header_index *headers)
+{
+	struct ami_kafka_route *route = routes_match(projections, event, category);
+	size_t kept = 0;
+	size_t removed;
+	size_t i;
+
+	if (!route) {
+		return 0;
+	}
+
+	for (i = 0; i < headers->count; i++) {
+		const struct ami_header *header = &headers->items[i];
+		int listed = header->key_len >= 0 && name_map_slot(&route->fields,
+			header->line, header->key_len, header->hash)->name;
+
+		if (listed != route->fields_exclude) {
+			headers->items[kept++] = *header;
+		}
+	}
+	removed = headers->count - kept;
+	headers->count = kept;
+
+	return removed;
+}
+
+/*! \brief Most counter shards; CPUs beyond that share them (power of two) */
+#define STATS_MAX_SHARDS 64
+
+/*!
+ * \brief Counters of the threads running on one CPU.
+ *
+ * Threads on other CPUs use other shards, so updates rarely contend for a
+ * cache line. They are still atomic: a thread can migrate between reading
+ * its CPU and updating the shard.
+ */
+struct stats_shard {
+	struct ami_kafka_stats stats;
+} __attribute__((aligned(64)));
+
+static struct stats_shard stats_shards[STATS_MAX_SHARDS];
+/*! \brief Shards in use minus one, set from the CPU count at load; only the first before */
+static unsigned int stats_shard_mask;
+
+/*! \brief Set while the thread stats_isolated_thread runs a benchmark */
+static int stats_isolated;
+static pthread_t stats_isolated_thread;
+/*! \brief Where that thread's counters go instead; never reported */
+static struct stats_shard stats_scratch;
+
+static struct ami_kafka_stats *stats_shard(void)
+{
+	int cpu;
+
+	if (__atomic_load_n(&stats_isolated, __ATOMIC_ACQUIRE)
+		&& pthread_equal(stats_isolated_thread, pthread_self())) {
+		return &stats_scratch.stats;
+	}
+	cpu = sched_getcpu();
+
+	return &stats_shards[(cpu < 0 ? 0 : cpu) & stats_shard_mask].stats;
+}
+
+/*!
+ * \brief Use one shard per configured CPU, up to STATS_MAX_SHARDS.
+ *
+ * Shards beyond the ones in use are never touched, so their pages are
+ * not even mapped. Called before any event is counted; the count only
+ * grows, so nothing counted before is lost.
+ */
+static void stats_shards_size(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_CONF);
+	unsigned int count = 1;
+
+	while (count < cpus && count < STATS_MAX_SHARDS) {
+		count <<= 1;
+	}
+	if (count - 1 > stats_shard_mask) {
+		stats_shard_mask = count - 1;
+	}
+}
+
+/*! \brief Monotonic clock in nanoseconds, for latency samples */
+static uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*! \brief How often a thread re-reads the wall clock, in nanoseconds */
+#define WALL_CLOCK_SYNC_NS 1000000000ULL
+
+/*! \brief Wall clock derived from the monotonic clock, per thread */
+struct ami_kafka_wall_clock {
+	/*! \brief monotonic time of the last wall clock reading, 0 = none yet */
+	uint64_t synced;
+	/*! \brief wall clock minus monotonic clock, in nanoseconds */
+	int64_t offset;
+	/*! \brief latest value handed out, in microseconds */
+	uint64_t last;
+};
+
+AST_THREADSTORAGE(wall_clock_buf);
+
+/*!
+ * \brief Move a wall clock to a monotonic reading.
+ *
+ * Values never go back. Between two wall clock readings they cannot,
+ * and at most one resync period is lost to a wall clock stepped back by
+ * less than that: the value stalls until the clock catches up. A larger
+ * step back is followed instead, so the stall stays bounded.
+ *
+ * \param now Monotonic time in nanoseconds.
+ * \param wall Wall clock in nanoseconds, read at \a now; 0 keeps the last offset.
+ * \return The wall clock time at \a now, in microseconds since the epoch.
+ */
+uint64_t ami_kafka_wall_clock_advance(struct ami_kafka_wall_clock *clock,
+	uint64_t now, uint64_t wall)
+{
+	uint64_t us;
+
+	if (wall) {
+		clock->offset = (int64_t) wall - (int64_t) now;
+		clock->synced = now;
+	}
+
+	us = (now + clock->offset) / 1000;
+	if (us < clock->last && (!wall || clock->last - us <= WALL_CLOCK_SYNC_NS / 1000)) {
+		us = clock->last;
+	}
+	clock->last = us;
+
+	return us;
+}
+
+/*!
+ * \brief Wall clock time in microseconds since the epoch.
+ *
+ * Derived from a monotonic reading the caller already has, usually from
+ * stats_now(), and an offset to the wall clock that each thread refreshes
+ * once a second. Most events cost no clock read beyond the one taken for
+ * the latency statistics. See ami_kafka_wall_clock_advance() for what a
+ * wall clock step does.
+ *
+ * \param now Monotonic time in nanoseconds, as from stats_now().
+ */
+uint64_t ami_kafka_wall_clock_us(uint64_t now)
+{
+	struct ami_kafka_wall_clock *clock = ast_threadstorage_get(&wall_clock_buf,
+		sizeof(*clock));
+	struct timespec ts;
+	uint64_t wall = 0;
+
+	if (!clock || !clock->synced || now - clock->synced >= WALL_CLOCK_SYNC_NS) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		wall = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		if (!clock) {
+			return wall / 1000;
+		}
+	}
+
+	return ami_kafka_wall_clock_advance(clock, now, wall);
+}
+
+/*!
+ * \brief Histogram bucket of a latency.
+ *
+ * Values below 2^LATENCY_SUB_BITS have a bucket each. Above that, every
+ * power of two is split into 2^LATENCY_SUB_BITS equal buckets, so a bucket
+ * is never wider than 1/8 of its lower bound.
+ */
+unsigned int ami_kafka_latency_bucket(uint64_t ns)
+{
+	unsigned int exp;
+
+	if (ns < (1U << LATENCY_SUB_BITS)) {
+		return ns;
+	}
+
+	exp = 63 - __builtin_clzll(ns);
+	if (exp > LATENCY_MAX_EXP) {
+		return LATENCY_BUCKETS - 1;
+	}
+
+	return ((exp - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+		| ((ns >> (exp - LATENCY_SUB_BITS)) & ((1U << LATENCY_SUB_BITS) - 1));
+}
+
+/*! \brief Smallest latency that falls in \a bucket */
+uint64_t ami_kafka_latency_bucket_floor(unsigned int bucket)
+{
+	unsigned int group = bucket >> LATENCY_SUB_BITS;
+	uint64_t sub = bucket & ((1U << LATENCY_SUB_BITS) - 1);
+
+	if (!group) {
+		return bucket;
+	}
+
+	return ((1ULL << LATENCY_SUB_BITS) | sub) << (group - 1);
+}
+
+/*!
+ * \brief Latency below which \a percentile percent of the samples fall.
+ *
+ * \return The upper bound of the bucket holding that sample, 0 if empty.
+ */
+uint64_t ami_kafka_latency_percentile(const uint64_t *buckets, double percentile)
+{
+	uint64_t total = 0;
+	uint64_t rank;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		total += buckets[i];
+	}
+	if (!total) {
+		return 0;
+	}
+
+	rank = total * percentile / 100.0;
+	if (rank >= total) {
+		rank = total - 1;
+	}
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		seen += buckets[i];
+		if (seen > rank) {
+			break;
+		}
+	}
+
+	return ami_kafka_latency_bucket_floor(i + 1) - 1;
+}
+
+void ami_kafka_stats_count(enum ami_kafka_counter counter)
+{
+	__atomic_add_fetch(&stats_shard()->counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+static void stats_add(enum ami_kafka_counter counter, uint64_t count)
+{
+	if (count) {
+		__atomic_add_fetch(&stats_shard()->counters[counter], count, __ATOMIC_RELAXED);
+	}
+}
+
+void ami_kafka_stats_record(enum ami_kafka_stage stage, uint64_t ns)
+{
+	__atomic_add_fetch(&stats_shard()->latency[stage][ami_kafka_latency_bucket(ns)], 1,
+		__ATOMIC_RELAXED);
+}
+
+/*! \brief Sum all shards into \a stats */
+void ami_kafka_stats_collect(struct ami_kafka_stats *stats)
+{
+	size_t i;
+	size_t j;
+	size_t k;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i <= stats_shard_mask; i++) {
+		const struct ami_kafka_stats *shard = &stats_shards[i].stats;
+
+		for (j = 0; j < AMI_KAFKA_STAT_COUNT; j++) {
+			stats->counters[j] += __atomic_load_n(&shard->counters[j], __ATOMIC_RELAXED);
+		}
+		for (j = 0; j < AMI_KAFKA_STAGE_COUNT; j++) {
+			for (k = 0; k < LATENCY_BUCKETS; k++) {
+				stats->latency[j][k] +=
+					__atomic_load_n(&shard->latency[j][k], __ATOMIC_RELAXED);
+			}
+		}
+	}
+}
+
+/*!
+ * \brief Zero all counters and histograms.
+ *
+ * Events in flight may be counted on either side of the reset.
+ */
+void ami_kafka_stats_reset(void)
+{
+	size_t i;
+	size_t j;
+	size_t k;
+
+	for (i = 0; i <= stats_shard_mask; i++) {
+		struct ami_kafka_stats *shard = &stats_shards[i].stats;
+
+		for (j = 0; j < AMI_KAFKA_STAT_COUNT; j++) {
+			__atomic_store_n(&shard->counters[j], 0, __ATOMIC_RELAXED);
+		}
+		for (j = 0; j < AMI_KAFKA_STAGE_COUNT; j++) {
+			for (k = 0; k < LATENCY_BUCKETS; k++) {
+				__atomic_store_n(&shard->latency[j][k], 0, __ATOMIC_RELAXED);
+			}
+		}
+	}
+}
+
+#ifdef HAVE_ZSTD
+/*! \brief Identifies ami_zstd_dictionary in the content_encoding header */
+#define AMI_ZSTD_DICTIONARY_ID "ami-v1"
+
+/*!
+ * \brief Raw-content zstd dictionary for AMI payloads.
+ *
+ * Keys and values that recur in nearly every event, in both the JSON and
+ * the AMI text layout, so single small events compress well. zstd favours
+ * recent (close) matches, so the most common text is at the end.
+ * The content is part of the "zstd;dict=ami-v1" encoding: do not edit it,
+ * add a new dictionary with a new id instead.
+ */
+static const char ami_zstd_dictionary[] =
+	"\"Event\":\"PeerStatus\",\"ChannelType\":\"PJSIP\",\"Peer\":\"PJSIP/\",\"PeerStatus\":\"Reachable\","
+	"\"Event\":\"ContactStatus\",\"URI\":\"sip:\",\"ContactStatus\":\"Reachable\",\"AOR\":\"\",\"EndpointName\":\"\",\"RoundtripUsec\":\"\","
+	"\"Event\":\"DeviceStateChange\",\"Device\":\"PJSIP/\",\"State\":\"NOT_INUSE\","
+	"\"Event\":\"ExtensionStatus\",\"Exten\":\"\",\"Context\":\"ext-local\",\"Hint\":\"PJSIP/\",\"Status\":\"0\",\"StatusText\":\"Idle\","
+	"\"Event\":\"QueueMemberStatus\",\"Queue\":\"\",\"MemberName\":\"\",\"Interface\":\"Local/\",\"StateInterface\":\"\",\"Membership\":\"dynamic\",\"Penalty\":\"0\",\"CallsTaken\":\"0\",\"LastCall\":\"0\",\"InCall\":\"0\",\"Paused\":\"0\",\"PausedReason\":\"\",\"Ringinuse\":\"0\","
+	"\"Event\":\"QueueCallerJoin\",\"Position\":\"1\",\"Count\":\"1\","
+	"\"Event\":\"BridgeEnter\",\"BridgeUniqueid\":\"\",\"BridgeType\":\"basic\",\"BridgeTechnology\":\"simple_bridge\",\"BridgeCreator\":\"<unknown>\",\"BridgeName\":\"<unknown>\",\"BridgeNumChannels\":\"2\",\"BridgeVideoSourceMode\":\"none\",\"SwapUniqueid\":\"\","
+	"\"Event\":\"DialBegin\",\"DestChannel\":\"PJSIP/\",\"DestChannelState\":\"5\",\"DestChannelStateDesc\":\"Ringing\",\"DestCallerIDNum\":\"\",\"DestCallerIDName\":\"\",\"DestConnectedLineNum\":\"\",\"DestConnectedLineName\":\"\",\"DestLanguage\":\"en\",\"DestAccountCode\":\"\",\"DestContext\":\"from-internal\",\"DestExten\":\"s\",\"DestPriority\":\"1\",\"DestUniqueid\":\"\",\"DestLinkedid\":\"\",\"DialString\":\"\","
+	"\"Event\":\"DialEnd\",\"DialStatus\":\"ANSWER\","
+	"\"Event\":\"Hangup\",\"Cause\":\"16\",\"Cause-txt\":\"Normal Clearing\","
+	"\"Event\":\"Newstate\",\"Event\":\"Newchannel\",\"Event\":\"Newexten\",\"Application\":\"Set\",\"AppData\":\"\","
+	"\"Event\":\"VarSet\",\"Variable\":\"\",\"Value\":\"\","
+	"\"Privilege\":\"dialplan,all\",\"Privilege\":\"system,all\",\"Privilege\":\"agent,all\",\"Privilege\":\"call,all\","
+	"Event: Newexten\r\nApplication: Set\r\nAppData: \r\n"
+	"Event: VarSet\r\nVariable: \r\nValue: \r\n"
+	"Privilege: dialplan,all\r\nPrivilege: call,all\r\n"
+	"Channel: PJSIP/\r\nChannelState: 6\r\nChannelStateDesc: Up\r\nCallerIDNum: \r\nCallerIDName: <unknown>\r\n"
+	"ConnectedLineNum: <unknown>\r\nConnectedLineName: <unknown>\r\nLanguage: en\r\nAccountCode: \r\n"
+	"Context: from-internal\r\nExten: s\r\nPriority: 1\r\nUniqueid: \r\nLinkedid: \r\n"
+	"EntityID: \r\nSystemName: \r\n"
+	"{\"Event\":\"\",\"EntityID\":\"\",\"SystemName\":\"\",\"Privilege\":\"call,all\","
+	"\"Channel\":\"PJSIP/\",\"ChannelState\":\"6\",\"ChannelStateDesc\":\"Up\",\"CallerIDNum\":\"\",\"CallerIDName\":\"<unknown>\","
+	"\"ConnectedLineNum\":\"<unknown>\",\"ConnectedLineName\":\"<unknown>\",\"Language\":\"en\",\"AccountCode\":\"\","
+	"\"Context\":\"from-internal\",\"Exten\":\"s\",\"Priority\":\"1\",\"Uniqueid\":\"\",\"Linkedid\":\"\"}";
+
+/*! \brief Largest dictionary file accepted for compression_dictionary */
+#define AMI_ZSTD_MAX_DICTIONARY (1024 * 1024)
+
+/*! \brief Per-thread zstd context; contexts cannot be shared between threads */
+struct zstd_thread_state {
+	ZSTD_CCtx *cctx;
+};
+
+static void zstd_thread_state_free(void *data)
+{
+	struct zstd_thread_state *state = data;
+
+	ZSTD_freeCCtx(state->cctx);
+	ast_free(state);
+}
+
+AST_THREADSTORAGE_CUSTOM(zstd_state, NULL, zstd_thread_state_free);
+
+/*!
+ * \brief Build a zstd dictionary from a file trained with 'zstd --train'.
+ *
+ * \return The dictionary, or NULL (logged) if the file can't be used.
+ */
+static ZSTD_CDict *zstd_dictionary_load(const char *path, int level)
+{
+	ZSTD_CDict *cdict = NULL;
+	char *data = NULL;
+	FILE *file;
+	long size;
+
+	file = fopen(path, "rb");
+	if (!file) {
+		ast_log(LOG_ERROR, "Cannot open compression_dictionary '%s': %s\n",
+			path, strerror(errno));
+		return NULL;
+	}
+
+	if (fseek(file, 0, SEEK_END) || (size = ftell(file)) <= 0
+		|| size > AMI_ZSTD_MAX_DICTIONARY || fseek(file, 0, SEEK_SET)) {
+		ast_log(LOG_ERROR, "compression_dictionary '%s' is empty or larger than %d bytes\n",
+			path, AMI_ZSTD_MAX_DICTIONARY);
+		goto done;
+	}
+
+	data = ast_malloc(size);
+	if (!data || fread(data, 1, size, file) != (size_t) size) {
+		ast_log(LOG_ERROR, "Cannot read compression_dictionary '%s'\n", path);
+		goto done;
+	}
+
+	/* Without an ID, consumers could not tell which dictionary to use */
+	if (!ZSTD_getDictID_fromDict(data, size)) {
+		ast_log(LOG_ERROR, "compression_dictionary '%s' is not a trained zstd "
+			"dictionary (see 'zstd --train')\n", path);
+		goto done;
+	}
+
+	/* The dictionary content is copied */
+	cdict = ZSTD_createCDict(data, size, level);
+
+done:
+	ast_free(data);
+	fclose(file);
+	return cdict;
+}
+#endif
+
+void ami_kafka_compressor_free(struct ami_kafka_compressor *compressor)
+{
+	if (!compressor) {
+		return;
+	}
+
+#ifdef HAVE_ZSTD
+	ZSTD_freeCDict(compressor->cdict);
+#endif
+	ast_free(compressor);
+}
+
+/*!
+ * \brief Set up payload compression.
+ *
+ * \param type Codec; must not be AMI_KAFKA_COMPRESSION_NONE.
+ * \param level zstd compression level.
+ * \param dictionary zstd only: "builtin" for ami_zstd_dictionary, "none",
+ *        or the path of a dictionary trained with 'zstd --train'.
+ * \return The compressor, or NULL if the codec is not available or the
+ *         dictionary can't be loaded.
+ */
+struct ami_kafka_compressor *ami_kafka_compressor_alloc(
+	enum ami_kafka_compression type, int level, const char *dictionary)
+{
+	struct ami_kafka_compressor *compressor;
+
+	compressor = ast_calloc(1, sizeof(*compressor));
+	if (!compressor) {
+		return NULL;
+	}
+	compressor->type = type;
+	compressor->level = level;
+
+	switch (type) {
+#ifdef HAVE_LZ4
+	case AMI_KAFKA_COMPRESSION_LZ4:
+		ast_copy_string(compressor->encoding, "lz4", sizeof(compressor->encoding));
+		return compressor;
+#endif
+#ifdef HAVE_ZSTD
+	case AMI_KAFKA_COMPRESSION_ZSTD:
+		if (ast_strlen_zero(dictionary) || !strcasecmp(dictionary, "none")) {
+			ast_copy_string(compressor->encoding, "zstd", sizeof(compressor->encoding));
+			return compressor;
+		}
+		if (!strcasecmp(dictionary, "builtin")) {
+			compressor->cdict = ZSTD_createCDict(ami_zstd_dictionary,
+				sizeof(ami_zstd_dictionary) - 1, level);
+			ast_copy_string(compressor->encoding, "zstd;dict=" AMI_ZSTD_DICTIONARY_ID,
+				sizeof(compressor->encoding));
+		} else {
+			compressor->cdict = zstd_dictionary_load(dictionary, level);
+			if (compressor->cdict) {
+				snprintf(compressor->encoding, sizeof(compressor->encoding),
+					"zstd;dict=%u", ZSTD_getDictID_fromCDict(compressor->cdict));
+			}
+		}
+		if (!compressor->cdict) {
+			break;
+		}
+		return compressor;
+#endif
+	default:
+		break;
+	}
+
+	ami_kafka_compressor_free(compressor);
+	return NULL;
+}
+
+/*!
+ * \brief Compress one Kafka message payload.
+ *
+ * \param compressor Settings from ami_kafka_compressor_alloc().
+ * \param data The payload.
+ * \param len Length of \a data.
+ * \param out Replaced with the compressed payload.
+ * \retval 0 if \a out holds the compressed payload
+ * \retval -1 if the payload is to be sent as it is: compression failed or
+ *         did not make it smaller
+ */
+int ami_kafka_compress(const struct ami_kafka_compressor *compressor,
+	const char *data, size_t len, struct ast_str **out)
+{
+	size_t written = 0;
+	char *dst = NULL;
+
+	ast_str_reset(*out);
+
+	switch (compressor->type) {
+#ifdef HAVE_LZ4
+	case AMI_KAFKA_COMPRESSION_LZ4: {
+		LZ4F_preferences_t prefs;
+		size_t bound;
+
+		/* The frame records the original size for the consumer */
+		memset(&prefs, 0, sizeof(prefs));
+		prefs.frameInfo.contentSize = len;
+
+		bound = LZ4F_compressFrameBound(len, &prefs);
+		dst = str_reserve(out, bound);
+		if (!dst) {
+			return -1;
+		}
+		written = LZ4F_compressFrame(dst, bound, data, len, &prefs);
+		if (LZ4F_isError(written)) {
+			return -1;
+		}
+		break;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	case AMI_KAFKA_COMPRESSION_ZSTD: {
+		struct zstd_thread_state *state;
+		size_t bound;
+
+		state = ast_threadstorage_get(&zstd_state, sizeof(*state));
+		if (!state) {
+			return -1;
+		}
+		if (!state->cctx) {
+			state->cctx = ZSTD_createCCtx();
+			if (!state->cctx) {
+				return -1;
+			}
+		}
+
+		bound = ZSTD_compressBound(len);
+		dst = str_reserve(out, bound);
+		if (!dst) {
+			return -1;
+		}
+		if (compressor->cdict) {
+			written = ZSTD_compress_usingCDict(state->cctx, dst, bound, data, len,
+				compressor->cdict);
+		} else {
+			written = ZSTD_compressCCtx(state->cctx, dst, bound, data, len,
+				compressor->level);
+		}
+		if (ZSTD_isError(written)) {
+			return -1;
+		}
+		break;
+	}
+#endif
+	default:
+		return -1;
+	}
+
+	if (written >= len) {
+		return -1;
+	}
+
+	str_commit(*out, dst + written);
+	return 0;
+}
+
+/*!
+ * \brief Compress a payload about to be produced, if configured.
+ *
+ * Left uncompressed if there is no room for the content_encoding header.
+ *
+ * \param general Configuration holding the compressor.
+ * \param payload In: the payload; out: the compressed payload.
+ * \param len In: length of \a payload; out: the compressed length.
+ * \param hdrs Headers of the message; content_encoding is appended if the
+ * payload was compressed.
+ * \param hdr_count In/out: number of headers in \a hdrs.
+ */
+static void compress_payload(const struct ami_kafka_conf_general *general,
+	const char **payload, size_t *len, struct ast_kafka_header *hdrs, size_t *hdr_count)
+{
+	struct ast_str *buf;
+
+	if (!general->compressor || *hdr_count >= AMI_KAFKA_MAX_HEADERS) {
+		return;
+	}
+
+	buf = ast_str_thread_get(&compress_buf, 1024);
+	if (!buf || ami_kafka_compress(general->compressor, *payload, *len, &buf)) {
+		return;
+	}
+
+	*payload = ast_str_buffer(buf);
+	*len = ast_str_strlen(buf);
+	hdrs[(*hdr_count)++] = (struct ast_kafka_header) { "content_encoding",
+		general->compressor->encoding };
+}
+
+/*! \brief Identifies a spool file; the digits are the layout version */
+#define SPOOL_MAGIC "AMISPL01"
+
+/*! \brief Records replayed per pass of the drainer, between snapshot lock releases */
+#define SPILL_DRAIN_CHUNK 256
+
+/*! \brief How long the drainer waits after a failed replay */
+#define SPILL_RETRY_MS 1000
+
+/*! \brief Start of the spool file; records follow */
+struct spool_header {
+	char magic[8];
+	/*! \brief bytes of record space after this header */
+	uint64_t size;
+	/*! \brief bytes ever consumed; head % size is the oldest record */
+	uint64_t head;
+	/*! \brief bytes ever written; tail % size is where the next record goes */
+	uint64_t tail;
+};
+
+/*!
+ * \brief A message that could not be produced, in memory and in the spool.
+ *
+ * Followed by the NUL-terminated topic, the key if there is one and each
+ * header name and value, then the payload. Records in the spool file are
+ * 8-byte aligned.
+ */
+struct spill_record {
+	/*! \brief bytes of the whole record; 0 in the spool means "continue at the start" */
+	uint32_t len;
+	uint32_t payload_len;
+	uint8_t has_key;
+	uint8_t header_count;
+	uint16_t reserved;
+	char data[0];
+};
+
+/*! \brief A decoded spill_record, pointing into it */
+struct spill_message {
+	const char *topic;
+	const char *key;
+	const char *payload;
+	size_t len;
+	struct ast_kafka_header hdrs[AMI_KAFKA_MAX_HEADERS];
+	size_t hdr_count;
+};
+
+/*!
+ * \brief Messages waiting for the producer to recover.
+ *
+ * The spool file, when there is one, is filled first since it survives a
+ * restart; the memory ring takes what does not fit. Once the ring holds a
+ * record, later ones go to the ring too, so the spool only ever holds
+ * records older than the ring's and replaying spool then ring keeps order.
+ */
+struct ami_kafka_spill {
+	ast_mutex_t lock;
+	/*! \brief signalled when records arrive or the drainer must stop */
+	ast_cond_t cond;
+	/*! \brief records waiting; read without the lock by producing threads */
+	unsigned int pending;
+	/*! \brief records that were neither produced nor spilled */
+	unsigned int dropped;
+	/*! \brief percent of the capacity in use, see ami_kafka_spill_fill() */
+	unsigned int fill;
+	struct spill_record **ring;
+	unsigned int ring_size;
+	unsigned int ring_head;
+	unsigned int ring_count;
+	/*! \brief mapped spool file, NULL if there is none */
+	struct spool_header *spool;
+	size_t spool_map_size;
+	unsigned int spool_count;
+	int spool_fd;
+	/*! \brief settings, to detect changes on reload */
+	char *path;
+	size_t file_size;
+	pthread_t drainer;
+	int drainer_running;
+	int stopping;
+};
+
+/*! \brief Spill in use, NULL if neither spill_size nor spill_file is set. */
+static struct ami_kafka_spill *event_spill;
+
+static size_t spill_align(size_t len)
+{
+	return (len + 7) & ~(size_t) 7;
+}
+
+/*! \brief Recompute spill->fill. Call with the lock held. */
+static void spill_update_fill(struct ami_kafka_spill *spill)
+{
+	unsigned int total = 0;
+	unsigned int tiers = 0;
+
+	if (spill->spool) {
+		total += (spill->spool->tail - spill->spool->head) * 100 / spill->spool->size;
+		tiers++;
+	}
+	if (spill->ring_size) {
+		total += (uint64_t) spill->ring_count * 100 / spill->ring_size;
+		tiers++;
+	}
+
+	__atomic_store_n(&spill->fill, tiers ? total / tiers : 0, __ATOMIC_RELAXED);
+}
+
+static struct spill_record *spill_record_encode(const char *topic, const char *key,
+	const void *payload, size_t len, const struct ast_kafka_header *hdrs,
+	size_t hdr_count)
+{
+	struct spill_record *record;
+	size_t size = sizeof(*record) + strlen(topic) + 1 + len;
+	char *pos;
+	size_t i;
+
+	if (key) {
+		size += strlen(key) + 1;
+	}
+	for (i = 0; i < hdr_count; i++) {
+		size += strlen(hdrs[i].name) + 1 + strlen(hdrs[i].value) + 1;
+	}
+	if (size > UINT32_MAX || hdr_count > AMI_KAFKA_MAX_HEADERS) {
+		return NULL;
+	}
+
+	record = ast_malloc(size);
+	if (!record) {
+		return NULL;
+	}
+
+	record->len = size;
+	record->payload_len = len;
+	record->has_key = key != NULL;
+	record->header_count = hdr_count;
+	record->reserved = 0;
+
+	pos = stpcpy(record->data, topic) + 1;
+	if (key) {
+		pos = stpcpy(pos, key) + 1;
+	}
+	for (i = 0; i < hdr_count; i++) {
+		pos = stpcpy(pos, hdrs[i].name) + 1;
+		pos = stpcpy(pos, hdrs[i].value) + 1;
+	}
+	memcpy(pos, payload, len);
+
+	return record;
+}
+
+/*! \brief Next NUL-terminated string of a record, NULL if it overruns \a end */
+static const char *spill_record_string(const char **pos, const char *end)
+{
+	const char *str = *pos;
+	const char *nul = memchr(str, '\0', end - str);
+
+	if (!nul) {
+		return NULL;
+	}
+	*pos = nul + 1;
+
+	return str;
+}
+
+/*!
+ * \brief Point \a msg at the fields of \a record.
+ *
+ * Spool records come from a file, so every length is checked.
+ */
+static int spill_record_decode(const struct spill_record *record,
+	struct spill_message *msg)
+{
+	const char *pos = record->data;
+	const char *end = (const char *) record + record->len;
+	size_t i;
+
+	if (record->len < sizeof(*record) || record->header_count > AMI_KAFKA_MAX_HEADERS
+		|| record->payload_len > record->len - sizeof(*record)) {
+		return -1;
+	}
+	end -= record->payload_len;
+
+	msg->topic = spill_record_string(&pos, end);
+	msg->key = record->has_key ? spill_record_string(&pos, end) : NULL;
+	if (!msg->topic || (record->has_key && !msg->key)) {
+		return -1;
+	}
+	for (i = 0; i < record->header_count; i++) {
+		msg->hdrs[i].name = spill_record_string(&pos, end);
+		msg->hdrs[i].value = msg->hdrs[i].name ? spill_record_string(&pos, end) : NULL;
+		if (!msg->hdrs[i].value) {
+			return -1;
+		}
+	}
+	msg->hdr_count = record->header_count;
+	msg->payload = end;
+	msg->len = record->payload_len;
+
+	return 0;
+}
+
+/*! \brief Oldest spool record, or NULL. Call with the lock held. */
+static struct spill_record *spool_peek(struct ami_kafka_spill *spill)
+{
+	struct spool_header *spool = spill->spool;
+	struct spill_record *record;
+	uint64_t offset;
+
+	while (spool->head != spool->tail) {
+		offset = spool->head % spool->size;
+		record = (struct spill_record *) ((char *) (spool + 1) + offset);
+		if (!record->len) {
+			spool->head += spool->size - offset;
+			continue;
+		}
+		return record;
+	}
+
+	return NULL;
+}
+
+/*! \brief Copy \a record at the end of the spool. Call with the lock held. */
+static int spool_append(struct ami_kafka_spill *spill, const struct spill_record *record)
+{
+	struct spool_header *spool = spill->spool;
+	uint64_t offset = spool->tail % spool->size;
+	uint64_t room = spool->size - (spool->tail - spool->head);
+	size_t len = spill_align(record->len);
+	size_t skip = spool->size - offset < len ? spool->size - offset : 0;
+
+	if (skip + len > room) {
+		return -1;
+	}
+
+	if (skip) {
+		((struct spill_record *) ((char *) (spool + 1) + offset))->len = 0;
+		offset = 0;
+	}
+	memcpy((char *) (spool + 1) + offset, record, record->len);
+
+	/* The record is complete before the tail covers it */
+	__atomic_store_n(&spool->tail, spool->tail + skip + len, __ATOMIC_RELEASE);
+	spill->spool_count++;
+
+	return 0;
+}
+
+/*!
+ * \brief Count the records of a spool left by a previous run.
+ *
+ * \retval -1 if a record is damaged; the caller then empties the spool.
+ */
+static int spool_recover(struct ami_kafka_spill *spill)
+{
+	struct spool_header *spool = spill->spool;
+	struct spill_message msg;
+	uint64_t head = spool->head;
+
+	if (spool->tail - spool->head > spool->size || spool->size % 8) {
+		return -1;
+	}
+
+	spill->spool_count = 0;
+	while (head != spool->tail) {
+		uint64_t offset = head % spool->size;
+		const struct spill_record *record =
+			(const struct spill_record *) ((char *) (spool + 1) + offset);
+
+		if (!record->len) {
+			head += spool->size - offset;
+			continue;
+		}
+		if (record->len > spool->size - offset || spill_record_decode(record, &msg)) {
+			return -1;
+		}
+		head += spill_align(record->len);
+		spill->spool_count++;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Map the spool file, creating it or reusing the one already there.
+ *
+ * A valid spool keeps its size and its records, which are replayed before
+ * any new message.
+ */
+static int spool_open(struct ami_kafka_spill *spill, const char *path, size_t size)
+{
+	struct spool_header header;
+	struct stat st;
+	int fresh = 1;
+
+	size &= ~(size_t) 7;
+
+	spill->spool_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (spill->spool_fd < 0 || fstat(spill->spool_fd, &st)) {
+		ast_log(LOG_ERROR, "Cannot open spill_file '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (st.st_size > (off_t) sizeof(header)
+		&& pread(spill->spool_fd, &header, sizeof(header), 0) == sizeof(header)
+		&& !memcmp(header.magic, SPOOL_MAGIC, sizeof(header.magic))
+		&& header.size && header.head != header.tail
+		&& st.st_size == (off_t) (sizeof(header) + header.size)) {
+		if (header.size != size) {
+			ast_log(LOG_NOTICE, "spill_file '%s' holds messages; keeping its size "
+				"of %" PRIu64 " bytes\n", path, header.size);
+		}
+		size = header.size;
+		fresh = 0;
+	} else if (ftruncate(spill->spool_fd, 0)
+		|| ftruncate(spill->spool_fd, sizeof(header) + size)) {
+		ast_log(LOG_ERROR, "Cannot size spill_file '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	spill->spool_map_size = sizeof(header) + size;
+	spill->spool = mmap(NULL, spill->spool_map_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, spill->spool_fd, 0);
+	if (spill->spool == MAP_FAILED) {
+		spill->spool = NULL;
+		ast_log(LOG_ERROR, "Cannot map spill_file '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (!fresh && spool_recover(spill)) {
+		ast_log(LOG_ERROR, "spill_file '%s' is damaged; discarding its messages\n", path);
+		fresh = 1;
+	}
+	if (fresh) {
+		memcpy(spill->spool->magic, SPOOL_MAGIC, sizeof(spill->spool->magic));
+		spill->spool->size = size;
+		spill->spool->head = 0;
+		spill->spool->tail = 0;
+		spill->spool_count = 0;
+	} else {
+		ast_log(LOG_NOTICE, "Replaying %u message(s) left in spill_file '%s'\n",
+			spill->spool_count, path);
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Create a spill.
+ *
+ * \param memory_records Capacity of the memory ring, may be 0.
+ * \param path Spool file, or NULL or "" for none.
+ * \param file_size Bytes of record space in a new spool file.
+ */
+struct ami_kafka_spill *ami_kafka_spill_alloc(unsigned int memory_records,
+	const char *path, size_t file_size)
+{
+	struct ami_kafka_spill *spill = ast_calloc(1, sizeof(*spill));
+
+	if (!spill) {
+		return NULL;
+	}
+
+	ast_mutex_init(&spill->lock);
+	ast_cond_init(&spill->cond, NULL);
+	spill->spool_fd = -1;
+	spill->file_size = file_size;
+	spill->ring_size = memory_records;
+
+	if (memory_records) {
+		spill->ring = ast_calloc(memory_records, sizeof(*spill->ring));
+		if (!spill->ring) {
+			ami_kafka_spill_free(spill);
+			return NULL;
+		}
+	}
+
+	if (!ast_strlen_zero(path)) {
+		spill->path = ast_strdup(path);
+		if (!spill->path || spool_open(spill, path, file_size)) {
+			ami_kafka_spill_free(spill);
+			return NULL;
+		}
+	}
+	spill->pending = spill->spool_count;
+	spill_update_fill(spill);
+
+	return spill;
+}
+
+/*!
+ * \brief Free a spill.
+ *
+ * Records still in memory are moved to the spool file, if there is one
+ * and they fit, so they are replayed by the next run.
+ */
+void ami_kafka_spill_free(struct ami_kafka_spill *spill)
+{
+	unsigned int lost = 0;
+
+	if (!spill) {
+		return;
+	}
+
+	while (spill->ring_count) {
+		struct spill_record *record = spill->ring[spill->ring_head];
+
+		if (!spill->spool || spool_append(spill, record)) {
+			lost++;
+		}
+		ast_free(record);
+		spill->ring_head = (spill->ring_head + 1) % spill->ring_size;
+		spill->ring_count--;
+	}
+	if (lost) {
+		ast_log(LOG_WARNING, "%u spilled message(s) lost\n", lost);
+	}
+
+	if (spill->spool) {
+		msync(spill->spool, spill->spool_map_size, MS_SYNC);
+		munmap(spill->spool, spill->spool_map_size);
+	}
+	if (spill->spool_fd >= 0) {
+		close(spill->spool_fd);
+	}
+	ast_free(spill->path);
+	ast_free(spill->ring);
+	ast_cond_destroy(&spill->cond);
+	ast_mutex_destroy(&spill->lock);
+	ast_free(spill);
+}
+
+unsigned int ami_kafka_spill_pending(struct ami_kafka_spill *spill)
+{
+	return __atomic_load_n(&spill->pending, __ATOMIC_ACQUIRE);
+}
+
+/*!
+ * \brief How full the spill is, in percent.
+ *
+ * The average of the spool file and memory ring fill levels, for the
+ * tiers there are. The file fills first, so this only goes up until
+ * messages are replayed.
+ */
+unsigned int ami_kafka_spill_fill(struct ami_kafka_spill *spill)
+{
+	return __atomic_load_n(&spill->fill, __ATOMIC_RELAXED);
+}
+
+/*!
+ * \brief Keep a message for ami_kafka_spill_drain().
+ *
+ * \retval 0 on success.
+ * \retval -1 if the spill is full; the message is lost.
+ */
+int ami_kafka_spill_push(struct ami_kafka_spill *spill, const char *topic,
+	const char *key, const void *payload, size_t len,
+	const struct ast_kafka_header *hdrs, size_t hdr_count)
+{
+	struct spill_record *record;
+	int res = 0;
+
+	record = spill_record_encode(topic, key, payload, len, hdrs, hdr_count);
+
+	ast_mutex_lock(&spill->lock);
+	if (!record) {
+		res = -1;
+	} else if (spill->spool && !spill->ring_count && !spool_append(spill, record)) {
+		ast_free(record);
+	} else if (spill->ring_count < spill->ring_size) {
+		spill->ring[(spill->ring_head + spill->ring_count) % spill->ring_size] = record;
+		spill->ring_count++;
+	} else {
+		ast_free(record);
+		res = -1;
+	}
+
+	if (res) {
+		__atomic_add_fetch(&spill->dropped, 1, __ATOMIC_RELAXED);
+	} else {
+		if (!spill->pending) {
+			ast_cond_signal(&spill->cond);
+		}
+		__atomic_store_n(&spill->pending, spill->pending + 1, __ATOMIC_RELEASE);
+		spill_update_fill(spill);
+	}
+	ast_mutex_unlock(&spill->lock);
+
+	return res;
+}
+
+/*!
+ * \brief Produce spilled messages, oldest first.
+ *
+ * Stops at the first message \a produce refuses, which stays first in line.
+ * Only one thread may drain a spill at a time; others may push meanwhile.
+ *
+ * \param max Most messages to produce.
+ * \return Number of messages produced.
+ */
+unsigned int ami_kafka_spill_drain(struct ami_kafka_spill *spill,
+	ami_kafka_produce_fn produce, struct ast_kafka_producer *producer,
+	unsigned int max)
+{
+	unsigned int produced = 0;
+
+	while (produced < max) {
+		struct spill_record *record;
+		struct spill_message msg;
+		int from_spool = 0;
+		int res;
+
+		/* Pushes never move the oldest record, so it is used unlocked */
+		ast_mutex_lock(&spill->lock);
+		record = spill->spool ? spool_peek(spill) : NULL;
+		if (record) {
+			from_spool = 1;
+		} else if (spill->ring_count) {
+			record = spill->ring[spill->ring_head];
+		}
+		ast_mutex_unlock(&spill->lock);
+
+		if (!record) {
+			break;
+		}
+
+		res = spill_record_decode(record, &msg);
+		if (!res) {
+			res = produce(producer, msg.topic, msg.key, msg.payload, msg.len,
+				msg.hdrs, msg.hdr_count);
+			if (res) {
+				break;
+			}
+			produced++;
+		} else {
+			ast_log(LOG_WARNING, "Discarding damaged spilled message\n");
+		}
+
+		ast_mutex_lock(&spill->lock);
+		if (from_spool) {
+			__atomic_store_n(&spill->spool->head,
+				spill->spool->head + spill_align(record->len), __ATOMIC_RELEASE);
+			spill->spool_count--;
+		} else {
+			ast_free(record);
+			spill->ring_head = (spill->ring_head + 1) % spill->ring_size;
+			spill->ring_count--;
+		}
+		__atomic_store_n(&spill->pending, spill->pending - 1, __ATOMIC_RELEASE);
+		spill_update_fill(spill);
+		ast_mutex_unlock(&spill->lock);
+	}
+
+	return produced;
+}
+
+/*!
+ * \brief Replay spilled messages whenever there are some.
+ *
+ * Retries every SPILL_RETRY_MS while the producer keeps refusing them.
+ */
+static void *spill_drainer(void *data)
+{
+	struct ami_kafka_spill *spill = data;
+
+	ast_mutex_lock(&spill->lock);
+	while (!spill->stopping) {
+		struct ami_kafka_snapshot *snapshot;
+		unsigned int produced = 0;
+
+		if (!spill->pending) {
+			ast_cond_wait(&spill->cond, &spill->lock);
+			continue;
+		}
+		ast_mutex_unlock(&spill->lock);
+
+		ast_rwlock_rdlock(&snapshot_lock);
+		snapshot = __atomic_load_n(&active_snapshot, __ATOMIC_ACQUIRE);
+		if (snapshot) {
+			produced = ami_kafka_spill_drain(spill, produce_hdrs, snapshot->producer,
+				SPILL_DRAIN_CHUNK);
+		}
+		ast_rwlock_unlock(&snapshot_lock);
+		stats_add(AMI_KAFKA_STAT_REPLAYED, produced);
+
+		ast_mutex_lock(&spill->lock);
+		if (produced < SPILL_DRAIN_CHUNK && spill->pending && !spill->stopping) {
+			struct timeval wait = ast_tvadd(ast_tvnow(), ast_samp2tv(SPILL_RETRY_MS, 1000));
+			struct timespec until = { .tv_sec = wait.tv_sec, .tv_nsec = wait.tv_usec * 1000 };
+
+			ast_cond_timedwait(&spill->cond, &spill->lock, &until);
+		}
+	}
+	ast_mutex_unlock(&spill->lock);
+
+	return NULL;
+}
+
+/*!
+ * \brief Create the spill and start its drainer.
+ */
+static int start_spill(const struct ami_kafka_conf_general *general)
+{
+	if (!general->spill_size && ast_strlen_zero(general->spill_file)) {
+		return 0;
+	}
+
+	event_spill = ami_kafka_spill_alloc(general->spill_size, general->spill_file,
+		general->spill_file_size);
+	if (!event_spill) {
+		return -1;
+	}
+
+	if (ast_pthread_create_background(&event_spill->drainer, NULL, spill_drainer,
+		event_spill)) {
+		ast_log(LOG_ERROR, "Failed to start ami_kafka spill drainer thread\n");
+		ami_kafka_spill_free(event_spill);
+		event_spill = NULL;
+		return -1;
+	}
+	event_spill->drainer_running = 1;
+
+	return 0;
+}
+
+/*!
+ * \brief Stop the drainer, replay what the producer takes, keep the rest.
+ *
+ * Nothing may produce anymore. What is left in memory moves to the spool
+ * file if there is one.
+ */
+static void stop_spill(const struct ami_kafka_snapshot *snapshot)
+{
+	unsigned int pending;
+
+	if (!event_spill) {
+		return;
+	}
+
+	if (event_spill->drainer_running) {
+		ast_mutex_lock(&event_spill->lock);
+		event_spill->stopping = 1;
+		ast_cond_signal(&event_spill->cond);
+		ast_mutex_unlock(&event_spill->lock);
+		pthread_join(event_spill->drainer, NULL);
+	}
+
+	if (snapshot) {
+		stats_add(AMI_KAFKA_STAT_REPLAYED, ami_kafka_spill_drain(event_spill,
+			produce_hdrs, snapshot->producer, UINT_MAX));
+	}
+
+	pending = ami_kafka_spill_pending(event_spill);
+	if (pending) {
+		ast_log(LOG_WARNING, "%u message(s) could not be replayed before unload%s\n",
+			pending, event_spill->spool ? "; spill_file keeps what fits" : "");
+	}
+
+	ami_kafka_spill_free(event_spill);
+	event_spill = NULL;
+}
+
+/*! \brief Whether the spill settings differ from the running spill. */
+static int spill_settings_changed(const struct ami_kafka_conf_general *general)
+{
+	if (!event_spill) {
+		return general->spill_size || !ast_strlen_zero(general->spill_file);
+	}
+
+	return general->spill_size != event_spill->ring_size
+		|| general->spill_file_size != event_spill->file_size
+		|| strcmp(general->spill_file, S_OR(event_spill->path, ""));
+}
+
+/*!
+ * \brief Produce a message, or spill it if the producer refuses it.
+ *
+ * While older messages wait in the spill, new ones queue behind them so
+ * that consumers still see them in order. With enqueue_timestamp, the
+ * enqueue_us header is added in the spare slot of \a hdrs right before
+ * the producer is called; it is not spilled. It needs a clock reading of
+ * its own, after compression.
+ *
+ * \param hdrs Headers, AMI_KAFKA_MAX_HEADERS of room.
+ */
+static void produce_message(const struct ami_kafka_snapshot *snapshot,
+	const char *topic, const char *key, const char *payload, size_t len,
+	struct ast_kafka_header *hdrs, size_t hdr_count)
+{
+	char enqueue_str[32];
+	size_t produce_count = hdr_count;
+
+	if (!event_spill || !ami_kafka_spill_pending(event_spill)) {
+		if (snapshot->conf->general->enqueue_timestamp
+			&& produce_count < AMI_KAFKA_MAX_HEADERS) {
+			snprintf(enqueue_str, sizeof(enqueue_str), "%" PRIu64,
+				ami_kafka_wall_clock_us(stats_now()));
+			hdrs[produce_count++] = (struct ast_kafka_header) { "enqueue_us", enqueue_str };
+		}
+		if (!produce_hdrs(snapshot->producer, topic, key, payload, len, hdrs,
+			produce_count)) {
+			ami_kafka_stats_count(AMI_KAFKA_STAT_PRODUCED);
+			return;
+		}
+		ami_kafka_stats_count(AMI_KAFKA_STAT_PRODUCE_FAILED);
+		if (!event_spill) {
+			return;
+		}
+	}
+
+	if (ami_kafka_spill_push(event_spill, topic, key, payload, len, hdrs, hdr_count)) {
+		unsigned int dropped = __atomic_load_n(&event_spill->dropped, __ATOMIC_RELAXED);
+
+		ami_kafka_stats_count(AMI_KAFKA_STAT_SPILL_DROPPED);
+		/* Log at powers of two so a full spill doesn't flood the log */
+		if (!(dropped & (dropped - 1))) {
+			ast_log(LOG_WARNING, "ami_kafka spill full, %u message(s) dropped so far\n",
+				dropped);
+		}
+		return;
+	}
+	ami_kafka_stats_count(AMI_KAFKA_STAT_SPILLED);
+}
+
+/*! \brief Lookup key of a batch */
+struct batch_key {
+	const char *topic;
+	const char *key;
+};
+
+static int batch_hash_fn(const void *obj, const int flags)
+{
+	const struct batch_key *search = obj;
+	struct batch_key key;
+
+	if ((flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_OBJECT) {
+		const struct ami_kafka_batch *batch = obj;
+
+		key.topic = batch->topic;
+		key.key = batch->key;
+		search = &key;
+	}
+
+	return ast_str_hash(search->key) ^ ast_str_hash(search->topic);
+}
+
+static int batch_cmp_fn(void *obj, void *arg, int flags)
+{
+	const struct ami_kafka_batch *batch = obj;
+	const struct batch_key *search = arg;
+	struct batch_key key;
+
+	if ((flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_OBJECT) {
+		const struct ami_kafka_batch *right = arg;
+
+		key.topic = right->topic;
+		key.key = right->key;
+		search = &key;
+	}
+
+	return !strcmp(batch->key, search->key) && !strcmp(batch->topic, search->topic)
+		? CMP_MATCH : 0;
+}
+
+/*! \brief Create an empty batch container. */
+struct ao2_container *ami_kafka_batches_alloc(void)
+{
+	return ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, 61,
+		batch_hash_fn, NULL, batch_cmp_fn);
+}
+
+static void batch_dtor(void *obj)
+{
+	struct ami_kafka_batch *batch = obj;
+
+	ao2_cleanup(batch->owner);
+	ast_free(batch->records);
+}
+
+static struct ami_kafka_batch *batch_alloc(enum ami_kafka_batch_mode mode,
+	const char *topic, const char *key, uint64_t timestamp)
+{
+	size_t topic_len = strlen(topic) + 1;
+	size_t key_len = strlen(key) + 1;
+	struct ami_kafka_batch *batch;
+
+	batch = ao2_alloc_options(sizeof(*batch) + topic_len + key_len, batch_dtor,
+		AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!batch) {
+		return NULL;
+	}
+
+	batch->records = ast_str_create(1024);
+	if (!batch->records) {
+		ao2_ref(batch, -1);
+		return NULL;
+	}
+	batch->mode = mode;
+	batch->timestamp = timestamp;
+	batch->topic = memcpy(batch->data, topic, topic_len);
+	batch->key = memcpy(batch->data + topic_len, key, key_len);
+
+	return batch;
+}
+
+/*! \brief Bytes the batch would take as a message with \a len more */
+static size_t batch_size(const struct ami_kafka_batch *batch, size_t len)
+{
+	/* One separator per record, plus the closing ']' of an array */
+	return ast_str_strlen(batch->records) + len + 2;
+}
+
+static int batch_linger_cb(const void *data);
+
+/*!
+ * \brief Add one formatted event to the batch for its topic and key.
+ *
+ * A batch is ready once it holds settings->max_events events or reaches
+ * settings->max_bytes; an event that would push a non-empty batch past
+ * max_bytes closes that batch and starts the next one. Batches that are
+ * not filled are produced when settings->linger_ms expires.
+ *
+ * \param batches Container from ami_kafka_batches_alloc().
+ * \param sched Scheduler that closes the linger times, NULL for none.
+ * \param settings Batching options.
+ * \param topic Kafka topic of the event.
+ * \param key Kafka message key of the event.
+ * \param record The formatted event.
+ * \param len Length of \a record.
+ * \param timestamp Capture time of the event, in microseconds since the epoch.
+ * \param[out] ready Batches to produce, each with a reference the caller owns.
+ * \return Number of batches in \a ready (0 to 2).
+ */
+int ami_kafka_batch_add(struct ao2_container *batches, struct ast_sched_context *sched,
+	const struct ami_kafka_batch_settings *settings, const char *topic,
+	const char *key, const char *record, size_t len, uint64_t timestamp,
+	struct ami_kafka_batch *ready[2])
+{
+	struct batch_key search = {
+		.topic = topic,
+		.key = key,
+	};
+	struct ami_kafka_batch *batch;
+	int count = 0;
+
+	ao2_lock(batches);
+
+	batch = ao2_find(batches, &search, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+	if (batch && (batch->mode != settings->mode
+		|| batch_size(batch, len) > settings->max_bytes)) {
+		/* This event doesn't fit (or the framing changed on reload) */
+		ao2_unlink_flags(batches, batch, OBJ_NOLOCK);
+		batch->linked = 0;
+		ready[count++] = batch;
+		batch = NULL;
+	}
+
+	if (!batch) {
+		batch = batch_alloc(settings->mode, topic, key, timestamp);
+		if (!batch) {
+			ao2_unlock(batches);
+			return count;
+		}
+		ao2_link_flags(batches, batch, OBJ_NOLOCK);
+		batch->linked = 1;
+
+		if (sched) {
+			batch->owner = ao2_bump(batches);
+			if (ast_sched_add(sched, settings->linger_ms, batch_linger_cb,
+				ao2_bump(batch)) < 0) {
+				ao2_ref(batch, -1);
+			}
+		}
+	}
+
+	if (ast_str_append(&batch->records, 0, "%c%.*s",
+		batch->mode == AMI_KAFKA_BATCH_NDJSON ? '\n' : (batch->count ? ',' : '['),
+		(int) len, record) > 0) {
+		batch->count++;
+	}
+
+	if (batch->count >= settings->max_events
+		|| batch_size(batch, 0) >= settings->max_bytes) {
+		ao2_unlink_flags(batches, batch, OBJ_NOLOCK);
+		batch->linked = 0;
+		ready[count++] = batch;
+	} else {
+		ao2_ref(batch, -1);
+	}
+
+	ao2_unlock(batches);
+
+	return count;
+}
+
+/*!
+ * \brief Produce a batch that was taken out of the batch container.
+ */
+static void batch_produce(const struct ami_kafka_snapshot *snapshot,
+	struct ami_kafka_batch *batch)
+{
+	const struct ami_kafka_identity *identity = snapshot->identity;
+	struct ast_kafka_header hdrs[AMI_KAFKA_MAX_HEADERS];
+	size_t hdr_count = 0;
+	char count_str[16];
+	char ts_str[32];
+	char ts_us_str[32];
+	const char *payload;
+	size_t len;
+
+	if (!batch->count) {
+		return;
+	}
+
+	if (batch->mode == AMI_KAFKA_BATCH_ARRAY) {
+		ast_str_append(&batch->records, 0, "]");
+		payload = ast_str_buffer(batch->records);
+		len = ast_str_strlen(batch->records);
+	} else {
+		/* Records were written with a leading newline; send one trailing */
+		ast_str_append(&batch->records, 0, "\n");
+		payload = ast_str_buffer(batch->records) + 1;
+		len = ast_str_strlen(batch->records) - 1;
+	}
+
+	snprintf(count_str, sizeof(count_str), "%u", batch->count);
+	snprintf(ts_str, sizeof(ts_str), "%" PRIu64, batch->timestamp / 1000000);
+	snprintf(ts_us_str, sizeof(ts_us_str), "%" PRIu64, batch->timestamp);
+
+	hdrs[hdr_count++] = (struct ast_kafka_header) { "entity_id", identity->entity_id };
+	if (identity->system_name) {
+		hdrs[hdr_count++] = (struct ast_kafka_header) { "system_name", identity->system_name };
+	}
+	hdrs[hdr_count++] = (struct ast_kafka_header) { "asterisk_version", ast_get_version() };
+	hdrs[hdr_count++] = (struct ast_kafka_header) { "format",
+		format_names[snapshot->conf->general->format] };
+	hdrs[hdr_count++] = (struct ast_kafka_header) { "batch_mode",
+		batch->mode == AMI_KAFKA_BATCH_ARRAY ? "array" : "ndjson" };
+	hdrs[hdr_count++] = (struct ast_kafka_header) { "batch_count", count_str };
+	hdrs[hdr_count++] = (struct ast_kafka_header) { "timestamp", ts_str };
+	hdrs[hdr_count++] = (struct ast_kafka_header) { "timestamp_us", ts_us_str };
+	hdrs[hdr_count++] = (struct ast_kafka_header) { "hostname", cached_hostname };
+	compress_payload(snapshot->conf->general, &payload, &len, hdrs, &hdr_count);
+
+	produce_message(snapshot, batch->topic, batch->key, payload, len, hdrs, hdr_count);
+}
+
+/*!
+ * \brief Scheduler callback: produce a batch whose linger time expired.
+ *
+ * Holds the reference taken when the batch was scheduled. Nothing is done
+ * if the batch already went out because it filled up.
+ */
+static int batch_linger_cb(const void *data)
+{
+	struct ami_kafka_batch *batch = (struct ami_kafka_batch *) data;
+	struct ami_kafka_snapshot *snapshot;
+	int expired = 0;
+
+	ao2_lock(batch->owner);
+	if (batch->linked) {
+		ao2_unlink_flags(batch->owner, batch, OBJ_NOLOCK);
+		batch->linked = 0;
+		expired = 1;
+	}
+	ao2_unlock(batch->owner);
+
+	if (expired) {
+		ast_rwlock_rdlock(&snapshot_lock);
+		snapshot = __atomic_load_n(&active_snapshot, __ATOMIC_ACQUIRE);
+		if (snapshot) {
+			batch_produce(snapshot, batch);
+		}
+		ast_rwlock_unlock(&snapshot_lock);
+	}
+
+	ao2_ref(batch, -1);
+	return 0;
+}
+
+/*! \brief Scheduler cleanup: drop the reference of a cancelled linger timer */
+static int batch_linger_cleanup(const void *data)
+{
+	ao2_ref((void *) data, -1);
+	return 0;
+}
+
+static int batch_flush_cb(void *obj, void *arg, int flags)
+{
+	struct ami_kafka_batch *batch = obj;
+
+	batch->linked = 0;
+	batch_produce(arg, batch);
+
+	return CMP_MATCH;
+}
+
+/*!
+ * \brief Produce every pending batch.
+ *
+ * Called by stop_batching(), once the scheduler is gone.
+ */
+static void batches_flush_all(const struct ami_kafka_snapshot *snapshot)
+{
+	if (batches) {
+		if (snapshot) {
+			ao2_callback(batches, OBJ_UNLINK | OBJ_MULTIPLE | OBJ_NODATA,
+				batch_flush_cb, (void *) snapshot);
+		}
+		ao2_ref(batches, -1);
+		batches = NULL;
+	}
+}
+
+static int calls_sweep_cb(const void *data);
+static int coalesce_expire_cb(const void *data);
+static int coalesce_expire_cleanup(const void *data);
+static void coalesced_flush_all(const struct ami_kafka_snapshot *snapshot);
+
+/*!
+ * \brief Stop the scheduler, then publish held events and pending batches.
+ *
+ * Called on unload, once nothing can add events anymore. Destroying the
+ * scheduler waits for a callback that is already running, so nothing
+ * touches the containers while they are flushed and released.
+ */
+static void stop_batching(const struct ami_kafka_snapshot *snapshot)
+{
+	if (batch_sched) {
+		ast_sched_clean_by_callback(batch_sched, coalesce_expire_cb,
+			coalesce_expire_cleanup);
+		ast_sched_clean_by_callback(batch_sched, batch_linger_cb, batch_linger_cleanup);
+		ast_sched_context_destroy(batch_sched);
+		batch_sched = NULL;
+	}
+
+	/* Held events may still be batched, so they go out first */
+	coalesced_flush_all(snapshot);
+	batches_flush_all(snapshot);
+
+	/* Only the sweep, gone with the scheduler, used it besides the hook */
+	ao2_cleanup(calls);
+	calls = NULL;
+}
+
+/*!
+ * \brief Create the batch, coalescing and call containers and start the
+ * scheduler that closes their linger times and windows and sweeps calls.
+ */
+static int start_batching(void)
+{
+	batches = ami_kafka_batches_alloc();
+	coalesced = ami_kafka_coalesced_alloc();
+	calls = ami_kafka_calls_alloc();
+	batch_sched = ast_sched_context_create();
+	if (!batches || !coalesced || !calls || !batch_sched
+		|| ast_sched_start_thread(batch_sched)
+		|| ast_sched_add(batch_sched, CALL_SWEEP_INTERVAL_MS, calls_sweep_cb, NULL) < 0) {
+		stop_batching(NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Hand one formatted event to batching and produce what is ready.
+ */
+static void batch_publish(const struct ami_kafka_snapshot *snapshot,
+	const char *topic, const char *key, const char *record, size_t len,
+	uint64_t timestamp)
+{
+	struct ami_kafka_batch *ready[2];
+	int count;
+	int i;
+
+	count = ami_kafka_batch_add(batches, batch_sched, &snapshot->conf->general->batch,
+		topic, key, record, len, timestamp, ready);
+	for (i = 0; i < count; i++) {
+		batch_produce(snapshot, ready[i]);
+		ao2_ref(ready[i], -1);
+	}
+}
+
+/*!
+ * \brief Format and publish one AMI event that passed the filters.
+ *
+ * \param snapshot Configuration, producer and precomputed identity.
+ * \param category AMI event category bitmask (EVENT_FLAG_*).
+ * \param event AMI event name (e.g., "Newchannel", "Hangup").
+ * \param headers Index of the event body; 'fields(...)' rules remove the
+ *        headers they leave out.
+ * \param timestamp Capture time of the event, in microseconds since the epoch.
+ * \param call Position of the event in its call, sent as Kafka headers.
+ * \param start When the format stage started, from stats_now().
+ */
+static void publish_indexed(const struct ami_kafka_snapshot *snapshot,
+	int category, const char *event, struct ami_header_index *headers,
+	uint64_t timestamp, const struct ami_kafka_call_stamp *call, uint64_t start)
+{
+	const struct ami_kafka_conf *conf = snapshot->conf;
+	const struct ami_kafka_identity *identity = snapshot->identity;
+	struct ast_kafka_header hdrs[AMI_KAFKA_MAX_HEADERS];
+	char key_buf[AMI_KAFKA_MAX_KEY];
+	char cat_str[256];
+	char ts_str[32];
+	char ts_us_str[32];
+	char seq_str[16];
+	char start_str[32];
+	const char *key;
+	const char *topic;
+	const char *payload;
+	size_t payload_len;
+	size_t hdr_count;
+	struct ast_str *buf;
+	size_t projected;
+	uint64_t end;
+	size_t i;
+
+	if (!conf->kafka || ast_strlen_zero(conf->kafka->topic)) {
+		return;
+	}
+
+	buf = ast_str_thread_get(&payload_buf, 1024);
+	if (!buf) {
+		ami_kafka_stats_count(AMI_KAFKA_STAT_FORMAT_FAILED);
+		return;
+	}
+
+	/* The key may come from a header the projection leaves out */
+	key = ami_kafka_message_key(&conf->kafka->key_source, event, headers,
+		identity, key_buf, sizeof(key_buf));
+	projected = ami_kafka_project(conf->general->projections, event, category, headers);
+
+	if (conf->general->format == AMI_KAFKA_FORMAT_JSON
+		|| conf->general->format == AMI_KAFKA_FORMAT_JSON_TYPED) {
+		ast_str_reset(buf);
+		if (ami_json_write(&buf, event, headers, identity)) {
+			ami_kafka_stats_count(AMI_KAFKA_STAT_FORMAT_FAILED);
+			return;
+		}
+	} else if (conf->general->format == AMI_KAFKA_FORMAT_MSGPACK) {
+		ast_str_reset(buf);
+		if (ami_msgpack_write(&buf, event, headers, identity)) {
+			ami_kafka_stats_count(AMI_KAFKA_STAT_FORMAT_FAILED);
+			return;
+		}
+	} else {
+		/* AMI format: prepend system identification headers */
+		ast_str_set_substr(&buf, 0, identity->ami_prefix, identity->ami_prefix_len);
+		if (!projected) {
+			ast_str_append_substr(&buf, 0, headers->body, headers->body_len);
+		} else {
+			for (i = 0; i < headers->count; i++) {
+				ast_str_append_substr(&buf, 0, headers->items[i].line,
+					headers->items[i].line_len);
+				ast_str_append_substr(&buf, 0, "\r\n", 2);
+			}
+			ast_str_append_substr(&buf, 0, "\r\n", 2);
+		}
+	}
+
+	ami_kafka_stats_count(AMI_KAFKA_STAT_FORMATTED);
+	end = stats_now();
+	ami_kafka_stats_record(AMI_KAFKA_STAGE_FORMAT, end - start);
+	start = end;
+
+	topic = ami_kafka_route_topic(conf->kafka->routes, event, category,
+		conf->kafka->topic);
+
+	if (conf->general->batch.mode != AMI_KAFKA_BATCH_NONE && batches) {
+		batch_publish(snapshot, topic, key, ast_str_buffer(buf),
+			ast_str_strlen(buf), timestamp);
+		ami_kafka_stats_count(AMI_KAFKA_STAT_BATCHED);
+		ami_kafka_stats_record(AMI_KAFKA_STAGE_PRODUCE, stats_now() - start);
+		return;
+	}
+
+	/* Only the per-event Kafka headers are filled in */
+	snprintf(ts_str, sizeof(ts_str), "%" PRIu64, timestamp / 1000000);
+	snprintf(ts_us_str, sizeof(ts_us_str), "%" PRIu64, timestamp);
+
+	memcpy(hdrs, identity->headers, identity->header_count * sizeof(*hdrs));
+	hdrs[identity->event_type_header].value = event;
+	hdrs[identity->event_category_header].value =
+		ami_kafka_category_str(category, cat_str, sizeof(cat_str));
+	hdrs[identity->timestamp_header].value = ts_str;
+	hdrs[identity->timestamp_us_header].value = ts_us_str;
+	hdr_count = identity->header_count;
+	if (call && call->sequence && hdr_count + 2 <= AMI_KAFKA_MAX_HEADERS) {
+		snprintf(seq_str, sizeof(seq_str), "%u", call->sequence);
+		snprintf(start_str, sizeof(start_str), "%ld", (long) call->start);
+		hdrs[hdr_count++] = (struct ast_kafka_header) { "call_sequence", seq_str };
+		hdrs[hdr_count++] = (struct ast_kafka_header) { "call_start", start_str };
+	}
+
+	payload = ast_str_buffer(buf);
+	payload_len = ast_str_strlen(buf);
+	compress_payload(conf->general, &payload, &payload_len, hdrs, &hdr_count);
+
+	produce_message(snapshot, topic, key, payload, payload_len, hdrs, hdr_count);
+	ami_kafka_stats_record(AMI_KAFKA_STAGE_PRODUCE, stats_now() - start);
+}
+
+/*! \brief Lookup key of a held event */
+struct coalesced_key {
+	const char *event;
+	const char *identity;
+};
+
+static int coalesced_hash_fn(const void *obj, const int flags)
+{
+	const struct coalesced_key *search = obj;
+	struct coalesced_key key;
+
+	if ((flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_OBJECT) {
+		const struct ami_kafka_coalesced *held = obj;
+
+		key.event = held->event;
+		key.identity = held->identity;
+		search = &key;
+	}
+
+	return ast_str_hash(search->identity) ^ ast_str_hash(search->event);
+}
+
+static int coalesced_cmp_fn(void *obj, void *arg, int flags)
+{
+	const struct ami_kafka_coalesced *held = obj;
+	const struct coalesced_key *search = arg;
+	struct coalesced_key key;
+
+	if ((flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_OBJECT) {
+		const struct ami_kafka_coalesced *right = arg;
+
+		key.event = right->event;
+		key.identity = right->identity;
+		search = &key;
+	}
+
+	return !strcmp(held->identity, search->identity) && !strcmp(held->event, search->event)
+		? CMP_MATCH : 0;
+}
+
+/*! \brief Create an empty container of held events. */
+struct ao2_container *ami_kafka_coalesced_alloc(void)
+{
+	return ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, 257,
+		coalesced_hash_fn, NULL, coalesced_cmp_fn);
+}
+
+static void coalesced_dtor(void *obj)
+{
+	struct ami_kafka_coalesced *held = obj;
+
+	ao2_cleanup(held->owner);
+	ast_free(held->body);
+}
+
+/*!
+ * \brief Hold an event so only the latest of a burst is published.
+ *
+ * The first event of an entity matching a 'coalesce(...)' rule opens a
+ * window of \a window_ms; later events with the same name and identity
+ * header value replace it until the window expires and the held event is
+ * published.
+ *
+ * \param held Container from ami_kafka_coalesced_alloc().
+ * \param sched Scheduler that closes the windows, NULL for none.
+ * \param rules Compiled 'coalesce(...)' rules.
+ * \param headers Index of the event body.
+ * \param call Position of the event in its call, NULL for none.
+ * \retval 1 the event is held
+ * \retval 0 the event is not coalesced and should be published now
+ */
+int ami_kafka_coalesce(struct ao2_container *held, struct ast_sched_context *sched,
+	struct ami_kafka_routes *rules, unsigned int window_ms, int category,
+	const char *event, const struct ami_header_index *headers, uint64_t timestamp,
+	const struct ami_kafka_call_stamp *call)
+{
+	static const struct ami_kafka_call_stamp untracked;
+	struct ami_kafka_route *route = routes_match(rules, event, category);
+	struct ami_kafka_coalesced *entry;
+	const struct ami_header *header;
+	struct coalesced_key search;
+	char identity[AMI_KAFKA_MAX_KEY];
+	char *body;
+	size_t identity_len;
+	size_t event_len;
+
+	if (!route || !held) {
+		return 0;
+	}
+	header = header_index_find(headers, route->topic, route->header_len,
+		route->header_hash);
+	if (!header) {
+		return 0;
+	}
+	identity_len = MIN(header->line_len - header->key_len - 2, sizeof(identity) - 1);
+	memcpy(identity, header->line + header->key_len + 2, identity_len);
+	identity[identity_len] = '\0';
+
+	body = ast_malloc(headers->body_len + 1);
+	if (!body) {
+		return 0;
+	}
+	memcpy(body, headers->body, headers->body_len);
+	body[headers->body_len] = '\0';
+
+	search.event = event;
+	search.identity = identity;
+
+	ao2_lock(held);
+	entry = ao2_find(held, &search, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+	if (entry) {
+		ast_free(entry->body);
+		entry->body = body;
+		entry->category = category;
+		entry->timestamp = timestamp;
+		entry->call = call ? *call : untracked;
+		entry->replaced++;
+		ao2_unlock(held);
+		ao2_ref(entry, -1);
+		ami_kafka_stats_count(AMI_KAFKA_STAT_COALESCED);
+		return 1;
+	}
+
+	event_len = strlen(event) + 1;
+	entry = ao2_alloc_options(sizeof(*entry) + event_len + identity_len + 1,
+		coalesced_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!entry) {
+		ao2_unlock(held);
+		ast_free(body);
+		return 0;
+	}
+	entry->body = body;
+	entry->category = category;
+	entry->timestamp = timestamp;
+	entry->call = call ? *call : untracked;
+	entry->event = memcpy(entry->data, event, event_len);
+	entry->identity = memcpy(entry->data + event_len, identity, identity_len + 1);
+
+	if (sched) {
+		entry->owner = ao2_bump(held);
+		if (ast_sched_add(sched, window_ms, coalesce_expire_cb, ao2_bump(entry)) < 0) {
+			/* Nothing would publish it; let it go out now instead */
+			ao2_ref(entry, -2);
+			ao2_unlock(held);
+			return 0;
+		}
+	}
+	ao2_link_flags(held, entry, OBJ_NOLOCK);
+	entry->linked = 1;
+	ao2_unlock(held);
+	ao2_ref(entry, -1);
+
+	return 1;
+}
+
+/*!
+ * \brief Take a held event out of the container.
+ *
+ * \return The event, with a reference the caller owns, or NULL.
+ */
+struct ami_kafka_coalesced *ami_kafka_coalesced_take(struct ao2_container *held,
+	const char *event, const char *identity)
+{
+	struct coalesced_key search = {
+		.event = event,
+		.identity = identity,
+	};
+	struct ami_kafka_coalesced *entry;
+
+	ao2_lock(held);
+	entry = ao2_find(held, &search, OBJ_SEARCH_KEY | OBJ_UNLINK | OBJ_NOLOCK);
+	if (entry) {
+		entry->linked = 0;
+	}
+	ao2_unlock(held);
+
+	return entry;
+}
+
+/*!
+ * \brief Format and publish the latest event of a closed window.
+ */
+static void coalesced_publish(const struct ami_kafka_snapshot *snapshot,
+	struct ami_kafka_coalesced *entry)
+{
+	struct ami_header_index headers;
+
+	if (!ami_header_index_build(&headers, entry->body)) {
+		publish_indexed(snapshot, entry->category, entry->event, &headers,
+			entry->timestamp, &entry->call, stats_now());
+	}
+	ami_header_index_free(&headers);
+}
+
+/*!
+ * \brief Scheduler callback: publish a held event whose window expired.
+ *
+ * Holds the reference taken when the window was opened. Nothing is done
+ * if the event was already taken out on unload.
+ */
+static int coalesce_expire_cb(const void *data)
+{
+	struct ami_kafka_coalesced *entry = (struct ami_kafka_coalesced *) data;
+	struct ami_kafka_snapshot *snapshot;
+	int expired = 0;
+
+	ao2_lock(entry->owner);
+	if (entry->linked) {
+		ao2_unlink_flags(entry->owner, entry, OBJ_NOLOCK);
+		entry->linked = 0;
+		expired = 1;
+	}
+	ao2_unlock(entry->owner);
+
+	if (expired) {
+		ast_rwlock_rdlock(&snapshot_lock);
+		snapshot = __atomic_load_n(&active_snapshot, __ATOMIC_ACQUIRE);
+		if (snapshot) {
+			coalesced_publish(snapshot, entry);
+		}
+		ast_rwlock_unlock(&snapshot_lock);
+	}
+
+	ao2_ref(entry, -1);
+	return 0;
+}
+
+/*! \brief Scheduler cleanup: drop the reference of a cancelled window */
+static int coalesce_expire_cleanup(const void *data)
+{
+	ao2_ref((void *) data, -1);
+	return 0;
+}
+
+static int coalesced_flush_cb(void *obj, void *arg, int flags)
+{
+	struct ami_kafka_coalesced *entry = obj;
+
+	entry->linked = 0;
+	coalesced_publish(arg, entry);
+
+	return CMP_MATCH;
+}
+
+/*!
+ * \brief Publish the events held in open coalescing windows.
+ *
+ * Called by stop_batching(), once the scheduler is gone.
+ */
+static void coalesced_flush_all(const struct ami_kafka_snapshot *snapshot)
+{
+	if (coalesced) {
+		if (snapshot) {
+			ao2_callback(coalesced, OBJ_UNLINK | OBJ_MULTIPLE | OBJ_NODATA,
+				coalesced_flush_cb, (void *) snapshot);
+		}
+		ao2_ref(coalesced, -1);
+		coalesced = NULL;
+	}
+}
+
+static int call_hash_fn(const void *obj, const int flags)
+{
+	const struct ami_kafka_call *call = obj;
+
+	if ((flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY) {
+		return ast_str_hash(obj);
+	}
+
+	return ast_str_hash(call->linkedid);
+}
+
+static int call_cmp_fn(void *obj, void *arg, int flags)
+{
+	const struct ami_kafka_call *call = obj;
+	const char *linkedid = arg;
+
+	if ((flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_OBJECT) {
+		linkedid = ((const struct ami_kafka_call *) arg)->linkedid;
+	}
+
+	return !strcmp(call->linkedid, linkedid) ? CMP_MATCH : 0;
+}
+
+/*! \brief Create an empty container of tracked calls. */
+struct ao2_container *ami_kafka_calls_alloc(void)
+{
+	return ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, 1021,
+		call_hash_fn, NULL, call_cmp_fn);
+}
+
+/*!
+ * \brief Find a header of an event by name.
+ *
+ * \return The value, \a len bytes up to the end of its line, or NULL.
+ */
+static const char *call_header_value(const struct ami_header_index *headers,
+	const char *name, size_t name_len, size_t *len)
+{
+	const struct ami_header *header = header_index_find(headers, name, name_len,
+		name_hash(name, name_len));
+
+	if (!header) {
+		return NULL;
+	}
+	*len = header->line_len - name_len - 2;
+
+	return header->line + name_len + 2;
+}
+
+/*! \brief Copy a header of an event into \a dst, truncated; unchanged if absent */
+static void call_copy_header(char *dst, size_t size,
+	const struct ami_header_index *headers, const char *name)
+{
+	size_t len;
+	const char *value = call_header_value(headers, name, strlen(name), &len);
+
+	if (value) {
+		len = MIN(len, size - 1);
+		memcpy(dst, value, len);
+		dst[len] = '\0';
+	}
+}
+
+/*! \brief Update the summary of \a call with one of its events */
+static void call_summary_update(struct ami_kafka_call *call, const char *event,
+	const struct ami_header_index *headers, time_t timestamp)
+{
+	struct ami_kafka_call_summary *summary = &call->summary;
+	const char *value;
+	size_t len;
+
+	ao2_lock(call);
+	if (!strcmp(event, "Newchannel")) {
+		if (!summary->channels++) {
+			call_copy_header(summary->channel, sizeof(summary->channel), headers, "Channel");
+			call_copy_header(summary->caller, sizeof(summary->caller), headers, "CallerIDNum");
+			call_copy_header(summary->exten, sizeof(summary->exten), headers, "Exten");
+		}
+	} else if (!strcmp(event, "Newstate")) {
+		value = call_header_value(headers, "ChannelState", 12, &len);
+		if (!summary->answer && value && len == 1 && *value == '6') {
+			summary->answer = timestamp;
+		}
+	} else if (!strcmp(event, "DialEnd")) {
+		summary->dials++;
+		call_copy_header(summary->dial_status, sizeof(summary->dial_status), headers,
+			"DialStatus");
+	} else if (!strcmp(event, "BridgeEnter")) {
+		value = call_header_value(headers, "BridgeUniqueid", 14, &len);
+		if (value && (len >= sizeof(summary->bridge)
+			|| strncmp(summary->bridge, value, len) || summary->bridge[len])) {
+			summary->bridges++;
+			call_copy_header(summary->bridge, sizeof(summary->bridge), headers,
+				"BridgeUniqueid");
+		}
+	} else if (!strcmp(event, "Hangup")) {
+		if (!summary->end) {
+			call_copy_header(summary->cause, sizeof(summary->cause), headers, "Cause");
+			call_copy_header(summary->cause_txt, sizeof(summary->cause_txt), headers,
+				"Cause-txt");
+		}
+		summary->end = timestamp;
+	}
+	ao2_unlock(call);
+}
+
+/*! \brief Hand out the next position in \a call */
+static void call_stamp(struct ami_kafka_call *call, time_t timestamp,
+	struct ami_kafka_call_stamp *stamp)
+{
+	stamp->sequence = __atomic_add_fetch(&call->sequence, 1, __ATOMIC_RELAXED);
+	stamp->start = call->start;
+	__atomic_store_n(&call->last_seen, timestamp, __ATOMIC_RELAXED);
+}
+
+/*!
+ * \brief Track the call of an event and stamp the event with its position.
+ *
+ * A Newchannel starts tracking its Linkedid, or adds a channel to a call
+ * already tracked; a Hangup removes one, and the call is forgotten with
+ * its last channel. Other events are only looked up, without taking the
+ * container lock for writing. Events of calls that started before
+ * tracking did are not stamped.
+ *
+ * \param calls Container from ami_kafka_calls_alloc().
+ * \param event AMI event name.
+ * \param headers Line index of the AMI body (see ami_header_index_build()).
+ * \param timestamp Capture time of the event.
+ * \param stamp Filled with the position of the event; sequence 0 if none.
+ * \param ended NULL to skip call summaries. Otherwise the event updates
+ *        the summary of its call, and a call that ended with it is stored
+ *        here with a reference for the caller (see ami_kafka_call_summary()).
+ * \retval 1 the event was stamped
+ * \retval 0 the event belongs to no tracked call
+ */
+int ami_kafka_call_track(struct ao2_container *calls, const char *event,
+	const struct ami_header_index *headers, time_t timestamp,
+	struct ami_kafka_call_stamp *stamp, struct ami_kafka_call **ended)
+{
+	struct ami_kafka_call *call;
+	char linkedid[AMI_KAFKA_MAX_KEY];
+	const char *value;
+	size_t len;
+	int newchannel;
+
+	stamp->sequence = 0;
+	value = call_header_value(headers, "Linkedid", 8, &len);
+	if (!value || !len || len >= sizeof(linkedid)) {
+		return 0;
+	}
+	memcpy(linkedid, value, len);
+	linkedid[len] = '\0';
+
+	newchannel = !strcmp(event, "Newchannel");
+	if (!newchannel && strcmp(event, "Hangup")) {
+		call = ao2_find(calls, linkedid, OBJ_SEARCH_KEY);
+		if (!call) {
+			return 0;
+		}
+		call_stamp(call, timestamp, stamp);
+		if (ended) {
+			call_summary_update(call, event, headers, timestamp);
+		}
+		ao2_ref(call, -1);
+		return 1;
+	}
+
+	ao2_lock(calls);
+	call = ao2_find(calls, linkedid, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+	if (!call && newchannel) {
+		call = ao2_alloc_options(sizeof(*call) + len + 1, NULL,
+			AO2_ALLOC_OPT_LOCK_MUTEX);
+		if (call) {
+			call->start = timestamp;
+			memcpy(call->linkedid, linkedid, len + 1);
+			ao2_link_flags(calls, call, OBJ_NOLOCK);
+		}
+	}
+	if (call) {
+		call->channels += newchannel ? 1 : -1;
+		call_stamp(call, timestamp, stamp);
+		if (ended) {
+			call_summary_update(call, event, headers, timestamp);
+		}
+		if (call->channels <= 0) {
+			ao2_unlink_flags(calls, call, OBJ_NOLOCK);
+			if (ended) {
+				*ended = ao2_bump(call);
+			}
+		}
+	}
+	ao2_unlock(calls);
+
+	if (!call) {
+		return 0;
+	}
+	ao2_ref(call, -1);
+
+	return 1;
+}
+
+/*!
+ * \brief Write the summary of a call as the body of a CallSummary event.
+ *
+ * Headers whose value is unknown, such as AnswerTime for a call that was
+ * never answered, are left out.
+ *
+ * \param call A call returned through the \a ended argument of
+ *        ami_kafka_call_track().
+ * \param buf Destination; replaced with "Key: Value\r\n" lines.
+ * \retval 0 on success
+ * \retval -1 on allocation failure
+ */
+int ami_kafka_call_summary(struct ami_kafka_call *call, struct ast_str **buf)
+{
+	const struct ami_kafka_call_summary *summary = &call->summary;
+	time_t end;
+	int res = 0;
+
+	ao2_lock(call);
+	end = summary->end ? summary->end : call->last_seen;
+	res |= ast_str_set(buf, 0, "Linkedid: %s\r\n", call->linkedid) < 0;
+	if (*summary->channel) {
+		res |= ast_str_append(buf, 0, "Channel: %s\r\n", summary->channel) < 0;
+		res |= ast_str_append(buf, 0, "CallerIDNum: %s\r\n", summary->caller) < 0;
+		res |= ast_str_append(buf, 0, "Exten: %s\r\n", summary->exten) < 0;
+	}
+	res |= ast_str_append(buf, 0, "StartTime: %ld\r\n", (long) call->start) < 0;
+	if (summary->answer) {
+		res |= ast_str_append(buf, 0, "AnswerTime: %ld\r\n", (long) summary->answer) < 0;
+	}
+	res |= ast_str_append(buf, 0, "EndTime: %ld\r\n", (long) end) < 0;
+	res |= ast_str_append(buf, 0, "Duration: %ld\r\n", (long) (end - call->start)) < 0;
+	res |= ast_str_append(buf, 0, "BillableSeconds: %ld\r\n",
+		summary->answer ? (long) (end - summary->answer) : 0L) < 0;
+	res |= ast_str_append(buf, 0, "Channels: %u\r\n", summary->channels) < 0;
+	res |= ast_str_append(buf, 0, "Bridges: %u\r\n", summary->bridges) < 0;
+	res |= ast_str_append(buf, 0, "Dials: %u\r\n", summary->dials) < 0;
+	if (*summary->dial_status) {
+		res |= ast_str_append(buf, 0, "DialStatus: %s\r\n", summary->dial_status) < 0;
+	}
+	if (*summary->cause) {
+		res |= ast_str_append(buf, 0, "Cause: %s\r\n", summary->cause) < 0;
+		res |= ast_str_append(buf, 0, "Cause-txt: %s\r\n", summary->cause_txt) < 0;
+	}
+	ao2_unlock(call);
+
+	return res ? -1 : 0;
+}
+
+static int call_idle_cb(void *obj, void *arg, int flags)
+{
+	const struct ami_kafka_call *call = obj;
+
+	return __atomic_load_n(&call->last_seen, __ATOMIC_RELAXED) < *(time_t *) arg
+		? CMP_MATCH : 0;
+}
+
+/*!
+ * \brief Forget the calls whose latest event was captured before \a before.
+ *
+ * \param expired NULL to drop the calls. Otherwise set to an iterator over
+ *        them (see ao2_callback()), or NULL if none; the caller destroys it
+ *        with ao2_iterator_destroy().
+ * \return How many calls were forgotten.
+ */
+unsigned int ami_kafka_calls_expire(struct ao2_container *calls, time_t before,
+	struct ao2_iterator **expired)
+{
+	int count = ao2_container_count(calls);
+
+	if (expired) {
+		*expired = ao2_callback(calls, OBJ_UNLINK | OBJ_MULTIPLE, call_idle_cb, &before);
+	} else {
+		ao2_callback(calls, OBJ_UNLINK | OBJ_MULTIPLE | OBJ_NODATA, call_idle_cb, &before);
+	}
+
+	return count - ao2_container_count(calls);
+}
+
+static void call_summary_dispatch(struct ami_kafka_snapshot *snapshot,
+	struct ami_kafka_call *call, uint64_t now);
+
+/*!
+ * \brief Scheduler callback: forget calls that went quiet.
+ *
+ * A call whose channels hung up under another Linkedid never sees its
+ * last Hangup. With call_summaries, such a call still gets its
+ * CallSummary, ending with its latest event. With call_tracking and
+ * call_summaries off, every call is forgotten.
+ */
+static int calls_sweep_cb(const void *data)
+{
+	struct ami_kafka_snapshot *snapshot;
+	struct ao2_iterator *iter = NULL;
+	struct ami_kafka_call *call;
+	time_t before = time(NULL) + 1;
+	unsigned int expired;
+	int summaries = 0;
+
+	ast_rwlock_rdlock(&snapshot_lock);
+	snapshot = __atomic_load_n(&active_snapshot, __ATOMIC_ACQUIRE);
+	if (snapshot && snapshot->conf->general && (snapshot->conf->general->call_tracking
+		|| snapshot->conf->general->call_summaries)) {
+		before -= snapshot->conf->general->call_idle_timeout + 1;
+		summaries = snapshot->conf->general->enabled
+			&& snapshot->conf->general->call_summaries;
+	}
+
+	expired = ami_kafka_calls_expire(calls, before, summaries ? &iter : NULL);
+	if (iter) {
+		while ((call = ao2_iterator_next(iter))) {
+			call_summary_dispatch(snapshot, call, ami_kafka_wall_clock_us(stats_now()));
+			ao2_ref(call, -1);
+		}
+		ao2_iterator_destroy(iter);
+	}
+	ast_rwlock_unlock(&snapshot_lock);
+
+	if (expired) {
+		ast_debug(1, "Forgot %u idle call(s)\n", expired);
+	}
+
+	return CALL_SWEEP_INTERVAL_MS;
+}
+
+/*!
+ * \brief Filter, format and publish one AMI event.
+ *
+ * Shared by the inline hook path and the asynchronous worker threads.
+ * ast_kafka_produce_hdrs() only copies data into librdkafka's internal
+ * buffer, so this is effectively non-blocking.
+ *
+ * \param snapshot Configuration, producer and precomputed identity.
+ * \param category AMI event category bitmask (EVENT_FLAG_*).
+ * \param event AMI event name (e.g., "Newchannel", "Hangup").
+ * \param body Full AMI event body text ("Key: Value\r\n...").
+ * \param index Line index of \a body if the caller already built one, or NULL.
+ * \param timestamp Capture time of the event, in microseconds since the epoch.
+ * \param call Position of the event in its call.
+ */
+static void ami_kafka_publish(const struct ami_kafka_snapshot *snapshot,
+	int category, const char *event, char *body, struct ami_header_index *index,
+	uint64_t timestamp, const struct ami_kafka_call_stamp *call)
+{
+	const struct ami_kafka_conf_general *general = snapshot->conf->general;
+	struct ami_header_index built;
+	struct ami_header_index *headers = index ? index : &built;
+	uint64_t start;
+	uint64_t end;
+
+	if (!snapshot->conf->kafka || ast_strlen_zero(snapshot->conf->kafka->topic)) {
+		return;
+	}
+
+	start = stats_now();
+
+	/* The body is scanned once; filters and formatters share the index */
+	if (!index && ami_header_index_build(&built, body)) {
+		goto done;
+	}
+
+	if (!should_send_event(general->filters, event, headers)) {
+		ami_kafka_stats_count(AMI_KAFKA_STAT_FILTERED);
+		goto done;
+	}
+
+	if (!ami_kafka_sample_keep(general->samples, event, category)) {
+		ami_kafka_stats_count(AMI_KAFKA_STAT_SAMPLED_OUT);
+		goto done;
+	}
+	if (!ami_kafka_ratelimit_allow(general->ratelimits, event, category,
+		headers, start)) {
+		ami_kafka_stats_count(AMI_KAFKA_STAT_RATE_LIMITED);
+		goto done;
+	}
+
+	if (ami_kafka_coalesce(coalesced, batch_sched, general->coalesces,
+		general->coalesce_window_ms, category, event, headers, timestamp, call)) {
+		ami_kafka_stats_record(AMI_KAFKA_STAGE_FILTER, stats_now() - start);
+		goto done;
+	}
+
+	end = stats_now();
+	ami_kafka_stats_record(AMI_KAFKA_STAGE_FILTER, end - start);
+
+	publish_indexed(snapshot, category, event, headers, timestamp, call, end);
+
+done:
+	if (!index) {
+		ami_header_index_free(&built);
+	}
+}
+
+/*! \brief Round a requested queue size up to the power of two actually used. */
+static unsigned int ami_kafka_queue_capacity(unsigned int size)
+{
+	unsigned int capacity = 2;
+
+	while (capacity < size && capacity < (1U << 30)) {
+		capacity <<= 1;
+	}
+
+	return capacity;
+}
+
+/*!
+ * \brief Allocate an asynchronous event queue.
+ *
+ * \param size Requested capacity, rounded up to a power of two.
+ * \return The queue, or NULL on failure.
+ */
+struct ami_kafka_queue *ami_kafka_queue_alloc(unsigned int size)
+{
+	struct ami_kafka_queue *queue;
+	unsigned int capacity = ami_kafka_queue_capacity(size);
+	unsigned int i;
+
+	queue = ast_calloc(1, sizeof(*queue));
+	if (!queue) {
+		return NULL;
+	}
+
+	queue->slots = ast_calloc(capacity, sizeof(*queue->slots));
+	if (!queue->slots) {
+		ast_free(queue);
+		return NULL;
+	}
+
+	if (ast_sem_init(&queue->items, 0, 0)) {
+		ast_free(queue->slots);
+		ast_free(queue);
+		return NULL;
+	}
+
+	queue->mask = capacity - 1;
+	for (i = 0; i < capacity; i++) {
+		queue->slots[i].seq = i;
+	}
+
+	return queue;
+}
+
+/*!
+ * \brief Free a queue and any events still in it.
+ *
+ * Only safe once no thread can push or pop anymore.
+ */
+void ami_kafka_queue_free(struct ami_kafka_queue *queue)
+{
+	struct ami_kafka_queued_event *item;
+
+	if (!queue) {
+		return;
+	}
+
+	while ((item = ami_kafka_queue_pop(queue))) {
+		ast_free(item);
+	}
+	ast_sem_destroy(&queue->items);
+	ast_free(queue->slots);
+	ast_free(queue);
+}
+
+/*!
+ * \brief Copy an event into the queue.
+ *
+ * Lock-free; safe to call from any number of threads concurrently.
+ *
+ * \param call Position of the event in its call, NULL for none.
+ * \retval 0 on success
+ * \retval -1 if the queue is full or allocation failed (event dropped)
+ */
+int ami_kafka_queue_push(struct ami_kafka_queue *queue, int category,
+	const char *event, const char *body, uint64_t timestamp,
+	const struct ami_kafka_call_stamp *call)
+{
+	static const struct ami_kafka_call_stamp untracked;
+	struct ami_kafka_queued_event *item;
+	struct ami_kafka_queue_slot *slot;
+	size_t event_len = strlen(event);
+	size_t body_len = strlen(body);
+	unsigned int pos;
+
+	item = ast_malloc(sizeof(*item) + body_len + 1 + event_len + 1);
+	if (!item) {
+		ast_atomic_fetch_add(&queue->dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	item->category = category;
+	item->timestamp = timestamp;
+	item->call = call ? *call : untracked;
+	memcpy(item->body, body, body_len + 1);
+	item->event = item->body + body_len + 1;
+	memcpy(item->event, event, event_len + 1);
+
+	pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		int diff;
+
+		slot = &queue->slots[pos & queue->mask];
+		diff = (int) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			ast_free(item);
+			ast_atomic_fetch_add(&queue->dropped, 1, __ATOMIC_RELAXED);
+			return -1;
+		} else {
+			pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->item = item;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	ast_sem_post(&queue->items);
+
+	return 0;
+}
+
+/*!
+ * \brief Take the oldest published event from the queue.
  *
- * Called synchronously for every AMI event under a read-lock in manager.c.
- * ast_kafka_produce() only copies data into librdkafka's internal buffer,
- * so this is effectively non-blocking.
+ * \return The event (caller must ast_free() it), or NULL if none is ready.
+ */
+struct ami_kafka_queued_event *ami_kafka_queue_pop(struct ami_kafka_queue *queue)
+{
+	struct ami_kafka_queued_event *item;
+	struct ami_kafka_queue_slot *slot;
+	unsigned int pos;
+
+	pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		int diff;
+
+		slot = &queue->slots[pos & queue->mask];
+		diff = (int) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	item = slot->item;
+	__atomic_store_n(&slot->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+
+	return item;
+}
+
+/*! \brief Number of events waiting in the queue, approximately */
+unsigned int ami_kafka_queue_depth(struct ami_kafka_queue *queue)
+{
+	unsigned int depth = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED)
+		- __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+
+	/* The two positions are read at slightly different times */
+	return MIN(depth, queue->mask + 1);
+}
+
+/*!
+ * \brief Worker thread: drain the queue and publish each event.
  *
- * \param category AMI event category bitmask (EVENT_FLAG_*).
- * \param event AMI event name (e.g., "Newchannel", "Hangup").
- * \param body Full AMI event body text ("Key: Value\r\n...").
- * \return Always 0 (never blocks the manager event dispatch).
+ * Every pushed event posts the semaphore once, and stop_workers() posts
+ * it once per worker, so each wakeup yields either an event or (while
+ * stopping, with the queue drained) an exit.
  */
-static int ami_hook_callback(int category, const char *event, char *body)
+static void *ami_kafka_worker(void *data)
 {
-	RAII_VAR(struct ami_kafka_conf *, conf, ao2_global_obj_ref(confs), ao2_cleanup);
-	struct ast_kafka_producer *producer;
-	const char *payload;
-	size_t payload_len;
-	RAII_VAR(struct ast_json *, json, NULL, ast_json_unref);
-	RAII_VAR(char *, json_str, NULL, ast_json_free);
-	RAII_VAR(struct ast_str *, ami_buf, NULL, ast_free);
+	struct ami_kafka_queue *queue = data;
 
-	if (!conf || !conf->general || !conf->general->enabled) {
-		return 0;
-	}
+	for (;;) {
+		struct ami_kafka_queued_event *item;
+		struct ami_kafka_snapshot *snapshot;
 
-	if (!should_send_event(conf->general->includefilters,
-		conf->general->excludefilters, event, body)) {
-		return 0;
+		if (ast_sem_wait(&queue->items)) {
+			continue;
+		}
+
+		while (!(item = ami_kafka_queue_pop(queue))) {
+			if (__atomic_load_n(&queue->stopping, __ATOMIC_ACQUIRE)) {
+				return NULL;
+			}
+			/* A producer reserved the head slot but has not published it yet */
+			sched_yield();
+		}
+
+		ast_rwlock_rdlock(&snapshot_lock);
+		snapshot = __atomic_load_n(&active_snapshot, __ATOMIC_ACQUIRE);
+		if (snapshot && snapshot->conf->general && snapshot->conf->general->enabled) {
+			ami_kafka_publish(snapshot, item->category, item->event, item->body, NULL,
+				item->timestamp, &item->call);
+		}
+		ast_rwlock_unlock(&snapshot_lock);
+		ast_free(item);
 	}
 
-	if (!conf->kafka || ast_strlen_zero(conf->kafka->topic)) {
-		return 0;
+	return NULL;
+}
+
+/*!
+ * \brief Create the asynchronous queue and start its worker threads.
+ */
+static int start_workers(unsigned int queue_size, unsigned int count)
+{
+	event_queue = ami_kafka_queue_alloc(queue_size);
+	if (!event_queue) {
+		return -1;
 	}
 
-	producer = ao2_global_obj_ref(cached_producer);
-	if (!producer) {
-		return 0;
+	worker_threads = ast_calloc(count, sizeof(*worker_threads));
+	if (!worker_threads) {
+		ami_kafka_queue_free(event_queue);
+		event_queue = NULL;
+		return -1;
 	}
 
-	if (conf->general->format == AMI_KAFKA_FORMAT_JSON) {
-		json = ami_body_to_json(event, body);
-		if (!json) {
-			ao2_cleanup(producer);
-			return 0;
+	for (worker_count = 0; worker_count < count; worker_count++) {
+		if (ast_pthread_create_background(&worker_threads[worker_count], NULL,
+			ami_kafka_worker, event_queue)) {
+			ast_log(LOG_ERROR, "Failed to start ami_kafka worker thread\n");
+			break;
 		}
+	}
 
-		json_str = ast_json_dump_string(json);
-		if (!json_str) {
-			ao2_cleanup(producer);
-			return 0;
-		}
+	if (!worker_count) {
+		ast_free(worker_threads);
+		worker_threads = NULL;
+		ami_kafka_queue_free(event_queue);
+		event_queue = NULL;
+		return -1;
+	}
 
-		payload = json_str;
-		payload_len = strlen(json_str);
-	} else {
-		/* AMI format: prepend system identification headers */
-		char eid_str[20];
-		ast_eid_to_str(eid_str, sizeof(eid_str), &ast_eid_default);
+	if (worker_count < count) {
+		ast_log(LOG_WARNING, "Running with %u of %u ami_kafka worker threads\n",
+			worker_count, count);
+	}
+	ast_debug(1, "Started %u ami_kafka worker thread(s), queue capacity %u\n",
+		worker_count, event_queue->mask + 1);
 
-		ami_buf = ast_str_create(strlen(body) + 128);
-		if (!ami_buf) {
-			ao2_cleanup(producer);
-			return 0;
-		}
+	return 0;
+}
+
+/*!
+ * \brief Drain the asynchronous queue and stop the worker threads.
+ *
+ * The hook must already be unregistered so nothing can push anymore.
+ */
+static void stop_workers(void)
+{
+	unsigned int i;
+
+	if (!event_queue) {
+		return;
+	}
+
+	__atomic_store_n(&event_queue->stopping, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < worker_count; i++) {
+		ast_sem_post(&event_queue->items);
+	}
+	for (i = 0; i < worker_count; i++) {
+		pthread_join(worker_threads[i], NULL);
+	}
 
-		ast_str_set(&ami_buf, 0, "EntityID: %s\r\n", eid_str);
-		if (!ast_strlen_zero(ast_config_AST_SYSTEM_NAME)) {
-			ast_str_append(&ami_buf, 0, "SystemName: %s\r\n",
-				ast_config_AST_SYSTEM_NAME);
+	ast_free(worker_threads);
+	worker_threads = NULL;
+	worker_count = 0;
+	ami_kafka_queue_free(event_queue);
+	event_queue = NULL;
+}
+
+/*!
+ * \brief How full the pipeline is, in percent.
+ *
+ * The fuller of the asynchronous queue and the spill of refused messages.
+ */
+static unsigned int pipeline_load(void)
+{
+	unsigned int load = 0;
+
+	if (event_queue) {
+		load = (uint64_t) ami_kafka_queue_depth(event_queue) * 100 / (event_queue->mask + 1);
+	}
+	if (event_spill) {
+		load = MAX(load, ami_kafka_spill_fill(event_spill));
+	}
+
+	return load;
+}
+
+/*!
+ * \brief Shed, queue or publish one event raised by manager or by the module.
+ *
+ * \param headers Line index of \a body, or NULL. Only the inline path uses
+ *        it: queued events are copied and indexed again by the worker.
+ */
+static void hook_dispatch(struct ami_kafka_snapshot *snapshot, int category,
+	const char *event, char *body, struct ami_header_index *headers, uint64_t now,
+	const struct ami_kafka_call_stamp *call)
+{
+	struct ami_kafka_conf_general *general = snapshot->conf->general;
+	unsigned int load;
+
+	/* Priorities are only looked up once the pipeline starts to fill */
+	load = pipeline_load();
+	if (load >= general->shed_from) {
+		enum ami_kafka_priority priority = ami_kafka_event_priority(
+			general->priorities, event, category);
+
+		if (ami_kafka_shed(&general->shed, priority, load)) {
+			ami_kafka_stats_count(priority == AMI_KAFKA_PRIORITY_LOW
+				? AMI_KAFKA_STAT_SHED_LOW : AMI_KAFKA_STAT_SHED_NORMAL);
+			return;
 		}
-		ast_str_append(&ami_buf, 0, "%s", body);
+	}
+
+	if (event_queue) {
+		if (ami_kafka_queue_push(event_queue, category, event, body, now, call)) {
+			unsigned int dropped = __atomic_load_n(&event_queue->dropped,
+				__ATOMIC_RELAXED);
+
+			ami_kafka_stats_count(AMI_KAFKA_STAT_QUEUE_FULL);
+			if (ami_kafka_event_priority(general->priorities, event, category)
+				== AMI_KAFKA_PRIORITY_CRITICAL) {
+				ami_kafka_stats_count(AMI_KAFKA_STAT_CRITICAL_DROPPED);
+			}
 
-		payload = ast_str_buffer(ami_buf);
-		payload_len = ast_str_strlen(ami_buf);
+			/* Log at powers of two so a saturated queue doesn't flood the log */
+			if (!(dropped & (dropped - 1))) {
+				ast_log(LOG_WARNING, "ami_kafka queue full, %u event(s) dropped so far\n",
+					dropped);
+			}
+		}
+		return;
 	}
 
-	/* Build Kafka message headers */
-	{
-		char eid_str[20];
-		char cat_str[256];
-		char ts_str[32];
-		struct ast_kafka_header hdrs[8];
-		size_t hdr_count = 0;
+	ami_kafka_publish(snapshot, category, event, body, headers, now, call);
+}
 
-		ast_eid_to_str(eid_str, sizeof(eid_str), &ast_eid_default);
-		category_to_str(category, cat_str, sizeof(cat_str));
-		snprintf(ts_str, sizeof(ts_str), "%ld", (long) time(NULL));
+/*!
+ * \brief Raise the CallSummary event of a call that just ended.
+ *
+ * It follows the Hangup that ended the call, or the sweep that dropped
+ * it, through the same pipeline, numbered right after its latest event
+ * when call_tracking is on.
+ */
+static void call_summary_dispatch(struct ami_kafka_snapshot *snapshot,
+	struct ami_kafka_call *call, uint64_t now)
+{
+	struct ami_kafka_call_stamp position = { 0, };
+	struct ast_str *body = ast_str_create(512);
 
-		hdrs[hdr_count].name = "entity_id";
-		hdrs[hdr_count].value = eid_str;
-		hdr_count++;
+	if (!body || ami_kafka_call_summary(call, &body)) {
+		ast_free(body);
+		return;
+	}
+	if (snapshot->conf->general->call_tracking) {
+		position.sequence = __atomic_add_fetch(&call->sequence, 1, __ATOMIC_RELAXED);
+		position.start = call->start;
+	}
+
+	ami_kafka_stats_count(AMI_KAFKA_STAT_CALL_SUMMARIES);
+	hook_dispatch(snapshot, EVENT_FLAG_CDR, "CallSummary", ast_str_buffer(body), NULL,
+		now, &position);
+	ast_free(body);
+}
 
-		if (!ast_strlen_zero(ast_config_AST_SYSTEM_NAME)) {
-			hdrs[hdr_count].name = "system_name";
-			hdrs[hdr_count].value = ast_config_AST_SYSTEM_NAME;
-			hdr_count++;
+/*!
+ * \brief AMI hook callback — hot path.
+ *
+ * Called synchronously for every AMI event under a read-lock in manager.c.
+ * In async mode the event is only copied into the lock-free queue;
+ * otherwise it is filtered, formatted and published inline. With call
+ * tracking, the body is indexed here once, for the call table and for
+ * the inline path. The event that ends a call is followed by its
+ * CallSummary with call_summaries.
+ *
+ * \param category AMI event category bitmask (EVENT_FLAG_*).
+ * \param event AMI event name (e.g., "Newchannel", "Hangup").
+ * \param body Full AMI event body text ("Key: Value\r\n...").
+ * \return Always 0 (never blocks the manager event dispatch).
+ */
+static int ami_hook_callback(int category, const char *event, char *body)
+{
+	struct ami_kafka_snapshot *snapshot;
+	struct ami_kafka_conf_general *general;
+	struct ami_kafka_call_stamp call = { 0, };
+	struct ami_kafka_call *ended = NULL;
+	struct ami_header_index headers;
+	struct ami_header_index *index = NULL;
+	uint64_t start = stats_now();
+	uint64_t now = ami_kafka_wall_clock_us(start);
+
+	ami_kafka_stats_count(AMI_KAFKA_STAT_SEEN);
+
+	/* No reference needed: we run under the hook list read lock */
+	snapshot = __atomic_load_n(&active_snapshot, __ATOMIC_ACQUIRE);
+	if (!snapshot || !snapshot->conf->general || !snapshot->conf->general->enabled) {
+		return 0;
+	}
+	general = snapshot->conf->general;
+
+	/* Before anything can drop the event, so calls see every Newchannel and Hangup */
+	if ((general->call_tracking || general->call_summaries) && calls) {
+		if (!ami_header_index_build(&headers, body)) {
+			index = &headers;
+			ami_kafka_call_track(calls, event, index, now / 1000000, &call,
+				general->call_summaries ? &ended : NULL);
+		} else {
+			ami_header_index_free(&headers);
 		}
+		if (!general->call_tracking) {
+			call.sequence = 0;
+		}
+	}
+
+	hook_dispatch(snapshot, category, event, body, index, now, &call);
+	if (index) {
+		ami_header_index_free(index);
+	}
 
-		hdrs[hdr_count].name = "asterisk_version";
-		hdrs[hdr_count].value = ast_get_version();
-		hdr_count++;
+	if (ended) {
+		call_summary_dispatch(snapshot, ended, now);
+		ao2_ref(ended, -1);
+	}
+	ami_kafka_stats_record(AMI_KAFKA_STAGE_HOOK, stats_now() - start);
+
+	return 0;
+}
 
-		hdrs[hdr_count].name = "event_type";
-		hdrs[hdr_count].value = event;
-		hdr_count++;
+/*!
+ * \brief Send messages to \a produce instead of res_kafka.
+ *
+ * For benchmarks: every message of the module, not only the benchmark's,
+ * goes to \a produce until it is restored.
+ *
+ * \param produce Replacement, or NULL for ast_kafka_produce_hdrs().
+ * \return The function used until now.
+ */
+ami_kafka_produce_fn ami_kafka_set_produce(ami_kafka_produce_fn produce)
+{
+	return __atomic_exchange_n(&produce_hdrs, produce ? produce : ast_kafka_produce_hdrs,
+		__ATOMIC_ACQ_REL);
+}
 
-		hdrs[hdr_count].name = "event_category";
-		hdrs[hdr_count].value = cat_str;
-		hdr_count++;
+/*!
+ * \brief Hand an event to the manager hook from outside manager.
+ *
+ * The hook relies on the hook list lock to keep the snapshot alive, which
+ * other callers don't hold, so snapshot_lock is taken instead.
+ */
+int ami_kafka_hook_event(int category, const char *event, char *body)
+{
+	int res;
 
-		hdrs[hdr_count].name = "format";
-		hdrs[hdr_count].value =
-			(conf->general->format == AMI_KAFKA_FORMAT_JSON) ? "json" : "ami";
-		hdr_count++;
+	ast_rwlock_rdlock(&snapshot_lock);
+	res = ami_hook_callback(category, event, body);
+	ast_rwlock_unlock(&snapshot_lock);
 
-		hdrs[hdr_count].name = "timestamp";
-		hdrs[hdr_count].value = ts_str;
-		hdr_count++;
+	return res;
+}
 
-		hdrs[hdr_count].name = "hostname";
-		hdrs[hdr_count].value = cached_hostname;
-		hdr_count++;
+/*!
+ * \brief Check the hook can be benchmarked, and keep the caller's
+ * statistics out of the reported ones until ami_kafka_bench_end().
+ *
+ * The benchmark feeds synthetic events to ami_kafka_hook_event() with a
+ * stub producer installed, then restores the real one. That is only safe
+ * when each event is produced before the hook returns and leaves nothing
+ * behind: no asynchronous queue, batch, coalescing window or spilled
+ * message that would reach Kafka later, and no call record, sample or
+ * rate limit that real events share.
+ *
+ * \param[out] reason Why the loaded configuration is refused.
+ * \retval 0 the hook may be benchmarked on this thread
+ * \retval -1 it may not
+ */
+int ami_kafka_bench_begin(const char **reason)
+{
+	const struct ami_kafka_conf_general *general;
+
+	ast_rwlock_rdlock(&snapshot_lock);
+	general = active_snapshot ? active_snapshot->conf->general : NULL;
+	if (!general || !general->enabled) {
+		*reason = "the module is disabled";
+	} else if (event_queue) {
+		*reason = "async = yes";
+	} else if (general->batch.mode != AMI_KAFKA_BATCH_NONE) {
+		*reason = "batch_mode is not none";
+	} else if (general->coalesces->num_rules) {
+		*reason = "coalesce(...) rules are configured";
+	} else if (general->samples->num_rules || general->ratelimits->num_rules) {
+		*reason = "sample(...) or ratelimit(...) rules are configured";
+	} else if (general->call_tracking || general->call_summaries) {
+		*reason = "call_tracking or call_summaries is on";
+	} else if (event_spill && ami_kafka_spill_pending(event_spill)) {
+		*reason = "refused messages are waiting in the spill";
+	} else {
+		*reason = NULL;
+	}
+	ast_rwlock_unlock(&snapshot_lock);
 
-		ast_kafka_produce_hdrs(producer, conf->kafka->topic, event,
-			payload, payload_len, hdrs, hdr_count);
+	if (*reason) {
+		return -1;
 	}
 
-	ao2_cleanup(producer);
+	stats_isolated_thread = pthread_self();
+	__atomic_store_n(&stats_isolated, 1, __ATOMIC_RELEASE);
+
 	return 0;
 }
 
+/*! \brief Report the caller's statistics again, after ami_kafka_bench_begin(). */
+void ami_kafka_bench_end(void)
+{
+	__atomic_store_n(&stats_isolated, 0, __ATOMIC_RELEASE);
+}
+
 static int load_config(int reload)
 {
 	switch (aco_process_config(&cfg_info, reload)) {
@@ -1064,10 +7831,217 @@ static int load_config(int reload)
 	return 0;
 }
 
+/*! \brief Names of the counters, for the CLI and the AmiKafkaStats action */
+static const struct {
+	const char *cli;
+	const char *ami;
+} counter_names[AMI_KAFKA_STAT_COUNT] = {
+	[AMI_KAFKA_STAT_SEEN] = { "Events seen", "EventsSeen" },
+	[AMI_KAFKA_STAT_FILTERED] = { "Events filtered out", "EventsFiltered" },
+	[AMI_KAFKA_STAT_FORMATTED] = { "Events formatted", "EventsFormatted" },
+	[AMI_KAFKA_STAT_FORMAT_FAILED] = { "Format failures", "FormatFailures" },
+	[AMI_KAFKA_STAT_BATCHED] = { "Events batched", "EventsBatched" },
+	[AMI_KAFKA_STAT_PRODUCED] = { "Messages produced", "MessagesProduced" },
+	[AMI_KAFKA_STAT_PRODUCE_FAILED] = { "Produce failures", "ProduceFailures" },
+	[AMI_KAFKA_STAT_QUEUE_FULL] = { "Queue full drops", "QueueFullDrops" },
+	[AMI_KAFKA_STAT_CRITICAL_DROPPED] = { "Critical drops", "CriticalDrops" },
+	[AMI_KAFKA_STAT_SHED_NORMAL] = { "Shed normal", "ShedNormal" },
+	[AMI_KAFKA_STAT_SHED_LOW] = { "Shed low", "ShedLow" },
+	[AMI_KAFKA_STAT_SAMPLED_OUT] = { "Sampled out", "SampledOut" },
+	[AMI_KAFKA_STAT_RATE_LIMITED] = { "Rate limited", "RateLimited" },
+	[AMI_KAFKA_STAT_COALESCED] = { "Coalesced", "Coalesced" },
+	[AMI_KAFKA_STAT_CALL_SUMMARIES] = { "Call summaries", "CallSummaries" },
+	[AMI_KAFKA_STAT_SPILLED] = { "Messages spilled", "MessagesSpilled" },
+	[AMI_KAFKA_STAT_SPILL_DROPPED] = { "Spill full drops", "SpillFullDrops" },
+	[AMI_KAFKA_STAT_REPLAYED] = { "Messages replayed", "MessagesReplayed" },
+};
+
+/*! \brief Names of the timed stages */
+static const struct {
+	const char *cli;
+	const char *ami;
+} stage_names[AMI_KAFKA_STAGE_COUNT] = {
+	[AMI_KAFKA_STAGE_HOOK] = { "hook", "Hook" },
+	[AMI_KAFKA_STAGE_FILTER] = { "filter", "Filter" },
+	[AMI_KAFKA_STAGE_FORMAT] = { "format", "Format" },
+	[AMI_KAFKA_STAGE_PRODUCE] = { "produce", "Produce" },
+};
+
+/*! \brief Latency summary of one stage, in nanoseconds */
+struct stage_summary {
+	uint64_t count;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+};
+
+static void stage_summarize(const uint64_t *buckets, struct stage_summary *summary)
+{
+	int i;
+
+	summary->count = 0;
+	summary->max = 0;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		summary->count += buckets[i];
+	}
+	for (i = LATENCY_BUCKETS - 1; i >= 0; i--) {
+		if (buckets[i]) {
+			summary->max = i < LATENCY_BUCKETS - 1
+				? ami_kafka_latency_bucket_floor(i + 1) - 1
+				: ami_kafka_latency_bucket_floor(i);
+			break;
+		}
+	}
+	summary->p50 = ami_kafka_latency_percentile(buckets, 50.0);
+	summary->p99 = ami_kafka_latency_percentile(buckets, 99.0);
+	summary->p999 = ami_kafka_latency_percentile(buckets, 99.9);
+}
+
+static char *handle_cli_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct ami_kafka_stats *stats;
+	struct stage_summary summary;
+	size_t i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "ami kafka show stats";
+		e->usage =
+			"Usage: ami kafka show stats\n"
+			"       Show event counters and per-stage latency percentiles.\n"
+			"       Latencies are bucket upper bounds, within 12.5%.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4) {
+		return CLI_SHOWUSAGE;
+	}
+
+	/* Too large for the stack of a CLI thread */
+	stats = ast_malloc(sizeof(*stats));
+	if (!stats) {
+		return CLI_FAILURE;
+	}
+	ami_kafka_stats_collect(stats);
+
+	for (i = 0; i < AMI_KAFKA_STAT_COUNT; i++) {
+		ast_cli(a->fd, "%-20s %" PRIu64 "\n", counter_names[i].cli, stats->counters[i]);
+	}
+	ast_cli(a->fd, "%-20s %u\n", "Spill pending",
+		event_spill ? ami_kafka_spill_pending(event_spill) : 0);
+
+	ast_cli(a->fd, "\n%-8s %12s %10s %10s %10s %10s\n",
+		"Stage", "Samples", "p50 us", "p99 us", "p99.9 us", "max us");
+	for (i = 0; i < AMI_KAFKA_STAGE_COUNT; i++) {
+		stage_summarize(stats->latency[i], &summary);
+		ast_cli(a->fd, "%-8s %12" PRIu64 " %10.1f %10.1f %10.1f %10.1f\n",
+			stage_names[i].cli, summary.count, summary.p50 / 1000.0,
+			summary.p99 / 1000.0, summary.p999 / 1000.0, summary.max / 1000.0);
+	}
+
+	ast_free(stats);
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_reset_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "ami kafka reset stats";
+		e->usage =
+			"Usage: ami kafka reset stats\n"
+			"       Zero the counters and latency histograms.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ami_kafka_stats_reset();
+	ast_cli(a->fd, "app_ami_kafka statistics reset\n");
+
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry cli_ami_kafka[] = {
+	AST_CLI_DEFINE(handle_cli_show_stats, "Show app_ami_kafka statistics"),
+	AST_CLI_DEFINE(handle_cli_reset_stats, "Reset app_ami_kafka statistics"),
+};
+
+/*! \brief Answer a statistics action, zeroing the statistics once read if \a reset */
+static int manager_stats_report(struct mansession *s, const struct message *m,
+	int reset)
+{
+	struct ami_kafka_stats *stats;
+	struct stage_summary summary;
+	size_t i;
+
+	stats = ast_malloc(sizeof(*stats));
+	if (!stats) {
+		astman_send_error(s, m, "Out of memory");
+		return 0;
+	}
+	ami_kafka_stats_collect(stats);
+
+	if (reset) {
+		ami_kafka_stats_reset();
+	}
+
+	astman_start_ack(s, m);
+	for (i = 0; i < AMI_KAFKA_STAT_COUNT; i++) {
+		astman_append(s, "%s: %" PRIu64 "\r\n", counter_names[i].ami, stats->counters[i]);
+	}
+	astman_append(s, "SpillPending: %u\r\n",
+		event_spill ? ami_kafka_spill_pending(event_spill) : 0);
+	for (i = 0; i < AMI_KAFKA_STAGE_COUNT; i++) {
+		const char *name = stage_names[i].ami;
+
+		stage_summarize(stats->latency[i], &summary);
+		astman_append(s,
+			"%sSamples: %" PRIu64 "\r\n"
+			"%sP50: %" PRIu64 "\r\n"
+			"%sP99: %" PRIu64 "\r\n"
+			"%sP999: %" PRIu64 "\r\n"
+			"%sMax: %" PRIu64 "\r\n",
+			name, summary.count, name, summary.p50, name, summary.p99,
+			name, summary.p999, name, summary.max);
+	}
+	astman_append(s, "\r\n");
+
+	ast_free(stats);
+
+	return 0;
+}
+
+static int manager_stats(struct mansession *s, const struct message *m)
+{
+	/* Reading needs the reporting class only; zeroing has an action of its own */
+	if (ast_true(astman_get_header(m, "Reset"))) {
+		astman_send_error(s, m, "Use AmiKafkaStatsReset to zero the statistics");
+		return 0;
+	}
+
+	return manager_stats_report(s, m, 0);
+}
+
+static int manager_stats_reset(struct mansession *s, const struct message *m)
+{
+	return manager_stats_report(s, m, 1);
+}
+
 static int load_module(void)
 {
 	RAII_VAR(struct ami_kafka_conf *, conf, NULL, ao2_cleanup);
 
+	stats_shards_size();
+
 	if (gethostname(cached_hostname, sizeof(cached_hostname)) != 0) {
 		ast_copy_string(cached_hostname, "unknown", sizeof(cached_hostname));
 	}
@@ -1084,8 +8058,84 @@ static int load_module(void)
 		FLDSET(struct ami_kafka_conf_general, enabled));
 	aco_option_register_custom(&cfg_info, "format", ACO_EXACT,
 		general_options, "json", format_handler, 0);
+	aco_option_register(&cfg_info, "fold_headers", ACO_EXACT,
+		general_options, "no", OPT_BOOL_T, 1,
+		FLDSET(struct ami_kafka_conf_general, fold_headers));
 	aco_option_register_custom(&cfg_info, "^eventfilter", ACO_REGEX,
 		general_options, "", eventfilter_handler, 0);
+	aco_option_register(&cfg_info, "async", ACO_EXACT,
+		general_options, "no", OPT_BOOL_T, 1,
+		FLDSET(struct ami_kafka_conf_general, async));
+	aco_option_register(&cfg_info, "queue_size", ACO_EXACT,
+		general_options, "65536", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct ami_kafka_conf_general, queue_size), 16, 4194304);
+	aco_option_register(&cfg_info, "worker_threads", ACO_EXACT,
+		general_options, "1", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct ami_kafka_conf_general, worker_threads), 1, 32);
+	aco_option_register_custom(&cfg_info, "batch_mode", ACO_EXACT,
+		general_options, "none", batch_mode_handler, 0);
+	aco_option_register(&cfg_info, "batch_max_events", ACO_EXACT,
+		general_options, "500", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct ami_kafka_conf_general, batch.max_events), 1, 100000);
+	aco_option_register(&cfg_info, "batch_max_bytes", ACO_EXACT,
+		general_options, "262144", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct ami_kafka_conf_general, batch.max_bytes), 1024, 16777216);
+	aco_option_register(&cfg_info, "batch_linger_ms", ACO_EXACT,
+		general_options, "100", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct ami_kafka_conf_general, batch.linger_ms), 1, 60000);
+	aco_option_register_custom(&cfg_info, "compression", ACO_EXACT,
+		general_options, "none", compression_handler, 0);
+	aco_option_register(&cfg_info, "compression_level", ACO_EXACT,
+		general_options, "3", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct ami_kafka_conf_general, compression_level), 1, 19);
+	aco_option_register(&cfg_info, "compression_dictionary", ACO_EXACT,
+		general_options, "builtin", OPT_CHAR_ARRAY_T, 0,
+		CHARFLDSET(struct ami_kafka_conf_general, compression_dictionary));
+	aco_option_register_custom(&cfg_info, "^priority\\(", ACO_REGEX,
+		general_options, "", priority_handler, 0);
+	aco_option_register_custom(&cfg_info, "^sample\\(", ACO_REGEX,
+		general_options, "", sample_handler, 0);
+	aco_option_register_custom(&cfg_info, "^ratelimit\\(", ACO_REGEX,
+		general_options, "", ratelimit_handler, 0);
+	aco_option_register_custom(&cfg_info, "^coalesce\\(", ACO_REGEX,
+		general_options, "", coalesce_handler, 0);
+	aco_option_register(&cfg_info, "coalesce_window_ms", ACO_EXACT,
+		general_options, "250", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct ami_kafka_conf_general, coalesce_window_ms), 1, 60000);
+	aco_option_register(&cfg_info, "enqueue_timestamp", ACO_EXACT,
+		general_options, "no", OPT_BOOL_T, 1,
+		FLDSET(struct ami_kafka_conf_general, enqueue_timestamp));
+	aco_option_register(&cfg_info, "call_tracking", ACO_EXACT,
+		general_options, "no", OPT_BOOL_T, 1,
+		FLDSET(struct ami_kafka_conf_general, call_tracking));
+	aco_option_register(&cfg_info, "call_summaries", ACO_EXACT,
+		general_options, "no", OPT_BOOL_T, 1,
+		FLDSET(struct ami_kafka_conf_general, call_summaries));
+	aco_option_register(&cfg_info, "call_idle_timeout", ACO_EXACT,
+		general_options, "86400", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct ami_kafka_conf_general, call_idle_timeout), 60, 2592000);
+	aco_option_register_custom(&cfg_info, "^fields\\(", ACO_REGEX,
+		general_options, "", fields_handler, 0);
+	aco_option_register(&cfg_info, "shed_low_threshold", ACO_EXACT,
+		general_options, "50", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct ami_kafka_conf_general, shed.threshold[AMI_KAFKA_PRIORITY_LOW]),
+		1, 100);
+	aco_option_register(&cfg_info, "shed_normal_threshold", ACO_EXACT,
+		general_options, "100", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct ami_kafka_conf_general, shed.threshold[AMI_KAFKA_PRIORITY_NORMAL]),
+		1, 100);
+	aco_option_register(&cfg_info, "shed_sample", ACO_EXACT,
+		general_options, "0", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct ami_kafka_conf_general, shed.sample), 0, 1000000);
+	aco_option_register(&cfg_info, "spill_size", ACO_EXACT,
+		general_options, "10000", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct ami_kafka_conf_general, spill_size), 0, 1000000);
+	aco_option_register(&cfg_info, "spill_file", ACO_EXACT,
+		general_options, "", OPT_CHAR_ARRAY_T, 0,
+		CHARFLDSET(struct ami_kafka_conf_general, spill_file));
+	aco_option_register(&cfg_info, "spill_file_size", ACO_EXACT,
+		general_options, "67108864", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct ami_kafka_conf_general, spill_file_size), 65536, 2147483648U);
 
 	/* Register kafka options */
 	aco_option_register(&cfg_info, "connection", ACO_EXACT,
@@ -1094,6 +8144,11 @@ static int load_module(void)
 	aco_option_register(&cfg_info, "topic", ACO_EXACT,
 		kafka_options, "asterisk_ami", OPT_STRINGFIELD_T, 0,
 		STRFLDSET(struct ami_kafka_conf_kafka, topic));
+	aco_option_register_custom(&cfg_info, "^route\\(", ACO_REGEX,
+		kafka_options, "", route_handler, 0);
+	aco_option_register(&cfg_info, "partition_key", ACO_EXACT,
+		kafka_options, "event", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct ami_kafka_conf_kafka, partition_key));
 
 	if (load_config(0) != 0) {
 		ast_log(LOG_WARNING, "Configuration failed to load\n");
@@ -1109,17 +8164,50 @@ static int load_module(void)
 		return AST_MODULE_LOAD_DECLINE;
 	}
 
-	if (setup_cached_producer() != 0) {
+	if (setup_snapshot() != 0) {
 		ast_log(LOG_ERROR, "Failed to setup Kafka producer\n");
 		aco_info_destroy(&cfg_info);
 		ao2_global_obj_release(confs);
 		return AST_MODULE_LOAD_DECLINE;
 	}
 
+	if (start_spill(conf->general)) {
+		ast_log(LOG_ERROR, "Failed to set up the spill for refused messages\n");
+		snapshot_replace(NULL);
+		aco_info_destroy(&cfg_info);
+		ao2_global_obj_release(confs);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	/* Always running, so batch_mode can be turned on by a reload */
+	if (start_batching()) {
+		ast_log(LOG_ERROR, "Failed to start event batching\n");
+		stop_spill(NULL);
+		snapshot_replace(NULL);
+		aco_info_destroy(&cfg_info);
+		ao2_global_obj_release(confs);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if (conf->general->async
+		&& start_workers(conf->general->queue_size, conf->general->worker_threads)) {
+		ast_log(LOG_ERROR, "Failed to start asynchronous event queue\n");
+		stop_batching(NULL);
+		stop_spill(NULL);
+		snapshot_replace(NULL);
+		aco_info_destroy(&cfg_info);
+		ao2_global_obj_release(confs);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
 	ast_manager_register_hook(&ami_kafka_hook);
+	ast_cli_register_multiple(cli_ami_kafka, ARRAY_LEN(cli_ami_kafka));
+	ast_manager_register_xml("AmiKafkaStats", EVENT_FLAG_REPORTING, manager_stats);
+	ast_manager_register_xml("AmiKafkaStatsReset", EVENT_FLAG_SYSTEM, manager_stats_reset);
 
-	ast_log(LOG_NOTICE, "AMI Kafka publishing enabled (format=%s)\n",
-		conf->general->format == AMI_KAFKA_FORMAT_JSON ? "json" : "ami");
+	ast_log(LOG_NOTICE, "AMI Kafka publishing enabled (format=%s, %s)\n",
+		format_names[conf->general->format],
+		event_queue ? "async" : "inline");
 	return AST_MODULE_LOAD_SUCCESS;
 }
 
@@ -1127,19 +8215,57 @@ static int unload_module(void)
 {
 	/* Unregister hook first — write-lock guarantees no callback is executing */
 	ast_manager_unregister_hook(&ami_kafka_hook);
+	ast_manager_unregister("AmiKafkaStats");
+	ast_manager_unregister("AmiKafkaStatsReset");
+	ast_cli_unregister_multiple(cli_ami_kafka, ARRAY_LEN(cli_ami_kafka));
+
+	/* Workers publish whatever is still queued before exiting */
+	stop_workers();
+
+	/* Held events and batches go out with the configuration they were built under */
+	stop_batching(active_snapshot);
 
-	ao2_global_obj_release(cached_producer);
+	/* Then refused messages get a last chance, before the producer goes */
+	stop_spill(active_snapshot);
+	snapshot_replace(NULL);
+	category_cache_clear();
 	aco_info_destroy(&cfg_info);
 	ao2_global_obj_release(confs);
 
 	return 0;
 }
 
+/*! \brief Whether the async settings differ from the running queue. */
+static int async_settings_changed(const struct ami_kafka_conf_general *general)
+{
+	if (!general->async) {
+		return event_queue != NULL;
+	}
+	if (!event_queue) {
+		return 1;
+	}
+
+	return general->worker_threads != worker_count
+		|| ami_kafka_queue_capacity(general->queue_size) != event_queue->mask + 1;
+}
+
 static int reload_module(void)
 {
 	int res = load_config(1);
 	if (res == 0) {
-		setup_cached_producer();
+		RAII_VAR(struct ami_kafka_conf *, conf, ao2_global_obj_ref(confs), ao2_cleanup);
+
+		setup_snapshot();
+
+		/* The queue and its threads are sized once, at module load */
+		if (conf && conf->general && async_settings_changed(conf->general)) {
+			ast_log(LOG_WARNING, "async, queue_size and worker_threads changes "
+				"take effect when app_ami_kafka is loaded again\n");
+		}
+		if (conf && conf->general && spill_settings_changed(conf->general)) {
+			ast_log(LOG_WARNING, "spill_size, spill_file and spill_file_size changes "
+				"take effect when app_ami_kafka is loaded again\n");
+		}
 	}
 	return res;
 }
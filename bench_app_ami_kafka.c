@@ -0,0 +1,611 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright 2026 VSGroup (Virtual Sistemas e Tecnologia Ltda)  (see the AUTHORS file)
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Microbenchmarks for the app_ami_kafka hot path
+ *
+ * Adds the CLI command "ami kafka bench", which runs a corpus of
+ * realistic AMI events through the header index, the filters, the
+ * payload writers and the complete manager hook, and reports throughput
+ * and per-event latency. Messages are counted by a stub producer
+ * instead of being sent to Kafka.
+ *
+ * \author VSGroup
+ */
+
+/*** MODULEINFO
+	<depend>app_ami_kafka</depend>
+	<depend>res_kafka</depend>
+	<support_level>extended</support_level>
+ ***/
+
+#include "asterisk.h"
+
+#include <inttypes.h>
+#include <malloc.h>
+#include <time.h>
+
+#include "asterisk/astobj2.h"
+#include "asterisk/cli.h"
+#include "asterisk/json.h"
+#include "asterisk/kafka.h"
+#include "asterisk/manager.h"
+#include "asterisk/module.h"
+#include "asterisk/strings.h"
+#include "asterisk/utils.h"
+
+/* ---- Imported from app_ami_kafka.c ---- */
+
+/*! \brief Number of lines indexed on the stack before spilling to the heap */
+#define AMI_HEADER_STACK_LINES 64
+
+/*! \brief One line of an AMI body, pointing into the body text */
+struct ami_header {
+	const char *line;
+	unsigned int line_len;
+	int key_len;
+	unsigned int hash;
+};
+
+/*! \brief Every line of one AMI body, found in a single scan */
+struct ami_header_index {
+	const char *body;
+	size_t body_len;
+	struct ami_header *items;
+	size_t count;
+	size_t size;
+	struct ami_header stack[AMI_HEADER_STACK_LINES];
+};
+
+/*! \brief Signature of ast_kafka_produce_hdrs() */
+typedef int (*ami_kafka_produce_fn)(struct ast_kafka_producer *producer,
+	const char *topic, const char *key, const void *payload, size_t len,
+	const struct ast_kafka_header *headers, size_t header_count);
+
+struct ami_kafka_identity;
+struct ami_kafka_filters;
+
+extern int ami_header_index_build(struct ami_header_index *index,
+	const char *body);
+
+extern void ami_header_index_free(struct ami_header_index *index);
+
+extern int add_filter(const char *criteria, const char *filter_pattern,
+	struct ao2_container *includefilters, struct ao2_container *excludefilters);
+
+extern struct ami_kafka_filters *ami_kafka_filters_compile(
+	struct ao2_container *includefilters, struct ao2_container *excludefilters);
+
+extern int should_send_event(const struct ami_kafka_filters *filters,
+	const char *event, const struct ami_header_index *headers);
+
+extern struct ast_json *ami_body_to_json(const char *event, char *body);
+
+extern struct ami_kafka_identity *ami_kafka_identity_alloc(const char *format);
+
+extern void ami_kafka_identity_free(struct ami_kafka_identity *identity);
+
+extern int ami_json_write(struct ast_str **buf, const char *event,
+	const struct ami_header_index *headers, const struct ami_kafka_identity *identity);
+
+extern int ami_msgpack_write(struct ast_str **buf, const char *event,
+	const struct ami_header_index *headers, const struct ami_kafka_identity *identity);
+
+extern ami_kafka_produce_fn ami_kafka_set_produce(ami_kafka_produce_fn produce);
+
+extern int ami_kafka_hook_event(int category, const char *event, char *body);
+
+extern int ami_kafka_bench_begin(const char **reason);
+
+extern void ami_kafka_bench_end(void);
+
+/* ---- Corpus ---- */
+
+/*! \brief One AMI event as manager hands it to the hook */
+struct bench_event {
+	const char *name;
+	int category;
+	const char *body;
+};
+
+static const struct bench_event corpus[] = {
+	{ "Newchannel", EVENT_FLAG_CALL,
+		"Privilege: call,all\r\n"
+		"Channel: PJSIP/1001-0000002a\r\n"
+		"ChannelState: 0\r\n"
+		"ChannelStateDesc: Down\r\n"
+		"CallerIDNum: 1001\r\n"
+		"CallerIDName: Alice Example\r\n"
+		"ConnectedLineNum: <unknown>\r\n"
+		"ConnectedLineName: <unknown>\r\n"
+		"Language: en\r\n"
+		"AccountCode: \r\n"
+		"Context: from-internal\r\n"
+		"Exten: 5551234\r\n"
+		"Priority: 1\r\n"
+		"Uniqueid: 1705312200.42\r\n"
+		"Linkedid: 1705312200.42\r\n" },
+	{ "VarSet", EVENT_FLAG_DIALPLAN,
+		"Privilege: dialplan,all\r\n"
+		"Channel: PJSIP/1001-0000002a\r\n"
+		"ChannelState: 4\r\n"
+		"ChannelStateDesc: Ring\r\n"
+		"CallerIDNum: 1001\r\n"
+		"CallerIDName: Alice Example\r\n"
+		"ConnectedLineNum: <unknown>\r\n"
+		"ConnectedLineName: <unknown>\r\n"
+		"Language: en\r\n"
+		"AccountCode: \r\n"
+		"Context: macro-dial-one\r\n"
+		"Exten: s\r\n"
+		"Priority: 12\r\n"
+		"Uniqueid: 1705312200.42\r\n"
+		"Linkedid: 1705312200.42\r\n"
+		"Variable: DIALSTATUS\r\n"
+		"Value: ANSWER\r\n" },
+	{ "CoreShowChannel", EVENT_FLAG_CALL,
+		"Privilege: call,all\r\n"
+		"ActionID: 7f1c2a\r\n"
+		"Channel: PJSIP/1001-0000002a\r\n"
+		"ChannelState: 6\r\n"
+		"ChannelStateDesc: Up\r\n"
+		"CallerIDNum: 1001\r\n"
+		"CallerIDName: Alice Example\r\n"
+		"ConnectedLineNum: 5551234\r\n"
+		"ConnectedLineName: Bob Example\r\n"
+		"Language: en\r\n"
+		"AccountCode: \r\n"
+		"Context: from-internal\r\n"
+		"Exten: 5551234\r\n"
+		"Priority: 1\r\n"
+		"Uniqueid: 1705312200.42\r\n"
+		"Linkedid: 1705312200.42\r\n"
+		"Application: Dial\r\n"
+		"ApplicationData: PJSIP/5551234@trunk,30,tT\r\n"
+		"Duration: 00:01:27\r\n"
+		"BridgeId: 4a1b5c8e-7d0f-4c2a-9b3e-1f6d8a2c0e57\r\n" },
+	{ "DeviceStateChange", EVENT_FLAG_CALL,
+		"Privilege: call,all\r\n"
+		"Device: PJSIP/1001\r\n"
+		"State: INUSE\r\n" },
+	{ "Cdr", EVENT_FLAG_CDR,
+		"Privilege: cdr,all\r\n"
+		"AccountCode: 3001\r\n"
+		"Source: 1001\r\n"
+		"Destination: 5551234\r\n"
+		"DestinationContext: from-internal\r\n"
+		"CallerID: \"Alice Example\" <1001>\r\n"
+		"Channel: PJSIP/1001-0000002a\r\n"
+		"DestinationChannel: PJSIP/trunk-0000002b\r\n"
+		"LastApplication: Dial\r\n"
+		"LastData: PJSIP/5551234@trunk,30,tT\r\n"
+		"StartTime: 2024-01-15 10:30:00\r\n"
+		"AnswerTime: 2024-01-15 10:30:04\r\n"
+		"EndTime: 2024-01-15 10:31:31\r\n"
+		"Duration: 91\r\n"
+		"BillableSeconds: 87\r\n"
+		"Disposition: ANSWERED\r\n"
+		"AMAFlags: DOCUMENTATION\r\n"
+		"UniqueID: 1705312200.42\r\n"
+		"UserField: campaign=winter-2024;agent=1001;queue=sales;wrapup=callback;"
+		"notes=customer asked for a follow-up call about the annual plan renewal and "
+		"the upgrade options for the additional seats discussed during the previous "
+		"call;score=4;tags=renewal,upgrade,follow-up,priority;crm=0057000001AbCdE\r\n"
+		"Peeraccount: \r\n"
+		"Linkedid: 1705312200.42\r\n"
+		"Sequence: 8812\r\n" },
+};
+
+/* ---- Filter configurations ---- */
+
+static int add_name_filters(struct ao2_container *include,
+	struct ao2_container *exclude, int count)
+{
+	char criteria[128];
+	int i;
+
+	/* Two names from the corpus, the rest never match */
+	if (add_filter("eventfilter(action(include),name(Newchannel))", "", include, exclude)
+		|| add_filter("eventfilter(action(include),name(Cdr))", "", include, exclude)) {
+		return -1;
+	}
+	for (i = 2; i < count; i++) {
+		snprintf(criteria, sizeof(criteria),
+			"eventfilter(action(include),name(UserEvent%d))", i);
+		if (add_filter(criteria, "", include, exclude)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int add_header_filters(struct ao2_container *include,
+	struct ao2_container *exclude)
+{
+	return add_filter("eventfilter(action(exclude),header(Channel),method(starts_with))",
+			"Local/", include, exclude)
+		|| add_filter("eventfilter(action(exclude),header(Context),method(exact))",
+			"from-trunk", include, exclude)
+		|| add_filter("eventfilter(action(exclude),header(Variable),method(starts_with))",
+			"__", include, exclude)
+		|| add_filter("eventfilter(action(exclude),header(Device),method(contains))",
+			"Local", include, exclude)
+		|| add_filter("eventfilter(action(include),header(Privilege),method(contains))",
+			"all", include, exclude);
+}
+
+static int add_regex_filters(struct ao2_container *include,
+	struct ao2_container *exclude)
+{
+	return add_filter("eventfilter", "Event: (Newchannel|Hangup|Cdr|VarSet)", include, exclude)
+		|| add_filter("eventfilter", "!Channel: Local/", include, exclude)
+		|| add_filter("eventfilter", "!Variable: __", include, exclude)
+		|| add_filter("eventfilter", "!Context: from-trunk", include, exclude)
+		|| add_filter("eventfilter", "!Device: Local/", include, exclude);
+}
+
+/*!
+ * \brief Compile one filter configuration.
+ *
+ * \param kind 0 = no filters, 1 = 10 names, 2 = 100 names, 3 = header
+ *        filters, 4 = legacy regex filters.
+ */
+static struct ami_kafka_filters *bench_filters(int kind)
+{
+	struct ao2_container *include;
+	struct ao2_container *exclude;
+	struct ami_kafka_filters *filters = NULL;
+	int res = 0;
+
+	include = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
+	exclude = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
+	if (!include || !exclude) {
+		goto done;
+	}
+
+	switch (kind) {
+	case 1:
+		res = add_name_filters(include, exclude, 10);
+		break;
+	case 2:
+		res = add_name_filters(include, exclude, 100);
+		break;
+	case 3:
+		res = add_header_filters(include, exclude);
+		break;
+	case 4:
+		res = add_regex_filters(include, exclude);
+		break;
+	}
+
+	if (!res) {
+		filters = ami_kafka_filters_compile(include, exclude);
+	}
+
+done:
+	ao2_cleanup(include);
+	ao2_cleanup(exclude);
+	return filters;
+}
+
+/* ---- Measurement ---- */
+
+/*! \brief Shared state of one "ami kafka bench" run */
+struct bench_state {
+	struct ami_header_index headers[ARRAY_LEN(corpus)];
+	char *bodies[ARRAY_LEN(corpus)];
+	struct ami_kafka_identity *json_identity;
+	struct ami_kafka_identity *json_typed_identity;
+	struct ami_kafka_identity *msgpack_identity;
+	struct ami_kafka_filters *filters;
+	struct ast_str *buf;
+	/*! \brief per-event latencies of the current case */
+	uint64_t *samples;
+	unsigned int iterations;
+};
+
+/*! \brief Process one corpus event; return non-zero to abort the case */
+typedef int (*bench_fn)(struct bench_state *state, size_t index);
+
+/*! \brief Messages handed to the stub producer */
+static unsigned int produced;
+
+static int stub_produce(struct ast_kafka_producer *producer, const char *topic,
+	const char *key, const void *payload, size_t len,
+	const struct ast_kafka_header *headers, size_t header_count)
+{
+	__atomic_add_fetch(&produced, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*! \brief Bytes currently allocated from the heap */
+static size_t heap_in_use(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	return mallinfo2().uordblks;
+#else
+	return (unsigned int) mallinfo().uordblks;
+#endif
+}
+
+static int uint64_cmp(const void *a, const void *b)
+{
+	uint64_t left = *(const uint64_t *) a;
+	uint64_t right = *(const uint64_t *) b;
+
+	return left < right ? -1 : left > right;
+}
+
+/*!
+ * \brief Run one case over the corpus and print its line of the report.
+ *
+ * Events are taken from the corpus round robin. Each one is timed on its
+ * own for the percentiles; throughput comes from the time of the whole
+ * loop, clock reads included.
+ */
+static void bench_case(int fd, struct bench_state *state, const char *name, bench_fn fn)
+{
+	unsigned int i;
+	uint64_t start;
+	uint64_t total;
+	size_t heap;
+	long heap_delta;
+
+	/* Warm up caches and thread-local buffers */
+	for (i = 0; i < ARRAY_LEN(corpus) * 16; i++) {
+		if (fn(state, i % ARRAY_LEN(corpus))) {
+			ast_cli(fd, "%-24s failed\n", name);
+			return;
+		}
+	}
+
+	heap = heap_in_use();
+	start = now_ns();
+	for (i = 0; i < state->iterations; i++) {
+		uint64_t begin = now_ns();
+
+		fn(state, i % ARRAY_LEN(corpus));
+		state->samples[i] = now_ns() - begin;
+	}
+	total = now_ns() - start;
+	heap_delta = (long) (heap_in_use() - heap);
+
+	qsort(state->samples, state->iterations, sizeof(*state->samples), uint64_cmp);
+
+	ast_cli(fd, "%-24s %12.0f %10.1f %8" PRIu64 " %8" PRIu64 " %10.2f\n", name,
+		state->iterations / (total / 1e9),
+		(double) total / state->iterations,
+		state->samples[state->iterations / 2],
+		state->samples[(uint64_t) state->iterations * 99 / 100],
+		(double) heap_delta / state->iterations);
+}
+
+static int bench_index(struct bench_state *state, size_t index)
+{
+	struct ami_header_index headers;
+	int res;
+
+	res = ami_header_index_build(&headers, corpus[index].body);
+	ami_header_index_free(&headers);
+
+	return res;
+}
+
+static int bench_filter(struct bench_state *state, size_t index)
+{
+	return should_send_event(state->filters, corpus[index].name,
+		&state->headers[index]) < 0;
+}
+
+static int bench_json(struct bench_state *state, size_t index)
+{
+	ast_str_reset(state->buf);
+	return ami_json_write(&state->buf, corpus[index].name, &state->headers[index],
+		state->json_identity);
+}
+
+static int bench_json_typed(struct bench_state *state, size_t index)
+{
+	ast_str_reset(state->buf);
+	return ami_json_write(&state->buf, corpus[index].name, &state->headers[index],
+		state->json_typed_identity);
+}
+
+static int bench_ast_json(struct bench_state *state, size_t index)
+{
+	struct ast_json *json;
+	char *str;
+
+	json = ami_body_to_json(corpus[index].name, state->bodies[index]);
+	str = ast_json_dump_string(json);
+	ast_json_unref(json);
+	ast_json_free(str);
+
+	return !str;
+}
+
+static int bench_msgpack(struct bench_state *state, size_t index)
+{
+	ast_str_reset(state->buf);
+	return ami_msgpack_write(&state->buf, corpus[index].name, &state->headers[index],
+		state->msgpack_identity);
+}
+
+static int bench_hook(struct bench_state *state, size_t index)
+{
+	return ami_kafka_hook_event(corpus[index].category, corpus[index].name,
+		state->bodies[index]);
+}
+
+static void bench_state_cleanup(struct bench_state *state)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(corpus); i++) {
+		ami_header_index_free(&state->headers[i]);
+		ast_free(state->bodies[i]);
+	}
+	ami_kafka_identity_free(state->json_identity);
+	ami_kafka_identity_free(state->json_typed_identity);
+	ami_kafka_identity_free(state->msgpack_identity);
+	ao2_cleanup(state->filters);
+	ast_free(state->buf);
+	ast_free(state->samples);
+}
+
+static void bench_run(int fd, unsigned int iterations)
+{
+	static const char * const filter_names[] = {
+		"filter/none", "filter/names_10", "filter/names_100",
+		"filter/headers_5", "filter/regex_5",
+	};
+	struct bench_state state = { .iterations = iterations, };
+	ami_kafka_produce_fn previous;
+	unsigned int hook_produced;
+	const char *reason;
+	size_t i;
+
+	state.samples = ast_calloc(iterations, sizeof(*state.samples));
+	state.buf = ast_str_create(4096);
+	state.json_identity = ami_kafka_identity_alloc("json");
+	state.json_typed_identity = ami_kafka_identity_alloc("json_typed");
+	state.msgpack_identity = ami_kafka_identity_alloc("msgpack");
+	if (!state.samples || !state.buf || !state.json_identity
+		|| !state.json_typed_identity || !state.msgpack_identity) {
+		ast_cli(fd, "Out of memory\n");
+		bench_state_cleanup(&state);
+		return;
+	}
+	for (i = 0; i < ARRAY_LEN(corpus); i++) {
+		state.bodies[i] = ast_strdup(corpus[i].body);
+		if (!state.bodies[i] || ami_header_index_build(&state.headers[i], corpus[i].body)) {
+			ast_cli(fd, "Out of memory\n");
+			bench_state_cleanup(&state);
+			return;
+		}
+	}
+
+	ast_cli(fd, "%u events per case, %zu event types\n\n", iterations, ARRAY_LEN(corpus));
+	ast_cli(fd, "%-24s %12s %10s %8s %8s %10s\n",
+		"Case", "Events/s", "Mean ns", "p50 ns", "p99 ns", "Heap B/ev");
+
+	bench_case(fd, &state, "index", bench_index);
+
+	for (i = 0; i < ARRAY_LEN(filter_names); i++) {
+		state.filters = bench_filters(i);
+		if (!state.filters) {
+			ast_cli(fd, "%-24s failed\n", filter_names[i]);
+			continue;
+		}
+		bench_case(fd, &state, filter_names[i], bench_filter);
+		ao2_ref(state.filters, -1);
+		state.filters = NULL;
+	}
+
+	bench_case(fd, &state, "format/json", bench_json);
+	bench_case(fd, &state, "format/json_typed", bench_json_typed);
+	bench_case(fd, &state, "format/json (ast_json)", bench_ast_json);
+	bench_case(fd, &state, "format/msgpack", bench_msgpack);
+
+	/* The whole hook with the loaded ami_kafka.conf, minus librdkafka */
+	if (ami_kafka_bench_begin(&reason)) {
+		ast_cli(fd, "%-24s skipped: %s\n", "hook", reason);
+		bench_state_cleanup(&state);
+		return;
+	}
+	__atomic_store_n(&produced, 0, __ATOMIC_RELAXED);
+	previous = ami_kafka_set_produce(stub_produce);
+	bench_case(fd, &state, "hook", bench_hook);
+	ami_kafka_set_produce(previous);
+	ami_kafka_bench_end();
+	hook_produced = __atomic_load_n(&produced, __ATOMIC_RELAXED);
+
+	ast_cli(fd, "\nhook: %u message(s) reached the stub producer "
+		"(filters, routes and fields of ami_kafka.conf apply)\n", hook_produced);
+
+	bench_state_cleanup(&state);
+}
+
+/* ---- CLI ---- */
+
+static char *handle_cli_bench(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	unsigned int iterations = 100000;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "ami kafka bench";
+		e->usage =
+			"Usage: ami kafka bench [<events>]\n"
+			"       Measure the app_ami_kafka hot path on a corpus of AMI events.\n"
+			"       <events> per case, 1000 to 10000000, default 100000.\n"
+			"       While the 'hook' case runs, ALL messages of app_ami_kafka go\n"
+			"       to a stub producer instead of Kafka: do not run in production.\n"
+			"       The 'hook' case is skipped unless every event is produced inside\n"
+			"       the hook: no async, batch_mode, coalesce, sample, ratelimit,\n"
+			"       call_tracking or call_summaries, and nothing in the spill.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc > 4) {
+		return CLI_SHOWUSAGE;
+	}
+	if (a->argc == 4 && (sscanf(a->argv[3], "%u", &iterations) != 1
+		|| iterations < 1000 || iterations > 10000000)) {
+		return CLI_SHOWUSAGE;
+	}
+
+	bench_run(a->fd, iterations);
+
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry cli_bench[] = {
+	AST_CLI_DEFINE(handle_cli_bench, "Benchmark the app_ami_kafka hot path"),
+};
+
+/* ---- Module lifecycle ---- */
+
+static int load_module(void)
+{
+	ast_cli_register_multiple(cli_bench, ARRAY_LEN(cli_bench));
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+static int unload_module(void)
+{
+	ast_cli_unregister_multiple(cli_bench, ARRAY_LEN(cli_bench));
+	return 0;
+}
+
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "AMI Kafka Publisher Benchmarks",
+	.support_level = AST_MODULE_SUPPORT_EXTENDED,
+	.load = load_module,
+	.unload = unload_module,
+	.requires = "app_ami_kafka",
+);
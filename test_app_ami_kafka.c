@@ -30,14 +30,27 @@
 
 #include "asterisk.h"
 
+#include <inttypes.h>
+#include <limits.h>
 #include <regex.h>
+#include <unistd.h>
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "asterisk/module.h"
 #include "asterisk/test.h"
 #include "asterisk/json.h"
+#include "asterisk/kafka.h"
 #include "asterisk/utils.h"
 #include "asterisk/astobj2.h"
 #include "asterisk/strings.h"
+#include "asterisk/paths.h"
+#include "asterisk/manager.h"
 
 #define TEST_CATEGORY "/app/ami_kafka/"
 
@@ -60,18 +73,363 @@ struct event_filter_entry {
 	char *string_filter;
 	char *event_name;
 	char *header_name;
+	int body_literal;
+	size_t pattern;
+};
+
+/*! \brief Position of an event in its call, from the call tracking stage */
+struct ami_kafka_call_stamp {
+	unsigned int sequence;
+	time_t start;
+};
+
+/*! \brief Event captured by the hook, waiting for a worker thread */
+struct ami_kafka_queued_event {
+	int category;
+	uint64_t timestamp;
+	struct ami_kafka_call_stamp call;
+	char *event;
+	char body[0];
+};
+
+#define AMI_HEADER_STACK_LINES 64
+
+/*! \brief One line of an AMI body, pointing into the body text */
+struct ami_header {
+	const char *line;
+	unsigned int line_len;
+	int key_len;
+	unsigned int hash;
+};
+
+/*! \brief Every line of one AMI body, found in a single scan */
+struct ami_header_index {
+	const char *body;
+	size_t body_len;
+	struct ami_header *items;
+	size_t count;
+	size_t size;
+	struct ami_header stack[AMI_HEADER_STACK_LINES];
+};
+
+/*! \brief Where the Kafka message key of an event comes from */
+enum ami_kafka_key_type {
+	AMI_KAFKA_KEY_EVENT = 0,
+	AMI_KAFKA_KEY_ENTITY_ID,
+	AMI_KAFKA_KEY_HEADER,
+};
+
+/*! \brief Parsed 'partition_key' option */
+struct ami_kafka_key_source {
+	enum ami_kafka_key_type type;
+	const char *header;
+	size_t header_len;
+	unsigned int hash;
+};
+
+/*! \brief How several events are combined into one Kafka message */
+enum ami_kafka_batch_mode {
+	AMI_KAFKA_BATCH_NONE = 0,
+	AMI_KAFKA_BATCH_ARRAY,
+	AMI_KAFKA_BATCH_NDJSON,
+};
+
+/*! \brief How much an event matters when the pipeline is saturated */
+enum ami_kafka_priority {
+	AMI_KAFKA_PRIORITY_CRITICAL = 0,
+	AMI_KAFKA_PRIORITY_NORMAL,
+	AMI_KAFKA_PRIORITY_LOW,
+	AMI_KAFKA_PRIORITY_COUNT,
+};
+
+/*! \brief When to drop events by priority */
+struct ami_kafka_shed_policy {
+	unsigned int threshold[AMI_KAFKA_PRIORITY_COUNT];
+	unsigned int sample;
+	unsigned int seen[AMI_KAFKA_PRIORITY_COUNT];
+};
+
+/*! \brief Event and message counters */
+enum ami_kafka_counter {
+	AMI_KAFKA_STAT_SEEN = 0,
+	AMI_KAFKA_STAT_FILTERED,
+	AMI_KAFKA_STAT_FORMATTED,
+	AMI_KAFKA_STAT_FORMAT_FAILED,
+	AMI_KAFKA_STAT_BATCHED,
+	AMI_KAFKA_STAT_PRODUCED,
+	AMI_KAFKA_STAT_PRODUCE_FAILED,
+	AMI_KAFKA_STAT_QUEUE_FULL,
+	AMI_KAFKA_STAT_CRITICAL_DROPPED,
+	AMI_KAFKA_STAT_SHED_NORMAL,
+	AMI_KAFKA_STAT_SHED_LOW,
+	AMI_KAFKA_STAT_SAMPLED_OUT,
+	AMI_KAFKA_STAT_RATE_LIMITED,
+	AMI_KAFKA_STAT_COALESCED,
+	AMI_KAFKA_STAT_CALL_SUMMARIES,
+	AMI_KAFKA_STAT_SPILLED,
+	AMI_KAFKA_STAT_SPILL_DROPPED,
+	AMI_KAFKA_STAT_REPLAYED,
+	AMI_KAFKA_STAT_COUNT,
+};
+
+/*! \brief Timed steps of the event path */
+enum ami_kafka_stage {
+	AMI_KAFKA_STAGE_HOOK = 0,
+	AMI_KAFKA_STAGE_FILTER,
+	AMI_KAFKA_STAGE_FORMAT,
+	AMI_KAFKA_STAGE_PRODUCE,
+	AMI_KAFKA_STAGE_COUNT,
+};
+
+#define LATENCY_SUB_BITS 3
+#define LATENCY_MAX_EXP 39
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXP - LATENCY_SUB_BITS + 2) << LATENCY_SUB_BITS)
+
+#define WALL_CLOCK_SYNC_NS 1000000000ULL
+
+struct ami_kafka_wall_clock {
+	uint64_t synced;
+	int64_t offset;
+	uint64_t last;
+};
+
+/*! \brief Counters and histograms summed over all shards */
+struct ami_kafka_stats {
+	uint64_t counters[AMI_KAFKA_STAT_COUNT];
+	uint64_t latency[AMI_KAFKA_STAGE_COUNT][LATENCY_BUCKETS];
+};
+
+/*! \brief Payload compression done by this module (not by librdkafka) */
+enum ami_kafka_compression {
+	AMI_KAFKA_COMPRESSION_NONE = 0,
+	AMI_KAFKA_COMPRESSION_LZ4,
+	AMI_KAFKA_COMPRESSION_ZSTD,
 };
 
+/*! \brief Compression settings of one configuration, shared by all threads */
+struct ami_kafka_compressor {
+	enum ami_kafka_compression type;
+	int level;
+	char encoding[32];
+#ifdef HAVE_ZSTD
+	ZSTD_CDict *cdict;
+#endif
+};
+
+/*! \brief Batching options from the general section */
+struct ami_kafka_batch_settings {
+	enum ami_kafka_batch_mode mode;
+	unsigned int max_events;
+	unsigned int max_bytes;
+	unsigned int linger_ms;
+};
+
+/*! \brief Events waiting to be produced as one Kafka message */
+struct ami_kafka_batch {
+	enum ami_kafka_batch_mode mode;
+	unsigned int count;
+	uint64_t timestamp;
+	int linked;
+	struct ao2_container *owner;
+	struct ast_str *records;
+	const char *topic;
+	const char *key;
+	char data[0];
+};
+
+struct ami_kafka_coalesced {
+	int category;
+	uint64_t timestamp;
+	struct ami_kafka_call_stamp call;
+	int linked;
+	struct ao2_container *owner;
+	unsigned int replaced;
+	char *body;
+	const char *event;
+	const char *identity;
+	char data[0];
+};
+
+struct ami_kafka_queue;
+
 extern struct ast_json *ami_body_to_json(const char *event, char *body);
 
+struct ami_kafka_identity;
+
+extern int ami_json_write(struct ast_str **buf, const char *event,
+	const struct ami_header_index *headers,
+	const struct ami_kafka_identity *identity);
+
+extern struct ami_kafka_identity *ami_kafka_identity_alloc(const char *format);
+extern void ami_kafka_identity_fold_headers(struct ami_kafka_identity *identity, int fold);
+
+extern int ami_msgpack_write(struct ast_str **buf, const char *event,
+	const struct ami_header_index *headers, const struct ami_kafka_identity *identity);
+
+extern void ami_kafka_identity_free(struct ami_kafka_identity *identity);
+
+extern int ami_header_index_build(struct ami_header_index *index,
+	const char *body);
+
+extern void ami_header_index_free(struct ami_header_index *index);
+
 extern int add_filter(const char *criteria, const char *filter_pattern,
 	struct ao2_container *includefilters, struct ao2_container *excludefilters);
 
+struct ami_kafka_matcher;
+
+extern struct ami_kafka_matcher *ami_kafka_matcher_build(const char * const *patterns,
+	size_t count);
+
+extern void ami_kafka_matcher_free(struct ami_kafka_matcher *matcher);
+
+extern void ami_kafka_matcher_scan(const struct ami_kafka_matcher *matcher,
+	const char *text, size_t len, unsigned long *matched);
+
 extern int match_eventdata(struct event_filter_entry *entry,
 	const char *eventdata);
 
-extern int should_send_event(struct ao2_container *includefilters,
-	struct ao2_container *excludefilters, const char *event, const char *body);
+struct ami_kafka_filters;
+
+extern struct ami_kafka_filters *ami_kafka_filters_compile(
+	struct ao2_container *includefilters, struct ao2_container *excludefilters);
+
+extern int should_send_event(const struct ami_kafka_filters *filters,
+	const char *event, const struct ami_header_index *headers);
+
+extern void ami_kafka_key_source_parse(struct ami_kafka_key_source *source,
+	const char *value);
+
+extern const char *ami_kafka_message_key(const struct ami_kafka_key_source *source,
+	const char *event, const struct ami_header_index *headers,
+	const struct ami_kafka_identity *identity, char *buf, size_t buflen);
+
+extern const char *ami_kafka_category_str(int category, char *buf, size_t buflen);
+
+struct ami_kafka_routes;
+
+extern int ami_kafka_route_add(struct ao2_container *rules, const char *option,
+	const char *topic);
+
+extern struct ami_kafka_routes *ami_kafka_routes_compile(struct ao2_container *rules);
+
+extern const char *ami_kafka_route_topic(struct ami_kafka_routes *routes,
+	const char *event, int category, const char *default_topic);
+
+extern int ami_kafka_priority_add(struct ao2_container *rules, const char *option,
+	const char *priority);
+
+extern enum ami_kafka_priority ami_kafka_event_priority(struct ami_kafka_routes *priorities,
+	const char *event, int category);
+
+extern int ami_kafka_shed(struct ami_kafka_shed_policy *policy,
+	enum ami_kafka_priority priority, unsigned int load);
+
+extern int ami_kafka_sample_add(struct ao2_container *rules, const char *option,
+	const char *value);
+
+extern int ami_kafka_ratelimit_add(struct ao2_container *rules, const char *option,
+	const char *value);
+
+extern int ami_kafka_sample_keep(struct ami_kafka_routes *samples, const char *event,
+	int category);
+
+extern int ami_kafka_ratelimit_allow(struct ami_kafka_routes *ratelimits, const char *event,
+	int category, const struct ami_header_index *headers, uint64_t now);
+
+struct ast_sched_context;
+
+extern int ami_kafka_coalesce_add(struct ao2_container *rules, const char *option,
+	const char *header);
+
+extern struct ao2_container *ami_kafka_coalesced_alloc(void);
+
+extern int ami_kafka_coalesce(struct ao2_container *held, struct ast_sched_context *sched,
+	struct ami_kafka_routes *rules, unsigned int window_ms, int category,
+	const char *event, const struct ami_header_index *headers, uint64_t timestamp,
+	const struct ami_kafka_call_stamp *call);
+
+extern struct ami_kafka_coalesced *ami_kafka_coalesced_take(struct ao2_container *held,
+	const char *event, const char *identity);
+
+extern struct ao2_container *ami_kafka_calls_alloc(void);
+
+struct ami_kafka_call;
+
+extern int ami_kafka_call_track(struct ao2_container *calls, const char *event,
+	const struct ami_header_index *headers, time_t timestamp,
+	struct ami_kafka_call_stamp *stamp, struct ami_kafka_call **ended);
+
+extern int ami_kafka_call_summary(struct ami_kafka_call *call, struct ast_str **buf);
+
+extern unsigned int ami_kafka_calls_expire(struct ao2_container *calls, time_t before,
+	struct ao2_iterator **expired);
+
+extern int ami_kafka_fields_add(struct ao2_container *rules, const char *option,
+	const char *value);
+
+extern size_t ami_kafka_project(struct ami_kafka_routes *projections, const char *event,
+	int category, struct ami_header_index *headers);
+
+extern struct ami_kafka_compressor *ami_kafka_compressor_alloc(
+	enum ami_kafka_compression type, int level, const char *dictionary);
+
+extern void ami_kafka_compressor_free(struct ami_kafka_compressor *compressor);
+
+extern int ami_kafka_compress(const struct ami_kafka_compressor *compressor,
+	const char *data, size_t len, struct ast_str **out);
+
+extern unsigned int ami_kafka_latency_bucket(uint64_t ns);
+
+extern uint64_t ami_kafka_latency_bucket_floor(unsigned int bucket);
+
+extern uint64_t ami_kafka_latency_percentile(const uint64_t *buckets, double percentile);
+
+extern void ami_kafka_stats_collect(struct ami_kafka_stats *stats);
+
+extern uint64_t ami_kafka_wall_clock_advance(struct ami_kafka_wall_clock *clock,
+	uint64_t now, uint64_t wall);
+
+extern uint64_t ami_kafka_wall_clock_us(uint64_t now);
+
+typedef int (*ami_kafka_produce_fn)(struct ast_kafka_producer *producer,
+	const char *topic, const char *key, const void *payload, size_t len,
+	const struct ast_kafka_header *headers, size_t header_count);
+
+struct ami_kafka_spill;
+
+extern struct ami_kafka_spill *ami_kafka_spill_alloc(unsigned int memory_records,
+	const char *path, size_t file_size);
+
+extern void ami_kafka_spill_free(struct ami_kafka_spill *spill);
+
+extern unsigned int ami_kafka_spill_pending(struct ami_kafka_spill *spill);
+
+extern int ami_kafka_spill_push(struct ami_kafka_spill *spill, const char *topic,
+	const char *key, const void *payload, size_t len,
+	const struct ast_kafka_header *hdrs, size_t hdr_count);
+
+extern unsigned int ami_kafka_spill_drain(struct ami_kafka_spill *spill,
+	ami_kafka_produce_fn produce, struct ast_kafka_producer *producer,
+	unsigned int max);
+
+extern struct ao2_container *ami_kafka_batches_alloc(void);
+
+extern int ami_kafka_batch_add(struct ao2_container *batches, struct ast_sched_context *sched,
+	const struct ami_kafka_batch_settings *settings, const char *topic,
+	const char *key, const char *record, size_t len, uint64_t timestamp,
+	struct ami_kafka_batch *ready[2]);
+
+extern struct ami_kafka_queue *ami_kafka_queue_alloc(unsigned int size);
+
+extern void ami_kafka_queue_free(struct ami_kafka_queue *queue);
+
+extern int ami_kafka_queue_push(struct ami_kafka_queue *queue, int category,
+	const char *event, const char *body, uint64_t timestamp,
+	const struct ami_kafka_call_stamp *call);
+
+extern struct ami_kafka_queued_event *ami_kafka_queue_pop(
+	struct ami_kafka_queue *queue);
 
 /* ---- Helpers ---- */
 
@@ -97,6 +455,31 @@ static void create_filter_containers(struct ao2_container **include,
 		AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
 }
 
+/*!
+ * \brief Compile the filter containers and run should_send_event() once.
+ *
+ * \retval -1 if the filters could not be compiled
+ */
+static int send_event(struct ao2_container *include,
+	struct ao2_container *exclude, const char *event, const char *body)
+{
+	struct ami_kafka_filters *filters;
+	struct ami_header_index headers;
+	int res = -1;
+
+	filters = ami_kafka_filters_compile(include, exclude);
+	if (!filters) {
+		return -1;
+	}
+	if (!ami_header_index_build(&headers, body)) {
+		res = should_send_event(filters, event, &headers);
+	}
+	ami_header_index_free(&headers);
+	ao2_ref(filters, -1);
+
+	return res;
+}
+
 /* ---- JSON conversion tests ---- */
 
 AST_TEST_DEFINE(json_basic_parsing)
@@ -303,6 +686,295 @@ AST_TEST_DEFINE(json_malformed_lines)
 	return AST_TEST_PASS;
 }
 
+/*!
+ * \brief Reference serialization: the ast_json tree path the module used
+ * before ami_json_write(), dumped with ast_json_dump_string().
+ */
+static char *reference_json(const char *event, const char *body)
+{
+	struct ast_json *json;
+	char eid_str[20];
+	char *copy;
+	char *line;
+	char *saveptr = NULL;
+	char *str;
+
+	json = ast_json_object_create();
+	if (!json) {
+		return NULL;
+	}
+
+	ast_json_object_set(json, "Event", ast_json_string_create(event));
+	ast_eid_to_str(eid_str, sizeof(eid_str), &ast_eid_default);
+	ast_json_object_set(json, "EntityID", ast_json_string_create(eid_str));
+	if (!ast_strlen_zero(ast_config_AST_SYSTEM_NAME)) {
+		ast_json_object_set(json, "SystemName",
+			ast_json_string_create(ast_config_AST_SYSTEM_NAME));
+	}
+
+	copy = ast_strdupa(body);
+	for (line = strtok_r(copy, "\r\n", &saveptr); line;
+	     line = strtok_r(NULL, "\r\n", &saveptr)) {
+		char *sep = strstr(line, ": ");
+
+		if (!sep) {
+			continue;
+		}
+		*sep = '\0';
+		ast_json_object_set(json, line, ast_json_string_create(sep + 2));
+	}
+
+	str = ast_json_dump_string(json);
+	ast_json_unref(json);
+	return str;
+}
+
+AST_TEST_DEFINE(json_writer_matches_reference)
+{
+	static const char *bodies[] = {
+		/* Manager puts the event name in the body too */
+		"Event: Newchannel\r\nPrivilege: call,all\r\n"
+		"Channel: PJSIP/100-00000001\r\nUniqueid: 1705312200.1\r\n\r\n",
+		/* Repeated keys: first position, last value */
+		"ChanVariable: A=1\r\nLinkedid: x\r\nChanVariable: B=2\r\n"
+		"SystemName: from-body\r\nEntityID: from-body\r\n",
+		/* Characters that need escaping, UTF-8 and empty values */
+		"CallerIDName: \"Al\\ice\"\tO'Brien\x01\x1f\r\n"
+		"ConnectedLineName: Jos\xc3\xa9 \xe2\x82\xac/\r\n"
+		"Empty: \r\nColon:NoSpace\r\nKey:With: colon\r\n: blank key\r\n",
+		/* Invalid UTF-8 is dropped, an earlier valid value survives */
+		"Good: one\r\nBad\xff: x\r\nGood: bad\xc0\xaf\r\nNext: \xed\xa0\x80\r\n",
+		"",
+		"\r\n\n\r",
+	};
+	struct ami_header_index headers;
+	struct ami_kafka_identity *identity;
+	struct ast_str *buf;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "json_writer_matches_reference";
+		info->category = TEST_CATEGORY;
+		info->summary = "Streaming JSON writer matches the ast_json path";
+		info->description =
+			"Verifies ami_json_write() produces byte-for-byte the "
+			"output of building an ast_json object and dumping it, "
+			"including key order, duplicate keys, escaping, invalid "
+			"UTF-8 and events with more headers than fit on the stack.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	buf = ast_str_create(64);
+	identity = ami_kafka_identity_alloc("json");
+	if (!buf || !identity) {
+		ast_free(buf);
+		ami_kafka_identity_free(identity);
+		return AST_TEST_FAIL;
+	}
+
+	for (i = 0; i <= ARRAY_LEN(bodies); i++) {
+		char *expected;
+		char large[8192];
+		const char *body = large;
+
+		if (i < ARRAY_LEN(bodies)) {
+			body = bodies[i];
+		} else {
+			/* More headers than the writer keeps on the stack */
+			size_t pos = 0;
+			int n;
+
+			for (n = 0; n < 150; n++) {
+				pos += snprintf(large + pos, sizeof(large) - pos,
+					"Header%d: value %d\r\n", n % 120, n);
+			}
+		}
+
+		ast_str_reset(buf);
+		if (ami_header_index_build(&headers, body)
+			|| ami_json_write(&buf, "Test", &headers, identity)) {
+			ast_test_status_update(test, "ami_json_write failed for body %zu\n", i);
+			ami_header_index_free(&headers);
+			ami_kafka_identity_free(identity);
+			ast_free(buf);
+			return AST_TEST_FAIL;
+		}
+		ami_header_index_free(&headers);
+
+		expected = reference_json("Test", body);
+		if (!expected || strcmp(expected, ast_str_buffer(buf))) {
+			ast_test_status_update(test, "Body %zu mismatch:\n  expected %s\n  got      %s\n",
+				i, S_OR(expected, "(null)"), ast_str_buffer(buf));
+			ast_json_free(expected);
+			ami_kafka_identity_free(identity);
+			ast_free(buf);
+			return AST_TEST_FAIL;
+		}
+		ast_json_free(expected);
+	}
+
+	ami_kafka_identity_free(identity);
+	ast_free(buf);
+	return AST_TEST_PASS;
+}
+
+/* ---- MessagePack payload ---- */
+
+/*! \brief Read a msgpack map or string header; return its length, or -1 */
+static long msgpack_read_len(const unsigned char **pos, const unsigned char *end, int map)
+{
+	const unsigned char *p = *pos;
+	long len;
+
+	if (p >= end) {
+		return -1;
+	}
+	if (map && (*p & 0xF0) == 0x80) {
+		len = *p++ & 0x0F;
+	} else if (!map && (*p & 0xE0) == 0xA0) {
+		len = *p++ & 0x1F;
+	} else if (!map && *p == 0xD9 && end - p >= 2) {
+		len = p[1];
+		p += 2;
+	} else if (*p == (map ? 0xDE : 0xDA) && end - p >= 3) {
+		len = (p[1] << 8) | p[2];
+		p += 3;
+	} else {
+		return -1;
+	}
+	if (!map && end - p < len) {
+		return -1;
+	}
+
+	*pos = p;
+	return len;
+}
+
+AST_TEST_DEFINE(msgpack_payload)
+{
+	static const char body[] =
+		"Privilege: call,all\r\n"
+		"Channel: PJSIP/100-00000001\r\n"
+		"X-Foo: bar\r\n"
+		"Channel: PJSIP/200-00000002\r\n"
+		"LongValue: 0123456789012345678901234567890123456789\r\n";
+	/* Tag, value; EntityID (2) and SystemName (3) depend on the host */
+	static const struct {
+		unsigned int tag;
+		const char *value;
+	} tagged[] = {
+		{ 1, "Test" },
+		{ 4, "call,all" },
+		{ 5, "PJSIP/200-00000002" },
+	};
+	static const char *other[][2] = {
+		{ "X-Foo", "bar" },
+		{ "LongValue", "0123456789012345678901234567890123456789" },
+	};
+	struct ami_header_index headers;
+	struct ami_kafka_identity *identity;
+	struct ast_str *buf;
+	const unsigned char *pos;
+	const unsigned char *end;
+	size_t num_tagged = 0;
+	size_t num_other = 0;
+	int res = AST_TEST_PASS;
+	long count;
+	long len;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "msgpack_payload";
+		info->category = TEST_CATEGORY;
+		info->summary = "Events are encoded as tagged MessagePack maps";
+		info->description =
+			"Verifies ami_msgpack_write() writes known headers under their "
+			"schema tags, other headers in the map under tag 0, and resolves "
+			"repeated headers like the JSON writer.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	buf = ast_str_create(64);
+	identity = ami_kafka_identity_alloc("msgpack");
+	if (!buf || !identity || ami_header_index_build(&headers, body)) {
+		ast_free(buf);
+		ami_kafka_identity_free(identity);
+		return AST_TEST_FAIL;
+	}
+	if (ami_msgpack_write(&buf, "Test", &headers, identity)) {
+		res = AST_TEST_FAIL;
+		goto cleanup;
+	}
+
+	pos = (const unsigned char *) ast_str_buffer(buf);
+	end = pos + ast_str_strlen(buf);
+	count = msgpack_read_len(&pos, end, 1);
+	while (count-- > 0 && pos < end) {
+		unsigned int tag = *pos++;
+
+		if (!tag) {
+			long pairs = msgpack_read_len(&pos, end, 1);
+
+			while (pairs-- > 0) {
+				const char *name;
+				long name_len;
+
+				name_len = msgpack_read_len(&pos, end, 0);
+				name = (const char *) pos;
+				pos += name_len > 0 ? name_len : 0;
+				len = msgpack_read_len(&pos, end, 0);
+				if (name_len < 0 || len < 0 || num_other >= ARRAY_LEN(other)
+					|| (long) strlen(other[num_other][0]) != name_len
+					|| memcmp(name, other[num_other][0], name_len)
+					|| (long) strlen(other[num_other][1]) != len
+					|| memcmp(pos, other[num_other][1], len)) {
+					ast_test_status_update(test, "Other header %zu mismatch\n", num_other);
+					res = AST_TEST_FAIL;
+					goto cleanup;
+				}
+				pos += len;
+				num_other++;
+			}
+			continue;
+		}
+
+		len = msgpack_read_len(&pos, end, 0);
+		if (len < 0 || num_other) {
+			ast_test_status_update(test, "Bad value for tag %u\n", tag);
+			res = AST_TEST_FAIL;
+			goto cleanup;
+		}
+		if (tag != 2 && tag != 3) {
+			if (num_tagged >= ARRAY_LEN(tagged) || tagged[num_tagged].tag != tag
+				|| (long) strlen(tagged[num_tagged].value) != len
+				|| memcmp(pos, tagged[num_tagged].value, len)) {
+				ast_test_status_update(test, "Tag %u mismatch\n", tag);
+				res = AST_TEST_FAIL;
+				goto cleanup;
+			}
+			num_tagged++;
+		}
+		pos += len;
+	}
+
+	if (count != -1 || pos != end || num_tagged != ARRAY_LEN(tagged)
+		|| num_other != ARRAY_LEN(other)) {
+		ast_test_status_update(test, "Payload incomplete or has trailing data\n");
+		res = AST_TEST_FAIL;
+	}
+
+cleanup:
+	ami_header_index_free(&headers);
+	ami_kafka_identity_free(identity);
+	ast_free(buf);
+	return res;
+}
+
 /* ---- Filter: add_filter tests ---- */
 
 AST_TEST_DEFINE(filter_legacy_include)
@@ -594,7 +1266,7 @@ AST_TEST_DEFINE(send_no_filters)
 
 	create_filter_containers(&include, &exclude);
 
-	res = should_send_event(include, exclude, "Newchannel", SAMPLE_BODY);
+	res = send_event(include, exclude, "Newchannel", SAMPLE_BODY);
 	if (res != 1) {
 		ast_test_status_update(test,
 			"Expected 1 (send), got %d\n", res);
@@ -632,7 +1304,7 @@ AST_TEST_DEFINE(send_include_match)
 	/* Include: regex matching "Channel: PJSIP/" in body */
 	add_filter("eventfilter", "Channel: PJSIP/", include, exclude);
 
-	res = should_send_event(include, exclude, "Newchannel", SAMPLE_BODY);
+	res = send_event(include, exclude, "Newchannel", SAMPLE_BODY);
 	if (res != 1) {
 		ast_test_status_update(test,
 			"Expected 1 (send), got %d\n", res);
@@ -670,7 +1342,7 @@ AST_TEST_DEFINE(send_include_no_match)
 	/* Include: regex that won't match the sample body */
 	add_filter("eventfilter", "Channel: SIP/", include, exclude);
 
-	res = should_send_event(include, exclude, "Newchannel", SAMPLE_BODY);
+	res = send_event(include, exclude, "Newchannel", SAMPLE_BODY);
 	if (res != 0) {
 		ast_test_status_update(test,
 			"Expected 0 (reject), got %d\n", res);
@@ -708,7 +1380,7 @@ AST_TEST_DEFINE(send_exclude_match)
 	/* Exclude: regex matching Channel: PJSIP/ */
 	add_filter("eventfilter", "!Channel: PJSIP/", include, exclude);
 
-	res = should_send_event(include, exclude, "Newchannel", SAMPLE_BODY);
+	res = send_event(include, exclude, "Newchannel", SAMPLE_BODY);
 	if (res != 0) {
 		ast_test_status_update(test,
 			"Expected 0 (reject), got %d\n", res);
@@ -746,7 +1418,7 @@ AST_TEST_DEFINE(send_exclude_no_match)
 	/* Exclude: regex that won't match */
 	add_filter("eventfilter", "!Channel: Local/", include, exclude);
 
-	res = should_send_event(include, exclude, "Newchannel", SAMPLE_BODY);
+	res = send_event(include, exclude, "Newchannel", SAMPLE_BODY);
 	if (res != 1) {
 		ast_test_status_update(test,
 			"Expected 1 (send), got %d\n", res);
@@ -788,7 +1460,7 @@ AST_TEST_DEFINE(send_include_exclude_combined)
 	add_filter("eventfilter", "!CallerIDNum: 100", include, exclude);
 
 	/* SAMPLE_BODY matches both include and exclude → reject */
-	res = should_send_event(include, exclude, "Newchannel", SAMPLE_BODY);
+	res = send_event(include, exclude, "Newchannel", SAMPLE_BODY);
 	if (res != 0) {
 		ast_test_status_update(test,
 			"Expected 0 (reject by exclude), got %d\n", res);
@@ -829,7 +1501,7 @@ AST_TEST_DEFINE(send_name_filter_match)
 	add_filter("eventfilter(action(include),name(Newchannel))", "",
 		include, exclude);
 
-	res = should_send_event(include, exclude, "Newchannel", SAMPLE_BODY);
+	res = send_event(include, exclude, "Newchannel", SAMPLE_BODY);
 	if (res != 1) {
 		ast_test_status_update(test,
 			"Expected 1 (send), got %d\n", res);
@@ -839,7 +1511,7 @@ AST_TEST_DEFINE(send_name_filter_match)
 	}
 
 	/* Different event name should not match */
-	res = should_send_event(include, exclude, "Hangup", SAMPLE_BODY);
+	res = send_event(include, exclude, "Hangup", SAMPLE_BODY);
 	if (res != 0) {
 		ast_test_status_update(test,
 			"Expected 0 (reject for Hangup), got %d\n", res);
@@ -853,6 +1525,71 @@ AST_TEST_DEFINE(send_name_filter_match)
 	return AST_TEST_PASS;
 }
 
+AST_TEST_DEFINE(send_name_dispatch)
+{
+	struct ao2_container *include = NULL;
+	struct ao2_container *exclude = NULL;
+	static const struct {
+		const char *event;
+		const char *body;
+		int expected;
+	} cases[] = {
+		/* name(Newchannel) include */
+		{ "Newchannel", SAMPLE_BODY, 1 },
+		/* wildcard include on Context */
+		{ "Hangup", "Context: from-internal\r\n", 1 },
+		/* neither include matches */
+		{ "Hangup", "Context: default\r\n", 0 },
+		/* name(Hangup) exclude on Cause, wildcard include matched */
+		{ "Hangup", "Context: from-internal\r\nCause: 16\r\n", 0 },
+		/* wildcard exclude applies to named events too */
+		{ "Newchannel", "Channel: Local/1@x-00000001;1\r\n", 0 },
+		/* name(Hangup) exclude does not leak into other events */
+		{ "Newstate", "Context: from-internal\r\nCause: 16\r\n", 1 },
+	};
+	size_t i;
+	int res = AST_TEST_PASS;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "send_name_dispatch";
+		info->category = TEST_CATEGORY;
+		info->summary = "Named and wildcard filters combine per event";
+		info->description =
+			"Verifies the compiled filters apply name() filters only "
+			"to their event and filters without name() to every "
+			"event, for both include and exclude actions.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	create_filter_containers(&include, &exclude);
+
+	add_filter("eventfilter(action(include),name(Newchannel))", "",
+		include, exclude);
+	add_filter("eventfilter(action(include),header(Context),method(exact))",
+		"from-internal", include, exclude);
+	add_filter("eventfilter(action(exclude),name(Hangup),header(Cause),method(exact))",
+		"16", include, exclude);
+	add_filter("eventfilter", "!Channel: Local/", include, exclude);
+
+	for (i = 0; i < ARRAY_LEN(cases); i++) {
+		int sent = send_event(include, exclude, cases[i].event, cases[i].body);
+
+		if (sent != cases[i].expected) {
+			ast_test_status_update(test,
+				"Case %zu (%s): expected %d, got %d\n", i,
+				cases[i].event, cases[i].expected, sent);
+			res = AST_TEST_FAIL;
+		}
+	}
+
+	ao2_cleanup(include);
+	ao2_cleanup(exclude);
+	return res;
+}
+
 /* ---- Advanced filter with header() + method() ---- */
 
 AST_TEST_DEFINE(send_header_starts_with)
@@ -880,7 +1617,7 @@ AST_TEST_DEFINE(send_header_starts_with)
 		"eventfilter(action(include),header(Channel),method(starts_with))",
 		"PJSIP/", include, exclude);
 
-	res = should_send_event(include, exclude, "Newchannel", SAMPLE_BODY);
+	res = send_event(include, exclude, "Newchannel", SAMPLE_BODY);
 	if (res != 1) {
 		ast_test_status_update(test,
 			"Expected 1 (send), got %d\n", res);
@@ -892,7 +1629,7 @@ AST_TEST_DEFINE(send_header_starts_with)
 	/* Body with a different channel should not match */
 	{
 		char other_body[] = "Channel: SIP/200-00000003\r\n";
-		res = should_send_event(include, exclude, "Newchannel", other_body);
+		res = send_event(include, exclude, "Newchannel", other_body);
 		if (res != 0) {
 			ast_test_status_update(test,
 				"Expected 0 (reject for SIP channel), got %d\n", res);
@@ -932,7 +1669,7 @@ AST_TEST_DEFINE(send_header_exact)
 		"eventfilter(action(include),header(Context),method(exact))",
 		"from-internal", include, exclude);
 
-	res = should_send_event(include, exclude, "Newchannel", SAMPLE_BODY);
+	res = send_event(include, exclude, "Newchannel", SAMPLE_BODY);
 	if (res != 1) {
 		ast_test_status_update(test,
 			"Expected 1 (send), got %d\n", res);
@@ -944,7 +1681,7 @@ AST_TEST_DEFINE(send_header_exact)
 	/* Partial match should fail with exact */
 	{
 		char other_body[] = "Context: from-internal-extra\r\n";
-		res = should_send_event(include, exclude, "Test", other_body);
+		res = send_event(include, exclude, "Test", other_body);
 		if (res != 0) {
 			ast_test_status_update(test,
 				"Expected 0 (reject for partial match), got %d\n", res);
@@ -984,7 +1721,7 @@ AST_TEST_DEFINE(send_header_contains)
 		"eventfilter(action(include),header(Channel),method(contains))",
 		"100", include, exclude);
 
-	res = should_send_event(include, exclude, "Newchannel", SAMPLE_BODY);
+	res = send_event(include, exclude, "Newchannel", SAMPLE_BODY);
 	if (res != 1) {
 		ast_test_status_update(test,
 			"Expected 1 (send), got %d\n", res);
@@ -1023,7 +1760,7 @@ AST_TEST_DEFINE(send_header_ends_with)
 		"eventfilter(action(include),header(Channel),method(ends_with))",
 		"00000001", include, exclude);
 
-	res = should_send_event(include, exclude, "Newchannel", SAMPLE_BODY);
+	res = send_event(include, exclude, "Newchannel", SAMPLE_BODY);
 	if (res != 1) {
 		ast_test_status_update(test,
 			"Expected 1 (send), got %d\n", res);
@@ -1037,6 +1774,1904 @@ AST_TEST_DEFINE(send_header_ends_with)
 	return AST_TEST_PASS;
 }
 
+AST_TEST_DEFINE(send_header_regex)
+{
+	struct ao2_container *include = NULL;
+	struct ao2_container *exclude = NULL;
+	int res = AST_TEST_PASS;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "send_header_regex";
+		info->category = TEST_CATEGORY;
+		info->summary = "Header filter with regex method";
+		info->description =
+			"Verifies a header(...) regex filter sees only the header "
+			"value, anchored at both ends, although the value is not "
+			"terminated inside the event body.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	create_filter_containers(&include, &exclude);
+
+	add_filter(
+		"eventfilter(action(include),header(Channel),method(regex))",
+		"^PJSIP/[0-9]+-[0-9a-f]+$", include, exclude);
+
+	/* Channel is a middle line: the value ends at "\r\n", not at NUL */
+	if (send_event(include, exclude, "Newchannel", SAMPLE_BODY) != 1) {
+		ast_test_status_update(test, "Expected PJSIP channel to match\n");
+		res = AST_TEST_FAIL;
+	}
+	/* Leading blanks are skipped, as ast_skip_blanks() did */
+	if (send_event(include, exclude, "Newchannel",
+		"Channel:   PJSIP/200-0000000a\r\nContext: x\r\n") != 1) {
+		ast_test_status_update(test, "Expected padded value to match\n");
+		res = AST_TEST_FAIL;
+	}
+	if (send_event(include, exclude, "Newchannel",
+		"Channel: PJSIP/200-0000000a;1\r\nContext: x\r\n") != 0) {
+		ast_test_status_update(test, "Expected suffixed value not to match\n");
+		res = AST_TEST_FAIL;
+	}
+
+	ao2_cleanup(include);
+	ao2_cleanup(exclude);
+	return res;
+}
+
+/* ---- Header index ---- */
+
+AST_TEST_DEFINE(header_index_lines)
+{
+	static const char body[] =
+		"Privilege: call,all\r\n"
+		"\r\n"
+		"NoSeparator\n"
+		"Key:NoSpace\r\n"
+		"A:B: C\r"
+		"Empty: \r\n"
+		"Last: value";
+	static const struct {
+		const char *line;
+		int key_len;
+	} expected[] = {
+		{ "Privilege: call,all", 9 },
+		{ "NoSeparator", -1 },
+		{ "Key:NoSpace", -1 },
+		{ "A:B: C", 3 },
+		{ "Empty: ", 5 },
+		{ "Last: value", 4 },
+	};
+	struct ami_header_index headers;
+	char large[8192];
+	size_t pos = 0;
+	size_t i;
+	int res = AST_TEST_PASS;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "header_index_lines";
+		info->category = TEST_CATEGORY;
+		info->summary = "Body line index";
+		info->description =
+			"Verifies ami_header_index_build() splits the body into "
+			"the same lines strtok_r(\"\\r\\n\") would, finds the key "
+			"at the first \": \" and grows past the stack entries.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (ami_header_index_build(&headers, body)) {
+		return AST_TEST_FAIL;
+	}
+	if (headers.count != ARRAY_LEN(expected) || headers.body_len != strlen(body)) {
+		ast_test_status_update(test, "Expected %zu lines of %zu bytes, got %zu of %zu\n",
+			ARRAY_LEN(expected), strlen(body), headers.count, headers.body_len);
+		res = AST_TEST_FAIL;
+	}
+	for (i = 0; i < headers.count && i < ARRAY_LEN(expected); i++) {
+		const struct ami_header *header = &headers.items[i];
+
+		if (header->line_len != strlen(expected[i].line)
+			|| strncmp(header->line, expected[i].line, header->line_len)
+			|| header->key_len != expected[i].key_len) {
+			ast_test_status_update(test, "Line %zu: expected '%s' (key %d), got '%.*s' (key %d)\n",
+				i, expected[i].line, expected[i].key_len,
+				(int) header->line_len, header->line, header->key_len);
+			res = AST_TEST_FAIL;
+		}
+	}
+	ami_header_index_free(&headers);
+
+	for (i = 0; i < AMI_HEADER_STACK_LINES * 3; i++) {
+		pos += snprintf(large + pos, sizeof(large) - pos, "H%zu: %zu\r\n", i, i);
+	}
+	if (ami_header_index_build(&headers, large)) {
+		return AST_TEST_FAIL;
+	}
+	if (headers.count != AMI_HEADER_STACK_LINES * 3
+		|| strncmp(headers.items[headers.count - 1].line, "H191: 191", 9)) {
+		ast_test_status_update(test, "Large body indexed as %zu lines\n", headers.count);
+		res = AST_TEST_FAIL;
+	}
+	ami_header_index_free(&headers);
+
+	return res;
+}
+
+/* ---- Asynchronous queue ---- */
+
+AST_TEST_DEFINE(queue_fifo_and_overflow)
+{
+	struct ami_kafka_queue *queue;
+	struct ami_kafka_queued_event *item;
+	char event[16];
+	int i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "queue_fifo_and_overflow";
+		info->category = TEST_CATEGORY;
+		info->summary = "Async queue preserves order and rejects when full";
+		info->description =
+			"Verifies the hook-to-worker queue returns events in push "
+			"order with their category, timestamp, call position, name "
+			"and body, and drops pushes once its capacity is reached.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	/* Capacity is rounded up to a power of two: 3 -> 4 */
+	queue = ami_kafka_queue_alloc(3);
+	if (!queue) {
+		ast_test_status_update(test, "ami_kafka_queue_alloc returned NULL\n");
+		return AST_TEST_FAIL;
+	}
+
+	for (i = 0; i < 4; i++) {
+		struct ami_kafka_call_stamp call = { .sequence = i, .start = 900, };
+
+		snprintf(event, sizeof(event), "Event%d", i);
+		if (ami_kafka_queue_push(queue, i, event, SAMPLE_BODY, 1000 + i,
+			i ? &call : NULL) != 0) {
+			ast_test_status_update(test, "Push %d failed\n", i);
+			ami_kafka_queue_free(queue);
+			return AST_TEST_FAIL;
+		}
+	}
+
+	if (ami_kafka_queue_push(queue, 0, "Overflow", SAMPLE_BODY, 0, NULL) != -1) {
+		ast_test_status_update(test, "Push into a full queue should fail\n");
+		ami_kafka_queue_free(queue);
+		return AST_TEST_FAIL;
+	}
+
+	for (i = 0; i < 4; i++) {
+		item = ami_kafka_queue_pop(queue);
+		snprintf(event, sizeof(event), "Event%d", i);
+		if (!item || item->category != i || item->timestamp != 1000 + (unsigned int) i
+			|| item->call.sequence != (unsigned int) i || (i && item->call.start != 900)
+			|| strcmp(item->event, event) || strcmp(item->body, SAMPLE_BODY)) {
+			ast_test_status_update(test, "Pop %d returned the wrong event\n", i);
+			ast_free(item);
+			ami_kafka_queue_free(queue);
+			return AST_TEST_FAIL;
+		}
+		ast_free(item);
+	}
+
+	if (ami_kafka_queue_pop(queue)) {
+		ast_test_status_update(test, "Pop from an empty queue should return NULL\n");
+		ami_kafka_queue_free(queue);
+		return AST_TEST_FAIL;
+	}
+
+	/* Slots are reusable after wrapping around */
+	if (ami_kafka_queue_push(queue, 0, "Again", SAMPLE_BODY, 0, NULL) != 0) {
+		ast_test_status_update(test, "Push after draining failed\n");
+		ami_kafka_queue_free(queue);
+		return AST_TEST_FAIL;
+	}
+
+	ami_kafka_queue_free(queue);
+	return AST_TEST_PASS;
+}
+
+/* ---- Message key ---- */
+
+AST_TEST_DEFINE(partition_key_sources)
+{
+	static const char body[] =
+		"Channel: PJSIP/100-00000001\r\n"
+		"Uniqueid: 1705312200.1\r\n"
+		"Linkedid: 1705312200.0\r\n"
+		"Empty: \r\n";
+	static const struct {
+		const char *option;
+		const char *expected;
+	} cases[] = {
+		{ "event", "Newchannel" },
+		{ "", "Newchannel" },
+		{ "Linkedid", "1705312200.0" },
+		{ "Uniqueid", "1705312200.1" },
+		{ "Channel", "PJSIP/100-00000001" },
+		/* Missing or empty header: fall back to the event name */
+		{ "DestLinkedid", "Newchannel" },
+		{ "Empty", "Newchannel" },
+		/* Header names are case-sensitive, like the JSON keys */
+		{ "linkedid", "Newchannel" },
+	};
+	struct ami_kafka_key_source source;
+	struct ami_header_index headers;
+	struct ami_kafka_identity *identity;
+	char buf[8];
+	const char *key;
+	size_t i;
+	int res = AST_TEST_PASS;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "partition_key_sources";
+		info->category = TEST_CATEGORY;
+		info->summary = "Kafka message key strategies";
+		info->description =
+			"Verifies ami_kafka_message_key() returns the event name, "
+			"the entity ID or the value of the configured header, "
+			"and falls back to the event name.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	identity = ami_kafka_identity_alloc("json");
+	if (!identity || ami_header_index_build(&headers, body)) {
+		ami_kafka_identity_free(identity);
+		return AST_TEST_FAIL;
+	}
+
+	for (i = 0; i < ARRAY_LEN(cases); i++) {
+		char key_buf[256];
+
+		ami_kafka_key_source_parse(&source, cases[i].option);
+		key = ami_kafka_message_key(&source, "Newchannel", &headers, identity,
+			key_buf, sizeof(key_buf));
+		if (strcmp(key, cases[i].expected)) {
+			ast_test_status_update(test, "partition_key '%s': expected '%s', got '%s'\n",
+				cases[i].option, cases[i].expected, key);
+			res = AST_TEST_FAIL;
+		}
+	}
+
+	ami_kafka_key_source_parse(&source, "entity_id");
+	key = ami_kafka_message_key(&source, "Newchannel", &headers, identity,
+		buf, sizeof(buf));
+	if (strlen(key) != 17 || key[2] != ':') {
+		ast_test_status_update(test, "Expected an entity ID, got '%s'\n", key);
+		res = AST_TEST_FAIL;
+	}
+
+	/* Values longer than the buffer are truncated, not overrun */
+	ami_kafka_key_source_parse(&source, "Linkedid");
+	key = ami_kafka_message_key(&source, "Newchannel", &headers, identity,
+		buf, sizeof(buf));
+	if (strcmp(key, "1705312")) {
+		ast_test_status_update(test, "Expected truncated key, got '%s'\n", key);
+		res = AST_TEST_FAIL;
+	}
+
+	ami_header_index_free(&headers);
+	ami_kafka_identity_free(identity);
+	return res;
+}
+
+/* ---- Category strings ---- */
+
+/*! \brief Slot of a mask in the category string cache of app_ami_kafka.c */
+#define CATEGORY_CACHE_SLOT(mask) (((unsigned int) (mask) * 2654435761U) >> 26)
+
+/*! \brief Names of the low EVENT_FLAG_* bits, in ami_kafka_category_str() order */
+static const char *category_test_names[] = {
+	"system", "call", "log", "verbose", "command", "agent", "user",
+	"config", "dtmf", "reporting", "cdr", "dialplan", "originate",
+};
+
+static void category_test_expected(int mask, char *buf, size_t buflen)
+{
+	size_t i;
+
+	buf[0] = '\0';
+	for (i = 0; i < ARRAY_LEN(category_test_names); i++) {
+		if (mask & (1 << i)) {
+			if (buf[0]) {
+				strncat(buf, ",", buflen - strlen(buf) - 1);
+			}
+			strncat(buf, category_test_names[i], buflen - strlen(buf) - 1);
+		}
+	}
+}
+
+AST_TEST_DEFINE(category_cache)
+{
+	char buf[256];
+	char expected[256];
+	const char *cached = NULL;
+	const char *str;
+	int cached_mask = 0;
+	int mask;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "category_cache";
+		info->category = TEST_CATEGORY;
+		info->summary = "Category strings are cached per bitmask";
+		info->description =
+			"Verifies a category bitmask is formatted once and then "
+			"answered with the same cached string, and a bitmask whose "
+			"cache slot holds another one still gets its own string.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	/* Slots already taken by other masks are never replaced; find a free one */
+	for (mask = 1; mask < (1 << ARRAY_LEN(category_test_names)) && !cached; mask++) {
+		category_test_expected(mask, expected, sizeof(expected));
+		str = ami_kafka_category_str(mask, buf, sizeof(buf));
+		if (strcmp(str, expected)) {
+			ast_test_status_update(test, "Mask %#x gave '%s', expected '%s'\n",
+				mask, str, expected);
+			return AST_TEST_FAIL;
+		}
+		str = ami_kafka_category_str(mask, buf, sizeof(buf));
+		if (str != buf) {
+			cached = str;
+			cached_mask = mask;
+		}
+	}
+	if (!cached) {
+		ast_test_status_update(test, "No category string was cached\n");
+		return AST_TEST_FAIL;
+	}
+	if (ami_kafka_category_str(cached_mask, buf, sizeof(buf)) != cached) {
+		ast_test_status_update(test, "Mask %#x was not answered from the cache\n",
+			cached_mask);
+		return AST_TEST_FAIL;
+	}
+
+	/* Another mask in the same slot */
+	for (mask = cached_mask + 1; mask < (1 << ARRAY_LEN(category_test_names)); mask++) {
+		if (CATEGORY_CACHE_SLOT(mask) == CATEGORY_CACHE_SLOT(cached_mask)) {
+			break;
+		}
+	}
+	if (mask == (1 << ARRAY_LEN(category_test_names))) {
+		ast_test_status_update(test, "No mask shares the slot of %#x\n", cached_mask);
+		return AST_TEST_FAIL;
+	}
+	category_test_expected(mask, expected, sizeof(expected));
+	str = ami_kafka_category_str(mask, buf, sizeof(buf));
+	if (str == cached || strcmp(str, expected)) {
+		ast_test_status_update(test, "Mask %#x in the slot of %#x gave '%s', expected '%s'\n",
+			mask, cached_mask, str, expected);
+		return AST_TEST_FAIL;
+	}
+	category_test_expected(cached_mask, expected, sizeof(expected));
+	if (ami_kafka_category_str(cached_mask, buf, sizeof(buf)) != cached
+		|| strcmp(cached, expected)) {
+		ast_test_status_update(test, "Mask %#x lost its cached string\n", cached_mask);
+		return AST_TEST_FAIL;
+	}
+
+	return AST_TEST_PASS;
+}
+
+/* ---- Topic routing ---- */
+
+AST_TEST_DEFINE(route_topics)
+{
+	static const struct {
+		const char *option;
+		const char *topic;
+	} rules[] = {
+		{ "route(category(security))", "ami-security" },
+		{ "route(prefix(Queue))", "ami-queue" },
+		{ "route(prefix(QueueMember))", "ami-members" },
+		{ "route(name(VarSet))", "ami-vars" },
+		{ "route(name(QueueCallerJoin))", "ami-joins" },
+		{ "route(name(VarSet))", "ignored" },
+	};
+	static const struct {
+		const char *event;
+		int category;
+		const char *expected;
+	} cases[] = {
+		{ "VarSet", EVENT_FLAG_DIALPLAN, "ami-vars" },
+		{ "QueueCallerJoin", EVENT_FLAG_AGENT, "ami-joins" },
+		{ "QueueMemberAdded", EVENT_FLAG_AGENT, "ami-members" },
+		{ "QueueCallerLeave", EVENT_FLAG_AGENT, "ami-queue" },
+		{ "QueueEntry", EVENT_FLAG_SECURITY, "ami-queue" },
+		{ "InvalidPassword", EVENT_FLAG_SECURITY, "ami-security" },
+		{ "Newchannel", EVENT_FLAG_CALL, "ami" },
+		{ "Que", EVENT_FLAG_CALL, "ami" },
+	};
+	struct ao2_container *container;
+	struct ami_kafka_routes *routes;
+	int res = AST_TEST_PASS;
+	size_t i;
+	int pass;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "route_topics";
+		info->category = TEST_CATEGORY;
+		info->summary = "Events are routed to topics by name, prefix and category";
+		info->description =
+			"Verifies ami_kafka_route_topic() prefers an exact name over "
+			"the longest prefix over a category, falls back to the default "
+			"topic, and returns the same answer from its cache.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	container = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
+	if (!container) {
+		return AST_TEST_FAIL;
+	}
+
+	for (i = 0; i < ARRAY_LEN(rules); i++) {
+		if (ami_kafka_route_add(container, rules[i].option, rules[i].topic)) {
+			ast_test_status_update(test, "Rejected route '%s'\n", rules[i].option);
+			res = AST_TEST_FAIL;
+		}
+	}
+	if (!ami_kafka_route_add(container, "route(category(nosuch))", "x")
+		|| !ami_kafka_route_add(container, "route(channel(X))", "x")
+		|| !ami_kafka_route_add(container, "route(name())", "x")
+		|| !ami_kafka_route_add(container, "route(name(X))", "")) {
+		ast_test_status_update(test, "Accepted a malformed route\n");
+		res = AST_TEST_FAIL;
+	}
+
+	routes = ami_kafka_routes_compile(container);
+	if (!routes) {
+		ao2_ref(container, -1);
+		return AST_TEST_FAIL;
+	}
+
+	/* The second pass is answered from the resolution cache */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < ARRAY_LEN(cases); i++) {
+			const char *topic = ami_kafka_route_topic(routes, cases[i].event,
+				cases[i].category, "ami");
+
+			if (strcmp(topic, cases[i].expected)) {
+				ast_test_status_update(test, "%s routed to '%s', expected '%s'\n",
+					cases[i].event, topic, cases[i].expected);
+				res = AST_TEST_FAIL;
+			}
+		}
+	}
+
+	if (strcmp(ami_kafka_route_topic(NULL, "VarSet", 0, "ami"), "ami")) {
+		ast_test_status_update(test, "No routes must use the default topic\n");
+		res = AST_TEST_FAIL;
+	}
+
+	ao2_ref(routes, -1);
+	ao2_ref(container, -1);
+	return res;
+}
+
+/* ---- Compression ---- */
+
+AST_TEST_DEFINE(priority_shedding)
+{
+	static const struct {
+		const char *option;
+		const char *priority;
+	} rules[] = {
+		{ "priority(name(Hangup))", "critical" },
+		{ "priority(category(security))", "Critical" },
+		{ "priority(name(VarSet))", "low" },
+		{ "priority(prefix(RTCP))", "low" },
+	};
+	static const struct {
+		const char *event;
+		int category;
+		enum ami_kafka_priority expected;
+	} cases[] = {
+		{ "Hangup", EVENT_FLAG_CALL, AMI_KAFKA_PRIORITY_CRITICAL },
+		{ "InvalidPassword", EVENT_FLAG_SECURITY, AMI_KAFKA_PRIORITY_CRITICAL },
+		{ "VarSet", EVENT_FLAG_DIALPLAN, AMI_KAFKA_PRIORITY_LOW },
+		{ "RTCPSent", EVENT_FLAG_REPORTING, AMI_KAFKA_PRIORITY_LOW },
+		{ "Newchannel", EVENT_FLAG_CALL, AMI_KAFKA_PRIORITY_NORMAL },
+	};
+	struct ami_kafka_shed_policy policy = {
+		.threshold = {
+			[AMI_KAFKA_PRIORITY_CRITICAL] = UINT_MAX,
+			[AMI_KAFKA_PRIORITY_NORMAL] = 90,
+			[AMI_KAFKA_PRIORITY_LOW] = 50,
+		},
+	};
+	struct ao2_container *container;
+	struct ami_kafka_routes *priorities;
+	int res = AST_TEST_PASS;
+	int kept = 0;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "priority_shedding";
+		info->category = TEST_CATEGORY;
+		info->summary = "Events are shed by priority class as load grows";
+		info->description =
+			"Verifies priority(...) rules assign classes, unknown classes "
+			"are rejected, low then normal events are shed past their "
+			"thresholds while critical ones never are, and sampling keeps "
+			"1 in N shed events.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	container = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
+	if (!container) {
+		return AST_TEST_FAIL;
+	}
+	for (i = 0; i < ARRAY_LEN(rules); i++) {
+		if (ami_kafka_priority_add(container, rules[i].option, rules[i].priority)) {
+			ast_test_status_update(test, "Rejected priority '%s'\n", rules[i].option);
+			res = AST_TEST_FAIL;
+		}
+	}
+	if (!ami_kafka_priority_add(container, "priority(name(Cdr))", "urgent")
+		|| !ami_kafka_priority_add(container, "route(name(Cdr))", "critical")) {
+		ast_test_status_update(test, "Accepted an invalid priority rule\n");
+		res = AST_TEST_FAIL;
+	}
+
+	priorities = ami_kafka_routes_compile(container);
+	ao2_ref(container, -1);
+	if (!priorities) {
+		return AST_TEST_FAIL;
+	}
+	for (i = 0; i < ARRAY_LEN(cases); i++) {
+		enum ami_kafka_priority priority = ami_kafka_event_priority(priorities,
+			cases[i].event, cases[i].category);
+
+		if (priority != cases[i].expected) {
+			ast_test_status_update(test, "%s: priority %d, expected %d\n",
+				cases[i].event, priority, cases[i].expected);
+			res = AST_TEST_FAIL;
+		}
+	}
+	ao2_ref(priorities, -1);
+	if (ami_kafka_event_priority(NULL, "Hangup", EVENT_FLAG_CALL) != AMI_KAFKA_PRIORITY_NORMAL) {
+		res = AST_TEST_FAIL;
+	}
+
+	if (ami_kafka_shed(&policy, AMI_KAFKA_PRIORITY_LOW, 49)
+		|| !ami_kafka_shed(&policy, AMI_KAFKA_PRIORITY_LOW, 50)
+		|| ami_kafka_shed(&policy, AMI_KAFKA_PRIORITY_NORMAL, 89)
+		|| !ami_kafka_shed(&policy, AMI_KAFKA_PRIORITY_NORMAL, 90)
+		|| ami_kafka_shed(&policy, AMI_KAFKA_PRIORITY_CRITICAL, 100)) {
+		ast_test_status_update(test, "Shedding does not follow the thresholds\n");
+		res = AST_TEST_FAIL;
+	}
+
+	policy.sample = 4;
+	for (i = 0; i < 100; i++) {
+		kept += !ami_kafka_shed(&policy, AMI_KAFKA_PRIORITY_LOW, 75);
+	}
+	if (kept != 25) {
+		ast_test_status_update(test, "Sampling kept %d of 100 events, expected 25\n", kept);
+		res = AST_TEST_FAIL;
+	}
+
+	return res;
+}
+
+AST_TEST_DEFINE(sample_and_ratelimit)
+{
+	const uint64_t second = 1000000000ULL;
+	char alice[] = "Channel: PJSIP/alice-00000001\r\nVariable: X\r\n\r\n";
+	char bob[] = "Channel: PJSIP/bob-00000002\r\nVariable: X\r\n\r\n";
+	char nochannel[] = "Variable: X\r\n\r\n";
+	struct ami_header_index a;
+	struct ami_header_index b;
+	struct ami_header_index none;
+	struct ao2_container *container;
+	struct ami_kafka_routes *samples;
+	struct ami_kafka_routes *ratelimits;
+	int res = AST_TEST_PASS;
+	int kept = 0;
+	int i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "sample_and_ratelimit";
+		info->category = TEST_CATEGORY;
+		info->summary = "Events are sampled and rate limited per rule";
+		info->description =
+			"Verifies sample(...) keeps 1 in N matching events, invalid "
+			"rates are rejected, ratelimit(...) allows a burst of N then one "
+			"event per period/N, and 'per channel' limits each Channel "
+			"separately.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	container = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
+	if (!container) {
+		return AST_TEST_FAIL;
+	}
+	if (ami_kafka_sample_add(container, "sample(name(VarSet))", "1/100")
+		|| ami_kafka_sample_add(container, "sample(prefix(RTCP))", "10")) {
+		res = AST_TEST_FAIL;
+	}
+	if (!ami_kafka_sample_add(container, "sample(name(Cdr))", "1/0")
+		|| !ami_kafka_sample_add(container, "sample(name(Cdr))", "half")) {
+		ast_test_status_update(test, "Accepted an invalid sample rate\n");
+		res = AST_TEST_FAIL;
+	}
+	samples = ami_kafka_routes_compile(container);
+	ao2_ref(container, -1);
+	if (!samples) {
+		return AST_TEST_FAIL;
+	}
+	for (i = 0; i < 1000; i++) {
+		kept += ami_kafka_sample_keep(samples, "VarSet", EVENT_FLAG_DIALPLAN);
+	}
+	if (kept != 10 || !ami_kafka_sample_keep(samples, "Hangup", EVENT_FLAG_CALL)) {
+		ast_test_status_update(test, "Sampling kept %d of 1000 events, expected 10\n", kept);
+		res = AST_TEST_FAIL;
+	}
+	ao2_ref(samples, -1);
+
+	container = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
+	if (!container) {
+		return AST_TEST_FAIL;
+	}
+	if (ami_kafka_ratelimit_add(container, "ratelimit(name(VarSet))", "10/s")
+		|| ami_kafka_ratelimit_add(container, "ratelimit(name(Newexten))", "2/m per channel")) {
+		res = AST_TEST_FAIL;
+	}
+	if (!ami_kafka_ratelimit_add(container, "ratelimit(name(Cdr))", "10")
+		|| !ami_kafka_ratelimit_add(container, "ratelimit(name(Cdr))", "10/d")
+		|| !ami_kafka_ratelimit_add(container, "ratelimit(name(Cdr))", "10/s per call")) {
+		ast_test_status_update(test, "Accepted an invalid rate limit\n");
+		res = AST_TEST_FAIL;
+	}
+	ratelimits = ami_kafka_routes_compile(container);
+	ao2_ref(container, -1);
+	if (!ratelimits || ami_header_index_build(&a, alice)) {
+		ao2_cleanup(ratelimits);
+		return AST_TEST_FAIL;
+	}
+	if (ami_header_index_build(&b, bob)) {
+		ami_header_index_free(&a);
+		ao2_ref(ratelimits, -1);
+		return AST_TEST_FAIL;
+	}
+	if (ami_header_index_build(&none, nochannel)) {
+		ami_header_index_free(&a);
+		ami_header_index_free(&b);
+		ao2_ref(ratelimits, -1);
+		return AST_TEST_FAIL;
+	}
+
+	/* A burst of 10, then one every 100 ms */
+	kept = 0;
+	for (i = 0; i < 20; i++) {
+		kept += ami_kafka_ratelimit_allow(ratelimits, "VarSet", EVENT_FLAG_DIALPLAN,
+			&a, second);
+	}
+	if (kept != 10
+		|| ami_kafka_ratelimit_allow(ratelimits, "VarSet", EVENT_FLAG_DIALPLAN, &b,
+			second + second / 20)
+		|| !ami_kafka_ratelimit_allow(ratelimits, "VarSet", EVENT_FLAG_DIALPLAN, &b,
+			second + second / 10)
+		|| !ami_kafka_ratelimit_allow(ratelimits, "Hangup", EVENT_FLAG_CALL, &a, second)) {
+		ast_test_status_update(test, "Rate limit allowed %d of a burst of 20, expected 10\n",
+			kept);
+		res = AST_TEST_FAIL;
+	}
+
+	/* Each channel has its own bucket of 2; events without one share another */
+	for (i = 0; i < 2; i++) {
+		if (!ami_kafka_ratelimit_allow(ratelimits, "Newexten", EVENT_FLAG_DIALPLAN, &a, second)
+			|| !ami_kafka_ratelimit_allow(ratelimits, "Newexten", EVENT_FLAG_DIALPLAN, &b, second)
+			|| !ami_kafka_ratelimit_allow(ratelimits, "Newexten", EVENT_FLAG_DIALPLAN, &none, second)) {
+			res = AST_TEST_FAIL;
+		}
+	}
+	if (ami_kafka_ratelimit_allow(ratelimits, "Newexten", EVENT_FLAG_DIALPLAN, &a, second)
+		|| ami_kafka_ratelimit_allow(ratelimits, "Newexten", EVENT_FLAG_DIALPLAN, &none, second)
+		|| !ami_kafka_ratelimit_allow(ratelimits, "Newexten", EVENT_FLAG_DIALPLAN, &a,
+			second + 30 * second)) {
+		ast_test_status_update(test, "Per channel rate limits are not independent\n");
+		res = AST_TEST_FAIL;
+	}
+
+	ami_header_index_free(&a);
+	ami_header_index_free(&b);
+	ami_header_index_free(&none);
+	ao2_ref(ratelimits, -1);
+
+	return res;
+}
+
+AST_TEST_DEFINE(coalesce_latest_state)
+{
+	char first[] = "Device: PJSIP/alice\r\nState: RINGING\r\n\r\n";
+	char second[] = "Device: PJSIP/alice\r\nState: INUSE\r\n\r\n";
+	char other[] = "Device: PJSIP/bob\r\nState: NOT_INUSE\r\n\r\n";
+	char anonymous[] = "State: UNKNOWN\r\n\r\n";
+	char *bodies[] = { first, second, other, anonymous };
+	static const int expected[] = { 1, 1, 1, 0 };
+	struct ami_header_index headers;
+	struct ao2_container *container;
+	struct ao2_container *held;
+	struct ami_kafka_routes *rules;
+	struct ami_kafka_coalesced *entry;
+	int res = AST_TEST_PASS;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "coalesce_latest_state";
+		info->category = TEST_CATEGORY;
+		info->summary = "Bursts of state events keep only the latest";
+		info->description =
+			"Verifies coalesce(...) rules hold events by name and identity "
+			"header value, a later event replaces the held one, and events "
+			"without the header or without a rule are not held.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	container = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
+	if (!container) {
+		return AST_TEST_FAIL;
+	}
+	if (ami_kafka_coalesce_add(container, "coalesce(name(DeviceStateChange))", "Device")) {
+		res = AST_TEST_FAIL;
+	}
+	if (!ami_kafka_coalesce_add(container, "coalesce(name(PeerStatus))", "")) {
+		ast_test_status_update(test, "Accepted a rule without an identity header\n");
+		res = AST_TEST_FAIL;
+	}
+	rules = ami_kafka_routes_compile(container);
+	ao2_ref(container, -1);
+	held = ami_kafka_coalesced_alloc();
+	if (!rules || !held) {
+		ao2_cleanup(rules);
+		ao2_cleanup(held);
+		return AST_TEST_FAIL;
+	}
+
+	for (i = 0; i < ARRAY_LEN(bodies); i++) {
+		int result;
+
+		if (ami_header_index_build(&headers, bodies[i])) {
+			res = AST_TEST_FAIL;
+			break;
+		}
+		result = ami_kafka_coalesce(held, NULL, rules, 250, EVENT_FLAG_CALL,
+			"DeviceStateChange", &headers, 1000 + i, NULL);
+		if (result != expected[i]) {
+			ast_test_status_update(test, "Event %zu: held %d, expected %d\n",
+				i, result, expected[i]);
+			res = AST_TEST_FAIL;
+		}
+		if (ami_kafka_coalesce(held, NULL, rules, 250, EVENT_FLAG_CALL,
+			"Newchannel", &headers, 1000 + i, NULL)) {
+			ast_test_status_update(test, "Held an event without a rule\n");
+			res = AST_TEST_FAIL;
+		}
+		ami_header_index_free(&headers);
+	}
+
+	if (ao2_container_count(held) != 2) {
+		ast_test_status_update(test, "%d events held, expected 2\n",
+			ao2_container_count(held));
+		res = AST_TEST_FAIL;
+	}
+
+	entry = ami_kafka_coalesced_take(held, "DeviceStateChange", "PJSIP/alice");
+	if (!entry || entry->replaced != 1 || entry->timestamp != 1001
+		|| strcmp(entry->body, second)) {
+		ast_test_status_update(test, "PJSIP/alice does not hold its latest state\n");
+		res = AST_TEST_FAIL;
+	}
+	ao2_cleanup(entry);
+
+	entry = ami_kafka_coalesced_take(held, "DeviceStateChange", "PJSIP/bob");
+	if (!entry || entry->replaced || strcmp(entry->body, other)) {
+		ast_test_status_update(test, "PJSIP/bob does not hold its state\n");
+		res = AST_TEST_FAIL;
+	}
+	ao2_cleanup(entry);
+
+	if (ami_kafka_coalesced_take(held, "DeviceStateChange", "PJSIP/alice")) {
+		ast_test_status_update(test, "A taken event is still held\n");
+		res = AST_TEST_FAIL;
+	}
+
+	ao2_ref(held, -1);
+	ao2_ref(rules, -1);
+
+	return res;
+}
+
+AST_TEST_DEFINE(fields_projection)
+{
+	static const char * const kept_newchannel[] = { "Channel", "CallerIDNum" };
+	static const char * const kept_queue[] = { "Privilege", "Channel", "Context" };
+	char body[] = SAMPLE_BODY;
+	struct ami_header_index headers;
+	struct ao2_container *container;
+	struct ami_kafka_routes *projections;
+	int res = AST_TEST_PASS;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "fields_projection";
+		info->category = TEST_CATEGORY;
+		info->summary = "fields(...) rules keep or drop selected headers";
+		info->description =
+			"Verifies a list of headers keeps only those headers, in body "
+			"order, a '!' list drops the listed ones, mixed lists are "
+			"rejected, and events without a rule keep every header.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	container = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, NULL);
+	if (!container) {
+		return AST_TEST_FAIL;
+	}
+	if (ami_kafka_fields_add(container, "fields(name(Newchannel))", "CallerIDNum, Channel,Uniqueid")
+		|| ami_kafka_fields_add(container, "fields(prefix(Queue))", "!ChannelState,! CallerIDNum")) {
+		res = AST_TEST_FAIL;
+	}
+	if (!ami_kafka_fields_add(container, "fields(name(Hangup))", "Channel,!Cause")
+		|| !ami_kafka_fields_add(container, "fields(name(Hangup))", " , ")) {
+		ast_test_status_update(test, "Accepted an invalid fields list\n");
+		res = AST_TEST_FAIL;
+	}
+	projections = ami_kafka_routes_compile(container);
+	ao2_ref(container, -1);
+	if (!projections) {
+		return AST_TEST_FAIL;
+	}
+
+	if (ami_header_index_build(&headers, body)) {
+		ao2_ref(projections, -1);
+		return AST_TEST_FAIL;
+	}
+	if (ami_kafka_project(projections, "Newchannel", EVENT_FLAG_CALL, &headers) != 3
+		|| headers.count != ARRAY_LEN(kept_newchannel)) {
+		ast_test_status_update(test, "Newchannel kept %zu headers, expected %zu\n",
+			headers.count, ARRAY_LEN(kept_newchannel));
+		res = AST_TEST_FAIL;
+	}
+	for (i = 0; i < headers.count && i < ARRAY_LEN(kept_newchannel); i++) {
+		if (strncmp(headers.items[i].line, kept_newchannel[i], headers.items[i].key_len)) {
+			ast_test_status_update(test, "Newchannel header %zu is not %s\n", i,
+				kept_newchannel[i]);
+			res = AST_TEST_FAIL;
+		}
+	}
+	ami_header_index_free(&headers);
+
+	if (ami_header_index_build(&headers, body)) {
+		ao2_ref(projections, -1);
+		return AST_TEST_FAIL;
+	}
+	if (ami_kafka_project(projections, "QueueMemberStatus", EVENT_FLAG_AGENT, &headers) != 2
+		|| headers.count != ARRAY_LEN(kept_queue)) {
+		ast_test_status_update(test, "QueueMemberStatus kept %zu headers, expected %zu\n",
+			headers.count, ARRAY_LEN(kept_queue));
+		res = AST_TEST_FAIL;
+	}
+	for (i = 0; i < headers.count && i < ARRAY_LEN(kept_queue); i++) {
+		if (strncmp(headers.items[i].line, kept_queue[i], headers.items[i].key_len)) {
+			ast_test_status_update(test, "QueueMemberStatus header %zu is not %s\n", i,
+				kept_queue[i]);
+			res = AST_TEST_FAIL;
+		}
+	}
+	if (ami_kafka_project(projections, "Hangup", EVENT_FLAG_CALL, &headers)) {
+		ast_test_status_update(test, "Projected an event without a rule\n");
+		res = AST_TEST_FAIL;
+	}
+	ami_header_index_free(&headers);
+
+	ao2_ref(projections, -1);
+
+	return res;
+}
+
+AST_TEST_DEFINE(filter_body_automaton)
+{
+	static const char * const patterns[] = { "he", "she", "his", "hers", "she" };
+	static const int expected[] = { 1, 1, 0, 1, 1 };
+	unsigned long matched[1];
+	struct ami_kafka_matcher *matcher;
+	struct ao2_container *include = NULL;
+	struct ao2_container *exclude = NULL;
+	char pattern[32];
+	int res = AST_TEST_PASS;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "filter_body_automaton";
+		info->category = TEST_CATEGORY;
+		info->summary = "Body patterns are matched by one automaton";
+		info->description =
+			"Verifies the Aho-Corasick matcher finds overlapping and "
+			"duplicate patterns in one pass, and that literal regex and "
+			"contains body filters give the same decisions as before, "
+			"including with more patterns than fit on the stack.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	matcher = ami_kafka_matcher_build(patterns, ARRAY_LEN(patterns));
+	if (!matcher) {
+		return AST_TEST_FAIL;
+	}
+	ami_kafka_matcher_scan(matcher, "ushers", 6, matched);
+	for (i = 0; i < ARRAY_LEN(patterns); i++) {
+		if (!!(matched[0] & (1UL << i)) != expected[i]) {
+			ast_test_status_update(test, "Pattern '%s' %sfound in 'ushers'\n",
+				patterns[i], expected[i] ? "not " : "");
+			res = AST_TEST_FAIL;
+		}
+	}
+	ami_kafka_matcher_free(matcher);
+
+	/* Literal regexes, escaped operators and contains share the scan */
+	create_filter_containers(&include, &exclude);
+	if (add_filter("eventfilter", "Channel: PJSIP/", include, exclude)
+		|| add_filter("eventfilter(action(include),method(contains))", "Local/1\\.0",
+			include, exclude)
+		|| add_filter("eventfilter", "Context: from\\-internal", include, exclude)
+		|| add_filter("eventfilter", "!CallerIDNum: 100", include, exclude)) {
+		res = AST_TEST_FAIL;
+	}
+	if (send_event(include, exclude, "Newchannel", SAMPLE_BODY) != 0
+		|| send_event(include, exclude, "Newchannel",
+			"Channel: PJSIP/200-00000002\r\nCallerIDNum: 200\r\n") != 1
+		|| send_event(include, exclude, "Newchannel",
+			"Channel: IAX2/1\r\nCallerIDNum: 200\r\n") != 0
+		|| send_event(include, exclude, "Newchannel",
+			"Channel: Local/1\\.0\r\n") != 1) {
+		ast_test_status_update(test, "Body filters decided differently than expected\n");
+		res = AST_TEST_FAIL;
+	}
+	ao2_cleanup(include);
+	ao2_cleanup(exclude);
+
+	/* More patterns than the stack set holds */
+	create_filter_containers(&include, &exclude);
+	for (i = 0; i < 300; i++) {
+		snprintf(pattern, sizeof(pattern), "Unique%zu|", i);
+		add_filter("eventfilter(action(include),method(contains))", pattern,
+			include, exclude);
+	}
+	if (send_event(include, exclude, "Newchannel", "Uniqueid: x\r\nX: Unique299|\r\n") != 1
+		|| send_event(include, exclude, "Newchannel", "X: Unique300|\r\n") != 0) {
+		ast_test_status_update(test, "Large pattern sets are not matched\n");
+		res = AST_TEST_FAIL;
+	}
+	ao2_cleanup(include);
+	ao2_cleanup(exclude);
+
+	return res;
+}
+
+AST_TEST_DEFINE(json_typed_values)
+{
+	static const char body[] =
+		"ChannelState: 6\r\n"
+		"Paused: no\r\n"
+		"Ringinuse: Yes\r\n"
+		"Duration: 007\r\n"
+		"CallsTaken: 12\r\n"
+		"RTT: 0.0125\r\n"
+		"LastCall: 1705312200\r\n"
+		"Priority: -\r\n"
+		"Status: Reachable\r\n";
+	static const char expected[] =
+		"\"ChannelState\":6,\"Paused\":false,"
+		"\"Ringinuse\":true,\"Duration\":\"007\",\"CallsTaken\":12,"
+		"\"RTT\":0.0125,\"LastCall\":1705312200,\"Priority\":\"-\","
+		"\"Status\":\"Reachable\"}";
+	const char *typed;
+	struct ami_kafka_identity *identity;
+	struct ami_header_index headers;
+	struct ast_str *buf;
+	int res = AST_TEST_PASS;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "json_typed_values";
+		info->category = TEST_CATEGORY;
+		info->summary = "json_typed writes known headers as numbers and booleans";
+		info->description =
+			"Verifies the json_typed format writes known numeric, "
+			"boolean and epoch headers as native JSON values, and keeps "
+			"values that do not parse as their type, and unknown "
+			"headers, as strings.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	buf = ast_str_create(256);
+	identity = ami_kafka_identity_alloc("json_typed");
+	if (!buf || !identity || ami_header_index_build(&headers, body)) {
+		ast_free(buf);
+		ami_kafka_identity_free(identity);
+		return AST_TEST_FAIL;
+	}
+
+	/* The event headers follow EntityID and SystemName of this system */
+	if (ami_json_write(&buf, "QueueMember", &headers, identity)
+		|| !(typed = strstr(ast_str_buffer(buf), "\"ChannelState\""))
+		|| strcmp(typed, expected)) {
+		ast_test_status_update(test, "Typed JSON mismatch:\n  expected %s\n  got      %s\n",
+			expected, ast_str_buffer(buf));
+		res = AST_TEST_FAIL;
+	}
+
+	ami_header_index_free(&headers);
+	ami_kafka_identity_free(identity);
+	ast_free(buf);
+	return res;
+}
+
+AST_TEST_DEFINE(json_fold_headers)
+{
+	static const char body[] =
+		"Channel: PJSIP/100-00000001\r\n"
+		"ChanVariable: CDR(accountcode)=sales\r\n"
+		"ChanVariable: X_TRACE=a=b\r\n"
+		"ChanVariable: CDR(accountcode)=support\r\n"
+		"DestChanVariable: Y=1\r\n"
+		"Variable: FOO\r\n"
+		"Variable: BAR\r\n"
+		"Duration: 5\r\n"
+		"Duration: 7\r\n"
+		"Value: x\r\n";
+	static const char expected[] =
+		"\"Channel\":\"PJSIP/100-00000001\","
+		"\"ChanVariable\":{\"CDR(accountcode)\":\"support\",\"X_TRACE\":\"a=b\"},"
+		"\"DestChanVariable\":{\"Y\":\"1\"},"
+		"\"Variable\":[\"FOO\",\"BAR\"],"
+		"\"Duration\":[5,7],"
+		"\"Value\":\"x\"}";
+	static const char unfolded[] =
+		"\"ChanVariable\":\"CDR(accountcode)=support\"";
+	struct ami_kafka_identity *identity;
+	struct ami_header_index headers;
+	struct ast_str *buf;
+	const char *folded;
+	int res = AST_TEST_PASS;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "json_fold_headers";
+		info->category = TEST_CATEGORY;
+		info->summary = "fold_headers keeps every value of repeated headers";
+		info->description =
+			"Verifies that with fold_headers repeated keys become arrays, "
+			"in order and typed in json_typed, that variable headers of "
+			"name=value pairs become objects with last-value-wins names, "
+			"and that without it the last value still wins.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	buf = ast_str_create(256);
+	identity = ami_kafka_identity_alloc("json_typed");
+	if (!buf || !identity || ami_header_index_build(&headers, body)) {
+		ast_free(buf);
+		ami_kafka_identity_free(identity);
+		return AST_TEST_FAIL;
+	}
+
+	if (ami_json_write(&buf, "AgentCalled", &headers, identity)
+		|| !strstr(ast_str_buffer(buf), unfolded)) {
+		ast_test_status_update(test, "Unfolded JSON lost the last value: %s\n",
+			ast_str_buffer(buf));
+		res = AST_TEST_FAIL;
+	}
+
+	ami_kafka_identity_fold_headers(identity, 1);
+	ast_str_reset(buf);
+	if (ami_json_write(&buf, "AgentCalled", &headers, identity)
+		|| !(folded = strstr(ast_str_buffer(buf), "\"Channel\""))
+		|| strcmp(folded, expected)) {
+		ast_test_status_update(test, "Folded JSON mismatch:\n  expected %s\n  got      %s\n",
+			expected, ast_str_buffer(buf));
+		res = AST_TEST_FAIL;
+	}
+
+	ami_header_index_free(&headers);
+	ami_kafka_identity_free(identity);
+	ast_free(buf);
+	return res;
+}
+
+/*! \brief ami_kafka_call_track() on an event given as its body text */
+static int call_test_track(struct ao2_container *calls, const char *event,
+	const char *body, time_t timestamp, struct ami_kafka_call_stamp *stamp,
+	struct ami_kafka_call **ended)
+{
+	struct ami_header_index headers;
+	int tracked = -1;
+
+	if (!ami_header_index_build(&headers, body)) {
+		tracked = ami_kafka_call_track(calls, event, &headers, timestamp, stamp, ended);
+	}
+	ami_header_index_free(&headers);
+
+	return tracked;
+}
+
+AST_TEST_DEFINE(call_sequencing)
+{
+	static const struct {
+		const char *event;
+		const char *body;
+		time_t timestamp;
+		unsigned int sequence;
+		time_t start;
+	} steps[] = {
+		{ "Newchannel", "Channel: PJSIP/100-1\r\nUniqueid: 1.1\r\nLinkedid: 1.1\r\n", 100, 1, 100 },
+		{ "Newchannel", "Channel: PJSIP/200-2\r\nUniqueid: 1.2\r\nLinkedid: 1.1\r\n", 101, 2, 100 },
+		{ "DialBegin", "Channel: PJSIP/100-1\r\nLinkedid: 1.1\r\n"
+			"DestChannel: PJSIP/200-2\r\nDestLinkedid: 1.1\r\n", 101, 3, 100 },
+		{ "Newchannel", "Channel: PJSIP/300-3\r\nUniqueid: 2.1\r\nLinkedid: 2.1\r\n", 102, 1, 102 },
+		{ "Newstate", "Channel: PJSIP/9-9\r\nLinkedid: 9.9\r\n", 103, 0, 0 },
+		{ "Hangup", "Channel: PJSIP/200-2\r\nDestLinkedid: 2.1\r\nLinkedid: 1.1\r\n", 110, 4, 100 },
+		{ "Hangup", "Channel: PJSIP/100-1\r\nLinkedid: 1.1\r\n", 111, 5, 100 },
+		/* The call is gone with its last channel */
+		{ "Cdr", "Linkedid: 1.1\r\n", 112, 0, 0 },
+		{ "Hangup", "Channel: PJSIP/9-9\r\nLinkedid: 9.9\r\n", 113, 0, 0 },
+		{ "Newchannel", "Channel: PJSIP/400-4\r\n", 114, 0, 0 },
+	};
+	struct ami_kafka_call_stamp stamp;
+	struct ao2_container *calls;
+	int res = AST_TEST_PASS;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "call_sequencing";
+		info->category = TEST_CATEGORY;
+		info->summary = "Events are numbered within their call";
+		info->description =
+			"Verifies call tracking starts a call at its first "
+			"Newchannel, numbers its events in order with the call's "
+			"start time, forgets it after its last Hangup, leaves "
+			"untracked events alone and expires calls that went quiet.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	calls = ami_kafka_calls_alloc();
+	if (!calls) {
+		return AST_TEST_FAIL;
+	}
+
+	for (i = 0; i < ARRAY_LEN(steps); i++) {
+		int tracked = call_test_track(calls, steps[i].event, steps[i].body,
+			steps[i].timestamp, &stamp, NULL);
+
+		if (tracked != !!steps[i].sequence || stamp.sequence != steps[i].sequence
+			|| (tracked && stamp.start != steps[i].start)) {
+			ast_test_status_update(test, "Step %zu (%s): sequence %u start %ld, "
+				"expected %u start %ld\n", i, steps[i].event, stamp.sequence,
+				(long) stamp.start, steps[i].sequence, (long) steps[i].start);
+			res = AST_TEST_FAIL;
+		}
+	}
+
+	/* Only call 2.1 is left, last seen at 102 */
+	if (ao2_container_count(calls) != 1
+		|| ami_kafka_calls_expire(calls, 102, NULL) != 0
+		|| ami_kafka_calls_expire(calls, 103, NULL) != 1
+		|| ao2_container_count(calls) != 0) {
+		ast_test_status_update(test, "Idle calls were not expired as expected\n");
+		res = AST_TEST_FAIL;
+	}
+
+	ao2_ref(calls, -1);
+	return res;
+}
+
+AST_TEST_DEFINE(call_summary_record)
+{
+	static const struct {
+		const char *event;
+		const char *body;
+		time_t timestamp;
+	} steps[] = {
+		{ "Newchannel", "Channel: PJSIP/100-1\r\nCallerIDNum: 100\r\nExten: 200\r\n"
+			"Uniqueid: 1.1\r\nLinkedid: 1.1\r\n", 100 },
+		{ "Newchannel", "Channel: PJSIP/200-2\r\nCallerIDNum: 200\r\nExten: s\r\n"
+			"Uniqueid: 1.2\r\nLinkedid: 1.1\r\n", 101 },
+		{ "DialEnd", "Channel: PJSIP/100-1\r\nLinkedid: 1.1\r\nDialStatus: ANSWER\r\n", 104 },
+		{ "Newstate", "Channel: PJSIP/200-2\r\nChannelState: 6\r\nLinkedid: 1.1\r\n", 104 },
+		{ "BridgeEnter", "BridgeUniqueid: b-1\r\nChannel: PJSIP/100-1\r\nLinkedid: 1.1\r\n", 105 },
+		{ "BridgeEnter", "BridgeUniqueid: b-1\r\nChannel: PJSIP/200-2\r\nLinkedid: 1.1\r\n", 105 },
+		{ "Hangup", "Channel: PJSIP/200-2\r\nLinkedid: 1.1\r\nCause: 16\r\n"
+			"Cause-txt: Normal Clearing\r\n", 160 },
+		{ "Hangup", "Channel: PJSIP/100-1\r\nLinkedid: 1.1\r\nCause: 0\r\n"
+			"Cause-txt: Unknown\r\n", 161 },
+	};
+	static const char expected[] =
+		"Linkedid: 1.1\r\n"
+		"Channel: PJSIP/100-1\r\n"
+		"CallerIDNum: 100\r\n"
+		"Exten: 200\r\n"
+		"StartTime: 100\r\n"
+		"AnswerTime: 104\r\n"
+		"EndTime: 161\r\n"
+		"Duration: 61\r\n"
+		"BillableSeconds: 57\r\n"
+		"Channels: 2\r\n"
+		"Bridges: 1\r\n"
+		"Dials: 1\r\n"
+		"DialStatus: ANSWER\r\n"
+		"Cause: 16\r\n"
+		"Cause-txt: Normal Clearing\r\n";
+	struct ami_kafka_call_stamp stamp;
+	struct ami_kafka_call *ended = NULL;
+	struct ao2_iterator *iter = NULL;
+	struct ao2_container *calls;
+	struct ast_str *buf;
+	int res = AST_TEST_PASS;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "call_summary_record";
+		info->category = TEST_CATEGORY;
+		info->summary = "A call ends with one summary of its events";
+		info->description =
+			"Verifies the call record is updated from Newchannel, "
+			"Newstate, DialEnd, BridgeEnter and Hangup, is handed out "
+			"only with the last Hangup, and is written as a CallSummary "
+			"body with durations, counts, dial status and the first "
+			"hangup cause. A call dropped while idle is handed out by "
+			"ami_kafka_calls_expire() and ends with its latest event.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	calls = ami_kafka_calls_alloc();
+	buf = ast_str_create(256);
+	if (!calls || !buf) {
+		ao2_cleanup(calls);
+		ast_free(buf);
+		return AST_TEST_FAIL;
+	}
+
+	for (i = 0; i < ARRAY_LEN(steps); i++) {
+		call_test_track(calls, steps[i].event, steps[i].body, steps[i].timestamp,
+			&stamp, &ended);
+		if (!ended != (i < ARRAY_LEN(steps) - 1)) {
+			ast_test_status_update(test, "Step %zu: call %s\n", i,
+				ended ? "ended too early" : "did not end");
+			res = AST_TEST_FAIL;
+			break;
+		}
+	}
+
+	if (ended) {
+		if (ami_kafka_call_summary(ended, &buf) || strcmp(ast_str_buffer(buf), expected)) {
+			ast_test_status_update(test, "Summary mismatch:\n%s\n", ast_str_buffer(buf));
+			res = AST_TEST_FAIL;
+		}
+		ao2_ref(ended, -1);
+		ended = NULL;
+	}
+
+	/* A call whose last Hangup went to another Linkedid */
+	call_test_track(calls, "Newchannel", "Channel: PJSIP/300-3\r\n"
+		"Linkedid: 2.1\r\n", 200, &stamp, &ended);
+	call_test_track(calls, "Newstate", "Channel: PJSIP/300-3\r\n"
+		"ChannelState: 6\r\nLinkedid: 2.1\r\n", 210, &stamp, &ended);
+	if (ended || ami_kafka_calls_expire(calls, 211, &iter) != 1 || !iter
+		|| !(ended = ao2_iterator_next(iter))
+		|| ami_kafka_call_summary(ended, &buf)
+		|| !strstr(ast_str_buffer(buf), "EndTime: 210\r\nDuration: 10\r\n")) {
+		ast_test_status_update(test, "Idle call summary mismatch:\n%s\n",
+			ast_str_buffer(buf));
+		res = AST_TEST_FAIL;
+	}
+	ao2_cleanup(ended);
+	if (iter) {
+		ao2_iterator_destroy(iter);
+	}
+
+	ao2_ref(calls, -1);
+	ast_free(buf);
+	return res;
+}
+
+AST_TEST_DEFINE(compression_codecs)
+{
+	struct ami_kafka_compressor *compressor;
+	struct ami_kafka_identity *identity;
+	struct ami_header_index headers;
+	struct ast_str *json;
+	struct ast_str *batch;
+	struct ast_str *out;
+	int res = AST_TEST_PASS;
+#ifdef HAVE_ZSTD
+	char decoded[1024];
+	size_t plain_len = 0;
+	size_t len;
+#endif
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "compression_codecs";
+		info->category = TEST_CATEGORY;
+		info->summary = "Payloads are compressed with the configured codec";
+		info->description =
+			"Verifies ami_kafka_compress() output decompresses to the "
+			"original payload, the built-in zstd dictionary improves on "
+			"plain zstd for a single event, payloads that do not shrink "
+			"are left alone, and codecs the module was built without "
+			"are refused.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	json = ast_str_create(256);
+	batch = ast_str_create(1024);
+	out = ast_str_create(64);
+	identity = ami_kafka_identity_alloc("json");
+	if (!json || !batch || !out || !identity
+		|| ami_header_index_build(&headers, SAMPLE_BODY)) {
+		ast_free(json);
+		ast_free(batch);
+		ast_free(out);
+		ami_kafka_identity_free(identity);
+		return AST_TEST_FAIL;
+	}
+	if (ami_json_write(&json, "Newchannel", &headers, identity)) {
+		res = AST_TEST_FAIL;
+		goto cleanup;
+	}
+
+	/* lz4 has no dictionary: a lone event rarely shrinks, a batch does */
+	compressor = ami_kafka_compressor_alloc(AMI_KAFKA_COMPRESSION_LZ4, 3, NULL);
+#ifdef HAVE_LZ4
+	ast_str_append(&batch, 0, "%s\n%s\n%s\n%s\n", ast_str_buffer(json),
+		ast_str_buffer(json), ast_str_buffer(json), ast_str_buffer(json));
+	if (!compressor || strcmp(compressor->encoding, "lz4")
+		|| ami_kafka_compress(compressor, ast_str_buffer(batch), ast_str_strlen(batch), &out)) {
+		ast_test_status_update(test, "lz4 did not compress the batch\n");
+		res = AST_TEST_FAIL;
+	} else {
+		LZ4F_decompressionContext_t dctx;
+		char decoded[4096];
+		size_t src_len = ast_str_strlen(out);
+		size_t dst_len = sizeof(decoded);
+
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+			res = AST_TEST_FAIL;
+		} else {
+			LZ4F_decompress(dctx, decoded, &dst_len, ast_str_buffer(out), &src_len, NULL);
+			LZ4F_freeDecompressionContext(dctx);
+			if (dst_len != ast_str_strlen(batch)
+				|| memcmp(decoded, ast_str_buffer(batch), dst_len)) {
+				ast_test_status_update(test, "lz4 round trip mismatch\n");
+				res = AST_TEST_FAIL;
+			}
+		}
+	}
+#else
+	if (compressor) {
+		ast_test_status_update(test, "lz4 accepted without lz4 support\n");
+		res = AST_TEST_FAIL;
+	}
+#endif
+	ami_kafka_compressor_free(compressor);
+
+	compressor = ami_kafka_compressor_alloc(AMI_KAFKA_COMPRESSION_ZSTD, 3, "none");
+#ifdef HAVE_ZSTD
+	if (!compressor || strcmp(compressor->encoding, "zstd")
+		|| ami_kafka_compress(compressor, ast_str_buffer(json), ast_str_strlen(json), &out)) {
+		ast_test_status_update(test, "zstd did not compress the event\n");
+		res = AST_TEST_FAIL;
+	} else {
+		plain_len = ast_str_strlen(out);
+		len = ZSTD_decompress(decoded, sizeof(decoded), ast_str_buffer(out), plain_len);
+		if (ZSTD_isError(len) || len != ast_str_strlen(json)
+			|| memcmp(decoded, ast_str_buffer(json), len)) {
+			ast_test_status_update(test, "zstd round trip mismatch\n");
+			res = AST_TEST_FAIL;
+		}
+	}
+
+	/* Too small to shrink: sent as it is */
+	if (compressor && !ami_kafka_compress(compressor, "{}", 2, &out)) {
+		ast_test_status_update(test, "A payload that grew was not left alone\n");
+		res = AST_TEST_FAIL;
+	}
+	ami_kafka_compressor_free(compressor);
+
+	compressor = ami_kafka_compressor_alloc(AMI_KAFKA_COMPRESSION_ZSTD, 3, "builtin");
+	if (!compressor || strcmp(compressor->encoding, "zstd;dict=ami-v1")
+		|| ami_kafka_compress(compressor, ast_str_buffer(json), ast_str_strlen(json), &out)
+		|| ast_str_strlen(out) >= plain_len) {
+		ast_test_status_update(test, "Built-in dictionary did not beat plain zstd\n");
+		res = AST_TEST_FAIL;
+	}
+	ami_kafka_compressor_free(compressor);
+
+	compressor = ami_kafka_compressor_alloc(AMI_KAFKA_COMPRESSION_ZSTD, 3,
+		"/nonexistent/ami.dict");
+	if (compressor) {
+		ast_test_status_update(test, "A missing dictionary file was accepted\n");
+		res = AST_TEST_FAIL;
+	}
+#else
+	if (compressor) {
+		ast_test_status_update(test, "zstd accepted without zstd support\n");
+		res = AST_TEST_FAIL;
+	}
+#endif
+	ami_kafka_compressor_free(compressor);
+
+cleanup:
+	ami_header_index_free(&headers);
+	ami_kafka_identity_free(identity);
+	ast_free(json);
+	ast_free(batch);
+	ast_free(out);
+	return res;
+}
+
+/* ---- Statistics ---- */
+
+AST_TEST_DEFINE(stats_histogram)
+{
+	struct ami_kafka_stats *before;
+	struct ami_kafka_stats *after;
+	uint64_t buckets[LATENCY_BUCKETS] = { 0, };
+	uint64_t ns;
+	uint64_t p50;
+	uint64_t p99;
+	unsigned int bucket;
+	unsigned int last = 0;
+	int res = AST_TEST_PASS;
+	int i;
+	int j;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "stats_histogram";
+		info->category = TEST_CATEGORY;
+		info->summary = "Latency histogram buckets and counters";
+		info->description =
+			"Verifies every latency falls in a bucket whose bounds contain "
+			"it and that is at most 1/8 wider than its floor, percentiles "
+			"come from the right bucket, and ami_kafka_stats_collect() "
+			"never goes back. Nothing is recorded into the live statistics.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	/* Every value up to 2^20, then a sweep up to past the last bucket */
+	for (ns = 0; ns < (1ULL << 44); ns = ns < (1 << 20) ? ns + 1 : ns + ns / 7) {
+		uint64_t floor;
+
+		bucket = ami_kafka_latency_bucket(ns);
+		if (bucket < last || bucket >= LATENCY_BUCKETS) {
+			ast_test_status_update(test, "%" PRIu64 " ns: bucket %u after %u\n",
+				ns, bucket, last);
+			return AST_TEST_FAIL;
+		}
+		last = bucket;
+		if (bucket == LATENCY_BUCKETS - 1) {
+			continue;
+		}
+
+		floor = ami_kafka_latency_bucket_floor(bucket);
+		if (floor > ns || ami_kafka_latency_bucket_floor(bucket + 1) <= ns
+			|| (floor >= 8 && ami_kafka_latency_bucket_floor(bucket + 1) - floor > floor / 8)) {
+			ast_test_status_update(test, "%" PRIu64 " ns: bucket %u [%" PRIu64 ", %" PRIu64 ")\n",
+				ns, bucket, floor, ami_kafka_latency_bucket_floor(bucket + 1));
+			return AST_TEST_FAIL;
+		}
+	}
+	if (last != LATENCY_BUCKETS - 1) {
+		ast_test_status_update(test, "Slowest samples not in the last bucket\n");
+		return AST_TEST_FAIL;
+	}
+
+	/* 990 samples at 1us, 10 at 1ms */
+	buckets[ami_kafka_latency_bucket(1000)] = 990;
+	buckets[ami_kafka_latency_bucket(1000000)] = 10;
+	p50 = ami_kafka_latency_percentile(buckets, 50.0);
+	p99 = ami_kafka_latency_percentile(buckets, 99.5);
+	if (p50 < 1000 || p50 > 1125 || p99 < 1000000 || p99 > 1125000
+		|| ami_kafka_latency_percentile(buckets, 0.0) != p50) {
+		ast_test_status_update(test, "p50 %" PRIu64 ", p99.5 %" PRIu64 "\n", p50, p99);
+		res = AST_TEST_FAIL;
+	}
+	memset(buckets, 0, sizeof(buckets));
+	if (ami_kafka_latency_percentile(buckets, 99.0)) {
+		ast_test_status_update(test, "Empty histogram has a percentile\n");
+		res = AST_TEST_FAIL;
+	}
+
+	/* A running system may count events meanwhile, but never fewer */
+	before = ast_malloc(sizeof(*before));
+	after = ast_malloc(sizeof(*after));
+	if (!before || !after) {
+		ast_free(before);
+		ast_free(after);
+		return AST_TEST_FAIL;
+	}
+	ami_kafka_stats_collect(before);
+	ami_kafka_stats_collect(after);
+
+	for (i = 0; i < AMI_KAFKA_STAT_COUNT; i++) {
+		if (after->counters[i] < before->counters[i]) {
+			ast_test_status_update(test, "Counter %d went back\n", i);
+			res = AST_TEST_FAIL;
+		}
+	}
+	for (i = 0; i < AMI_KAFKA_STAGE_COUNT; i++) {
+		for (j = 0; j < LATENCY_BUCKETS; j++) {
+			if (after->latency[i][j] < before->latency[i][j]) {
+				ast_test_status_update(test, "Stage %d bucket %d went back\n", i, j);
+				res = AST_TEST_FAIL;
+			}
+		}
+	}
+
+	ast_free(before);
+	ast_free(after);
+
+	return res;
+}
+
+AST_TEST_DEFINE(wall_clock)
+{
+	struct timespec ts;
+	uint64_t now;
+	uint64_t us;
+	uint64_t later;
+	uint64_t wall;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "wall_clock";
+		info->category = TEST_CATEGORY;
+		info->summary = "Microsecond wall clock from monotonic readings";
+		info->description =
+			"Verifies ami_kafka_wall_clock_us() is close to the wall clock, "
+			"follows the monotonic reading it is given and never goes back "
+			"when given an earlier one.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	/* A second past any earlier reading, so this thread reads the wall clock now */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec + WALL_CLOCK_SYNC_NS;
+	us = ami_kafka_wall_clock_us(now);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	wall = (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+	if (us > wall || wall - us > 1000000) {
+		ast_test_status_update(test, "%" PRIu64 " us is not close to %" PRIu64 " us\n",
+			us, wall);
+		return AST_TEST_FAIL;
+	}
+
+	later = ami_kafka_wall_clock_us(now + 1000000);
+	if (later != us + 1000) {
+		ast_test_status_update(test, "1 ms later gave %" PRIu64 " us after %" PRIu64 " us\n",
+			later, us);
+		return AST_TEST_FAIL;
+	}
+
+	if (ami_kafka_wall_clock_us(now) != later) {
+		ast_test_status_update(test, "An earlier reading went back in time\n");
+		return AST_TEST_FAIL;
+	}
+
+	return AST_TEST_PASS;
+}
+
+AST_TEST_DEFINE(wall_clock_step)
+{
+	/* Monotonic 10 s is wall clock 1000 s */
+	static const struct {
+		uint64_t now_ms;
+		uint64_t wall_ms;
+		uint64_t expected_ms;
+	} steps[] = {
+		{ 10000, 1000000, 1000000 },
+		{ 10500, 0, 1000500 },
+		/* Stepped back 1.3 s, behind the last value by less than a resync period */
+		{ 11500, 1000200, 1000500 },
+		{ 11600, 0, 1000500 },
+		{ 11900, 0, 1000600 },
+		/* Stepped back by more than a resync period: follow it */
+		{ 13000, 900000, 900000 },
+		{ 13001, 0, 900001 },
+		/* Forward steps are always followed */
+		{ 14001, 1000000, 1000000 },
+	};
+	struct ami_kafka_wall_clock clock = { 0, };
+	uint64_t us;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "wall_clock_step";
+		info->category = TEST_CATEGORY;
+		info->summary = "Wall clock steps seen by the microsecond clock";
+		info->description =
+			"Verifies ami_kafka_wall_clock_advance() stalls for a wall clock "
+			"stepped back by less than a resync period, and follows a larger "
+			"step back or any step forward.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	for (i = 0; i < ARRAY_LEN(steps); i++) {
+		us = ami_kafka_wall_clock_advance(&clock, steps[i].now_ms * 1000000,
+			steps[i].wall_ms * 1000000);
+		if (us != steps[i].expected_ms * 1000) {
+			ast_test_status_update(test, "Step %zu: %" PRIu64 " us, expected %" PRIu64 " ms\n",
+				i, us, steps[i].expected_ms);
+			return AST_TEST_FAIL;
+		}
+	}
+
+	return AST_TEST_PASS;
+}
+
+/* ---- Spilling ---- */
+
+/*! \brief Sequence number of the next message spill_test_produce() expects */
+static unsigned int spill_test_next;
+/*! \brief Messages spill_test_produce() accepts before refusing the rest */
+static unsigned int spill_test_accept;
+static int spill_test_ok;
+
+/*! \brief Checks replayed messages arrive intact and in order */
+static int spill_test_produce(struct ast_kafka_producer *producer,
+	const char *topic, const char *key, const void *payload, size_t len,
+	const struct ast_kafka_header *headers, size_t header_count)
+{
+	char expected[64];
+
+	if (!spill_test_accept) {
+		return -1;
+	}
+	spill_test_accept--;
+
+	snprintf(expected, sizeof(expected), "message %02u padded to a longer payload",
+		spill_test_next++);
+	if (strcmp(topic, "ami") || !key || strcmp(key, "1700000000.1")
+		|| len != strlen(expected) || memcmp(payload, expected, len)
+		|| header_count != 2 || strcmp(headers[1].name, "event_type")
+		|| strcmp(headers[1].value, "Hangup")) {
+		spill_test_ok = 0;
+	}
+
+	return 0;
+}
+
+AST_TEST_DEFINE(spill_replay_order)
+{
+	const struct ast_kafka_header hdrs[] = {
+		{ "entity_id", "00:11:22:33:44:55" },
+		{ "event_type", "Hangup" },
+	};
+	struct ami_kafka_spill *spill;
+	char path[] = "/tmp/ami_kafka_spill_XXXXXX";
+	char payload[64];
+	unsigned int accepted = 0;
+	unsigned int pushed = 0;
+	int res = AST_TEST_PASS;
+	int fd;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "spill_replay_order";
+		info->category = TEST_CATEGORY;
+		info->summary = "Refused messages are replayed in order, across restarts";
+		info->description =
+			"Fills a small spool file and memory ring, replays part of them "
+			"until the producer refuses one, frees the spill and reopens the "
+			"file, then checks the remaining messages come back complete and "
+			"in their original order.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		return AST_TEST_FAIL;
+	}
+	close(fd);
+
+	/* Room for 4 of these 112-byte records in the file, then 2 in memory */
+	spill = ami_kafka_spill_alloc(2, path, 480);
+	if (!spill) {
+		unlink(path);
+		return AST_TEST_FAIL;
+	}
+	for (pushed = 0; pushed < 10; pushed++) {
+		snprintf(payload, sizeof(payload), "message %02u padded to a longer payload", pushed);
+		if (ami_kafka_spill_push(spill, "ami", "1700000000.1", payload, strlen(payload),
+			hdrs, ARRAY_LEN(hdrs))) {
+			break;
+		}
+		accepted++;
+	}
+	if (accepted != 6 || ami_kafka_spill_pending(spill) != 6) {
+		ast_test_status_update(test, "%u message(s) spilled, expected 6\n", accepted);
+		res = AST_TEST_FAIL;
+		goto cleanup;
+	}
+
+	spill_test_next = 0;
+	spill_test_accept = 3;
+	spill_test_ok = 1;
+	if (ami_kafka_spill_drain(spill, spill_test_produce, NULL, UINT_MAX) != 3
+		|| ami_kafka_spill_pending(spill) != 3 || !spill_test_ok) {
+		ast_test_status_update(test, "First replay did not stop at the refused message\n");
+		res = AST_TEST_FAIL;
+		goto cleanup;
+	}
+
+	/* The memory records follow the file's when it is reopened */
+	ami_kafka_spill_free(spill);
+	spill = ami_kafka_spill_alloc(2, path, 65536);
+	if (!spill || ami_kafka_spill_pending(spill) != 3) {
+		ast_test_status_update(test, "Spool file did not keep the pending messages\n");
+		res = AST_TEST_FAIL;
+		goto cleanup;
+	}
+
+	spill_test_accept = 1;
+	if (ami_kafka_spill_drain(spill, spill_test_produce, NULL, 1) != 1) {
+		res = AST_TEST_FAIL;
+	}
+	spill_test_accept = UINT_MAX;
+	if (ami_kafka_spill_drain(spill, spill_test_produce, NULL, UINT_MAX) != 2
+		|| ami_kafka_spill_pending(spill) || !spill_test_ok || spill_test_next != 6) {
+		ast_test_status_update(test, "Replay after reopening out of order or incomplete\n");
+		res = AST_TEST_FAIL;
+	}
+
+cleanup:
+	ami_kafka_spill_free(spill);
+	unlink(path);
+
+	return res;
+}
+
+/* ---- Batching ---- */
+
+AST_TEST_DEFINE(batch_framing_and_limits)
+{
+	struct ami_kafka_batch_settings settings = {
+		.mode = AMI_KAFKA_BATCH_ARRAY,
+		.max_events = 3,
+		.max_bytes = 1024,
+		.linger_ms = 100,
+	};
+	struct ami_kafka_batch *ready[2];
+	struct ao2_container *batches;
+	char big[600];
+	int res = AST_TEST_PASS;
+	int count;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "batch_framing_and_limits";
+		info->category = TEST_CATEGORY;
+		info->summary = "Events are batched per topic and key";
+		info->description =
+			"Verifies ami_kafka_batch_add() keeps one batch per topic "
+			"and key, frames records as a JSON array or as NDJSON, and "
+			"closes a batch on its event and byte limits.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	batches = ami_kafka_batches_alloc();
+	if (!batches) {
+		return AST_TEST_FAIL;
+	}
+
+	/* Third event for the same key fills the batch; the other key waits */
+	ami_kafka_batch_add(batches, NULL, &settings, "t", "Hangup", "{\"a\":1}", 7, 10, ready);
+	ami_kafka_batch_add(batches, NULL, &settings, "t", "Dial", "{\"x\":0}", 7, 11, ready);
+	ami_kafka_batch_add(batches, NULL, &settings, "t", "Hangup", "{\"a\":2}", 7, 12, ready);
+	count = ami_kafka_batch_add(batches, NULL, &settings, "t", "Hangup", "{\"a\":3}", 7, 13, ready);
+	if (count != 1 || ready[0]->count != 3 || ready[0]->timestamp != 10
+		|| strcmp(ready[0]->key, "Hangup")
+		|| strcmp(ast_str_buffer(ready[0]->records), "[{\"a\":1},{\"a\":2},{\"a\":3}")) {
+		ast_test_status_update(test, "Array batch not closed at max_events (%d)\n", count);
+		res = AST_TEST_FAIL;
+	}
+	if (count > 0) {
+		ao2_ref(ready[0], -1);
+	}
+	if (ao2_container_count(batches) != 1) {
+		ast_test_status_update(test, "Expected only the Dial batch to be pending\n");
+		res = AST_TEST_FAIL;
+	}
+
+	/* An event that doesn't fit closes the pending batch and starts the next */
+	settings.mode = AMI_KAFKA_BATCH_NDJSON;
+	memset(big, 'x', sizeof(big));
+	ami_kafka_batch_add(batches, NULL, &settings, "u", "Newexten", big, sizeof(big), 20, ready);
+	count = ami_kafka_batch_add(batches, NULL, &settings, "u", "Newexten", big, sizeof(big), 21, ready);
+	if (count != 1 || ready[0]->count != 1 || ready[0]->mode != AMI_KAFKA_BATCH_NDJSON
+		|| ast_str_buffer(ready[0]->records)[0] != '\n'
+		|| ast_str_strlen(ready[0]->records) != sizeof(big) + 1) {
+		ast_test_status_update(test, "NDJSON batch not closed at max_bytes (%d)\n", count);
+		res = AST_TEST_FAIL;
+	}
+	if (count > 0) {
+		ao2_ref(ready[0], -1);
+	}
+
+	/* A changed framing closes the Dial batch built as an array */
+	count = ami_kafka_batch_add(batches, NULL, &settings, "t", "Dial", "{}", 2, 30, ready);
+	if (count != 1 || ready[0]->mode != AMI_KAFKA_BATCH_ARRAY || ready[0]->count != 1) {
+		ast_test_status_update(test, "Batch mode change did not close the batch\n");
+		res = AST_TEST_FAIL;
+	}
+	if (count > 0) {
+		ao2_ref(ready[0], -1);
+	}
+
+	ao2_ref(batches, -1);
+	return res;
+}
+
 /* ---- Module lifecycle ---- */
 
 static int load_module(void)
@@ -1045,6 +3680,8 @@ static int load_module(void)
 	AST_TEST_REGISTER(json_entity_id);
 	AST_TEST_REGISTER(json_empty_body);
 	AST_TEST_REGISTER(json_malformed_lines);
+	AST_TEST_REGISTER(json_writer_matches_reference);
+	AST_TEST_REGISTER(msgpack_payload);
 	AST_TEST_REGISTER(filter_legacy_include);
 	AST_TEST_REGISTER(filter_legacy_exclude);
 	AST_TEST_REGISTER(filter_advanced_include_name);
@@ -1058,10 +3695,32 @@ static int load_module(void)
 	AST_TEST_REGISTER(send_exclude_no_match);
 	AST_TEST_REGISTER(send_include_exclude_combined);
 	AST_TEST_REGISTER(send_name_filter_match);
+	AST_TEST_REGISTER(send_name_dispatch);
 	AST_TEST_REGISTER(send_header_starts_with);
 	AST_TEST_REGISTER(send_header_exact);
 	AST_TEST_REGISTER(send_header_contains);
 	AST_TEST_REGISTER(send_header_ends_with);
+	AST_TEST_REGISTER(send_header_regex);
+	AST_TEST_REGISTER(header_index_lines);
+	AST_TEST_REGISTER(queue_fifo_and_overflow);
+	AST_TEST_REGISTER(partition_key_sources);
+	AST_TEST_REGISTER(category_cache);
+	AST_TEST_REGISTER(route_topics);
+	AST_TEST_REGISTER(priority_shedding);
+	AST_TEST_REGISTER(sample_and_ratelimit);
+	AST_TEST_REGISTER(coalesce_latest_state);
+	AST_TEST_REGISTER(fields_projection);
+	AST_TEST_REGISTER(filter_body_automaton);
+	AST_TEST_REGISTER(json_typed_values);
+	AST_TEST_REGISTER(json_fold_headers);
+	AST_TEST_REGISTER(call_sequencing);
+	AST_TEST_REGISTER(call_summary_record);
+	AST_TEST_REGISTER(compression_codecs);
+	AST_TEST_REGISTER(stats_histogram);
+	AST_TEST_REGISTER(wall_clock);
+	AST_TEST_REGISTER(wall_clock_step);
+	AST_TEST_REGISTER(spill_replay_order);
+	AST_TEST_REGISTER(batch_framing_and_limits);
 
 	return AST_MODULE_LOAD_SUCCESS;
 }
@@ -1072,6 +3731,8 @@ static int unload_module(void)
 	AST_TEST_UNREGISTER(json_entity_id);
 	AST_TEST_UNREGISTER(json_empty_body);
 	AST_TEST_UNREGISTER(json_malformed_lines);
+	AST_TEST_UNREGISTER(json_writer_matches_reference);
+	AST_TEST_UNREGISTER(msgpack_payload);
 	AST_TEST_UNREGISTER(filter_legacy_include);
 	AST_TEST_UNREGISTER(filter_legacy_exclude);
 	AST_TEST_UNREGISTER(filter_advanced_include_name);
@@ -1085,10 +3746,32 @@ static int unload_module(void)
 	AST_TEST_UNREGISTER(send_exclude_no_match);
 	AST_TEST_UNREGISTER(send_include_exclude_combined);
 	AST_TEST_UNREGISTER(send_name_filter_match);
+	AST_TEST_UNREGISTER(send_name_dispatch);
 	AST_TEST_UNREGISTER(send_header_starts_with);
 	AST_TEST_UNREGISTER(send_header_exact);
 	AST_TEST_UNREGISTER(send_header_contains);
 	AST_TEST_UNREGISTER(send_header_ends_with);
+	AST_TEST_UNREGISTER(send_header_regex);
+	AST_TEST_UNREGISTER(header_index_lines);
+	AST_TEST_UNREGISTER(queue_fifo_and_overflow);
+	AST_TEST_UNREGISTER(partition_key_sources);
+	AST_TEST_UNREGISTER(category_cache);
+	AST_TEST_UNREGISTER(route_topics);
+	AST_TEST_UNREGISTER(priority_shedding);
+	AST_TEST_UNREGISTER(sample_and_ratelimit);
+	AST_TEST_UNREGISTER(coalesce_latest_state);
+	AST_TEST_UNREGISTER(fields_projection);
+	AST_TEST_UNREGISTER(filter_body_automaton);
+	AST_TEST_UNREGISTER(json_typed_values);
+	AST_TEST_UNREGISTER(json_fold_headers);
+	AST_TEST_UNREGISTER(call_sequencing);
+	AST_TEST_UNREGISTER(call_summary_record);
+	AST_TEST_UNREGISTER(compression_codecs);
+	AST_TEST_UNREGISTER(stats_histogram);
+	AST_TEST_UNREGISTER(wall_clock);
+	AST_TEST_UNREGISTER(wall_clock_step);
+	AST_TEST_UNREGISTER(spill_replay_order);
+	AST_TEST_UNREGISTER(batch_framing_and_limits);
 
 	return 0;
 }